@@ -343,6 +343,11 @@ _tap_ctl_list_tapdisk(int id, struct list_head *_list)
 			break;
 		}
 
+		if (message.type == TAPDISK_MESSAGE_ERROR) {
+			err = -message.u.response.error;
+			break;
+		}
+
 		if (message.u.list.count == 0)
 			break;
 
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "tap-ctl.h"
+
+int
+tap_ctl_stats(const int id, const int minor, char **_stats)
+{
+	tapdisk_message_t message;
+	char *stats, *tmp;
+	size_t len, n;
+	int err, sfd;
+
+	*_stats = NULL;
+
+	err = tap_ctl_connect_id(id, &sfd);
+	if (err)
+		return err;
+
+	memset(&message, 0, sizeof(message));
+	message.type   = TAPDISK_MESSAGE_STATS;
+	message.cookie = minor;
+
+	err = tap_ctl_write_message(sfd, &message, 2);
+	if (err)
+		goto out;
+
+	len   = 0;
+	stats = NULL;
+
+	do {
+		err = tap_ctl_read_message(sfd, &message, 2);
+		if (err) {
+			err = -EPROTO;
+			break;
+		}
+
+		if (message.type == TAPDISK_MESSAGE_ERROR) {
+			err = -message.u.response.error;
+			break;
+		}
+
+		if (message.type != TAPDISK_MESSAGE_STATS_RSP) {
+			EPRINTF("got unexpected result '%s' from %d\n",
+				tapdisk_message_name(message.type), id);
+			err = -EINVAL;
+			break;
+		}
+
+		n = strnlen(message.u.string.text,
+			    sizeof(message.u.string.text));
+		if (!n)
+			break;
+
+		tmp = realloc(stats, len + n + 1);
+		if (!tmp) {
+			err = -ENOMEM;
+			break;
+		}
+
+		stats = tmp;
+		memcpy(stats + len, message.u.string.text, n);
+		len += n;
+		stats[len] = 0;
+	} while (1);
+
+	if (!err && !stats) {
+		stats = strdup("");
+		if (!stats)
+			err = -ENOMEM;
+	}
+
+	if (err)
+		free(stats);
+	else
+		*_stats = stats;
+
+out:
+	close(sfd);
+	return err;
+}
@@ -96,6 +96,8 @@ int tap_ctl_close(const int id, const int minor, const int force);
 int tap_ctl_pause(const int id, const int minor);
 int tap_ctl_unpause(const int id, const int minor, const char *params);
 
+int tap_ctl_stats(const int id, const int minor, char **stats);
+
 int tap_ctl_blk_major(void);
 
 #endif
@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
 #include "tapdisk.h"
@@ -54,30 +55,63 @@
 
 #define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
 
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
+#define BLOCK_CACHE_MAX_SIZE            (100 << 20) /* 100MB per process */
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
 #define BLOCK_CACHE_PAGE_IDLETIME       60
 
+#define BLOCK_STORE_ENTRY_SIZE          (sizeof(block_store_entry_t))
+/* one bucket per node of a full cache, rounded up: must be a power of 2 */
+#define BLOCK_STORE_BUCKETS             (1 << 18)
+
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
 typedef struct radix_tree_link          radix_tree_link_t;
 typedef struct radix_tree_leaf          radix_tree_leaf_t;
-typedef struct radix_tree_page          radix_tree_page_t;
 
 typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
 
-struct radix_tree_page {
-	char                           *buf;
-	size_t                          size;
-	uint64_t                        sec;
-	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
+typedef struct block_store              block_store_t;
+typedef struct block_store_entry        block_store_entry_t;
+
+/*
+ * Cached data lives in a single content-addressed store shared by every
+ * block cache in the process, so images cloned from the same base (or
+ * merely holding the same blocks) keep one copy of each sector between
+ * them.  The per-image radix trees map a sector to the hash of its
+ * contents plus the tag of the store entry that held them when the
+ * sector was cached.  Entries are evicted in LRU order once the store
+ * reaches BLOCK_CACHE_MAX_SIZE; a leaf whose entry is gone (or whose
+ * hash has since been reused by different contents) no longer matches
+ * its tag and is simply a miss.
+ */
+struct block_store_entry {
+	uint64_t                        hash;
+	uint64_t                        tag;
+	block_store_entry_t            *next;
+	struct list_head                lru;
+	char                            data[RADIX_TREE_NODE_SIZE];
+};
+
+struct block_store {
+	pthread_mutex_t                 lock;
+	int                             refs;
+
+	block_store_entry_t           **table;
+	struct list_head                lru;
+	uint64_t                        size;
+	uint64_t                        tag;
+
+	uint64_t                        entries;
+	uint64_t                        shared;
+	uint64_t                        collisions;
+	uint64_t                        evictions;
 };
 
 struct radix_tree_leaf {
-	radix_tree_page_t              *page;
-	char                           *buf;
+	uint64_t                        hash;
+	uint64_t                        tag;
 };
 
 struct radix_tree_link {
@@ -95,7 +129,7 @@ struct radix_tree_node {
 
 struct radix_tree {
 	int                             height;
-	uint64_t                        size;
+	uint64_t                        leaves;
 	uint32_t                        nodes;
 	radix_tree_node_t              *root;
 
@@ -104,7 +138,6 @@ struct radix_tree {
 
 struct block_cache_request {
 	int                             err;
-	char                           *buf;
 	uint64_t                        secs;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
@@ -134,6 +167,192 @@ struct block_cache {
 	block_cache_stats_t             stats;
 };
 
+static block_store_t block_store = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline uint64_t
+block_store_hash(const char *buf)
+{
+	int i, n;
+	uint64_t hash;
+	const uint64_t *data;
+
+	hash = 0xcbf29ce484222325ULL;
+	data = (const uint64_t *)buf;
+	n    = RADIX_TREE_NODE_SIZE / sizeof(uint64_t);
+
+	for (i = 0; i < n; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+
+	return hash;
+}
+
+static inline void
+block_store_touch(block_store_t *store, block_store_entry_t *entry)
+{
+	list_del(&entry->lru);
+	list_add_tail(&entry->lru, &store->lru);
+}
+
+static inline block_store_entry_t **
+block_store_bucket(block_store_t *store, uint64_t hash)
+{
+	return store->table + (hash & (BLOCK_STORE_BUCKETS - 1));
+}
+
+static block_store_entry_t *
+block_store_find(block_store_t *store, uint64_t hash)
+{
+	block_store_entry_t *entry;
+
+	entry = *block_store_bucket(store, hash);
+	while (entry && entry->hash != hash)
+		entry = entry->next;
+
+	return entry;
+}
+
+static void
+block_store_remove(block_store_t *store, block_store_entry_t *entry)
+{
+	block_store_entry_t **pprev;
+
+	pprev = block_store_bucket(store, entry->hash);
+	while (*pprev != entry)
+		pprev = &(*pprev)->next;
+
+	*pprev = entry->next;
+	list_del(&entry->lru);
+
+	store->size -= BLOCK_STORE_ENTRY_SIZE;
+	store->entries--;
+	free(entry);
+}
+
+static void
+block_store_evict(block_store_t *store)
+{
+	block_store_entry_t *entry;
+
+	while (store->size + BLOCK_STORE_ENTRY_SIZE > BLOCK_CACHE_MAX_SIZE &&
+	       !list_empty(&store->lru)) {
+		entry = list_entry(store->lru.next, block_store_entry_t, lru);
+		block_store_remove(store, entry);
+		store->evictions++;
+	}
+}
+
+/*
+ * store a copy of @buf under @hash.  returns the tag a leaf must carry
+ * to find it again, or 0 if the sector could not be cached.
+ * called with the store lock held.
+ */
+static uint64_t
+block_store_insert(block_store_t *store, uint64_t hash, const char *buf)
+{
+	block_store_entry_t *entry, **bucket;
+
+	entry = block_store_find(store, hash);
+	if (entry) {
+		if (memcmp(entry->data, buf, RADIX_TREE_NODE_SIZE)) {
+			store->collisions++;
+			return 0;
+		}
+
+		block_store_touch(store, entry);
+		store->shared++;
+		return entry->tag;
+	}
+
+	block_store_evict(store);
+
+	entry = malloc(sizeof(block_store_entry_t));
+	if (!entry)
+		return 0;
+
+	memcpy(entry->data, buf, RADIX_TREE_NODE_SIZE);
+	entry->hash = hash;
+	entry->tag  = ++store->tag;
+
+	bucket      = block_store_bucket(store, hash);
+	entry->next = *bucket;
+	*bucket     = entry;
+	list_add_tail(&entry->lru, &store->lru);
+
+	store->size += BLOCK_STORE_ENTRY_SIZE;
+	store->entries++;
+
+	return entry->tag;
+}
+
+/*
+ * called with the store lock held.
+ */
+static char *
+block_store_lookup(block_store_t *store, radix_tree_leaf_t *leaf)
+{
+	block_store_entry_t *entry;
+
+	entry = block_store_find(store, leaf->hash);
+	if (!entry || entry->tag != leaf->tag)
+		return NULL;
+
+	block_store_touch(store, entry);
+	return entry->data;
+}
+
+static int
+block_store_get(void)
+{
+	int err = 0;
+	block_store_t *store = &block_store;
+
+	pthread_mutex_lock(&store->lock);
+
+	if (store->refs++)
+		goto out;
+
+	store->table = calloc(BLOCK_STORE_BUCKETS,
+			      sizeof(block_store_entry_t *));
+	if (!store->table) {
+		store->refs--;
+		err = -ENOMEM;
+		goto out;
+	}
+
+	INIT_LIST_HEAD(&store->lru);
+	store->size = 0;
+
+out:
+	pthread_mutex_unlock(&store->lock);
+	return err;
+}
+
+static void
+block_store_put(void)
+{
+	block_store_entry_t *entry, *tmp;
+	block_store_t *store = &block_store;
+
+	pthread_mutex_lock(&store->lock);
+
+	if (--store->refs)
+		goto out;
+
+	list_for_each_entry_safe(entry, tmp, &store->lru, lru)
+		block_store_remove(store, entry);
+
+	free(store->table);
+	store->table = NULL;
+
+out:
+	pthread_mutex_unlock(&store->lock);
+}
+
 static inline uint64_t
 radix_tree_calculate_size(int height)
 {
@@ -174,12 +393,6 @@ radix_tree_node_is_root(radix_tree_t *tree, radix_tree_node_t *node)
 	return (node->height == tree->height);
 }
 
-static inline uint64_t
-radix_tree_size(radix_tree_t *tree)
-{
-	return tree->size + tree->nodes * sizeof(radix_tree_node_t);
-}
-
 static inline void
 radix_tree_clear_link(radix_tree_link_t *link)
 {
@@ -218,79 +431,22 @@ radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
 	tree->nodes--;
 }
 
-static inline radix_tree_page_t *
-radix_tree_allocate_page(radix_tree_t *tree,
-			 char *buf, uint64_t sec, size_t size)
-{
-	radix_tree_page_t *page;
-
-	page = calloc(1, sizeof(radix_tree_page_t));
-	if (!page)
-		return NULL;
-
-	page->buf   = buf;
-	page->sec   = sec;
-	page->size  = size;
-	tree->size += size;
-
-	return page;
-}
-
-static inline void
-radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
-{
-	int i;
-
-	for (i = 0; i < page->size >> RADIX_TREE_NODE_SHIFT; i++)
-		DBG("%s: ejecting sector 0x%llx\n",
-		    tree->cache->name, page->sec + i);
-
-	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
-	tree->size -= page->size;
-	free(page->buf);
-	free(page);
-}
-
 /*
- * remove a leaf and the shared radix_tree_page_t containing its buffer.
- * leaves are deleted, nodes are not; gc will reap the nodes later.
+ * drop a leaf's reference to the store.  the store entry itself is
+ * shared and only goes away through LRU eviction.
  */
 static void
-radix_tree_remove_page(radix_tree_t *tree, radix_tree_page_t *page)
-{
-	int i;
-
-	if (!page)
-		return;
-
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++)
-		radix_tree_clear_link(page->owners[i]);
-
-	radix_tree_free_page(tree, page);
-}
-
-static void
-radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
-		       radix_tree_page_t *page, off_t off)
+radix_tree_remove_leaf(radix_tree_t *tree, radix_tree_link_t *link)
 {
-	int i;
-
-	if (off + RADIX_TREE_NODE_SIZE > page->size)
+	if (!link->u.leaf.tag)
 		return;
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++) {
-		if (page->owners[i])
-			continue;
-
-		page->owners[i]   = link;
-		link->u.leaf.page = page;
-		link->u.leaf.buf  = page->buf + off;
-
-		break;
-	}
+	tree->cache->stats.prunes++;
+	tree->leaves--;
+	radix_tree_clear_link(link);
 }
 
-static char *
+static radix_tree_leaf_t *
 radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
 {
 	int idx;
@@ -307,7 +463,7 @@ radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
 		link->time = now.tv_sec;
 
 		if (radix_tree_node_contains_leaves(tree, node))
-			return link->u.leaf.buf;
+			return (link->u.leaf.tag ? &link->u.leaf : NULL);
 
 		if (!link->u.next)
 			return NULL;
@@ -316,9 +472,9 @@ radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
 	} while (1);
 }
 
-static char *
+static int
 radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
-		    radix_tree_page_t *page, off_t off)
+		    uint64_t hash, uint64_t tag)
 {
 	int idx;
 	struct timeval now;
@@ -334,47 +490,24 @@ radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
 		link->time = now.tv_sec;
 
 		if (radix_tree_node_contains_leaves(tree, node)) {
-			radix_tree_remove_page(tree, link->u.leaf.page);
-			radix_tree_insert_leaf(tree, link, page, off);
-			return link->u.leaf.buf;
+			if (!link->u.leaf.tag)
+				tree->leaves++;
+			link->u.leaf.hash = hash;
+			link->u.leaf.tag  = tag;
+			return 0;
 		}
 
 		if (!link->u.next) {
 			link->u.next = radix_tree_allocate_child_node(tree,
 								      node);
 			if (!link->u.next)
-				return NULL;
+				return -ENOMEM;
 		}
 
 		node = link->u.next;
 	} while (1);
 }
 
-static int
-radix_tree_add_leaves(radix_tree_t *tree, char *buf,
-		      uint64_t sector, uint64_t sectors)
-{
-	int i;
-	radix_tree_page_t *page;
-
-	page = radix_tree_allocate_page(tree, buf, sector,
-					sectors << RADIX_TREE_NODE_SHIFT);
-	if (!page)
-		return -ENOMEM;
-
-	for (i = 0; i < sectors; i++)
-		if (!radix_tree_add_leaf(tree, sector + i, 
-					 page, (i << RADIX_TREE_NODE_SHIFT)))
-			goto fail;
-
-	return 0;
-
-fail:
-	page->buf = NULL;
-	radix_tree_remove_page(tree, page);
-	return -ENOMEM;
-}
-
 static void
 radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
 {
@@ -388,7 +521,7 @@ radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
 		link = node->links + i;
 
 		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
+			radix_tree_remove_leaf(tree, link);
 		else
 			radix_tree_delete_branch(tree, link->u.next);
 
@@ -437,7 +570,7 @@ radix_tree_prune_branch(radix_tree_t *tree,
 		}
 
 		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
+			radix_tree_remove_leaf(tree, link);
 		else
 			radix_tree_delete_branch(tree, link->u.next);
 
@@ -461,14 +594,14 @@ radix_tree_prune(radix_tree_t *tree)
 	if (!tree->root)
 		return;
 
-	DPRINTF("tree %s has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+	DPRINTF("tree %s has %"PRIu64" leaves, %u nodes\n",
+		tree->cache->name, tree->leaves, tree->nodes);
 
 	gettimeofday(&now, NULL);
 	radix_tree_prune_branch(tree, tree->root, now.tv_sec);
 
-	DPRINTF("tree %s now has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+	DPRINTF("tree %s now has %"PRIu64" leaves, %u nodes\n",
+		tree->cache->name, tree->leaves, tree->nodes);
 }
 
 static inline int
@@ -536,12 +669,18 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	cache->sectors = driver->info.size;
 
+	err = block_store_get();
+	if (err) {
+		free(cache->name);
+		return err;
+	}
+
 	tree = &cache->tree;
+	tree->cache = cache;
 	err  = radix_tree_initialize(tree, cache->sectors);
 	if (err)
 		goto fail;
 
-	tree->cache = cache;
 	cache->requests_free = BLOCK_CACHE_REQUESTS;
 	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
 		cache->request_free_list[i] = cache->requests + i;
@@ -551,8 +690,10 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 							  BLOCK_CACHE_PAGE_IDLETIME << 1,
 							  block_cache_prune_event,
 							  cache);
-	if (cache->timeout_id < 0)
+	if (cache->timeout_id < 0) {
+		err = cache->timeout_id;
 		goto fail;
+	}
 
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
 		"tree: %p, height: %d\n",
@@ -566,6 +707,7 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 fail:
 	free(cache->name);
 	radix_tree_free(&cache->tree);
+	block_store_put();
 	return err;
 }
 
@@ -582,55 +724,22 @@ block_cache_close(td_driver_t *driver)
 
 	tapdisk_server_unregister_event(cache->timeout_id);
 	radix_tree_free(tree);
+	block_store_put();
 	free(cache->name);
 
 	return 0;
 }
 
-static inline uint64_t
-block_cache_hash(block_cache_t *cache, char *buf)
-{
-	int i, n;
-	uint64_t cksm, *data;
-
-	return 0;
-
-	cksm = 0;
-	data = (uint64_t *)buf;
-	n    = RADIX_TREE_NODE_SIZE / sizeof(uint64_t);
-
-	for (i = 0; i < n; i++)
-		cksm += data[i];
-
-	return ~cksm;
-}
-
-static void
-block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
-{
-	int i;
-	off_t off;
-
-	cache->stats.hits += treq.secs;
-
-	for (i = 0; i < treq.secs; i++) {
-		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
-		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
-
-		off = i << RADIX_TREE_NODE_SHIFT;
-		memcpy(treq.buf + off, iov[i], RADIX_TREE_NODE_SIZE);
-	}
-
-	td_complete_request(treq, 0);
-}
-
 static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
 	int i;
+	off_t off;
+	uint64_t hash, tag;
 	radix_tree_t *tree;
 	block_cache_t *cache;
 	block_cache_request_t *breq;
+	block_store_t *store = &block_store;
 
 	breq        = (block_cache_request_t *)clone.cb_data;
 	cache       = breq->cache;
@@ -641,22 +750,26 @@ block_cache_populate_cache(td_request_t clone, int err)
 	if (breq->secs)
 		return;
 
-	if (breq->err) {
-		free(breq->buf);
+	if (breq->err)
 		goto out;
-	}
 
 	for (i = 0; i < breq->treq.secs; i++) {
-		off_t off = i << RADIX_TREE_NODE_SHIFT;
-		DBG("%s: populating sec 0x%08llx\n",
-		    cache->name, breq->treq.sec + i);
-		memcpy(breq->treq.buf + off,
-		       breq->buf + off, RADIX_TREE_NODE_SIZE);
-	}
+		off  = i << RADIX_TREE_NODE_SHIFT;
+		hash = block_store_hash(breq->treq.buf + off);
 
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
-		free(breq->buf);
+		DBG("%s: populating sec 0x%08"PRIx64", hash: 0x%016"PRIx64"\n",
+		    cache->name, breq->treq.sec + i, hash);
+
+		pthread_mutex_lock(&store->lock);
+		tag = block_store_insert(store, hash, breq->treq.buf + off);
+		pthread_mutex_unlock(&store->lock);
+
+		if (!tag)
+			continue;
+
+		if (radix_tree_add_leaf(tree, breq->treq.sec + i, hash, tag))
+			break;
+	}
 
 out:
 	td_complete_request(breq->treq, breq->err);
@@ -666,39 +779,23 @@ out:
 static void
 block_cache_miss(block_cache_t *cache, td_request_t treq)
 {
-	char *buf;
-	size_t size;
 	td_request_t clone;
-	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
 	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
 
 	clone = treq;
-	tree  = &cache->tree;
-	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
-
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
-		goto out;
-
 	breq = block_cache_get_request(cache);
 	if (!breq)
 		goto out;
 
-	if (posix_memalign((void **)&buf, RADIX_TREE_NODE_SIZE, size)) {
-		block_cache_put_request(cache, breq);
-		goto out;
-	}
-
 	breq->treq    = treq;
 	breq->secs    = treq.secs;
 	breq->err     = 0;
-	breq->buf     = buf;
 	breq->cache   = cache;
 
-	clone.buf     = buf;
 	clone.cb      = block_cache_populate_cache;
 	clone.cb_data = breq;
 
@@ -710,9 +807,11 @@ static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	int i;
+	char *data;
 	radix_tree_t *tree;
 	block_cache_t *cache;
-	char *iov[BLOCK_CACHE_NODES_PER_PAGE];
+	radix_tree_leaf_t *leaf;
+	block_store_t *store = &block_store;
 
 	cache = (block_cache_t *)driver->data;
 	tree  = &cache->tree;
@@ -722,13 +821,28 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
+	pthread_mutex_lock(&store->lock);
+
 	for (i = 0; i < treq.secs; i++) {
-		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
-		if (!iov[i])
+		leaf = radix_tree_find_leaf(tree, treq.sec + i);
+		data = (leaf ? block_store_lookup(store, leaf) : NULL);
+		if (!data) {
+			pthread_mutex_unlock(&store->lock);
 			return block_cache_miss(cache, treq);
+		}
+
+		DBG("%s: block cache hit: sec 0x%08"PRIx64", "
+		    "hash: 0x%016"PRIx64"\n",
+		    cache->name, treq.sec + i, leaf->hash);
+
+		memcpy(treq.buf + (i << RADIX_TREE_NODE_SHIFT),
+		       data, RADIX_TREE_NODE_SIZE);
 	}
 
-	return block_cache_hit(cache, treq, iov);
+	pthread_mutex_unlock(&store->lock);
+
+	cache->stats.hits += treq.secs;
+	td_complete_request(treq, 0);
 }
 
 static void
@@ -764,6 +878,7 @@ block_cache_debug(td_driver_t *driver)
 {
 	block_cache_t *cache;
 	block_cache_stats_t *stats;
+	block_store_t *store = &block_store;
 
 	cache = (block_cache_t *)driver->data;
 	stats = &cache->stats;
@@ -771,6 +886,42 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	WARN("leaves: %"PRIu64", nodes: %u\n",
+	     cache->tree.leaves, cache->tree.nodes);
+
+	pthread_mutex_lock(&store->lock);
+	WARN("store: size: %"PRIu64", entries: %"PRIu64", shared: %"PRIu64", "
+	     "collisions: %"PRIu64", evictions: %"PRIu64"\n",
+	     store->size, store->entries, store->shared,
+	     store->collisions, store->evictions);
+	pthread_mutex_unlock(&store->lock);
+}
+
+static void
+block_cache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	block_cache_t *cache;
+	block_cache_stats_t *stats;
+	block_store_t *store = &block_store;
+
+	cache = (block_cache_t *)driver->data;
+	stats = &cache->stats;
+
+	tapdisk_stats_field(st, "reads", PRIu64, stats->reads);
+	tapdisk_stats_field(st, "hits", PRIu64, stats->hits);
+	tapdisk_stats_field(st, "misses", PRIu64, stats->misses);
+	tapdisk_stats_field(st, "prunes", PRIu64, stats->prunes);
+	tapdisk_stats_field(st, "leaves", PRIu64, cache->tree.leaves);
+
+	pthread_mutex_lock(&store->lock);
+	tapdisk_stats_field(st, "store", "{");
+	tapdisk_stats_field(st, "size", PRIu64, store->size);
+	tapdisk_stats_field(st, "entries", PRIu64, store->entries);
+	tapdisk_stats_field(st, "shared", PRIu64, store->shared);
+	tapdisk_stats_field(st, "collisions", PRIu64, store->collisions);
+	tapdisk_stats_field(st, "evictions", PRIu64, store->evictions);
+	tapdisk_stats_leave(st, '}');
+	pthread_mutex_unlock(&store->lock);
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -784,4 +935,5 @@ struct tap_disk tapdisk_block_cache = {
 	.td_get_parent_id           = block_cache_get_parent_id,
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
+	.td_stats                   = block_cache_stats,
 };
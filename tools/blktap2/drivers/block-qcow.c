@@ -77,9 +77,66 @@ struct qcow_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdqcow_state  *state;
+	int                  pending;
+	int                  err;
+	struct list_head     next;
 };
 
+/*
+ * L2 tables are cached in an LRU list and indexed by their file offset.
+ * On a miss the table is read with a tiocb and the request waits on the
+ * cache entry, so the event loop keeps running.  L1 and L2 updates made
+ * by cluster allocation are queued as metadata writes and issued one at
+ * a time, in order; a data write that depends on an allocation is only
+ * completed once the metadata write covering it has completed.  Tables
+ * being read, or with queued updates, are never evicted.
+ */
+struct qcow_l2_table {
+	uint64_t              offset;   /* 0 if unused */
+	uint64_t             *table;
+	int                   reading;
+	int                   dirty;
+	struct qcow_l2_table *hash_next;
+	struct list_head      lru;
+	struct list_head      waiters;
+	struct tiocb          tiocb;
+	struct tdqcow_state  *state;
+};
+
+struct qcow_md_write {
+	uint64_t              offset;
+	size_t                size;
+	char                 *buf;
+	uint64_t             *old;      /* L2 entries before, for undo */
+	struct qcow_l2_table *table;
+	struct list_head      next;
+	struct list_head      waiters;
+	struct tiocb          tiocb;
+	struct tdqcow_state  *state;
+};
+
+/* asynchronous state of a get_cluster_offset() call */
+struct qcow_async {
+	struct qcow_l2_table *wait;     /* table being read */
+	struct qcow_md_write *md;       /* metadata write to wait for */
+	int                   err;
+};
+
+static int _qcow_l2_cache_size = L2_CACHE_SIZE;
+
 static int decompress_cluster(struct tdqcow_state *s, uint64_t cluster_offset);
+void tdqcow_queue_read(td_driver_t *driver, td_request_t treq);
+void tdqcow_queue_write(td_driver_t *driver, td_request_t treq);
+
+int
+qcow_set_l2_cache_size(int size)
+{
+	if (size < 1 || size > L2_CACHE_SIZE_MAX)
+		return -EINVAL;
+
+	_qcow_l2_cache_size = size;
+	return 0;
+}
 
 uint32_t gen_cksum(char *ptr, int len)
 {
@@ -209,7 +266,11 @@ void tdqcow_complete(void *arg, struct tiocb *tiocb, int err)
 	struct qcow_request *aio = (struct qcow_request *)arg;
 	struct tdqcow_state *s = aio->state;
 
-	td_complete_request(aio->treq, err);
+	aio->err = (aio->err ? aio->err : err);
+	if (--aio->pending)
+		return;
+
+	td_complete_request(aio->treq, aio->err);
 
 	s->aio_free_list[s->aio_free_count++] = aio;
 }
@@ -228,9 +289,11 @@ static void async_read(td_driver_t *driver, td_request_t treq)
 	if (prv->aio_free_count == 0)
 		goto fail;
 
-	aio        = prv->aio_free_list[--prv->aio_free_count];
-	aio->treq  = treq;
-	aio->state = prv;
+	aio          = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq    = treq;
+	aio->state   = prv;
+	aio->pending = 1;
+	aio->err     = 0;
 
 	td_prep_read(&aio->tiocb, prv->fd, treq.buf,
 		     size, offset, tdqcow_complete, aio);
@@ -242,7 +305,11 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
-static void async_write(td_driver_t *driver, td_request_t treq)
+/*
+ * if @md is set, @treq is not complete until @md has been written too
+ */
+static void async_write(td_driver_t *driver, td_request_t treq,
+			struct qcow_md_write *md)
 {
 	int size;
 	uint64_t offset;
@@ -256,9 +323,16 @@ static void async_write(td_driver_t *driver, td_request_t treq)
 	if (prv->aio_free_count == 0)
 		goto fail;
 
-	aio        = prv->aio_free_list[--prv->aio_free_count];
-	aio->treq  = treq;
-	aio->state = prv;
+	aio          = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq    = treq;
+	aio->state   = prv;
+	aio->pending = 1;
+	aio->err     = 0;
+
+	if (md) {
+		aio->pending++;
+		list_add_tail(&aio->next, &md->waiters);
+	}
 
 	td_prep_write(&aio->tiocb, prv->fd, treq.buf,
 		      size, offset, tdqcow_complete, aio);
@@ -364,6 +438,411 @@ int qtruncate(int fd, off_t length, int sparse)
 	return 0;
 }
 
+static inline struct qcow_l2_table **
+l2_cache_bucket(struct tdqcow_state *s, uint64_t offset)
+{
+	return s->l2_hash + ((offset >> s->cluster_bits) & s->l2_hash_mask);
+}
+
+static struct qcow_l2_table *
+l2_cache_find(struct tdqcow_state *s, uint64_t offset)
+{
+	struct qcow_l2_table *t;
+
+	for (t = *l2_cache_bucket(s, offset); t; t = t->hash_next)
+		if (t->offset == offset)
+			return t;
+
+	return NULL;
+}
+
+static void
+l2_cache_remove(struct tdqcow_state *s, struct qcow_l2_table *t)
+{
+	struct qcow_l2_table **pprev;
+
+	if (!t->offset)
+		return;
+
+	pprev = l2_cache_bucket(s, t->offset);
+	while (*pprev != t)
+		pprev = &(*pprev)->hash_next;
+
+	*pprev       = t->hash_next;
+	t->hash_next = NULL;
+	t->offset    = 0;
+}
+
+static inline void
+l2_cache_touch(struct tdqcow_state *s, struct qcow_l2_table *t)
+{
+	list_del(&t->lru);
+	list_add_tail(&t->lru, &s->l2_lru);
+}
+
+static void
+l2_cache_insert(struct tdqcow_state *s, struct qcow_l2_table *t,
+		uint64_t offset)
+{
+	struct qcow_l2_table **bucket = l2_cache_bucket(s, offset);
+
+	t->offset    = offset;
+	t->hash_next = *bucket;
+	*bucket      = t;
+
+	l2_cache_touch(s, t);
+}
+
+/*
+ * recycle the least recently used table that is neither being read
+ * nor waiting for a metadata write
+ */
+static struct qcow_l2_table *
+l2_cache_get_slot(struct tdqcow_state *s)
+{
+	struct qcow_l2_table *t;
+
+	list_for_each_entry(t, &s->l2_lru, lru) {
+		if (t->reading || t->dirty)
+			continue;
+
+		if (t->offset) {
+			s->l2_stats.evictions++;
+			l2_cache_remove(s, t);
+		}
+
+		return t;
+	}
+
+	return NULL;
+}
+
+static void
+l2_cache_reset(struct tdqcow_state *s)
+{
+	int i;
+
+	for (i = 0; i < s->l2_cache_size; i++)
+		l2_cache_remove(s, s->l2_tables + i);
+}
+
+static void
+l2_cache_free(struct tdqcow_state *s)
+{
+	free(s->l2_cache);
+	free(s->l2_tables);
+	free(s->l2_hash);
+	s->l2_cache  = NULL;
+	s->l2_tables = NULL;
+	s->l2_hash   = NULL;
+}
+
+static int
+l2_cache_init(struct tdqcow_state *s)
+{
+	int i, err;
+	uint32_t buckets;
+	struct qcow_l2_table *t;
+
+	INIT_LIST_HEAD(&s->l2_lru);
+	INIT_LIST_HEAD(&s->md_queue);
+
+	s->l2_cache_size = _qcow_l2_cache_size;
+
+	for (buckets = 1; buckets < s->l2_cache_size; buckets <<= 1)
+		;
+	s->l2_hash_mask = buckets - 1;
+
+	err = posix_memalign((void **)&s->l2_cache, 4096,
+			     s->l2_size * s->l2_cache_size * sizeof(uint64_t));
+	if (err) {
+		s->l2_cache = NULL;
+		goto fail;
+	}
+
+	s->l2_tables = calloc(s->l2_cache_size, sizeof(struct qcow_l2_table));
+	s->l2_hash   = calloc(buckets, sizeof(struct qcow_l2_table *));
+	if (!s->l2_tables || !s->l2_hash)
+		goto fail;
+
+	for (i = 0; i < s->l2_cache_size; i++) {
+		t        = s->l2_tables + i;
+		t->table = s->l2_cache + i * s->l2_size;
+		t->state = s;
+		INIT_LIST_HEAD(&t->waiters);
+		list_add_tail(&t->lru, &s->l2_lru);
+	}
+
+	return 0;
+
+fail:
+	l2_cache_free(s);
+	return -ENOMEM;
+}
+
+static void
+l2_table_read_done(void *arg, struct tiocb *tiocb, int err)
+{
+	td_request_t treq;
+	struct list_head waiters;
+	struct qcow_request *req, *tmp;
+	struct qcow_l2_table *t = (struct qcow_l2_table *)arg;
+	struct tdqcow_state *s = t->state;
+
+	t->reading = 0;
+
+	if (err) {
+		DPRINTF("reading L2 table at 0x%"PRIx64" failed: %d\n",
+			t->offset, err);
+		l2_cache_remove(s, t);
+	}
+
+	INIT_LIST_HEAD(&waiters);
+	list_splice(&t->waiters, &waiters);
+	INIT_LIST_HEAD(&t->waiters);
+
+	list_for_each_entry_safe(req, tmp, &waiters, next) {
+		treq = req->treq;
+		list_del(&req->next);
+		s->aio_free_list[s->aio_free_count++] = req;
+
+		if (err)
+			td_complete_request(treq, err);
+		else if (treq.op == TD_OP_WRITE)
+			tdqcow_queue_write(s->driver, treq);
+		else
+			tdqcow_queue_read(s->driver, treq);
+	}
+}
+
+static void
+l2_table_read(struct tdqcow_state *s, struct qcow_l2_table *t)
+{
+	t->reading = 1;
+	td_prep_read(&t->tiocb, s->fd, (char *)t->table,
+		     s->l2_size * sizeof(uint64_t), t->offset,
+		     l2_table_read_done, t);
+	td_queue_tiocb(s->driver, &t->tiocb);
+}
+
+/*
+ * park the unprocessed part of a request until @t has been read
+ */
+static int
+l2_table_wait(struct tdqcow_state *s, struct qcow_l2_table *t,
+	      td_request_t treq)
+{
+	struct qcow_request *req;
+
+	if (!s->aio_free_count)
+		return -EBUSY;
+
+	req        = s->aio_free_list[--s->aio_free_count];
+	req->treq  = treq;
+	req->state = s;
+	list_add_tail(&req->next, &t->waiters);
+
+	s->l2_stats.waits++;
+	return 0;
+}
+
+static void
+md_copy(char *dst, const char *src, size_t size, int swap)
+{
+	int i;
+	uint64_t *p;
+
+	memcpy(dst, src, size);
+
+	/* L1 entries are kept in cpu order, L2 entries in big endian */
+	if (swap)
+		for (p = (uint64_t *)dst, i = 0; i < size / sizeof(uint64_t); i++)
+			cpu_to_be64s(&p[i]);
+}
+
+static void
+md_write_done(void *arg, struct tiocb *tiocb, int err);
+
+static void
+md_write_kick(struct tdqcow_state *s)
+{
+	struct qcow_md_write *md;
+
+	if (s->md_busy || list_empty(&s->md_queue))
+		return;
+
+	md = list_entry(s->md_queue.next, struct qcow_md_write, next);
+	s->md_busy = 1;
+
+	td_prep_write(&md->tiocb, s->fd, md->buf, md->size, md->offset,
+		      md_write_done, md);
+	td_queue_tiocb(s->driver, &md->tiocb);
+}
+
+/*
+ * a failed L2 update must not stay visible in the cache: put back the
+ * entries it changed, unless changed again since, and take them out of
+ * later queued writes of the same sector too.
+ */
+static void
+md_write_undo(struct tdqcow_state *s, struct qcow_md_write *md)
+{
+	int i;
+	uint64_t *new, *cur;
+	struct qcow_md_write *q;
+
+	new = (uint64_t *)md->buf;
+	cur = md->table->table +
+		(md->offset - md->table->offset) / sizeof(uint64_t);
+
+	for (i = 0; i < md->size / sizeof(uint64_t); i++) {
+		if (new[i] == md->old[i])
+			continue;
+
+		if (cur[i] == new[i])
+			cur[i] = md->old[i];
+
+		list_for_each_entry(q, &s->md_queue, next) {
+			if (q->offset != md->offset || !q->old)
+				continue;
+			if (((uint64_t *)q->buf)[i] == new[i])
+				((uint64_t *)q->buf)[i] = md->old[i];
+			if (q->old[i] == new[i])
+				q->old[i] = md->old[i];
+		}
+	}
+}
+
+static void
+md_write_done(void *arg, struct tiocb *tiocb, int err)
+{
+	struct qcow_request *aio, *tmp;
+	struct qcow_md_write *md = (struct qcow_md_write *)arg;
+	struct tdqcow_state *s = md->state;
+
+	if (err)
+		DPRINTF("metadata write at 0x%"PRIx64" failed: %d\n",
+			md->offset, err);
+
+	list_del(&md->next);
+	s->md_busy = 0;
+
+	if (err && md->old)
+		md_write_undo(s, md);
+
+	if (md->table)
+		md->table->dirty--;
+
+	list_for_each_entry_safe(aio, tmp, &md->waiters, next) {
+		list_del(&aio->next);
+		tdqcow_complete(aio, NULL, err);
+	}
+
+	free(md->old);
+	free(md->buf);
+	free(md);
+
+	md_write_kick(s);
+}
+
+static inline struct qcow_md_write *
+md_write_last(struct tdqcow_state *s)
+{
+	if (list_empty(&s->md_queue))
+		return NULL;
+
+	return list_entry(s->md_queue.prev, struct qcow_md_write, next);
+}
+
+/*
+ * write @size bytes of metadata at @offset.  without @as the write is
+ * synchronous.  otherwise it is queued behind all earlier metadata
+ * writes (or merged into a queued write of the same range) and
+ * @as->md is set to the write a dependent request must wait for.
+ * @entry, if set, is the L2 entry in @src just changed from @old; it
+ * is restored should the queued write fail.
+ */
+static int
+md_write(struct tdqcow_state *s, uint64_t offset, void *src, size_t size,
+	 int swap, struct qcow_l2_table *t, uint64_t *entry, uint64_t old,
+	 struct qcow_async *as)
+{
+	int err;
+	char *buf;
+	uint64_t *pre = NULL;
+	struct qcow_md_write *md;
+
+	if (as) {
+		list_for_each_entry(md, &s->md_queue, next) {
+			if (s->md_busy && md->next.prev == &s->md_queue)
+				continue;
+
+			if (md->offset == offset && md->size == size) {
+				md_copy(md->buf, src, size, swap);
+				s->l2_stats.md_merged++;
+				goto out;
+			}
+		}
+	}
+
+	err = posix_memalign((void **)&buf, 4096, size);
+	if (err) {
+		DPRINTF("ERROR allocating memory for metadata write\n");
+		return -ENOMEM;
+	}
+
+	md_copy(buf, src, size, swap);
+	s->l2_stats.md_writes++;
+
+	if (!as) {
+		/*
+		 * Issue non-asynchronous write.
+		 * For safety, we must ensure that
+		 * entry is written before blocks.
+		 */
+		err = 0;
+		lseek(s->fd, offset, SEEK_SET);
+		if (write(s->fd, buf, size) != size)
+			err = -EIO;
+		free(buf);
+		return err;
+	}
+
+	if (entry) {
+		pre = malloc(size);
+		if (!pre) {
+			free(buf);
+			return -ENOMEM;
+		}
+		memcpy(pre, src, size);
+		pre[entry - (uint64_t *)src] = old;
+	}
+
+	md = calloc(1, sizeof(struct qcow_md_write));
+	if (!md) {
+		free(pre);
+		free(buf);
+		return -ENOMEM;
+	}
+
+	md->offset = offset;
+	md->size   = size;
+	md->buf    = buf;
+	md->old    = pre;
+	md->table  = t;
+	md->state  = s;
+	INIT_LIST_HEAD(&md->waiters);
+	list_add_tail(&md->next, &s->md_queue);
+
+	if (t)
+		t->dirty++;
+
+out:
+	as->md = md_write_last(s);
+	md_write_kick(s);
+	return 0;
+}
+
 /* 'allocate' is:
  *
  * 0 to not allocate.
@@ -376,26 +855,36 @@ int qtruncate(int fd, off_t length, int sparse)
  * cluster_size 
  *
  * return 0 if not allocated.
+ *
+ * 'as' is NULL for synchronous metadata I/O.  Otherwise, a return of 0
+ * with as->wait set means the L2 table is being read and the request
+ * must wait on it; with as->err set, the lookup failed.  as->md is set
+ * if the caller must not complete a write before that metadata write.
  */
 static uint64_t get_cluster_offset(struct tdqcow_state *s,
                                    uint64_t offset, int allocate,
                                    int compressed_size,
-                                   int n_start, int n_end)
+                                   int n_start, int n_end,
+                                   struct qcow_async *as)
 {
-	int min_index, i, j, l1_index, l2_index, l2_sector, l1_sector;
-	char *tmp_ptr2, *l2_ptr, *l1_ptr;
-	uint64_t *tmp_ptr;
+	int i, l1_index, l2_index, l2_sector, l1_sector;
 	uint64_t l2_offset, *l2_table, cluster_offset, tmp;
-	uint32_t min_count;
-	int new_l2_table;
+	struct qcow_l2_table *t;
+	size_t l2_bytes, size;
+
+	l2_bytes = s->l2_size * sizeof(uint64_t);
 
 	/*Check L1 table for the extent offset*/
 	l1_index = offset >> (s->l2_bits + s->cluster_bits);
 	l2_offset = s->l1_table[l1_index];
-	new_l2_table = 0;
 	if (!l2_offset) {
 		if (!allocate)
 			return 0;
+
+		t = l2_cache_get_slot(s);
+		if (!t)
+			goto busy;
+
 		/* 
 		 * allocating a new l2 entry + extent 
 		 * at the end of the file, we must also
@@ -407,95 +896,39 @@ static uint64_t get_cluster_offset(struct tdqcow_state *s,
 		l2_offset = (l2_offset + s->cluster_size - 1) 
 			& ~(s->cluster_size - 1);
 
-		/* update the L1 entry */
-		s->l1_table[l1_index] = l2_offset;
-		
 		/*Truncate file for L2 table 
 		 *(initialised to zero in case we crash)*/
-		if (qtruncate(s->fd, 
-			      l2_offset + (s->l2_size * sizeof(uint64_t)),
-			      s->sparse) != 0) {
+		if (qtruncate(s->fd, l2_offset + l2_bytes, s->sparse) != 0) {
 			DPRINTF("ERROR truncating file\n");
-			return 0;
+			goto fail;
 		}
-		s->fd_end = l2_offset + (s->l2_size * sizeof(uint64_t));
+		s->fd_end = l2_offset + l2_bytes;
+
+		/* update the L1 entry */
+		s->l1_table[l1_index] = l2_offset;
 
 		/*Update the L1 table entry on disk
                  * (for O_DIRECT we write 4KByte blocks)*/
 		l1_sector = (l1_index * sizeof(uint64_t)) >> 12;
-		l1_ptr = (char *)s->l1_table + (l1_sector << 12);
-
-		if (posix_memalign((void **)&tmp_ptr, 4096, 4096) != 0) {
-			DPRINTF("ERROR allocating memory for L1 table\n");
-		}
-		memcpy(tmp_ptr, l1_ptr, 4096);
-
-		/* Convert block to write to big endian */
-		for(i = 0; i < 4096 / sizeof(uint64_t); i++) {
-			cpu_to_be64s(&tmp_ptr[i]);
-		}
-
-		/*
-		 * Issue non-asynchronous L1 write.
-		 * For safety, we must ensure that
-		 * entry is written before blocks.
-		 */
-		lseek(s->fd, s->l1_table_offset + (l1_sector << 12), SEEK_SET);
-		if (write(s->fd, tmp_ptr, 4096) != 4096) {
-			free(tmp_ptr);
-		 	return 0;
-		}
-		free(tmp_ptr);
-
-		new_l2_table = 1;
-		goto cache_miss;
-	} else if (s->min_cluster_alloc == s->l2_size) {
-		/*Fast-track the request*/
-		cluster_offset = l2_offset + (s->l2_size * sizeof(uint64_t));
-		l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-		return cluster_offset + (l2_index * s->cluster_size);
-	}
-
-	/*Check to see if L2 entry is already cached*/
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (l2_offset == s->l2_cache_offsets[i]) {
-			/* increment the hit count */
-			if (++s->l2_cache_counts[i] == 0xffffffff) {
-				for (j = 0; j < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
-			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
-			goto found;
+		if (md_write(s, s->l1_table_offset + (l1_sector << 12),
+			     (char *)s->l1_table + (l1_sector << 12),
+			     4096, 1, NULL, NULL, 0, as)) {
+			s->l1_table[l1_index] = 0;
+			goto fail;
 		}
-	}
 
-cache_miss:
-	/* not found: load a new entry in the least used one */
-	min_index = 0;
-	min_count = 0xffffffff;
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
-			min_index = i;
-		}
-	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
+		l2_table = t->table;
 
-	/*If extent pre-allocated, read table from disk, 
-	 *otherwise write new table to disk*/
-	if (new_l2_table) {
 		/*Should we allocate the whole extent? Adjustable parameter.*/
 		if (s->cluster_alloc == s->l2_size) {
-			cluster_offset = l2_offset + 
-				(s->l2_size * sizeof(uint64_t));
+			cluster_offset = l2_offset + l2_bytes;
 			cluster_offset = (cluster_offset + s->cluster_size - 1)
 				& ~(s->cluster_size - 1);
 			if (qtruncate(s->fd, cluster_offset + 
 				  (s->cluster_size * s->l2_size), 
 				      s->sparse) != 0) {
 				DPRINTF("ERROR truncating file\n");
-				return 0;
+				goto fail;
 			}
 			s->fd_end = cluster_offset + 
 				(s->cluster_size * s->l2_size);
@@ -503,24 +936,58 @@ cache_miss:
 				l2_table[i] = cpu_to_be64(cluster_offset + 
 							  (i*s->cluster_size));
 			}  
-		} else memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+		} else memset(l2_table, 0, l2_bytes);
 
-		lseek(s->fd, l2_offset, SEEK_SET);
-		if (write(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) !=
-		   s->l2_size * sizeof(uint64_t))
-			return 0;
-	} else {
-		lseek(s->fd, l2_offset, SEEK_SET);
-		if (read(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) != 
-		    s->l2_size * sizeof(uint64_t))
-			return 0;
+		l2_cache_insert(s, t, l2_offset);
+
+		if (md_write(s, l2_offset, l2_table, l2_bytes, 0, t,
+			     NULL, 0, as)) {
+			l2_cache_remove(s, t);
+			goto fail;
+		}
+
+		goto found;
+	} else if (s->min_cluster_alloc == s->l2_size) {
+		/*Fast-track the request*/
+		cluster_offset = l2_offset + l2_bytes;
+		l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+		return cluster_offset + (l2_index * s->cluster_size);
+	}
+
+	/*Check to see if L2 entry is already cached*/
+	t = l2_cache_find(s, l2_offset);
+	if (t) {
+		if (t->reading)
+			goto wait;
+
+		s->l2_stats.hits++;
+		l2_cache_touch(s, t);
+		goto found;
+	}
+
+	/* not found: load a new entry in the least recently used one */
+	s->l2_stats.misses++;
+
+	t = l2_cache_get_slot(s);
+	if (!t)
+		goto busy;
+
+	l2_cache_insert(s, t, l2_offset);
+
+	if (as) {
+		l2_table_read(s, t);
+		goto wait;
+	}
+
+	lseek(s->fd, l2_offset, SEEK_SET);
+	if (read(s->fd, t->table, l2_bytes) != l2_bytes) {
+		l2_cache_remove(s, t);
+		return 0;
 	}
-	
-	/*Update the cache entries*/ 
-	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
 
 found:
+	l2_table = t->table;
+
 	/*The extent is split into 's->l2_size' blocks of 
 	 *size 's->cluster_size'*/
 	l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
@@ -591,25 +1058,40 @@ found:
 			}
 		}
 		/* update L2 table */
-		tmp = cpu_to_be64(cluster_offset);
-		l2_table[l2_index] = tmp;
+		tmp = l2_table[l2_index];
+		l2_table[l2_index] = cpu_to_be64(cluster_offset);
 
 		/*For IO_DIRECT we write 4KByte blocks*/
 		l2_sector = (l2_index * sizeof(uint64_t)) >> 12;
-		l2_ptr = (char *)l2_table + (l2_sector << 12);
-		
-		if (posix_memalign((void **)&tmp_ptr2, 4096, 4096) != 0) {
-			DPRINTF("ERROR allocating memory for L1 table\n");
-		}
-		memcpy(tmp_ptr2, l2_ptr, 4096);
-		lseek(s->fd, l2_offset + (l2_sector << 12), SEEK_SET);
-		if (write(s->fd, tmp_ptr2, 4096) != 4096) {
-			free(tmp_ptr2);
-			return -1;
+		size = (l2_bytes < 4096 ? l2_bytes : 4096);
+
+		if (md_write(s, l2_offset + (l2_sector << 12),
+			     (char *)l2_table + (l2_sector << 12),
+			     size, 0, t, &l2_table[l2_index], tmp, as)) {
+			l2_table[l2_index] = tmp;
+			goto fail;
 		}
-		free(tmp_ptr2);
+	} else if (as && allocate && t->dirty) {
+		/* the cluster's allocation may not have reached the disk */
+		as->md = md_write_last(s);
 	}
+
 	return cluster_offset;
+
+wait:
+	if (as)
+		as->wait = t;
+	return 0;
+
+busy:
+	if (as)
+		as->err = -EBUSY;
+	return 0;
+
+fail:
+	if (as)
+		as->err = -EIO;
+	return 0;
 }
 
 static int qcow_is_allocated(struct tdqcow_state *s, int64_t sector_num,
@@ -618,7 +1100,8 @@ static int qcow_is_allocated(struct tdqcow_state *s, int64_t sector_num,
 	int index_in_cluster, n;
 	uint64_t cluster_offset;
 
-	cluster_offset = get_cluster_offset(s, sector_num << 9, 0, 0, 0, 0);
+	cluster_offset = get_cluster_offset(s, sector_num << 9, 0, 0, 0, 0,
+					    NULL);
 	index_in_cluster = sector_num & (s->cluster_sectors - 1);
 	n = s->cluster_sectors - index_in_cluster;
 	if (n > nb_sectors)
@@ -882,6 +1365,7 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 	}
 
 	s->fd = fd;
+	s->driver = driver;
 	s->name = strdup(name);
 	if (!s->name)
 		goto fail;
@@ -928,9 +1412,8 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 		goto fail;
 
 	/* alloc L2 cache */
-	size = s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t);
-	ret = posix_memalign((void **)&s->l2_cache, 4096, size);
-	if(ret != 0) goto fail;
+	if (l2_cache_init(s))
+		goto fail;
 
 	size = s->cluster_size;
 	ret = posix_memalign((void **)&s->cluster_cache, 4096, size);
@@ -972,7 +1455,7 @@ fail:
 
 	free_aio_state(s);
 	free(s->l1_table);
-	free(s->l2_cache);
+	l2_cache_free(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(fd);
@@ -984,7 +1467,7 @@ void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
 	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
 	int ret = 0, index_in_cluster, n, i;
 	uint64_t cluster_offset, sector, nb_sectors;
-	struct qcow_prv* prv;
+	struct qcow_async as;
 	td_request_t clone = treq;
 	char* buf = treq.buf;
 
@@ -993,13 +1476,31 @@ void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
 
 	/*We store a local record of the request*/
 	while (nb_sectors > 0) {
+		memset(&as, 0, sizeof(as));
 		cluster_offset = 
-			get_cluster_offset(s, sector << 9, 0, 0, 0, 0);
+			get_cluster_offset(s, sector << 9, 0, 0, 0, 0, &as);
 		index_in_cluster = sector & (s->cluster_sectors - 1);
 		n = s->cluster_sectors - index_in_cluster;
 		if (n > nb_sectors)
 			n = nb_sectors;
 
+		/* what is left of the request */
+		treq.buf  = buf;
+		treq.sec  = sector;
+		treq.secs = nb_sectors;
+
+		if (as.wait) {
+			ret = l2_table_wait(s, as.wait, treq);
+			if (ret)
+				td_complete_request(treq, ret);
+			return;
+		}
+
+		if (as.err) {
+			td_complete_request(treq, as.err);
+			return;
+		}
+
 		if (s->aio_free_count == 0) {
 			td_complete_request(treq, -EBUSY);
 			return;
@@ -1008,31 +1509,26 @@ void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
 		if(!cluster_offset) {
             int i;
             /* Forward entire request if possible. */
-            for(i=0; i<nb_sectors; i++)
-                if(get_cluster_offset(s, (sector+i) << 9, 0, 0, 0, 0))
+            for(i=0; i<nb_sectors; i++) {
+                memset(&as, 0, sizeof(as));
+                if(get_cluster_offset(s, (sector+i) << 9, 0, 0, 0, 0, &as) ||
+                   as.wait || as.err)
                     goto coalesce_failed;
-            treq.buf  = buf;
-            treq.sec  = sector;
-            treq.secs = nb_sectors;
+            }
 			td_forward_request(treq);
             return;
 coalesce_failed:            
-			treq.buf  = buf;
-			treq.sec  = sector;
 			treq.secs = n;
 			td_forward_request(treq);
 
 		} else if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
+			treq.secs = n;
 			if (decompress_cluster(s, cluster_offset) < 0) {
 				td_complete_request(treq, -EIO);
 				goto done;
 			}
 			memcpy(buf, s->cluster_cache + index_in_cluster * 512, 
 			       512 * n);
-			
-			treq.buf  = buf;
-			treq.sec  = sector;
-			treq.secs = n;
 			td_complete_request(treq, 0);
 		} else {
 		  clone.buf  = buf;
@@ -1053,8 +1549,7 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
 	int ret = 0, index_in_cluster, n, i;
 	uint64_t cluster_offset, sector, nb_sectors;
-	td_callback_t cb;
-	struct qcow_prv* prv;
+	struct qcow_async as;
 	char* buf = treq.buf;
 	td_request_t clone=treq;
 
@@ -1068,17 +1563,31 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 		if (n > nb_sectors)
 			n = nb_sectors;
 
+		/* what is left of the request */
+		treq.buf  = buf;
+		treq.sec  = sector;
+		treq.secs = nb_sectors;
+
 		if (s->aio_free_count == 0) {
 			td_complete_request(treq, -EBUSY);
 			return;
 		}
 
+		memset(&as, 0, sizeof(as));
 		cluster_offset = get_cluster_offset(s, sector << 9, 1, 0,
 						    index_in_cluster, 
-						    index_in_cluster+n);
+						    index_in_cluster+n, &as);
+		if (as.wait) {
+			ret = l2_table_wait(s, as.wait, treq);
+			if (ret)
+				td_complete_request(treq, ret);
+			return;
+		}
+
 		if (!cluster_offset) {
-			DPRINTF("Ooops, no write cluster offset!\n");
-			td_complete_request(treq, -EIO);
+			if (!as.err)
+				DPRINTF("Ooops, no write cluster offset!\n");
+			td_complete_request(treq, as.err ? as.err : -EIO);
 			return;
 		}
 
@@ -1090,13 +1599,13 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 			clone.buf  = buf;
 			clone.sec  = (cluster_offset>>9) + index_in_cluster;
 			clone.secs = n;
-			async_write(driver, clone);
+			async_write(driver, clone, as.md);
 		} else {
 		  clone.buf  = buf;
 		  clone.sec  = (cluster_offset>>9) + index_in_cluster;
 		  clone.secs = n;
 
-		  async_write(driver, clone);
+		  async_write(driver, clone, as.md);
 		}
 		
 		nb_sectors -= n;
@@ -1167,7 +1676,7 @@ int tdqcow_close(td_driver_t *driver)
 	free_aio_state(s);
 	free(s->name);
 	free(s->l1_table);
-	free(s->l2_cache);
+	l2_cache_free(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(s->fd);	
@@ -1330,9 +1839,7 @@ static int qcow_make_empty(struct tdqcow_state *s)
 		return -1;
 	}
 
-	memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+	l2_cache_reset(s);
 
 	return 0;
 }
@@ -1386,7 +1893,7 @@ static int qcow_compress_cluster(struct tdqcow_state *s, int64_t sector_num,
 		//tdqcow_queue_write(bs, sector_num, buf, s->cluster_sectors);
 	} else {
 		cluster_offset = get_cluster_offset(s, sector_num << 9, 2, 
-                                            out_len, 0, 0);
+                                            out_len, 0, 0, NULL);
 		cluster_offset &= s->cluster_offset_mask;
 		lseek(s->fd, cluster_offset, SEEK_SET);
 		if (write(s->fd, out_buf, out_len) != out_len) {
@@ -1485,6 +1992,24 @@ int tdqcow_validate_parent(td_driver_t *driver,
 	return 0;
 }
 
+static void
+tdqcow_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct tdqcow_state *s = (struct tdqcow_state *)driver->data;
+	struct qcow_l2_stats *stats = &s->l2_stats;
+
+	tapdisk_stats_field(st, "l2_cache", "{");
+	tapdisk_stats_field(st, "size", "d", s->l2_cache_size);
+	tapdisk_stats_field(st, "hits", PRIu64, stats->hits);
+	tapdisk_stats_field(st, "misses", PRIu64, stats->misses);
+	tapdisk_stats_field(st, "waits", PRIu64, stats->waits);
+	tapdisk_stats_field(st, "evictions", PRIu64, stats->evictions);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "md_writes", PRIu64, stats->md_writes);
+	tapdisk_stats_field(st, "md_merged", PRIu64, stats->md_merged);
+}
+
 struct tap_disk tapdisk_qcow = {
 	.disk_type           = "tapdisk_qcow",
 	.flags              = 0,
@@ -1496,4 +2021,5 @@ struct tap_disk tapdisk_qcow = {
 	.td_get_parent_id    = tdqcow_get_parent_id,
 	.td_validate_parent  = tdqcow_validate_parent,
 	.td_debug           = NULL,
+	.td_stats            = tdqcow_stats,
 };
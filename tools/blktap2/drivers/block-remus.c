@@ -37,9 +37,6 @@
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
-#include "hashtable.h"
-#include "hashtable_itr.h"
-#include "hashtable_utility.h"
 
 #include <errno.h>
 #include <inttypes.h>
@@ -60,7 +57,9 @@
 
 /* timeout for reads and writes in ms */
 #define HEARTBEAT_MS 1000
-#define RAMDISK_HASHSIZE 128
+/* largest buffered extent, and most extents written back at once (sectors) */
+#define RAMDISK_EXTENT_MAX 256
+#define RAMDISK_INFLIGHT_MAX 32
 
 /* connect retry timeout (seconds) */
 #define REMUS_CONNRETRY_TIMEOUT 10
@@ -99,18 +98,39 @@ td_vbd_t *device_vbd = NULL;
 td_image_t *remus_image = NULL;
 struct tap_disk tapdisk_remus;
 
+/* A buffered extent: a run of consecutive sectors held in one page-aligned
+ * buffer, so that it can be written out with a single request. */
+struct ramdisk_extent {
+	uint64_t sector;
+	int secs;
+	int size;			/* allocated sectors */
+	char* buf;
+	struct ramdisk_extent* left;
+	struct ramdisk_extent* right;
+	int height;
+};
+
+/* The extents of a map never overlap and are kept in an AVL tree ordered
+ * by start sector. Writes are merged into neighbouring extents as they
+ * arrive, so a map is always ready to be written out in disk order. */
+struct ramdisk_map {
+	struct ramdisk_extent* root;
+	unsigned int extents;
+	uint64_t secs;
+};
+
 struct ramdisk {
 	size_t sector_size;
-	struct hashtable* h;
-	/* when a ramdisk is flushed, h is given a new empty hash for writes
-	 * while the old ramdisk (prev) is drained asynchronously.
+	struct ramdisk_map h;
+	/* when a ramdisk is flushed, h is moved to prev and writes of the
+	 * next checkpoint are buffered in a new, empty h while prev is
+	 * drained asynchronously.
 	 */
-	struct hashtable* prev;
+	struct ramdisk_map prev;
 	/* count of outstanding requests to the base driver */
 	size_t inflight;
-	/* prev holds the requests to be flushed, while inprogress holds
-	 * requests being flushed. When requests complete, they are removed
-	 * from inprogress.
+	/* extents are moved from prev to inprogress when their write is
+	 * issued, and freed when it completes.
 	 * Whenever a new flush is merged with ongoing flush (i.e, prev),
 	 * we have to make sure that none of the new requests overlap with
 	 * ones in "inprogress". If it does, keep it back in prev and dont issue
@@ -120,7 +140,15 @@ struct ramdisk {
 	 * IOW, make sure we dont create a write-after-write time ordering constraint.
 	 * 
 	 */
-	struct hashtable* inprogress;
+	struct ramdisk_map inprogress;
+	/* set while ramdisk_flush() is issuing writes */
+	int flushing;
+
+	uint64_t checkpoints;
+	uint64_t writes;
+	uint64_t merged;
+	uint64_t flushed;
+	uint64_t waw_deferred;
 };
 
 /* the ramdisk intercepts the original callback for reads and writes.
@@ -231,6 +259,7 @@ static inline int ring_isfull(struct req_ring* ring)
 }
 /* Prototype declarations */
 static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s);
+static void ramdisk_map_drop(struct ramdisk_map* map, uint64_t sector);
 
 /* functions to create and sumbit treq's */
 
@@ -239,8 +268,6 @@ replicated_write_callback(td_request_t treq, int err)
 {
 	struct tdremus_state *s = (struct tdremus_state *) treq.cb_data;
 	td_vbd_request_t *vreq;
-	int i;
-	uint64_t start;
 	vreq = (td_vbd_request_t *) treq.private;
 
 	/* the write failed for now, lets panic. this is very bad */
@@ -255,16 +282,12 @@ replicated_write_callback(td_request_t treq, int err)
 	free(vreq);
 
 	s->ramdisk.inflight--;
-	start = treq.sec;
-	for (i = 0; i < treq.secs; i++) {
-		hashtable_remove(s->ramdisk.inprogress, &start);
-		start++;
-	}
-	free(treq.buf);
+	s->ramdisk.flushed += treq.secs;
+	ramdisk_map_drop(&s->ramdisk.inprogress, treq.sec);
 
-	if (!s->ramdisk.inflight && !s->ramdisk.prev) {
-		/* TODO: the ramdisk has been flushed */
-	}
+	/* queue what was held back by the inflight limit or a WAW conflict */
+	if (s->ramdisk.prev.root && !s->ramdisk.flushing)
+		ramdisk_flush(s->tdremus_driver, s);
 }
 
 static inline int
@@ -282,6 +305,7 @@ create_write_request(struct tdremus_state *state, td_sector_t sec, int secs, cha
 	treq.cb_data = state;
 	treq.id      = 0;
 	treq.sidx    = 0;
+	treq.ts      = 0;
 
 	vreq         = calloc(1, sizeof(td_vbd_request_t));
 	treq.private = vreq;
@@ -302,200 +326,423 @@ create_write_request(struct tdremus_state *state, td_sector_t sec, int secs, cha
 	return 0;
 }
 
+/* extent tree */
+
+static inline uint64_t rd_end(struct ramdisk_extent* e)
+{
+	return e->sector + e->secs;
+}
 
-/* http://www.concentric.net/~Ttwang/tech/inthash.htm */
-static unsigned int uint64_hash(void* k)
+static inline int rd_height(struct ramdisk_extent* e)
 {
-	uint64_t key = *(uint64_t*)k;
+	return e ? e->height : 0;
+}
 
-	key = (~key) + (key << 18);
-	key = key ^ (key >> 31);
-	key = key * 21;
-	key = key ^ (key >> 11);
-	key = key + (key << 6);
-	key = key ^ (key >> 22);
+static inline void rd_update(struct ramdisk_extent* e)
+{
+	int l = rd_height(e->left), r = rd_height(e->right);
 
-	return (unsigned int)key;
+	e->height = 1 + (l > r ? l : r);
 }
 
-static int rd_hash_equal(void* k1, void* k2)
+static struct ramdisk_extent* rd_rotate_right(struct ramdisk_extent* e)
 {
-	uint64_t key1, key2;
+	struct ramdisk_extent* l = e->left;
 
-	key1 = *(uint64_t*)k1;
-	key2 = *(uint64_t*)k2;
+	e->left = l->right;
+	l->right = e;
+	rd_update(e);
+	rd_update(l);
 
-	return key1 == key2;
+	return l;
 }
 
-static int ramdisk_read(struct ramdisk* ramdisk, uint64_t sector,
-			int nb_sectors, char* buf)
+static struct ramdisk_extent* rd_rotate_left(struct ramdisk_extent* e)
 {
-	int i;
-	char* v;
-	uint64_t key;
+	struct ramdisk_extent* r = e->right;
 
-	for (i = 0; i < nb_sectors; i++) {
-		key = sector + i;
-		/* check whether it is queued in a previous flush request */
-		if (!(ramdisk->prev && (v = hashtable_search(ramdisk->prev, &key)))) {
-			/* check whether it is an ongoing flush */
-			if (!(ramdisk->inprogress && (v = hashtable_search(ramdisk->inprogress, &key))))
-				return -1;
-		}
-		memcpy(buf + i * ramdisk->sector_size, v, ramdisk->sector_size);
-	}
+	e->right = r->left;
+	r->left = e;
+	rd_update(e);
+	rd_update(r);
 
-	return 0;
+	return r;
 }
 
-static int ramdisk_write_hash(struct hashtable* h, uint64_t sector, char* buf,
-			      size_t len)
+static struct ramdisk_extent* rd_balance(struct ramdisk_extent* e)
 {
-	char* v;
-	uint64_t* key;
+	int bal;
 
-	if ((v = hashtable_search(h, &sector))) {
-		memcpy(v, buf, len);
-		return 0;
+	rd_update(e);
+	bal = rd_height(e->left) - rd_height(e->right);
+
+	if (bal > 1) {
+		if (rd_height(e->left->left) < rd_height(e->left->right))
+			e->left = rd_rotate_left(e->left);
+		return rd_rotate_right(e);
 	}
 
-	if (!(v = malloc(len))) {
-		DPRINTF("ramdisk_write_hash: malloc failed\n");
-		return -1;
+	if (bal < -1) {
+		if (rd_height(e->right->right) < rd_height(e->right->left))
+			e->right = rd_rotate_right(e->right);
+		return rd_rotate_left(e);
 	}
-	memcpy(v, buf, len);
-	if (!(key = malloc(sizeof(*key)))) {
-		DPRINTF("ramdisk_write_hash: error allocating key\n");
-		free(v);
-		return -1;
+
+	return e;
+}
+
+static struct ramdisk_extent* rd_insert(struct ramdisk_extent* root,
+					struct ramdisk_extent* e)
+{
+	if (!root) {
+		e->left = e->right = NULL;
+		e->height = 1;
+		return e;
 	}
-	*key = sector;
-	if (!hashtable_insert(h, key, v)) {
-		DPRINTF("ramdisk_write_hash failed on sector %" PRIu64 "\n", sector);
-		free(key);
-		free(v);
-		return -1;
+
+	if (e->sector < root->sector)
+		root->left = rd_insert(root->left, e);
+	else
+		root->right = rd_insert(root->right, e);
+
+	return rd_balance(root);
+}
+
+static struct ramdisk_extent* rd_remove_min(struct ramdisk_extent* root,
+					    struct ramdisk_extent** min)
+{
+	if (!root->left) {
+		*min = root;
+		return root->right;
 	}
 
-	return 0;
+	root->left = rd_remove_min(root->left, min);
+	return rd_balance(root);
 }
 
-static inline int ramdisk_write(struct ramdisk* ramdisk, uint64_t sector,
-				int nb_sectors, char* buf)
+static struct ramdisk_extent* rd_remove(struct ramdisk_extent* root,
+					uint64_t sector,
+					struct ramdisk_extent** out)
 {
-	int i, rc;
+	struct ramdisk_extent* min;
+
+	if (!root)
+		return NULL;
 
-	for (i = 0; i < nb_sectors; i++) {
-		rc = ramdisk_write_hash(ramdisk->h, sector + i,
-					buf + i * ramdisk->sector_size,
-					ramdisk->sector_size);
-		if (rc)
-			return rc;
+	if (sector < root->sector)
+		root->left = rd_remove(root->left, sector, out);
+	else if (sector > root->sector)
+		root->right = rd_remove(root->right, sector, out);
+	else {
+		*out = root;
+		if (!root->right)
+			return root->left;
+		root->right = rd_remove_min(root->right, &min);
+		min->left = root->left;
+		min->right = root->right;
+		root = min;
 	}
 
-	return 0;
+	return rd_balance(root);
 }
 
-static int uint64_compare(const void* k1, const void* k2)
+/* the extent with the greatest start sector <= sector */
+static struct ramdisk_extent* rd_floor(struct ramdisk_map* map,
+				       uint64_t sector)
 {
-	uint64_t u1 = *(uint64_t*)k1;
-	uint64_t u2 = *(uint64_t*)k2;
+	struct ramdisk_extent *e = map->root, *best = NULL;
+
+	while (e) {
+		if (e->sector <= sector) {
+			best = e;
+			e = e->right;
+		} else
+			e = e->left;
+	}
 
-	/* u1 - u2 is unsigned */
-	return u1 < u2 ? -1 : u1 > u2 ? 1 : 0;
+	return best;
 }
 
-/* set psectors to an array of the sector numbers in the hash, returning
- * the number of entries (or -1 on error) */
-static int ramdisk_get_sectors(struct hashtable* h, uint64_t** psectors)
+/* the extent with the smallest start sector >= sector */
+static struct ramdisk_extent* rd_ceil(struct ramdisk_map* map,
+				      uint64_t sector)
 {
-	struct hashtable_itr* itr;
-	uint64_t* sectors;
-	int count;
+	struct ramdisk_extent *e = map->root, *best = NULL;
 
-	if (!(count = hashtable_count(h)))
-		return 0;
+	while (e) {
+		if (e->sector >= sector) {
+			best = e;
+			e = e->left;
+		} else
+			e = e->right;
+	}
 
-	if (!(*psectors = malloc(count * sizeof(uint64_t)))) {
-		DPRINTF("ramdisk_get_sectors: error allocating sector map\n");
-		return -1;
+	return best;
+}
+
+static struct ramdisk_extent* rd_covering(struct ramdisk_map* map,
+					  uint64_t sector)
+{
+	struct ramdisk_extent* e = rd_floor(map, sector);
+
+	return e && rd_end(e) > sector ? e : NULL;
+}
+
+static inline int rd_overlaps(struct ramdisk_map* map, uint64_t sector,
+			      int secs)
+{
+	struct ramdisk_extent* e = rd_floor(map, sector + secs - 1);
+
+	return e && rd_end(e) > sector;
+}
+
+static void ramdisk_map_add(struct ramdisk_map* map, struct ramdisk_extent* e)
+{
+	map->root = rd_insert(map->root, e);
+	map->extents++;
+	map->secs += e->secs;
+}
+
+static struct ramdisk_extent* ramdisk_map_take(struct ramdisk_map* map,
+					       uint64_t sector)
+{
+	struct ramdisk_extent* e = NULL;
+
+	map->root = rd_remove(map->root, sector, &e);
+	if (e) {
+		map->extents--;
+		map->secs -= e->secs;
 	}
-	sectors = *psectors;
 
-	itr = hashtable_iterator(h);
-	count = 0;
-	do {
-		sectors[count++] = *(uint64_t*)hashtable_iterator_key(itr);
-	} while (hashtable_iterator_advance(itr));
-	free(itr);
+	return e;
+}
 
-	return count;
+static void rd_extent_free(struct ramdisk_extent* e)
+{
+	free(e->buf);
+	free(e);
 }
 
-/*
-  return -1 for OOM
-  return -2 for merge lookup failure
-  return -3 for WAW race
-  return 0 on success.
-*/
-static int merge_requests(struct ramdisk* ramdisk, uint64_t start,
-			size_t count, char **mergedbuf)
+static void ramdisk_map_drop(struct ramdisk_map* map, uint64_t sector)
 {
+	struct ramdisk_extent* e = ramdisk_map_take(map, sector);
+
+	if (e)
+		rd_extent_free(e);
+}
+
+static void ramdisk_map_clear(struct ramdisk_map* map)
+{
+	struct ramdisk_extent* e;
+
+	while (map->root) {
+		map->root = rd_remove_min(map->root, &e);
+		rd_extent_free(e);
+	}
+
+	map->extents = 0;
+	map->secs = 0;
+}
+
+/* make room for secs more sectors in e, at the front or the back */
+static int rd_extent_grow(struct ramdisk_extent* e, int secs, size_t ss,
+			  int front)
+{
+	int size = e->secs + secs;
 	char* buf;
-	char* sector;
-	int i;
-	uint64_t *key;
-	int rc = 0;
 
-	if (!(buf = valloc(count * ramdisk->sector_size))) {
-		DPRINTF("merge_request: allocation failed\n");
+	if (size <= e->size) {
+		if (front)
+			memmove(e->buf + secs * ss, e->buf, e->secs * ss);
+		return 0;
+	}
+
+	/* grow geometrically: sequential writes arrive a few sectors at a time */
+	if (size < 2 * e->size)
+		size = 2 * e->size;
+	if (size < RAMDISK_EXTENT_MAX && size > RAMDISK_EXTENT_MAX / 2)
+		size = RAMDISK_EXTENT_MAX;
+	if (size < e->secs + secs)
+		size = e->secs + secs;
+
+	if (!(buf = valloc(size * ss))) {
+		DPRINTF("%s: allocation failed\n", __FUNCTION__);
 		return -1;
 	}
 
-	for (i = 0; i < count; i++) {
-		if (!(sector = hashtable_search(ramdisk->prev, &start))) {
-			DPRINTF("merge_request: lookup failed on %"PRIu64"\n", start);
-			free(buf);
-			rc = -2;
-			goto fail;
-		}
+	memcpy(buf + (front ? secs * ss : 0), e->buf, e->secs * ss);
+	free(e->buf);
+	e->buf = buf;
+	e->size = size;
 
-		/* Check inprogress requests to avoid waw non-determinism */
-		if (hashtable_search(ramdisk->inprogress, &start)) {
-			DPRINTF("merge_request: WAR RACE on %"PRIu64"\n", start);
-			free(buf);
-			rc = -3;
-			goto fail;
+	return 0;
+}
+
+/* buffer [sector, sector + secs), which is not covered by any extent of
+ * map. prev and next are the extents around the gap, if any. */
+static int ramdisk_map_fill(struct ramdisk_map* map,
+			    struct ramdisk_extent* prev,
+			    struct ramdisk_extent* next,
+			    uint64_t sector, int secs, char* data, size_t ss)
+{
+	struct ramdisk_extent* e;
+
+	if (prev && rd_end(prev) == sector &&
+	    prev->secs + secs <= RAMDISK_EXTENT_MAX) {
+		if (rd_extent_grow(prev, secs, ss, 0))
+			return -1;
+		memcpy(prev->buf + prev->secs * ss, data, secs * ss);
+		prev->secs += secs;
+		map->secs += secs;
+
+		/* the gap is closed: join the extents on either side */
+		if (next && rd_end(prev) == next->sector &&
+		    prev->secs + next->secs <= RAMDISK_EXTENT_MAX &&
+		    !rd_extent_grow(prev, next->secs, ss, 0)) {
+			next = ramdisk_map_take(map, next->sector);
+			memcpy(prev->buf + prev->secs * ss,
+			       next->buf, next->secs * ss);
+			prev->secs += next->secs;
+			map->secs += next->secs;
+			rd_extent_free(next);
 		}
-		/* Insert req into inprogress (brief period of duplication of hash entries until
-		 * they are removed from prev. Read tracking would not be reading wrong entries)
-		 */
-		if (!(key = malloc(sizeof(*key)))) {
-			DPRINTF("%s: error allocating key\n", __FUNCTION__);
-			free(buf);			
-			rc = -1;
-			goto fail;
+
+		return 0;
+	}
+
+	if (next && sector + secs == next->sector &&
+	    next->secs + secs <= RAMDISK_EXTENT_MAX) {
+		if (rd_extent_grow(next, secs, ss, 1))
+			return -1;
+		memcpy(next->buf, data, secs * ss);
+		/* no other extent starts in the gap, so the tree order holds */
+		next->sector = sector;
+		next->secs += secs;
+		map->secs += secs;
+		return 0;
+	}
+
+	if (!(e = calloc(1, sizeof(*e))))
+		goto fail;
+	if (!(e->buf = valloc(secs * ss))) {
+		free(e);
+		goto fail;
+	}
+
+	e->sector = sector;
+	e->secs = secs;
+	e->size = secs;
+	memcpy(e->buf, data, secs * ss);
+	ramdisk_map_add(map, e);
+
+	return 0;
+
+ fail:
+	DPRINTF("%s: allocation failed on sector %" PRIu64 "\n",
+		__FUNCTION__, sector);
+	return -1;
+}
+
+/* copy [sector, sector + secs) into map, overwriting buffered sectors
+ * and merging new ones into adjacent extents */
+static int ramdisk_map_write(struct ramdisk_map* map, uint64_t sector,
+			     int secs, char* buf, size_t ss)
+{
+	struct ramdisk_extent *e, *next;
+	unsigned int extents = map->extents;
+	uint64_t cur, end, stop;
+
+	cur = sector;
+	end = sector + secs;
+
+	while (cur < end) {
+		e = rd_floor(map, cur);
+
+		if (e && rd_end(e) > cur) {
+			stop = MIN(end, rd_end(e));
+			memcpy(e->buf + (cur - e->sector) * ss,
+			       buf + (cur - sector) * ss, (stop - cur) * ss);
+			cur = stop;
+			continue;
 		}
-		*key = start;
-		if (!hashtable_insert(ramdisk->inprogress, key, NULL)) {
-			DPRINTF("%s failed to insert sector %" PRIu64 " into inprogress hash\n", 
-				__FUNCTION__, start);
-			free(key);
-			free(buf);
-			rc = -1;
-			goto fail;
+
+		next = rd_ceil(map, cur);
+		stop = next ? MIN(end, next->sector) : end;
+		stop = MIN(stop, cur + RAMDISK_EXTENT_MAX);
+
+		if (ramdisk_map_fill(map, e, next, cur, stop - cur,
+				     buf + (cur - sector) * ss, ss))
+			return -1;
+
+		cur = stop;
+	}
+
+	/* 1 if the write went entirely into existing extents */
+	return map->extents <= extents;
+}
+
+/* copy [sector, sector + nb_sectors) of the checkpoints being flushed
+ * into buf. Returns 0 if every sector was found, -1 if none was, and
+ * -EBUSY if only part of the range is buffered. */
+static int ramdisk_read(struct ramdisk* ramdisk, uint64_t sector,
+			int nb_sectors, char* buf)
+{
+	struct ramdisk_extent *e, *n;
+	size_t ss = ramdisk->sector_size;
+	uint64_t cur, end, stop;
+	int found = 0, missing = 0;
+
+	cur = sector;
+	end = sector + nb_sectors;
+
+	while (cur < end) {
+		/* check whether it is queued in a previous flush request,
+		 * then whether it is an ongoing flush */
+		if (!(e = rd_covering(&ramdisk->prev, cur)))
+			e = rd_covering(&ramdisk->inprogress, cur);
+
+		stop = e ? rd_end(e) : end;
+		n = rd_ceil(&ramdisk->prev, cur + 1);
+		if (n && n->sector < stop)
+			stop = n->sector;
+		if (!e) {
+			n = rd_ceil(&ramdisk->inprogress, cur + 1);
+			if (n && n->sector < stop)
+				stop = n->sector;
 		}
-		memcpy(buf + i * ramdisk->sector_size, sector, ramdisk->sector_size);
-		start++;
+		stop = MIN(stop, end);
+
+		if (e) {
+			memcpy(buf + (cur - sector) * ss,
+			       e->buf + (cur - e->sector) * ss,
+			       (stop - cur) * ss);
+			found = 1;
+		} else
+			missing = 1;
+
+		cur = stop;
 	}
 
-	*mergedbuf = buf;
+	if (!missing)
+		return 0;
+
+	return found ? -EBUSY : -1;
+}
+
+static inline int ramdisk_write(struct ramdisk* ramdisk, uint64_t sector,
+				int nb_sectors, char* buf)
+{
+	int rc;
+
+	rc = ramdisk_map_write(&ramdisk->h, sector, nb_sectors, buf,
+			       ramdisk->sector_size);
+	if (rc < 0)
+		return rc;
+
+	ramdisk->writes++;
+	ramdisk->merged += rc;
+
 	return 0;
-fail:
-	for (start--; i >0; i--, start--)
-		hashtable_remove(ramdisk->inprogress, &start);
-	return rc;
 }
 
 /* The underlying driver may not handle having the whole ramdisk queued at
@@ -504,112 +751,94 @@ fail:
  * the underlying driver */
 static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s)
 {
-	uint64_t* sectors;
-	char* buf = NULL;
-	uint64_t base, batchlen;
-	int i, j, count = 0;
-
-	// RPRINTF("ramdisk flush\n");
+	struct ramdisk* ramdisk = &s->ramdisk;
+	struct ramdisk_extent* e;
+	uint64_t next = 0;
+	int rc = 0;
 
-	if ((count = ramdisk_get_sectors(s->ramdisk.prev, &sectors)) <= 0)
-		return count;
+	ramdisk->flushing = 1;
 
-	/* Create the inprogress table if empty */
-	if (!s->ramdisk.inprogress)
-		s->ramdisk.inprogress = create_hashtable(RAMDISK_HASHSIZE,
-							uint64_hash,
-							rd_hash_equal);
-	
-	/*
-	  RPRINTF("ramdisk: flushing %d sectors\n", count);
-	*/
+	/* prev is ordered and merged: issue it in disk order */
+	while (ramdisk->inflight < RAMDISK_INFLIGHT_MAX &&
+	       (e = rd_ceil(&ramdisk->prev, next))) {
+		next = rd_end(e);
 
-	/* sort and merge sectors to improve disk performance */
-	qsort(sectors, count, sizeof(*sectors), uint64_compare);
-
-	for (i = 0; i < count;) {
-		base = sectors[i++];
-		while (i < count && sectors[i] == sectors[i-1] + 1)
-			i++;
-		batchlen = sectors[i-1] - base + 1;
-
-		j = merge_requests(&s->ramdisk, base, batchlen, &buf);
-			
-		if (j) {
-			RPRINTF("ramdisk_flush: merge_requests failed:%s\n",
-				j == -1? "OOM": (j==-2? "missing sector" : "WAW race"));
-			if (j == -3) continue;
-			free(sectors);
-			return -1;
+		/* Check inprogress requests to avoid waw non-determinism */
+		if (rd_overlaps(&ramdisk->inprogress, e->sector, e->secs)) {
+			ramdisk->waw_deferred++;
+			continue;
 		}
 
+		ramdisk_map_take(&ramdisk->prev, e->sector);
+		ramdisk_map_add(&ramdisk->inprogress, e);
+		ramdisk->inflight++;
+
 		/* NOTE: create_write_request() creates a treq AND forwards it down
-		 * the driver chain */
-		// RPRINTF("forwarding write request at %" PRIu64 ", length: %" PRIu64 "\n", base, batchlen);
-		create_write_request(s, base, batchlen, buf);
-		//RPRINTF("write request at %" PRIu64 ", length: %" PRIu64 " forwarded\n", base, batchlen);
-
-		s->ramdisk.inflight++;
-
-		for (j = 0; j < batchlen; j++) {
-			buf = hashtable_search(s->ramdisk.prev, &base);
-			free(buf);
-			hashtable_remove(s->ramdisk.prev, &base);
-			base++;
+		 * the driver chain. It may complete before returning. */
+		if (create_write_request(s, e->sector, e->secs, e->buf)) {
+			RPRINTF("ramdisk_flush: error allocating write request\n");
+			ramdisk_map_take(&ramdisk->inprogress, e->sector);
+			ramdisk_map_add(&ramdisk->prev, e);
+			ramdisk->inflight--;
+			rc = -1;
+			break;
 		}
 	}
 
-	if (!hashtable_count(s->ramdisk.prev)) {
-		/* everything is in flight */
-		hashtable_destroy(s->ramdisk.prev, 0);
-		s->ramdisk.prev = NULL;
-	}
-
-	free(sectors);
+	ramdisk->flushing = 0;
 
-	// RPRINTF("ramdisk flush done\n");
-	return 0;
+	return rc;
 }
 
 /* flush ramdisk contents to disk */
 static int ramdisk_start_flush(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
-	uint64_t* key;
-	char* buf;
-	int rc = 0;
-	int i, j, count, batchlen;
-	uint64_t* sectors;
+	struct ramdisk* ramdisk = &s->ramdisk;
+	struct ramdisk_extent* e;
+	uint64_t sector;
 
-	if (!hashtable_count(s->ramdisk.h)) {
+	if (!ramdisk->h.root) {
 		/*
 		  RPRINTF("Nothing to flush\n");
 		*/
 		return 0;
 	}
 
-	if (s->ramdisk.prev) {
+	ramdisk->checkpoints++;
+
+	if (ramdisk->prev.root) {
 		/* a flush request issued while a previous flush is still in progress
 		 * will merge with the previous request. If you want the previous
 		 * request to be consistent, wait for it to complete. */
-		if ((count = ramdisk_get_sectors(s->ramdisk.h, &sectors)) < 0)
-			return count;
+		while (ramdisk->h.root) {
+			ramdisk->h.root = rd_remove_min(ramdisk->h.root, &e);
+			ramdisk->h.extents--;
+			ramdisk->h.secs -= e->secs;
+
+			/* extents clear of prev are moved over as they are */
+			sector = e->sector ? e->sector - 1 : 0;
+			if (!rd_overlaps(&ramdisk->prev, sector,
+					 rd_end(e) + 1 - sector)) {
+				ramdisk_map_add(&ramdisk->prev, e);
+				continue;
+			}
 
-		for (i = 0; i < count; i++) {
-			buf = hashtable_search(s->ramdisk.h, sectors + i);
-			ramdisk_write_hash(s->ramdisk.prev, sectors[i], buf,
-					   s->ramdisk.sector_size);
+			if (ramdisk_map_write(&ramdisk->prev, e->sector,
+					      e->secs, e->buf,
+					      ramdisk->sector_size) < 0) {
+				rd_extent_free(e);
+				return -1;
+			}
+			rd_extent_free(e);
 		}
-		free(sectors);
-
-		hashtable_destroy (s->ramdisk.h, 0);
-	} else
-		s->ramdisk.prev = s->ramdisk.h;
-
-	/* We create a new hashtable so that new writes can be performed before
-	 * the old hashtable is completely drained. */
-	s->ramdisk.h = create_hashtable(RAMDISK_HASHSIZE, uint64_hash,
-					rd_hash_equal);
+	} else {
+		/* Writes of the next checkpoint go to a new, empty map so
+		 * that they can be buffered before prev is completely
+		 * drained. */
+		ramdisk->prev = ramdisk->h;
+		memset(&ramdisk->h, 0, sizeof(ramdisk->h));
+	}
 
 	return ramdisk_flush(driver, s);
 }
@@ -619,20 +848,25 @@ static int ramdisk_start(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
 
-	if (s->ramdisk.h) {
+	if (s->ramdisk.sector_size) {
 		RPRINTF("ramdisk already allocated\n");
 		return 0;
 	}
 
 	s->ramdisk.sector_size = driver->info.sector_size;
-	s->ramdisk.h = create_hashtable(RAMDISK_HASHSIZE, uint64_hash,
-					rd_hash_equal);
 
 	DPRINTF("Ramdisk started, %zu bytes/sector\n", s->ramdisk.sector_size);
 
 	return 0;
 }
 
+static void ramdisk_free(struct ramdisk* ramdisk)
+{
+	ramdisk_map_clear(&ramdisk->h);
+	ramdisk_map_clear(&ramdisk->prev);
+	ramdisk_map_clear(&ramdisk->inprogress);
+}
+
 /* common client/server functions */
 /* mayberead: Time out after a certain interval. */
 static int mread(int fd, void* buf, size_t len)
@@ -906,7 +1140,7 @@ static int server_flush(td_driver_t *driver)
 	/* 
 	 * Nothing to flush in beginning.
 	 */
-	if (!s->ramdisk.prev)
+	if (!s->ramdisk.prev.root)
 		return 0;
 	/* Try to flush any remaining requests */
 	return ramdisk_flush(driver, s);	
@@ -1138,7 +1372,7 @@ static inline int server_writes_inflight(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
 
-	if (!s->ramdisk.inflight && !s->ramdisk.prev)
+	if (!s->ramdisk.inflight && !s->ramdisk.prev.root)
 		return 0;
 
 	return 1;
@@ -1151,17 +1385,19 @@ static inline int server_writes_inflight(td_driver_t *driver)
 void backup_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
-	int i;
+	int rc;
 	if(!remus_image)
 		remus_image = treq.image;
 	
 	/* check if this read is queued in any currently ongoing flush */
-	if (ramdisk_read(&s->ramdisk, treq.sec, treq.secs, treq.buf)) {
+	rc = ramdisk_read(&s->ramdisk, treq.sec, treq.secs, treq.buf);
+	if (rc == -1) {
 		/* TODO: Add to pending read hash */
 		td_forward_request(treq);
 	} else {
-		/* complete the request */
-		td_complete_request(treq, 0);
+		/* complete the request, or have it retried once the
+		 * partially buffered range has reached the disk */
+		td_complete_request(treq, rc);
 	}
 }
 
@@ -1689,9 +1925,8 @@ static int tdremus_close(td_driver_t *driver)
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
 
 	RPRINTF("closing\n");
-	if (s->ramdisk.inprogress)
-		hashtable_destroy(s->ramdisk.inprogress, 0);
-	
+	ramdisk_free(&s->ramdisk);
+
 	if (s->driver_data) {
 		free(s->driver_data);
 		s->driver_data = NULL;
@@ -1708,6 +1943,28 @@ static int tdremus_close(td_driver_t *driver)
 	return 0;
 }
 
+static void tdremus_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct tdremus_state *s = (struct tdremus_state *)driver->data;
+	struct ramdisk *ramdisk = &s->ramdisk;
+
+	if (s->mode != mode_backup && s->mode != mode_unprotected)
+		return;
+
+	tapdisk_stats_field(st, "ramdisk", "{");
+	tapdisk_stats_field(st, "buffered_extents", "u", ramdisk->h.extents);
+	tapdisk_stats_field(st, "buffered_sectors", PRIu64, ramdisk->h.secs);
+	tapdisk_stats_field(st, "pending_extents", "u", ramdisk->prev.extents);
+	tapdisk_stats_field(st, "pending_sectors", PRIu64, ramdisk->prev.secs);
+	tapdisk_stats_field(st, "inflight", "zu", ramdisk->inflight);
+	tapdisk_stats_field(st, "checkpoints", PRIu64, ramdisk->checkpoints);
+	tapdisk_stats_field(st, "writes", PRIu64, ramdisk->writes);
+	tapdisk_stats_field(st, "merged", PRIu64, ramdisk->merged);
+	tapdisk_stats_field(st, "flushed_sectors", PRIu64, ramdisk->flushed);
+	tapdisk_stats_field(st, "waw_deferred", PRIu64, ramdisk->waw_deferred);
+	tapdisk_stats_leave(st, '}');
+}
+
 static int tdremus_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
 {
 	/* we shouldn't have a parent... for now */
@@ -1730,4 +1987,5 @@ struct tap_disk tapdisk_remus = {
 	.td_get_parent_id   = tdremus_get_parent_id,
 	.td_validate_parent = tdremus_validate_parent,
 	.td_debug           = NULL,
+	.td_stats           = tdremus_stats,
 };
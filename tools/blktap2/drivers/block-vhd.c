@@ -52,6 +52,7 @@
 #include <sys/ioctl.h>
 #include <string.h>    /* for memset.                                 */
 #include <libaio.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
 #include "libvhd.h"
@@ -110,6 +111,8 @@ unsigned int SPB;
 
 /******VHD DEFINES******/
 #define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE_MAX           (1 << 16)
+#define VHD_BM_READAHEAD             4
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
@@ -143,6 +146,7 @@ unsigned int SPB;
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_READAHEAD        16
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
@@ -195,8 +199,9 @@ struct vhd_bat_state {
 
 struct vhd_bitmap {
 	u32                       blk;
-	u64                       seqno;       /* lru sequence number */
 	vhd_flag_t                status;
+	struct vhd_bitmap        *hash_next;   /* bitmap hash chain */
+	struct list_head          lru;         /* position in bm_lru */
 
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
@@ -227,13 +232,21 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	int                       bm_cache_size;
+	u32                       bm_hash_mask;
+	struct vhd_bitmap       **bm_hash;     /* cached bitmaps, by blk */
+	struct list_head          bm_lru;      /* cached bitmaps, lru first */
+	char                     *bm_maps;     /* map and shadow buffers */
 
 	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bitmap       **bitmap_free;
+	struct vhd_bitmap        *bitmap_list;
+
+	char                     *fullmap;     /* one bit per block: set once
+						* the block is known to be
+						* fully allocated */
+	u32                       full_blocks;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -248,6 +261,17 @@ struct vhd_state {
 	uint64_t                  read_size;
 	uint64_t                  writes;
 	uint64_t                  write_size;
+
+	struct {
+		uint64_t          unallocated; /* bat entry clear */
+		uint64_t          full;        /* served by fullmap */
+		uint64_t          hits;
+		uint64_t          pending;     /* bitmap read in flight */
+		uint64_t          misses;
+		uint64_t          readahead;
+		uint64_t          readahead_hits;
+		uint64_t          evictions;
+	} bm_stats;
 };
 
 #define test_vhd_flag(word, flag)  ((word) & (flag))
@@ -262,12 +286,28 @@ static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
 static struct vhd_state  *_vhd_master;
 static unsigned long      _vhd_zsize;
 static char              *_vhd_zeros;
+static pthread_mutex_t    _vhd_zlock = PTHREAD_MUTEX_INITIALIZER;
+static int                _vhd_cache_size = VHD_CACHE_SIZE;
+
+int
+vhd_set_bitmap_cache_size(int size)
+{
+	if (size < 1 || size > VHD_CACHE_SIZE_MAX)
+		return -EINVAL;
+
+	_vhd_cache_size = size;
+	return 0;
+}
 
 static int
 vhd_initialize(struct vhd_state *s)
 {
+	int err = 0;
+
+	pthread_mutex_lock(&_vhd_zlock);
+
 	if (_vhd_zeros)
-		return 0;
+		goto out;
 
 	_vhd_zsize = 2 * getpagesize();
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
@@ -276,26 +316,32 @@ vhd_initialize(struct vhd_state *s)
 	_vhd_zeros = mmap(0, _vhd_zsize, PROT_READ,
 			  MAP_SHARED | MAP_ANON, -1, 0);
 	if (_vhd_zeros == MAP_FAILED) {
-		EPRINTF("vhd_initialize failed: %d\n", -errno);
+		err = -errno;
+		EPRINTF("vhd_initialize failed: %d\n", err);
 		_vhd_zeros = NULL;
 		_vhd_zsize = 0;
-		return -errno;
+		goto out;
 	}
 
 	_vhd_master = s;
-	return 0;
+out:
+	pthread_mutex_unlock(&_vhd_zlock);
+	return err;
 }
 
 static void
 vhd_free(struct vhd_state *s)
 {
-	if (_vhd_master != s || !_vhd_zeros)
-		return;
+	pthread_mutex_lock(&_vhd_zlock);
 
-	munmap(_vhd_zeros, _vhd_zsize);
-	_vhd_zsize  = 0;
-	_vhd_zeros  = NULL;
-	_vhd_master = NULL;
+	if (_vhd_master == s && _vhd_zeros) {
+		munmap(_vhd_zeros, _vhd_zsize);
+		_vhd_zsize  = 0;
+		_vhd_zeros  = NULL;
+		_vhd_master = NULL;
+	}
+
+	pthread_mutex_unlock(&_vhd_zlock);
 }
 
 static char *
@@ -312,9 +358,22 @@ _get_vhd_zeros(const char *func, unsigned long size)
 
 #define vhd_zeros(size)	_get_vhd_zeros(__func__, size)
 
+/*
+ * The fullmap mirrors the on-disk batmap, but exists whether or not
+ * the image has one and also learns about full blocks from bitmaps
+ * read at runtime, so I/O to them never needs a bitmap.
+ */
+#define fullmap_test(s, blk) ((s)->fullmap[(blk) >> 3] & (1 << ((blk) & 7)))
+#define fullmap_set(s, blk)  ((s)->fullmap[(blk) >> 3] |= (1 << ((blk) & 7)))
+
 static inline void
 set_batmap(struct vhd_state *s, uint32_t blk)
 {
+	if (s->fullmap && !fullmap_test(s, blk)) {
+		fullmap_set(s, blk);
+		s->full_blocks++;
+	}
+
 	if (s->bat.batmap.map) {
 		vhd_batmap_set(&s->vhd, &s->bat.batmap, blk);
 		DBG(TLOG_DBG, "block 0x%x completely full\n", blk);
@@ -324,9 +383,9 @@ set_batmap(struct vhd_state *s, uint32_t blk)
 static inline int
 test_batmap(struct vhd_state *s, uint32_t blk)
 {
-	if (!s->bat.batmap.map)
+	if (!s->fullmap)
 		return 0;
-	return vhd_batmap_test(&s->vhd, &s->bat.batmap, blk);
+	return fullmap_test(s, blk);
 }
 
 static int
@@ -389,6 +448,10 @@ find_next_free_block(struct vhd_state *s)
 static void
 vhd_free_bat(struct vhd_state *s)
 {
+	free(s->fullmap);
+	s->fullmap     = NULL;
+	s->full_blocks = 0;
+
 	free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
 	free(s->bat.bat_buf);
@@ -436,6 +499,18 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
+	s->fullmap = calloc((s->bat.bat.entries + 7) >> 3, 1);
+	if (!s->fullmap) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	if (s->bat.batmap.map)
+		for (i = 0; i < s->bat.bat.entries; i++)
+			if (bat_entry(s, i) != DD_BLK_UNUSED &&
+			    vhd_batmap_test(&s->vhd, &s->bat.batmap, i))
+				set_batmap(s, i);
+
 	err = posix_memalign((void **)&s->bat.bat_buf,
 			     VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
 	if (err) {
@@ -453,51 +528,65 @@ fail:
 static void
 vhd_free_bitmap_cache(struct vhd_state *s)
 {
-	int i;
-	struct vhd_bitmap *bm;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
-	}
+	free(s->bm_maps);
+	free(s->bm_hash);
+	free(s->bitmap_free);
+	free(s->bitmap_list);
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	s->bm_maps       = NULL;
+	s->bm_hash       = NULL;
+	s->bitmap_free   = NULL;
+	s->bitmap_list   = NULL;
+	s->bm_cache_size = 0;
+	s->bm_free_count = 0;
 }
 
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
-	int i, err, map_size;
+	int i, n, err, map_size;
 	struct vhd_bitmap *bm;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	/* no point caching more bitmaps than there are blocks */
+	n = _vhd_cache_size;
+	if (n > s->bat.bat.entries)
+		n = (s->bat.bat.entries ? : 1);
 
-	s->bm_lru        = 0;
 	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	s->bm_cache_size = n;
+	s->bm_free_count = n;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
+	for (s->bm_hash_mask = 1; s->bm_hash_mask < n; s->bm_hash_mask <<= 1)
+		;
+	s->bm_hash_mask--;
 
-		err = posix_memalign((void **)&bm->map, 512, map_size);
-		if (err) {
-			bm->map = NULL;
-			goto fail;
-		}
+	err = -ENOMEM;
 
-		err = posix_memalign((void **)&bm->shadow, 512, map_size);
-		if (err) {
-			bm->shadow = NULL;
-			goto fail;
-		}
+	s->bitmap_list = calloc(n, sizeof(struct vhd_bitmap));
+	s->bitmap_free = calloc(n, sizeof(struct vhd_bitmap *));
+	s->bm_hash     = calloc(s->bm_hash_mask + 1,
+				sizeof(struct vhd_bitmap *));
+	if (!s->bitmap_list || !s->bitmap_free || !s->bm_hash)
+		goto fail;
 
-		memset(bm->map, 0, map_size);
-		memset(bm->shadow, 0, map_size);
+	err = posix_memalign((void **)&s->bm_maps, 512, 2 * n * map_size);
+	if (err) {
+		s->bm_maps = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	memset(s->bm_maps, 0, 2 * n * map_size);
+
+	for (i = 0; i < n; i++) {
+		bm         = s->bitmap_list + i;
+		bm->map    = s->bm_maps + (2 * i) * map_size;
+		bm->shadow = s->bm_maps + (2 * i + 1) * map_size;
+		INIT_LIST_HEAD(&bm->lru);
 		s->bitmap_free[i] = bm;
 	}
 
+	DBG(TLOG_INFO, "%s: caching %d bitmaps\n", s->vhd.file, n);
 	return 0;
 
 fail:
@@ -605,6 +694,7 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 
 	s = (struct vhd_state *)driver->data;
 	memset(s, 0, sizeof(struct vhd_state));
+	INIT_LIST_HEAD(&s->bm_lru);
 
 	s->flags  = flags;
 	s->driver = driver;
@@ -958,7 +1048,6 @@ static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
@@ -968,17 +1057,23 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline struct vhd_bitmap **
+bitmap_hash(struct vhd_state *s, uint32_t block)
+{
+	return &s->bm_hash[block & s->bm_hash_mask];
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	if (!s->bm_hash)
+		return NULL;
+
+	for (bm = *bitmap_hash(s, block); bm; bm = bm->hash_next)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
@@ -1030,28 +1125,38 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 	return 1;
 }
 
+static void
+uninstall_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pprev;
+
+	pprev = bitmap_hash(s, bm->blk);
+	while (*pprev && *pprev != bm)
+		pprev = &(*pprev)->hash_next;
+
+	if (*pprev)
+		*pprev = bm->hash_next;
+
+	bm->hash_next = NULL;
+	list_del_init(&bm->lru);
+}
+
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	u64 seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (bitmap_locked(bm))
+			continue;
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
+		ASSERT(!bitmap_in_use(bm));
+		uninstall_bitmap(s, bm);
+		s->bm_stats.evictions++;
+		return bm;
 	}
 
-	return  lru;
+	return NULL;
 }
 
 static int
@@ -1076,67 +1181,38 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_del(&bm->lru);
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **head = bitmap_hash(s, bm->blk);
+
+	ASSERT(!get_bitmap(s, bm->blk));
 
-	ASSERT(0);
+	bm->hash_next = *head;
+	*head         = bm;
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(get_bitmap(s, bm->blk) == bm);
 
-	s->bitmap[i] = NULL;
+	uninstall_bitmap(s, bm);
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
 static int
-read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
+__read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 {
 	u32 blk, sec;
 	struct vhd_bitmap *bm;
@@ -1174,6 +1250,11 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	/* bump lru count */
 	touch_bitmap(s, bm);
 
+	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READAHEAD)) {
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_READAHEAD);
+		s->bm_stats.readahead_hits++;
+	}
+
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
 		return VHD_BM_READ_PENDING;
 
@@ -1181,6 +1262,42 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 		VHD_BM_BIT_SET : VHD_BM_BIT_CLEAR);
 }
 
+/*
+ * requests requeued after a bitmap read were already
+ * accounted for when they first missed.
+ */
+static int
+read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op,
+		  int requeue)
+{
+	int ret;
+
+	ret = __read_bitmap_cache(s, sector, op);
+	if (requeue || s->vhd.footer.type == HD_TYPE_FIXED)
+		return ret;
+
+	switch (ret) {
+	case VHD_BM_BAT_CLEAR:
+		s->bm_stats.unallocated++;
+		break;
+	case VHD_BM_BIT_SET:
+	case VHD_BM_BIT_CLEAR:
+		if (test_batmap(s, sector / s->spb))
+			s->bm_stats.full++;
+		else
+			s->bm_stats.hits++;
+		break;
+	case VHD_BM_READ_PENDING:
+		s->bm_stats.pending++;
+		break;
+	case VHD_BM_NOT_CACHED:
+		s->bm_stats.misses++;
+		break;
+	}
+
+	return ret;
+}
+
 static int
 read_bitmap_cache_span(struct vhd_state *s, 
 		       uint64_t sector, int nr_secs, int value)
@@ -1593,6 +1710,36 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 	return 0;
 }
 
+/*
+ * a miss right behind a block we already know about looks like a
+ * sequential stream: fetch the next few bitmaps along with this one,
+ * rather than stalling the stream on a bitmap read per block.
+ */
+static void
+schedule_bitmap_readahead(struct vhd_state *s, uint32_t blk)
+{
+	u32 i, end;
+	struct vhd_bitmap *bm;
+
+	if (!blk || (!test_batmap(s, blk - 1) && !get_bitmap(s, blk - 1)))
+		return;
+
+	end = MIN(blk + 1 + VHD_BM_READAHEAD, s->bat.bat.entries);
+
+	for (i = blk + 1; i < end; i++) {
+		if (bat_entry(s, i) == DD_BLK_UNUSED ||
+		    test_batmap(s, i) || get_bitmap(s, i))
+			continue;
+
+		if (schedule_bitmap_read(s, i))
+			break;
+
+		bm = get_bitmap(s, i);
+		set_vhd_flag(bm->status, VHD_FLAG_BM_READAHEAD);
+		s->bm_stats.readahead++;
+	}
+}
+
 static void
 schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 {
@@ -1671,9 +1818,8 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 }
 
 static void
-vhd_queue_read(td_driver_t *driver, td_request_t treq)
+__vhd_queue_read(struct vhd_state *s, td_request_t treq, int requeue)
 {
-	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
@@ -1685,7 +1831,8 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 		err   = 0;
 		clone = treq;
 
-		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_READ)) {
+		switch (read_bitmap_cache(s, clone.sec,
+					  VHD_OP_DATA_READ, requeue)) {
 		case -EINVAL:
 			err = -EINVAL;
 			goto fail;
@@ -1716,6 +1863,8 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 			err = __vhd_queue_request(s, VHD_OP_DATA_READ, clone);
 			if (err)
 				goto fail;
+
+			schedule_bitmap_readahead(s, clone.sec / s->spb);
 			break;
 
 		case VHD_BM_READ_PENDING:
@@ -1744,9 +1893,8 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 }
 
 static void
-vhd_queue_write(td_driver_t *driver, td_request_t treq)
+__vhd_queue_write(struct vhd_state *s, td_request_t treq, int requeue)
 {
-	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x, (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
@@ -1760,7 +1908,8 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 		flags = 0;
 		clone = treq;
 
-		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_WRITE)) {
+		switch (read_bitmap_cache(s, clone.sec,
+					  VHD_OP_DATA_WRITE, requeue)) {
 		case -EINVAL:
 			err = -EINVAL;
 			goto fail;
@@ -1803,6 +1952,8 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE, clone);
 			if (err)
 				goto fail;
+
+			schedule_bitmap_readahead(s, clone.sec / s->spb);
 			break;
 
 		case VHD_BM_READ_PENDING:
@@ -1829,6 +1980,22 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static void
+vhd_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	__vhd_queue_read(s, treq, 0);
+}
+
+static void
+vhd_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	__vhd_queue_write(s, treq, 0);
+}
+
 static inline void
 signal_completion(struct vhd_request *list, int error)
 {
@@ -2081,6 +2248,8 @@ finish_bitmap_read(struct vhd_request *req)
 
 	if (!req->error) {
 		memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
+		if (!test_batmap(s, blk) && bitmap_full(s, bm))
+			set_batmap(s, blk);
 
 		while (r) {
 			struct vhd_request tmp;
@@ -2093,9 +2262,9 @@ finish_bitmap_read(struct vhd_request *req)
 			       tmp.op == VHD_OP_DATA_WRITE);
 
 			if (tmp.op == VHD_OP_DATA_READ)
-				vhd_queue_read(s->driver, tmp.treq);
+				__vhd_queue_read(s, tmp.treq, 1);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
-				vhd_queue_write(s->driver, tmp.treq);
+				__vhd_queue_write(s, tmp.treq, 1);
 
 			r = next;
 		}
@@ -2106,8 +2275,13 @@ finish_bitmap_read(struct vhd_request *req)
 		return signal_completion(r, err);
 	}
 
-	if (!bitmap_in_use(bm))
+	if (!bitmap_in_use(bm)) {
 		unlock_bitmap(bm);
+
+		/* full blocks are served from the fullmap */
+		if (test_batmap(s, blk))
+			free_vhd_bitmap(s, bm);
+	}
 }
 
 static void
@@ -2240,6 +2414,7 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2261,16 +2436,21 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: size: %d, free: %d, full blocks: %u, "
+	    "unallocated: %"PRIu64", full: %"PRIu64", hits: %"PRIu64", "
+	    "pending: %"PRIu64", misses: %"PRIu64", readahead: %"PRIu64", "
+	    "readahead hits: %"PRIu64", evictions: %"PRIu64"\n",
+	    s->bm_cache_size, s->bm_free_count, s->full_blocks,
+	    s->bm_stats.unallocated, s->bm_stats.full, s->bm_stats.hits,
+	    s->bm_stats.pending, s->bm_stats.misses, s->bm_stats.readahead,
+	    s->bm_stats.readahead_hits, s->bm_stats.evictions);
+
+	i = 0;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -2296,6 +2476,7 @@ vhd_debug(td_driver_t *driver)
 		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
 		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
+		i++;
 	}
 
 	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
@@ -2308,6 +2489,69 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static void
+vhd_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	tapdisk_stats_field(st, "queued", PRIu64, s->queued);
+	tapdisk_stats_field(st, "completed", PRIu64, s->completed);
+	tapdisk_stats_field(st, "returned", PRIu64, s->returned);
+	tapdisk_stats_field(st, "reads", PRIu64, s->reads);
+	tapdisk_stats_field(st, "read_sectors", PRIu64, s->read_size);
+	tapdisk_stats_field(st, "writes", PRIu64, s->writes);
+	tapdisk_stats_field(st, "write_sectors", PRIu64, s->write_size);
+
+	if (!vhd_type_dynamic(&s->vhd))
+		return;
+
+	tapdisk_stats_field(st, "blocks", "u", s->bat.bat.entries);
+	tapdisk_stats_field(st, "full_blocks", "u", s->full_blocks);
+
+	tapdisk_stats_field(st, "bitmap_cache", "{");
+	tapdisk_stats_field(st, "size", "d", s->bm_cache_size);
+	tapdisk_stats_field(st, "used", "d",
+			    s->bm_cache_size - s->bm_free_count);
+	tapdisk_stats_field(st, "unallocated", PRIu64, s->bm_stats.unallocated);
+	tapdisk_stats_field(st, "full", PRIu64, s->bm_stats.full);
+	tapdisk_stats_field(st, "hits", PRIu64, s->bm_stats.hits);
+	tapdisk_stats_field(st, "pending", PRIu64, s->bm_stats.pending);
+	tapdisk_stats_field(st, "misses", PRIu64, s->bm_stats.misses);
+	tapdisk_stats_field(st, "readahead", PRIu64, s->bm_stats.readahead);
+	tapdisk_stats_field(st, "readahead_hits", PRIu64,
+			    s->bm_stats.readahead_hits);
+	tapdisk_stats_field(st, "evictions", PRIu64, s->bm_stats.evictions);
+	tapdisk_stats_leave(st, '}');
+}
+
+/*
+ * a range is absent only if none of its blocks are allocated, nor
+ * about to be: reads of such a range are forwarded to the parent whole.
+ */
+static int
+vhd_range_present(td_driver_t *driver, td_sector_t sec, int secs)
+{
+	uint32_t blk, end;
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	if (!vhd_type_dynamic(&s->vhd) || !s->bat.bat.bat || secs <= 0)
+		return 1;
+
+	blk = sec / s->spb;
+	end = (sec + secs - 1) / s->spb;
+
+	for (; blk <= end; blk++) {
+		if (blk >= s->bat.bat.entries)
+			return 1;
+		if (bat_entry(s, blk) != DD_BLK_UNUSED)
+			return 1;
+		if (bat_locked(s) && s->bat.pbw_blk == blk)
+			return 1;
+	}
+
+	return 0;
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2319,4 +2563,6 @@ struct tap_disk tapdisk_vhd = {
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
+	.td_range_present   = vhd_range_present,
 };
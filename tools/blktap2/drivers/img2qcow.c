@@ -273,6 +273,7 @@ int main(int argc, const char *argv[])
 			treq.cb_data = buf;
 			treq.id = 0;
 			treq.sidx = 0;
+			treq.ts = 0;
                         vreq = calloc(1, sizeof(td_vbd_request_t));
 			treq.private = vreq; 
                         
@@ -291,16 +292,18 @@ int main(int argc, const char *argv[])
 			if (i == info.size) 
 			  complete = 1;
 
-                        tapdisk_submit_all_tiocbs(&server.aio_queue);
+                        tapdisk_submit_all_tiocbs(&server.loop.aio_queue);
 			debug_output(i,info.size);
                 }
 		
 		while(returned_events != submit_events) {
-		    ret = scheduler_wait_for_events(&server.scheduler);
+		    ret = scheduler_wait_for_events(&server.loop.scheduler);
 		    if (ret < 0) {
 		      DFPRINTF("server wait returned %d\n", ret);
 		      sleep(2);
 		    }
+		    /* requests may be requeued from completions */
+		    tapdisk_submit_all_tiocbs(&server.loop.aio_queue);
 		}
 
 		if (complete && (returned_events == submit_events)) 
@@ -238,7 +238,13 @@ io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 	print_merged_iocbs(ctx, queue, on_queue + 1);
 #endif
 
-	return ++on_queue;
+	++on_queue;
+
+	ctx->merge_batches++;
+	ctx->merge_iocbs  += num;
+	ctx->merge_merged += num - on_queue;
+
+	return on_queue;
 }
 
 static int
@@ -57,6 +57,11 @@ struct opioctx {
 	struct opio       **free_opios;
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
+
+	/* io_merge() statistics */
+	unsigned long long  merge_batches;
+	unsigned long long  merge_iocbs;	/* iocbs passed in */
+	unsigned long long  merge_merged;	/* iocbs folded into others */
 };
 
 int opio_init(struct opioctx *ctx, int num_iocbs);
@@ -79,7 +79,20 @@ uint32_t gen_cksum(char *ptr, int len);
 int get_filesize(char *filename, uint64_t *size, struct stat *st);
 int qtruncate(int fd, off_t length, int sparse);
 
-#define L2_CACHE_SIZE 16  /*Fixed allocation in Qemu*/
+#define L2_CACHE_SIZE 16  /*Default, as in Qemu*/
+#define L2_CACHE_SIZE_MAX (1 << 16)
+
+struct qcow_l2_table;
+struct qcow_md_write;
+
+struct qcow_l2_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t waits;
+	uint64_t evictions;
+	uint64_t md_writes;
+	uint64_t md_merged;
+};
 
 struct tdqcow_state {
         int fd;                        /*Main Qcow file descriptor */
@@ -104,10 +117,15 @@ struct tdqcow_state {
 	uint64_t l1_table_offset;      /*L1 table offset from beginning of 
 					*file*/
 	uint64_t *l1_table;            /*L1 table entries*/
-	uint64_t *l2_cache;            /*We maintain a cache of size 
-					*L2_CACHE_SIZE of most read entries*/
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];     /*L2 cache entries*/
-	uint32_t l2_cache_counts[L2_CACHE_SIZE];      /*Cache access record*/
+	uint64_t *l2_cache;            /*Memory for l2_cache_size tables*/
+	int l2_cache_size;             /*Number of cached L2 tables*/
+	struct qcow_l2_table *l2_tables;  /*L2 cache entries*/
+	struct qcow_l2_table **l2_hash;   /*L2 cache index, by table offset*/
+	uint32_t l2_hash_mask;
+	struct list_head l2_lru;       /*Cache entries, least recent first*/
+	struct qcow_l2_stats l2_stats;
+	struct list_head md_queue;     /*Pending L1/L2 writes, in order*/
+	int md_busy;                   /*Head of md_queue is in flight*/
 	uint8_t *cluster_cache;          
 	uint8_t *cluster_data;
 	uint64_t cluster_cache_offset; /**/
@@ -117,6 +135,8 @@ struct tdqcow_state {
 	AES_KEY aes_encrypt_key;       /*AES key*/
 	AES_KEY aes_decrypt_key;       /*AES key*/
 
+	td_driver_t *driver;
+
         /* libaio state */
 	int                  aio_free_count;	
 	int                  max_aio_reqs;
@@ -174,6 +174,7 @@ static void send_read_responses(td_request_t treq, int err)
         treq.cb      = send_write_responses;
         treq.id      = 0;
         treq.sidx    = 0;
+        treq.ts      = 0;
 
         req->pending = BLOCK_PROCESSSZ>>9;
         treq.cb_data = req;
@@ -191,7 +192,7 @@ static void send_read_responses(td_request_t treq, int err)
         ddaio->ops->td_queue_write(ddaio,treq);
         --vreq->submitting;
 
-        tapdisk_submit_all_tiocbs(&server.aio_queue);
+        tapdisk_submit_all_tiocbs(&server.loop.aio_queue);
 
 	return;
 }
@@ -391,6 +392,7 @@ int main(int argc, const char *argv[])
 			treq.cb      = send_read_responses;
 			treq.id      = 0;
 			treq.sidx    = 0;
+			treq.ts      = 0;
 
                         req = calloc(1, sizeof(struct request_info));
                         req->buf = buf;
@@ -417,16 +419,18 @@ int main(int argc, const char *argv[])
 			  complete = 1;
 
 			
-			tapdisk_submit_all_tiocbs(&server.aio_queue);
+			tapdisk_submit_all_tiocbs(&server.loop.aio_queue);
 		}
 		
 
 		while(returned_write_events != submit_events) {
-		  ret = scheduler_wait_for_events(&server.scheduler);
+		  ret = scheduler_wait_for_events(&server.loop.scheduler);
 		  if (ret < 0) {
 		    DFPRINTF("server wait returned %d\n", ret);
 		    sleep(2);
 		  }
+		  /* requests may be requeued from completions */
+		  tapdisk_submit_all_tiocbs(&server.loop.aio_queue);
 		}
 		if (complete && (returned_write_events == submit_events)) 
 			running = 0;
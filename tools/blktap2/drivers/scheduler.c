@@ -26,6 +26,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -34,9 +35,14 @@
 #include "scheduler.h"
 #include "tapdisk-log.h"
 
+#ifdef SCHEDULER_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #define DBG(_f, _a...)               tlog_write(TLOG_DBG, _f, ##_a)
 
 #define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_MAX_EVENTS         64
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
@@ -47,125 +53,515 @@
 #define scheduler_for_each_event(s, event, tmp)	\
 	list_for_each_entry_safe(event, tmp, &(s)->events, next)
 
+#define scheduler_timer_slot(s, t)		\
+	(&(s)->timers[(t) & (SCHEDULER_TIMER_SLOTS - 1)])
+
 typedef struct event {
 	char                         mode;
+	char                         dead;
 	event_id_t                   id;
 
 	int                          fd;
 	int                          timeout;
-	int                          deadline;
+	time_t                       deadline;
+	int                          pass;
 
 	event_cb_t                   cb;
 	void                        *private;
 
 	struct list_head             next;
+	struct list_head             fd_next;
+	struct list_head             timer;
 } event_t;
 
-static void
-scheduler_prepare_events(scheduler_t *s)
+/*
+ * Per-fd state: the events waiting on an fd, and the union of their
+ * modes as currently registered with the backend.
+ */
+struct scheduler_fd {
+	int                          fd;
+	char                         mode;
+	struct list_head             events;
+#ifdef SCHEDULER_EPOLL
+	int                          forced;
+	struct list_head             next;
+#endif
+};
+
+static time_t
+scheduler_now(void)
 {
-	int diff;
 	struct timeval now;
-	event_t *event, *tmp;
 
+	gettimeofday(&now, NULL);
+	return now.tv_sec;
+}
+
+#ifdef SCHEDULER_EPOLL
+
+static int
+scheduler_backend_init(scheduler_t *s)
+{
+	INIT_LIST_HEAD(&s->forced);
+
+	s->epoll_fd = epoll_create(SCHEDULER_MAX_EVENTS);
+	if (s->epoll_fd == -1)
+		return -errno;
+
+	fcntl(s->epoll_fd, F_SETFD, FD_CLOEXEC);
+
+	return 0;
+}
+
+static void
+scheduler_backend_put_fd(scheduler_t *s, struct scheduler_fd *sfd)
+{
+	if (sfd->forced)
+		list_del_init(&sfd->next);
+}
+
+static int
+scheduler_backend_update(scheduler_t *s, struct scheduler_fd *sfd, char old)
+{
+	struct epoll_event ev;
+	int op, err;
+
+	if (sfd->forced)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = sfd->fd;
+
+	if (sfd->mode & SCHEDULER_POLL_READ_FD)
+		ev.events |= EPOLLIN;
+	if (sfd->mode & SCHEDULER_POLL_WRITE_FD)
+		ev.events |= EPOLLOUT;
+	if (sfd->mode & SCHEDULER_POLL_EXCEPT_FD)
+		ev.events |= EPOLLPRI;
+
+	if (!old)
+		op = EPOLL_CTL_ADD;
+	else if (sfd->mode)
+		op = EPOLL_CTL_MOD;
+	else
+		op = EPOLL_CTL_DEL;
+
+	err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+	if (!err)
+		return 0;
+
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		if (errno == EEXIST)
+			goto mod;
+		if (errno == EPERM) {
+			/*
+			 * regular files can't be polled; select()
+			 * reported them as always ready, so do we.
+			 */
+			sfd->forced = 1;
+			list_add_tail(&sfd->next, &s->forced);
+			return 0;
+		}
+		break;
+
+	case EPOLL_CTL_MOD:
+		/* the fd was closed and reopened under us */
+		if (errno == ENOENT) {
+			err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD,
+					sfd->fd, &ev);
+			if (!err)
+				return 0;
+		}
+		break;
+
+	case EPOLL_CTL_DEL:
+		if (errno == ENOENT || errno == EBADF)
+			return 0;
+		break;
+	}
+
+	return -errno;
+
+mod:
+	err = epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, sfd->fd, &ev);
+	return err ? -errno : 0;
+}
+
+static int
+scheduler_run_fd(scheduler_t *, struct scheduler_fd *, char);
+
+static char
+scheduler_epoll_mode(uint32_t events)
+{
+	char mode = 0;
+
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		mode |= SCHEDULER_POLL_READ_FD;
+	if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+		mode |= SCHEDULER_POLL_WRITE_FD;
+	if (events & EPOLLPRI)
+		mode |= SCHEDULER_POLL_EXCEPT_FD;
+
+	return mode;
+}
+
+static int
+scheduler_backend_wait(scheduler_t *s, int timeout)
+{
+	struct epoll_event events[SCHEDULER_MAX_EVENTS];
+	struct scheduler_fd *sfd;
+	char mode;
+	int i, n, fd;
+
+	if (!list_empty(&s->forced))
+		timeout = 0;
+
+	n = epoll_wait(s->epoll_fd, events, SCHEDULER_MAX_EVENTS,
+		       timeout * 1000);
+	if (n < 0)
+		return -errno;
+
+	for (i = 0; i < n; i++) {
+		fd = events[i].data.fd;
+		if (fd >= s->nr_fds || !s->fds[fd])
+			continue;
+
+		mode = scheduler_epoll_mode(events[i].events);
+		scheduler_run_fd(s, s->fds[fd], mode);
+	}
+
+	list_for_each_entry(sfd, &s->forced, next)
+		n += scheduler_run_fd(s, sfd, sfd->mode);
+
+	return n;
+}
+
+#else /* !SCHEDULER_EPOLL */
+
+static int
+scheduler_backend_init(scheduler_t *s)
+{
 	FD_ZERO(&s->read_fds);
 	FD_ZERO(&s->write_fds);
 	FD_ZERO(&s->except_fds);
 
-	s->max_fd  = 0;
-	s->timeout = SCHEDULER_MAX_TIMEOUT;
+	s->max_fd = -1;
 
-	gettimeofday(&now, NULL);
+	return 0;
+}
 
-	scheduler_for_each_event(s, event, tmp) {
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+static void
+scheduler_backend_put_fd(scheduler_t *s, struct scheduler_fd *sfd)
+{
+}
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+static int
+scheduler_backend_update(scheduler_t *s, struct scheduler_fd *sfd, char old)
+{
+	int fd = sfd->fd;
+
+	if (sfd->mode & SCHEDULER_POLL_READ_FD)
+		FD_SET(fd, &s->read_fds);
+	else
+		FD_CLR(fd, &s->read_fds);
+
+	if (sfd->mode & SCHEDULER_POLL_WRITE_FD)
+		FD_SET(fd, &s->write_fds);
+	else
+		FD_CLR(fd, &s->write_fds);
+
+	if (sfd->mode & SCHEDULER_POLL_EXCEPT_FD)
+		FD_SET(fd, &s->except_fds);
+	else
+		FD_CLR(fd, &s->except_fds);
+
+	if (sfd->mode)
+		s->max_fd = MAX(s->max_fd, fd);
+	else
+		while (s->max_fd >= 0 &&
+		       (!s->fds[s->max_fd] || !s->fds[s->max_fd]->mode))
+			s->max_fd--;
+
+	return 0;
+}
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+static int
+scheduler_run_fd(scheduler_t *, struct scheduler_fd *, char);
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
-		}
+static int
+scheduler_backend_wait(scheduler_t *s, int timeout)
+{
+	fd_set read_fds, write_fds, except_fds;
+	struct timeval tv;
+	char mode;
+	int fd, n;
+
+	read_fds   = s->read_fds;
+	write_fds  = s->write_fds;
+	except_fds = s->except_fds;
+
+	tv.tv_sec  = timeout;
+	tv.tv_usec = 0;
+
+	n = select(s->max_fd + 1, &read_fds, &write_fds, &except_fds, &tv);
+	if (n <= 0)
+		return n < 0 ? -errno : 0;
+
+	for (fd = 0; fd <= s->max_fd; fd++) {
+		mode = 0;
+		if (FD_ISSET(fd, &read_fds))
+			mode |= SCHEDULER_POLL_READ_FD;
+		if (FD_ISSET(fd, &write_fds))
+			mode |= SCHEDULER_POLL_WRITE_FD;
+		if (FD_ISSET(fd, &except_fds))
+			mode |= SCHEDULER_POLL_EXCEPT_FD;
+
+		if (mode && s->fds[fd])
+			scheduler_run_fd(s, s->fds[fd], mode);
+	}
+
+	return n;
+}
+
+#endif /* SCHEDULER_EPOLL */
+
+static struct scheduler_fd *
+scheduler_get_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd **fds, *sfd;
+	int nr;
+
+	if (fd < s->nr_fds && s->fds[fd])
+		return s->fds[fd];
+
+	if (fd >= s->nr_fds) {
+		nr = MAX(fd + 1, MAX(2 * s->nr_fds, SCHEDULER_MAX_EVENTS));
+
+		fds = realloc(s->fds, nr * sizeof(*fds));
+		if (!fds)
+			return NULL;
+
+		memset(fds + s->nr_fds, 0, (nr - s->nr_fds) * sizeof(*fds));
+		s->fds    = fds;
+		s->nr_fds = nr;
+	}
+
+	sfd = calloc(1, sizeof(*sfd));
+	if (!sfd)
+		return NULL;
+
+	sfd->fd = fd;
+	INIT_LIST_HEAD(&sfd->events);
+#ifdef SCHEDULER_EPOLL
+	INIT_LIST_HEAD(&sfd->next);
+#endif
+
+	s->fds[fd] = sfd;
+
+	return sfd;
+}
+
+static void
+scheduler_put_fd(scheduler_t *s, struct scheduler_fd *sfd)
+{
+	scheduler_backend_put_fd(s, sfd);
+	s->fds[sfd->fd] = NULL;
+	free(sfd);
+}
+
+static int
+scheduler_update_fd(scheduler_t *s, struct scheduler_fd *sfd)
+{
+	event_t *event;
+	char mode, old;
+	int err;
+
+	mode = 0;
+	list_for_each_entry(event, &sfd->events, fd_next)
+		if (!event->dead)
+			mode |= event->mode & SCHEDULER_POLL_FD;
+
+	if (mode == sfd->mode)
+		return 0;
+
+	old       = sfd->mode;
+	sfd->mode = mode;
+
+	err = scheduler_backend_update(s, sfd, old);
+	if (err) {
+		DBG("fd %d: mode 0x%x -> 0x%x failed: %d\n",
+		    sfd->fd, old, mode, err);
+		sfd->mode = old;
 	}
 
-	s->timeout = MIN(s->timeout, s->max_timeout);
+	return err;
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_add_timer(scheduler_t *s, event_t *event)
+{
+	time_t t = MAX(event->deadline, s->timer_last);
+
+	list_add_tail(&event->timer, scheduler_timer_slot(s, t));
+}
+
+static void
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
 {
 	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		event->deadline = now.tv_sec + event->timeout;
+		event->deadline = scheduler_now() + event->timeout;
+		list_del_init(&event->timer);
+		scheduler_add_timer(s, event);
 	}
 
+	event->pass = s->pass;
 	event->cb(event->id, mode, event->private);
 }
 
+/*
+ * Each event gets at most one callback per pass, and each ready
+ * condition on an fd is handed to the first event waiting for it.
+ */
+static int
+scheduler_run_fd(scheduler_t *s, struct scheduler_fd *sfd, char ready)
+{
+	event_t *event;
+	char mode;
+	int n = 0;
+
+	ready &= sfd->mode;
+
+	list_for_each_entry(event, &sfd->events, fd_next) {
+		if (!ready)
+			break;
+
+		if (event->dead || event->pass == s->pass)
+			continue;
+
+		mode = event->mode & ready;
+		if (mode & SCHEDULER_POLL_READ_FD)
+			mode = SCHEDULER_POLL_READ_FD;
+		else if (mode & SCHEDULER_POLL_WRITE_FD)
+			mode = SCHEDULER_POLL_WRITE_FD;
+		else if (mode & SCHEDULER_POLL_EXCEPT_FD)
+			mode = SCHEDULER_POLL_EXCEPT_FD;
+		else
+			continue;
+
+		ready &= ~mode;
+		scheduler_event_callback(s, event, mode);
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Timers hash into one-second slots by deadline. Every pass sweeps
+ * the slots from the last pass up to and including the current
+ * second, so zero timeouts fire once per pass as they always have.
+ */
 static void
-scheduler_run_events(scheduler_t *s)
+scheduler_run_timers(scheduler_t *s)
 {
-	struct timeval now;
+	struct list_head expired, *slot;
 	event_t *event, *tmp;
+	time_t now, t;
+	int n;
+
+	now = scheduler_now();
+	INIT_LIST_HEAD(&expired);
+
+	for (t = s->timer_last, n = 0;
+	     t <= now && n < SCHEDULER_TIMER_SLOTS; t++, n++) {
+		slot = scheduler_timer_slot(s, t);
+		list_for_each_entry_safe(event, tmp, slot, timer)
+			if (!event->dead && event->deadline <= now) {
+				list_del(&event->timer);
+				list_add_tail(&event->timer, &expired);
+			}
+	}
 
-	gettimeofday(&now, NULL);
+	s->timer_last = now;
 
- again:
-	s->restart = 0;
+	while (!list_empty(&expired)) {
+		event = list_entry(expired.next, event_t, timer);
+		list_del_init(&event->timer);
 
-	scheduler_for_each_event(s, event, tmp) {
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_READ_FD);
-			goto next;
-		}
+		if (event->dead)
+			continue;
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_WRITE_FD);
-			goto next;
+		if (event->pass == s->pass) {
+			scheduler_add_timer(s, event);
+			continue;
 		}
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_EXCEPT_FD);
-			goto next;
-		}
+		scheduler_event_callback(s, event, SCHEDULER_POLL_TIMEOUT);
+	}
+}
+
+static int
+scheduler_next_timeout(scheduler_t *s)
+{
+	event_t *event;
+	time_t now, t;
+	int n;
+
+	if (!s->nr_timers)
+		return SCHEDULER_MAX_TIMEOUT;
+
+	now = scheduler_now();
 
-		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
-		    (event->deadline <= now.tv_sec))
-		    scheduler_event_callback(event, SCHEDULER_POLL_TIMEOUT);
+	for (t = MIN(s->timer_last, now), n = 0;
+	     n < SCHEDULER_TIMER_SLOTS; t++, n++)
+		list_for_each_entry(event, scheduler_timer_slot(s, t), timer)
+			if (!event->dead && event->deadline <= t)
+				return MAX(t - now, 0);
 
-	next:
-		if (s->restart)
-			goto again;
+	return SCHEDULER_TIMER_SLOTS;
+}
+
+static void
+scheduler_free_event(scheduler_t *s, event_t *event)
+{
+	struct scheduler_fd *sfd;
+
+	list_del(&event->next);
+	list_del(&event->timer);
+
+	if (event->mode & SCHEDULER_POLL_FD) {
+		sfd = s->fds[event->fd];
+		list_del(&event->fd_next);
+		if (list_empty(&sfd->events))
+			scheduler_put_fd(s, sfd);
 	}
+
+	free(event);
+}
+
+static void
+scheduler_gc_events(scheduler_t *s)
+{
+	event_t *event, *tmp;
+
+	if (!s->nr_dead)
+		return;
+
+	scheduler_for_each_event(s, event, tmp)
+		if (event->dead)
+			scheduler_free_event(s, event);
+
+	s->nr_dead = 0;
 }
 
 int
 scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 int timeout, event_cb_t cb, void *private)
 {
+	struct scheduler_fd *sfd;
 	event_t *event;
-	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -173,21 +569,55 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
 		return -EINVAL;
 
+	if (mode & SCHEDULER_POLL_FD) {
+		if (fd < 0)
+			return -EINVAL;
+#ifndef SCHEDULER_EPOLL
+		if (fd >= FD_SETSIZE)
+			return -EINVAL;
+#endif
+	}
+
 	event = calloc(1, sizeof(event_t));
 	if (!event)
 		return -ENOMEM;
 
-	gettimeofday(&now, NULL);
-
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->fd_next);
+	INIT_LIST_HEAD(&event->timer);
 
 	event->mode     = mode;
 	event->fd       = fd;
 	event->timeout  = timeout;
-	event->deadline = now.tv_sec + timeout;
+	event->deadline = scheduler_now() + timeout;
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = s->uuid++;
+
+	if (mode & SCHEDULER_POLL_FD) {
+		sfd = scheduler_get_fd(s, fd);
+		if (!sfd) {
+			free(event);
+			return -ENOMEM;
+		}
+
+		list_add_tail(&event->fd_next, &sfd->events);
+
+		err = scheduler_update_fd(s, sfd);
+		if (err) {
+			list_del(&event->fd_next);
+			if (list_empty(&sfd->events))
+				scheduler_put_fd(s, sfd);
+			free(event);
+			return err;
+		}
+	}
+
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		scheduler_add_timer(s, event);
+		s->nr_timers++;
+	}
+
+	event->id = s->uuid++;
 
 	if (!s->uuid)
 		s->uuid++;
@@ -197,6 +627,11 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	return event->id;
 }
 
+/*
+ * Callbacks may unregister any event, including ones the current pass
+ * has yet to visit, so while dispatching events are only marked dead
+ * and freed once the pass completes.
+ */
 void
 scheduler_unregister_event(scheduler_t *s, event_id_t id)
 {
@@ -206,10 +641,19 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 		return;
 
 	scheduler_for_each_event(s, event, tmp)
-		if (event->id == id) {
-			list_del(&event->next);
-			free(event);
-			s->restart = 1;
+		if (event->id == id && !event->dead) {
+			event->dead = 1;
+
+			if (event->mode & SCHEDULER_POLL_TIMEOUT)
+				s->nr_timers--;
+
+			if (event->mode & SCHEDULER_POLL_FD)
+				scheduler_update_fd(s, s->fds[event->fd]);
+
+			if (s->running)
+				s->nr_dead++;
+			else
+				scheduler_free_event(s, event);
 			break;
 		}
 }
@@ -225,41 +669,45 @@ int
 scheduler_wait_for_events(scheduler_t *s)
 {
 	int ret;
-	struct timeval tv;
-
-	scheduler_prepare_events(s);
 
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
+	s->timeout = MIN(scheduler_next_timeout(s), s->max_timeout);
 
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	/* callbacks may iterate the scheduler again, e.g. to drain a vbd */
+	s->running++;
+	s->pass++;
 
-	s->restart     = 0;
+	ret = scheduler_backend_wait(s, s->timeout);
+	if (ret >= 0)
+		scheduler_run_timers(s);
+
+	s->running--;
 	s->timeout     = SCHEDULER_MAX_TIMEOUT;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
-	if (ret < 0)
-		return ret;
-
-	scheduler_run_events(s);
+	if (!s->running)
+		scheduler_gc_events(s);
 
 	return ret;
 }
 
-void
+int
 scheduler_initialize(scheduler_t *s)
 {
+	int i;
+
 	memset(s, 0, sizeof(scheduler_t));
 
 	s->uuid = 1;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
-
 	INIT_LIST_HEAD(&s->events);
+
+	for (i = 0; i < SCHEDULER_TIMER_SLOTS; i++)
+		INIT_LIST_HEAD(&s->timers[i]);
+
+	s->timer_last = scheduler_now();
+
+	return scheduler_backend_init(s);
 }
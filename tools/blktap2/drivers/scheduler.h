@@ -37,24 +37,51 @@
 #define SCHEDULER_POLL_EXCEPT_FD     0x4
 #define SCHEDULER_POLL_TIMEOUT       0x8
 
+/*
+ * Linux gets an epoll backend; other hosts fall back to select(), with
+ * the fd_sets maintained incrementally rather than rebuilt every pass.
+ */
+#ifdef __linux__
+#define SCHEDULER_EPOLL
+#endif
+
+/* one-second slots; must be a power of two */
+#define SCHEDULER_TIMER_SLOTS        64
+
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct scheduler_fd;
+
 typedef struct scheduler {
+#ifdef SCHEDULER_EPOLL
+	int                          epoll_fd;
+	struct list_head             forced;
+#else
 	fd_set                       read_fds;
 	fd_set                       write_fds;
 	fd_set                       except_fds;
+	int                          max_fd;
+#endif
+
+	struct scheduler_fd        **fds;
+	int                          nr_fds;
 
 	struct list_head             events;
 
+	struct list_head             timers[SCHEDULER_TIMER_SLOTS];
+	time_t                       timer_last;
+	int                          nr_timers;
+
 	int                          uuid;
-	int                          max_fd;
+	int                          pass;
+	int                          running;
+	int                          nr_dead;
 	int                          timeout;
-	int                          restart;
 	int                          max_timeout;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
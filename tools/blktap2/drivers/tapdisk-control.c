@@ -48,6 +48,8 @@
 #include "tapdisk-message.h"
 #include "tapdisk-disktype.h"
 
+#define TAPDISK_CONTROL_STATS_SIZE  (64 << 10)
+
 struct tapdisk_control {
 	char              *path;
 	int                socket;
@@ -214,75 +216,133 @@ tapdisk_control_validate_request(tapdisk_message_t *request)
 	return 0;
 }
 
+/*
+ * vbds live on the event loops in tapdisk-server.c. Everything that
+ * touches one runs on its loop through tapdisk_server_call*(), so
+ * the control path itself stays single-threaded.
+ */
+
+static int
+__tapdisk_control_list_minors(void *private)
+{
+	tapdisk_message_t *response = private;
+	td_vbd_t *vbd;
+
+	list_for_each_entry(vbd, tapdisk_server_get_loop_vbds(), loop_next) {
+		if (response->u.minors.count >= TAPDISK_MESSAGE_MAX_MINORS)
+			return -ERANGE;
+
+		response->u.minors.list[response->u.minors.count++] =
+			vbd->minor;
+	}
+
+	return 0;
+}
+
 static void
 tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
 			    tapdisk_message_t *request)
 {
-	int i;
-	td_vbd_t *vbd;
-	struct list_head *head;
 	tapdisk_message_t response;
+	int err;
 
-	i = 0;
 	memset(&response, 0, sizeof(response));
 
 	response.type = TAPDISK_MESSAGE_LIST_MINORS_RSP;
 	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
-
-	list_for_each_entry(vbd, head, next) {
-		response.u.minors.list[i++] = vbd->minor;
-		if (i >= TAPDISK_MESSAGE_MAX_MINORS) {
-			response.type = TAPDISK_MESSAGE_ERROR;
-			response.u.response.error = ERANGE;
-			break;
-		}
+	err = tapdisk_server_call_all(__tapdisk_control_list_minors,
+				      &response);
+	if (err) {
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.u.response.error = -err;
 	}
 
-	response.u.minors.count = i;
 	tapdisk_control_write_message(connection->socket, &response, 2);
 	tapdisk_control_close_connection(connection);
 }
 
-static void
-tapdisk_control_list(struct tapdisk_control_connection *connection,
-		     tapdisk_message_t *request)
+struct tapdisk_control_list {
+	tapdisk_message_t *entries;
+	int                count;
+};
+
+static int
+__tapdisk_control_list(void *private)
 {
+	struct tapdisk_control_list *list = private;
+	tapdisk_message_t *entries, *entry;
 	td_vbd_t *vbd;
-	struct list_head *head;
-	tapdisk_message_t response;
-	int count, i;
-
-	memset(&response, 0, sizeof(response));
-	response.type = TAPDISK_MESSAGE_LIST_RSP;
-	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
+	list_for_each_entry(vbd, tapdisk_server_get_loop_vbds(), loop_next) {
+		entries = realloc(list->entries,
+				  (list->count + 1) * sizeof(*entries));
+		if (!entries)
+			return -ENOMEM;
 
-	count = 0;
-	list_for_each_entry(vbd, head, next)
-		count++;
+		list->entries = entries;
+		entry = &entries[list->count++];
 
-	list_for_each_entry(vbd, head, next) {
-		response.u.list.count   = count--;
-		response.u.list.minor   = vbd->minor;
-		response.u.list.state   = vbd->state;
-		response.u.list.path[0] = 0;
+		memset(entry, 0, sizeof(*entry));
+		entry->u.list.minor = vbd->minor;
+		entry->u.list.state = vbd->state;
 
 		if (!list_empty(&vbd->images)) {
 			td_image_t *image = list_entry(vbd->images.next,
 						       td_image_t, next);
-			snprintf(response.u.list.path,
-				 sizeof(response.u.list.path),
+			snprintf(entry->u.list.path,
+				 sizeof(entry->u.list.path),
 				 "%s:%s",
 				 tapdisk_disk_types[image->type]->name,
 				 image->name);
 		}
+	}
+
+	return 0;
+}
+
+static void
+tapdisk_control_list(struct tapdisk_control_connection *connection,
+		     tapdisk_message_t *request)
+{
+	struct tapdisk_control_list list;
+	tapdisk_message_t response;
+	int count, i, err;
+
+	list.entries = NULL;
+	list.count   = 0;
+
+	err = tapdisk_server_call_all(__tapdisk_control_list, &list);
+	if (err) {
+		free(list.entries);
+
+		memset(&response, 0, sizeof(response));
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.cookie = request->cookie;
+		response.u.response.error = -err;
+
+		tapdisk_control_write_message(connection->socket,
+					      &response, 2);
+		tapdisk_control_close_connection(connection);
+		return;
+	}
+
+	count = list.count;
+
+	for (i = 0; i < list.count; i++) {
+		response = list.entries[i];
+		response.type = TAPDISK_MESSAGE_LIST_RSP;
+		response.cookie = request->cookie;
+		response.u.list.count = count--;
 
 		tapdisk_control_write_message(connection->socket, &response, 2);
 	}
 
+	free(list.entries);
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_LIST_RSP;
+	response.cookie = request->cookie;
 	response.u.list.count   = count;
 	response.u.list.minor   = -1;
 	response.u.list.path[0] = 0;
@@ -306,38 +366,19 @@ tapdisk_control_get_pid(struct tapdisk_control_connection *connection,
 	tapdisk_control_close_connection(connection);
 }
 
-static void
-tapdisk_control_attach_vbd(struct tapdisk_control_connection *connection,
-			   tapdisk_message_t *request)
+static int
+__tapdisk_control_attach_vbd(void *private)
 {
-	tapdisk_message_t response;
+	tapdisk_message_t *request = private;
 	char *devname;
 	td_vbd_t *vbd;
-	struct blktap2_params params;
-	image_t image;
 	int minor, err;
 
-	/*
-	 * TODO: check for max vbds per process
-	 */
-
-	vbd = tapdisk_server_get_vbd(request->cookie);
-	if (vbd) {
-		err = -EEXIST;
-		goto out;
-	}
-
 	minor = request->cookie;
-	if (minor < 0) {
-		err = -EINVAL;
-		goto out;
-	}
 
 	vbd = tapdisk_vbd_create(minor);
-	if (!vbd) {
-		err = -ENOMEM;
-		goto out;
-	}
+	if (!vbd)
+		return -ENOMEM;
 
 	err = asprintf(&devname, BLKTAP2_RING_DEVICE"%d", minor);
 	if (err == -1) {
@@ -352,38 +393,60 @@ tapdisk_control_attach_vbd(struct tapdisk_control_connection *connection,
 
 	tapdisk_server_add_vbd(vbd);
 
-out:
-	memset(&response, 0, sizeof(response));
-	response.type = TAPDISK_MESSAGE_ATTACH_RSP;
-	response.cookie = request->cookie;
-	response.u.response.error = -err;
-
-	tapdisk_control_write_message(connection->socket, &response, 2);
-	tapdisk_control_close_connection(connection);
-
-	return;
+	return 0;
 
 fail_vbd:
 	tapdisk_vbd_detach(vbd);
 	free(vbd);
-	goto out;
+	return err;
 }
 
-
 static void
-tapdisk_control_detach_vbd(struct tapdisk_control_connection *connection,
+tapdisk_control_attach_vbd(struct tapdisk_control_connection *connection,
 			   tapdisk_message_t *request)
 {
 	tapdisk_message_t response;
 	td_vbd_t *vbd;
 	int err;
 
+	/*
+	 * TODO: check for max vbds per process
+	 */
+
 	vbd = tapdisk_server_get_vbd(request->cookie);
-	if (!vbd) {
+	if (vbd) {
+		err = -EEXIST;
+		goto out;
+	}
+
+	if ((int)request->cookie < 0) {
 		err = -EINVAL;
 		goto out;
 	}
 
+	err = tapdisk_server_call(tapdisk_server_pick_loop(),
+				  __tapdisk_control_attach_vbd, request);
+
+out:
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_ATTACH_RSP;
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+static int
+__tapdisk_control_detach_vbd(void *private)
+{
+	tapdisk_message_t *request = private;
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd)
+		return -EINVAL;
+
 	tapdisk_vbd_detach(vbd);
 
 	if (list_empty(&vbd->images)) {
@@ -391,8 +454,19 @@ tapdisk_control_detach_vbd(struct tapdisk_control_connection *connection,
 		free(vbd);
 	}
 
-	err = 0;
-out:
+	return 0;
+}
+
+static void
+tapdisk_control_detach_vbd(struct tapdisk_control_connection *connection,
+			   tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	int err;
+
+	err = tapdisk_server_call_vbd(request->cookie,
+				      __tapdisk_control_detach_vbd, request);
+
 	memset(&response, 0, sizeof(response));
 	response.type = TAPDISK_MESSAGE_DETACH_RSP;
 	response.cookie = request->cookie;
@@ -402,32 +476,31 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
-static void
-tapdisk_control_open_image(struct tapdisk_control_connection *connection,
-			   tapdisk_message_t *request)
+struct tapdisk_control_open {
+	tapdisk_message_t *request;
+	image_t            image;
+};
+
+static int
+__tapdisk_control_open_image(void *private)
 {
-	int err;
-	image_t image;
-	td_vbd_t *vbd;
-	td_flag_t flags;
-	tapdisk_message_t response;
+	struct tapdisk_control_open *open = private;
+	tapdisk_message_t *request = open->request;
+	image_t *image = &open->image;
 	struct blktap2_params params;
+	td_flag_t flags;
+	td_vbd_t *vbd;
+	int err;
 
 	vbd = tapdisk_server_get_vbd(request->cookie);
-	if (!vbd) {
-		err = -EINVAL;
-		goto out;
-	}
+	if (!vbd)
+		return -EINVAL;
 
-	if (vbd->minor == -1) {
-		err = -EINVAL;
-		goto out;
-	}
+	if (vbd->minor == -1)
+		return -EINVAL;
 
-	if (vbd->name) {
-		err = -EALREADY;
-		goto out;
-	}
+	if (vbd->name)
+		return -EALREADY;
 
 	flags = 0;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_RDONLY)
@@ -443,25 +516,23 @@ tapdisk_control_open_image(struct tapdisk_control_connection *connection,
 
 	vbd->name = strndup(request->u.params.path,
 			    sizeof(request->u.params.path));
-	if (!vbd->name) {
-		err = -ENOMEM;
-		goto out;
-	}
+	if (!vbd->name)
+		return -ENOMEM;
 
 	err = tapdisk_vbd_parse_stack(vbd, request->u.params.path);
 	if (err)
-		goto out;
+		return err;
 
 	err = tapdisk_vbd_open_stack(vbd, request->u.params.storage, flags);
 	if (err)
-		goto out;
+		return err;
 
-	err = tapdisk_vbd_get_image_info(vbd, &image);
+	err = tapdisk_vbd_get_image_info(vbd, image);
 	if (err)
 		goto fail_close;
 
-	params.capacity = image.size;
-	params.sector_size = image.secsize;
+	params.capacity = image->size;
+	params.sector_size = image->secsize;
 	strncpy(params.name, vbd->name, BLKTAP2_MAX_MESSAGE_LEN);
 
 	err = ioctl(vbd->ring.fd, BLKTAP2_IOCTL_CREATE_DEVICE, &params);
@@ -471,9 +542,29 @@ tapdisk_control_open_image(struct tapdisk_control_connection *connection,
 		goto fail_close;
 	}
 
-	err = 0;
+	return 0;
+
+fail_close:
+	tapdisk_vbd_close_vdi(vbd);
+	free(vbd->name);
+	vbd->name = NULL;
+	return err;
+}
+
+static void
+tapdisk_control_open_image(struct tapdisk_control_connection *connection,
+			   tapdisk_message_t *request)
+{
+	struct tapdisk_control_open open;
+	tapdisk_message_t response;
+	int err;
+
+	memset(&open, 0, sizeof(open));
+	open.request = request;
+
+	err = tapdisk_server_call_vbd(request->cookie,
+				      __tapdisk_control_open_image, &open);
 
-out:
 	memset(&response, 0, sizeof(response));
 	response.cookie = request->cookie;
 
@@ -481,42 +572,28 @@ out:
 		response.type                = TAPDISK_MESSAGE_ERROR;
 		response.u.response.error    = -err;
 	} else {
-		response.u.image.sectors     = image.size;
-		response.u.image.sector_size = image.secsize;
-		response.u.image.info        = image.info;
+		response.u.image.sectors     = open.image.size;
+		response.u.image.sector_size = open.image.secsize;
+		response.u.image.info        = open.image.info;
 		response.type                = TAPDISK_MESSAGE_OPEN_RSP;
 	}
 
 	tapdisk_control_write_message(connection->socket, &response, 2);
 	tapdisk_control_close_connection(connection);
-
-	return;
-
-fail_close:
-	tapdisk_vbd_close_vdi(vbd);
-	free(vbd->name);
-	vbd->name = NULL;
-	goto out;
 }
 
-static void
-tapdisk_control_close_image(struct tapdisk_control_connection *connection,
-			    tapdisk_message_t *request)
+static int
+__tapdisk_control_close_image(void *private)
 {
-	tapdisk_message_t response;
+	tapdisk_message_t *request = private;
 	td_vbd_t *vbd;
-	int err;
 
 	vbd = tapdisk_server_get_vbd(request->cookie);
-	if (!vbd) {
-		err = -EINVAL;
-		goto out;
-	}
+	if (!vbd)
+		return -EINVAL;
 
-	if (!list_empty(&vbd->pending_requests)) {
-		err = -EAGAIN;
-		goto out;
-	}
+	if (!list_empty(&vbd->pending_requests))
+		return -EAGAIN;
 
 	tapdisk_vbd_close_vdi(vbd);
 
@@ -531,8 +608,19 @@ tapdisk_control_close_image(struct tapdisk_control_connection *connection,
 		tapdisk_vbd_free(vbd);
 	}
 
-	err = 0;
-out:
+	return 0;
+}
+
+static void
+tapdisk_control_close_image(struct tapdisk_control_connection *connection,
+			    tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	int err;
+
+	err = tapdisk_server_call_vbd(request->cookie,
+				      __tapdisk_control_close_image, request);
+
 	memset(&response, 0, sizeof(response));
 	response.type = TAPDISK_MESSAGE_CLOSE_RSP;
 	response.cookie = request->cookie;
@@ -542,23 +630,16 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
-static void
-tapdisk_control_pause_vbd(struct tapdisk_control_connection *connection,
-			  tapdisk_message_t *request)
+static int
+__tapdisk_control_pause_vbd(void *private)
 {
-	int err;
+	tapdisk_message_t *request = private;
 	td_vbd_t *vbd;
-	tapdisk_message_t response;
-
-	memset(&response, 0, sizeof(response));
-
-	response.type = TAPDISK_MESSAGE_PAUSE_RSP;
+	int err;
 
 	vbd = tapdisk_server_get_vbd(request->cookie);
-	if (!vbd) {
-		err = -EINVAL;
-		goto out;
-	}
+	if (!vbd)
+		return -EINVAL;
 
 	do {
 		err = tapdisk_vbd_pause(vbd);
@@ -569,61 +650,157 @@ tapdisk_control_pause_vbd(struct tapdisk_control_connection *connection,
 		tapdisk_server_iterate();
 	} while (1);
 
-out:
+	return err;
+}
+
+static void
+tapdisk_control_pause_vbd(struct tapdisk_control_connection *connection,
+			  tapdisk_message_t *request)
+{
+	int err;
+	tapdisk_message_t response;
+
+	memset(&response, 0, sizeof(response));
+
+	response.type = TAPDISK_MESSAGE_PAUSE_RSP;
+
+	err = tapdisk_server_call_vbd(request->cookie,
+				      __tapdisk_control_pause_vbd, request);
+
 	response.cookie = request->cookie;
 	response.u.response.error = -err;
 	tapdisk_control_write_message(connection->socket, &response, 2);
 	tapdisk_control_close_connection(connection);
 }
 
+static int
+__tapdisk_control_resume_vbd(void *private)
+{
+	tapdisk_message_t *request = private;
+	td_vbd_t *vbd;
+	int err;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd)
+		return -EINVAL;
+
+	if (!td_flag_test(vbd->state, TD_VBD_PAUSED))
+		return -EINVAL;
+
+	if (request->u.params.path[0]) {
+		free(vbd->name);
+		vbd->name = strndup(request->u.params.path,
+				    sizeof(request->u.params.path));
+		if (!vbd->name)
+			return -ENOMEM;
+	} else if (!vbd->name)
+		return -EINVAL;
+
+	err = tapdisk_vbd_parse_stack(vbd, vbd->name);
+	if (err)
+		return err;
+
+	return tapdisk_vbd_resume(vbd, NULL, -1);
+}
+
 static void
 tapdisk_control_resume_vbd(struct tapdisk_control_connection *connection,
 			   tapdisk_message_t *request)
 {
 	int err;
-	td_vbd_t *vbd;
 	tapdisk_message_t response;
 
 	memset(&response, 0, sizeof(response));
 
 	response.type = TAPDISK_MESSAGE_RESUME_RSP;
 
-	vbd = tapdisk_server_get_vbd(request->cookie);
-	if (!vbd) {
-		err = -EINVAL;
-		goto out;
-	}
+	err = tapdisk_server_call_vbd(request->cookie,
+				      __tapdisk_control_resume_vbd, request);
 
-	if (!td_flag_test(vbd->state, TD_VBD_PAUSED)) {
-		err = -EINVAL;
-		goto out;
-	}
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
 
-	if (request->u.params.path[0]) {
-		free(vbd->name);
-		vbd->name = strndup(request->u.params.path,
-				    sizeof(request->u.params.path));
-		if (!vbd->name) {
-			err = -ENOMEM;
-			goto out;
-		}
-	} else if (!vbd->name) {
-		err = -EINVAL;
-		goto out;
+struct tapdisk_control_stats {
+	int                minor;
+	td_stats_t         st;
+};
+
+static int
+__tapdisk_control_stats_vbd(void *private)
+{
+	struct tapdisk_control_stats *stats = private;
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(stats->minor);
+	if (!vbd)
+		return -EINVAL;
+
+	tapdisk_vbd_stats(vbd, &stats->st);
+
+	return 0;
+}
+
+/*
+ * The JSON document is streamed back in string-sized chunks; an
+ * empty chunk terminates it.
+ */
+static void
+tapdisk_control_stats_vbd(struct tapdisk_control_connection *connection,
+			  tapdisk_message_t *request)
+{
+	struct tapdisk_control_stats stats;
+	tapdisk_message_t response;
+	size_t len, off, n;
+	char *buf;
+	int err;
+
+	memset(&response, 0, sizeof(response));
+	response.cookie = request->cookie;
+
+	buf = malloc(TAPDISK_CONTROL_STATS_SIZE);
+	if (!buf) {
+		err = -ENOMEM;
+		goto fail;
 	}
 
-	err = tapdisk_vbd_parse_stack(vbd, vbd->name);
-	if (err)
-		goto out;
+	stats.minor = request->cookie;
+	tapdisk_stats_init(&stats.st, buf, TAPDISK_CONTROL_STATS_SIZE);
 
-	err = tapdisk_vbd_resume(vbd, NULL, -1);
+	err = tapdisk_server_call_vbd(request->cookie,
+				      __tapdisk_control_stats_vbd, &stats);
 	if (err)
-		goto out;
+		goto fail;
 
-out:
-	response.cookie = request->cookie;
+	len = tapdisk_stats_length(&stats.st);
+	response.type = TAPDISK_MESSAGE_STATS_RSP;
+
+	for (off = 0; off < len; off += n) {
+		n = len - off;
+		if (n > sizeof(response.u.string.text) - 1)
+			n = sizeof(response.u.string.text) - 1;
+
+		memcpy(response.u.string.text, buf + off, n);
+		response.u.string.text[n] = 0;
+
+		err = tapdisk_control_write_message(connection->socket,
+						    &response, 2);
+		if (err)
+			goto out;
+	}
+
+	response.u.string.text[0] = 0;
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	goto out;
+
+fail:
+	response.type = TAPDISK_MESSAGE_ERROR;
 	response.u.response.error = -err;
 	tapdisk_control_write_message(connection->socket, &response, 2);
+out:
+	free(buf);
 	tapdisk_control_close_connection(connection);
 }
 
@@ -664,6 +841,8 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 		return tapdisk_control_resume_vbd(connection, &message);
 	case TAPDISK_MESSAGE_CLOSE:
 		return tapdisk_control_close_image(connection, &message);
+	case TAPDISK_MESSAGE_STATS:
+		return tapdisk_control_stats_vbd(connection, &message);
 	default: {
 		tapdisk_message_t response;
 	fail:
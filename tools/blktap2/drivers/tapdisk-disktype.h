@@ -59,4 +59,10 @@ int tapdisk_disktype_find(const char *name);
 int tapdisk_disktype_parse_params(const char *params, const char **_path);
 int tapdisk_parse_disk_type(const char *, const char **, int *);
 
+/* block-vhd.c: number of sector bitmaps cached per vhd image */
+int vhd_set_bitmap_cache_size(int);
+
+/* block-qcow.c: number of L2 tables cached per qcow image */
+int qcow_set_l2_cache_size(int);
+
 #endif
@@ -99,3 +99,10 @@ tapdisk_driver_debug(td_driver_t *driver)
 	if (driver->ops->td_debug)
 		driver->ops->td_debug(driver);
 }
+
+void
+tapdisk_driver_stats(td_driver_t *driver, td_stats_t *st)
+{
+	if (driver->ops->td_stats)
+		driver->ops->td_stats(driver, st);
+}
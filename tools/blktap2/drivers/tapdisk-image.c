@@ -167,3 +167,66 @@ fail:
 	    req->operation, req->sector_number + total);
 	return -EINVAL;
 }
+
+void
+tapdisk_image_stats_queue(td_image_t *image, td_request_t *treq)
+{
+	td_image_stats_t *stats = &image->stats;
+
+	treq->ts = tapdisk_stats_clock();
+
+	tapdisk_histogram_add(&stats->size[treq->op], treq->secs);
+
+	stats->inflight += treq->secs;
+	if (stats->inflight > stats->max_inflight)
+		stats->max_inflight = stats->inflight;
+}
+
+/*
+ * Drivers may split a request and complete the parts separately, so
+ * every part is accounted with its own size and latency.
+ */
+void
+tapdisk_image_stats_leave(td_image_t *image, td_request_t *treq,
+			  int forwarded, int err)
+{
+	td_image_stats_t *stats = &image->stats;
+	uint64_t now;
+
+	now = tapdisk_stats_clock();
+	tapdisk_histogram_add(&stats->latency[treq->op], now - treq->ts);
+
+	if (forwarded)
+		stats->forwarded++;
+	else
+		stats->completed++;
+
+	if (err)
+		stats->errors++;
+
+	if (stats->inflight > treq->secs)
+		stats->inflight -= treq->secs;
+	else
+		stats->inflight = 0;
+}
+
+void
+tapdisk_image_stats(td_image_t *image, td_stats_t *st)
+{
+	td_image_stats_t *stats = &image->stats;
+
+	tapdisk_stats_field(st, "completed", PRIu64, stats->completed);
+	tapdisk_stats_field(st, "forwarded", PRIu64, stats->forwarded);
+	tapdisk_stats_field(st, "errors", PRIu64, stats->errors);
+	tapdisk_stats_field(st, "inflight_sectors", PRIu64, stats->inflight);
+	tapdisk_stats_field(st, "max_inflight_sectors", PRIu64,
+			    stats->max_inflight);
+	tapdisk_stats_histogram(st, "read_latency_us",
+				&stats->latency[TD_OP_READ]);
+	tapdisk_stats_histogram(st, "write_latency_us",
+				&stats->latency[TD_OP_WRITE]);
+	tapdisk_stats_histogram(st, "read_sectors",
+				&stats->size[TD_OP_READ]);
+	tapdisk_stats_histogram(st, "write_sectors",
+				&stats->size[TD_OP_WRITE]);
+}
@@ -31,6 +31,21 @@
 #include "tapdisk.h"
 #include <xen/io/blkif.h>
 
+/*
+ * Requests are accounted to the image they are queued to, from
+ * td_queue_read/write until they are completed or forwarded to the
+ * next image. Arrays are indexed by TD_OP_READ/TD_OP_WRITE.
+ */
+typedef struct td_image_stats {
+	td_histogram_t               latency[2];	/* usecs */
+	td_histogram_t               size[2];		/* sectors */
+	uint64_t                     completed;
+	uint64_t                     forwarded;
+	uint64_t                     errors;
+	uint64_t                     inflight;		/* sectors */
+	uint64_t                     max_inflight;
+} td_image_stats_t;
+
 struct td_image_handle {
 	int                          type;
 	char                        *name;
@@ -44,6 +59,8 @@ struct td_image_handle {
 
 	void                        *private;
 
+	td_image_stats_t             stats;
+
 	struct list_head             next;
 };
 
@@ -53,4 +70,8 @@ void tapdisk_image_free(td_image_t *);
 int tapdisk_image_check_td_request(td_image_t *, td_request_t);
 int tapdisk_image_check_ring_request(td_image_t *, blkif_request_t *);
 
+void tapdisk_image_stats_queue(td_image_t *, td_request_t *);
+void tapdisk_image_stats_leave(td_image_t *, td_request_t *, int, int);
+void tapdisk_image_stats(td_image_t *, td_stats_t *);
+
 #endif
@@ -33,6 +33,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
 
 int
 td_load(td_image_t *image)
@@ -163,6 +164,8 @@ td_queue_write(td_image_t *image, td_request_t treq)
 	int err;
 	td_driver_t *driver;
 
+	tapdisk_image_stats_queue(image, &treq);
+
 	driver = image->driver;
 	if (!driver) {
 		err = -ENODEV;
@@ -191,6 +194,8 @@ td_queue_read(td_image_t *image, td_request_t treq)
 	int err;
 	td_driver_t *driver;
 
+	tapdisk_image_stats_queue(image, &treq);
+
 	driver = image->driver;
 	if (!driver) {
 		err = -ENODEV;
@@ -213,15 +218,27 @@ fail:
 	td_complete_request(treq, err);
 }
 
+/*
+ * Requests created outside td_queue_read/write carry a zero timestamp
+ * and are not accounted to any image.
+ */
 void
 td_forward_request(td_request_t treq)
 {
+	if (treq.ts) {
+		tapdisk_image_stats_leave(treq.image, &treq, 1, 0);
+		treq.ts = 0;
+	}
+
 	tapdisk_vbd_forward_request(treq);
 }
 
 void
 td_complete_request(td_request_t treq, int res)
 {
+	if (treq.ts && treq.image)
+		tapdisk_image_stats_leave(treq.image, &treq, 0, res);
+
 	((td_callback_t)treq.cb)(treq, res);
 }
 
@@ -257,3 +274,42 @@ td_debug(td_image_t *image)
 
 	tapdisk_driver_debug(driver);
 }
+
+void
+td_stats(td_image_t *image, td_stats_t *st)
+{
+	td_driver_t *driver;
+
+	tapdisk_stats_enter(st, '{');
+	tapdisk_stats_field(st, "name", "s", image->name);
+	tapdisk_stats_field(st, "type", "s",
+			    tapdisk_disk_types[image->type]->name);
+
+	driver = image->driver;
+	if (driver && td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		tapdisk_stats_field(st, "driver", "{");
+		tapdisk_driver_stats(driver, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	tapdisk_stats_field(st, "requests", "{");
+	tapdisk_image_stats(image, st);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_leave(st, '}');
+}
+
+int
+td_range_present(td_image_t *image, td_sector_t sec, int secs)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return 1;
+
+	if (!driver->ops->td_range_present)
+		return 1;
+
+	return driver->ops->td_range_present(driver, sec, secs);
+}
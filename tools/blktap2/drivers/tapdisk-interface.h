@@ -44,6 +44,8 @@ void td_forward_request(td_request_t);
 void td_complete_request(td_request_t, int);
 
 void td_debug(td_image_t *);
+void td_stats(td_image_t *, td_stats_t *);
+int td_range_present(td_image_t *, td_sector_t, int);
 
 void td_queue_tiocb(td_driver_t *, struct tiocb *);
 void td_prep_read(struct tiocb *, int, char *, size_t,
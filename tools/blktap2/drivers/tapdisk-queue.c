@@ -28,11 +28,23 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <libaio.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
+#ifdef TAPDISK_URING
+#include <sys/syscall.h>
+#ifndef __NR_io_uring_setup
+#undef TAPDISK_URING
+#endif
+#endif
+#ifdef TAPDISK_URING
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "tapdisk.h"
 #include "tapdisk-log.h"
@@ -262,9 +274,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
 	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = NULL,
-	.tio_destroy = NULL,
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
 	.tio_submit  = tapdisk_rwio_submit
 };
 
@@ -547,6 +559,356 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef TAPDISK_URING
+
+/*
+ * io_uring
+ *
+ * The merged iocb queue goes out in a single io_uring_enter per
+ * submission pass, and completions are reaped straight from the
+ * shared completion ring when the registered eventfd fires.
+ *
+ * Each merged request is a single-segment readv/writev. We insist on
+ * IORING_FEAT_SUBMIT_STABLE so the kernel is done with the iovec (and
+ * the sqe) once io_uring_enter returns, and the iovec can live in the
+ * slot of the sqe that carried it.
+ */
+
+struct uring {
+	int                  ring_fd;
+	int                  event_fd;
+	int                  event_id;
+
+	void                *sq_ring;
+	size_t               sq_ring_size;
+	unsigned            *sq_head;
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_array;
+
+	struct io_uring_sqe *sqes;
+	size_t               sqes_size;
+
+	void                *cq_ring;
+	size_t               cq_ring_size;
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct iovec        *iovs;
+	struct io_event     *aio_events;
+};
+
+#define uring_ptr(_ring, _off) ((void *)((char *)(_ring) + (_off)))
+
+static inline int
+__io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		 unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int
+__io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+
+	if (!ur)
+		return;
+
+	if (ur->event_id >= 0) {
+		tapdisk_server_unregister_event(ur->event_id);
+		ur->event_id = -1;
+	}
+
+	if (ur->event_fd >= 0) {
+		close(ur->event_fd);
+		ur->event_fd = -1;
+	}
+
+	if (ur->sqes) {
+		munmap(ur->sqes, ur->sqes_size);
+		ur->sqes = NULL;
+	}
+
+	if (ur->cq_ring) {
+		munmap(ur->cq_ring, ur->cq_ring_size);
+		ur->cq_ring = NULL;
+	}
+
+	if (ur->sq_ring) {
+		munmap(ur->sq_ring, ur->sq_ring_size);
+		ur->sq_ring = NULL;
+	}
+
+	if (ur->ring_fd >= 0) {
+		close(ur->ring_fd);
+		ur->ring_fd = -1;
+	}
+
+	free(ur->iovs);
+	ur->iovs = NULL;
+
+	free(ur->aio_events);
+	ur->aio_events = NULL;
+}
+
+static void *
+tapdisk_uring_map(struct uring *ur, size_t size, off_t offset)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ur->ring_fd, offset);
+
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static void tapdisk_uring_event(event_id_t, char, void *);
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *ur = queue->tio_data;
+	struct io_uring_params p;
+	int err;
+
+	ur->ring_fd  = -1;
+	ur->event_fd = -1;
+	ur->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+
+	ur->ring_fd = __io_uring_setup(qlen, &p);
+	if (ur->ring_fd < 0) {
+		err = -errno;
+		DPRINTF("io_uring_setup(%d) failed: %d\n", qlen, err);
+		goto fail;
+	}
+
+	if (!(p.features & IORING_FEAT_SUBMIT_STABLE)) {
+		DPRINTF("io_uring lacks stable submission, need linux 5.5\n");
+		err = -ENOSYS;
+		goto fail;
+	}
+
+	ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->sq_ring = tapdisk_uring_map(ur, ur->sq_ring_size,
+					IORING_OFF_SQ_RING);
+	if (!ur->sq_ring) {
+		err = -errno;
+		goto fail;
+	}
+
+	ur->sq_head  = uring_ptr(ur->sq_ring, p.sq_off.head);
+	ur->sq_tail  = uring_ptr(ur->sq_ring, p.sq_off.tail);
+	ur->sq_mask  = uring_ptr(ur->sq_ring, p.sq_off.ring_mask);
+	ur->sq_array = uring_ptr(ur->sq_ring, p.sq_off.array);
+
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = tapdisk_uring_map(ur, ur->sqes_size, IORING_OFF_SQES);
+	if (!ur->sqes) {
+		err = -errno;
+		goto fail;
+	}
+
+	ur->cq_ring_size =
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ur->cq_ring = tapdisk_uring_map(ur, ur->cq_ring_size,
+					IORING_OFF_CQ_RING);
+	if (!ur->cq_ring) {
+		err = -errno;
+		goto fail;
+	}
+
+	ur->cq_head = uring_ptr(ur->cq_ring, p.cq_off.head);
+	ur->cq_tail = uring_ptr(ur->cq_ring, p.cq_off.tail);
+	ur->cq_mask = uring_ptr(ur->cq_ring, p.cq_off.ring_mask);
+	ur->cqes    = uring_ptr(ur->cq_ring, p.cq_off.cqes);
+
+	ur->iovs = calloc(p.sq_entries, sizeof(struct iovec));
+	ur->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!ur->iovs || !ur->aio_events) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	ur->event_fd = tapdisk_sys_eventfd(0);
+	if (ur->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = __io_uring_register(ur->ring_fd, IORING_REGISTER_EVENTFD,
+				  &ur->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	ur->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      ur->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = ur->event_id;
+	if (err < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *ur = queue->tio_data;
+	struct io_uring_cqe *cqe;
+	struct io_event *ep;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	unsigned head, tail;
+	int i, n, split;
+	uint64_t val;
+
+	read_exact(ur->event_fd, &val, sizeof(val));
+
+	/*
+	 * one eventfd count may stand for more completions than fit in
+	 * aio_events: reap in batches until the ring is empty, or the
+	 * rest would wait for a wakeup that need never come.
+	 */
+	for (;;) {
+		head = *ur->cq_head;
+		tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		for (n = 0; head != tail && n < queue->size; head++, n++) {
+			cqe     = &ur->cqes[head & *ur->cq_mask];
+			iocb    = (struct iocb *)(unsigned long)cqe->user_data;
+			ep      = ur->aio_events + n;
+			ep->obj = iocb;
+			ep->res = cqe->res;
+		}
+
+		__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+		split = io_split(&queue->opioctx, ur->aio_events, n);
+		tapdisk_filter_events(queue->filter, ur->aio_events, split);
+
+		DBG("events: %d, tiocbs: %d\n", n, split);
+
+		queue->iocbs_pending  -= n;
+		queue->tiocbs_pending -= split;
+
+		for (i = split, ep = ur->aio_events; i-- > 0; ep++) {
+			iocb  = ep->obj;
+			tiocb = iocb->data;
+			complete_tiocb(queue, tiocb, ep->res);
+		}
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	struct io_uring_sqe *sqe;
+	struct iovec *iov;
+	struct iocb *iocb;
+	unsigned tail, idx;
+	int i, merged, submitted, err = 0;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	tail = *ur->sq_tail;
+
+	for (i = 0; i < merged; i++, tail++) {
+		iocb = queue->iocbs[i];
+		idx  = tail & *ur->sq_mask;
+		sqe  = &ur->sqes[idx];
+		iov  = &ur->iovs[idx];
+
+		iov->iov_base = iocb->u.c.buf;
+		iov->iov_len  = iocb->u.c.nbytes;
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode    = (iocb->aio_lio_opcode == IO_CMD_PWRITE ?
+				  IORING_OP_WRITEV : IORING_OP_READV);
+		sqe->fd        = iocb->aio_fildes;
+		sqe->addr      = (unsigned long)iov;
+		sqe->len       = 1;
+		sqe->off       = iocb->u.c.offset;
+		sqe->user_data = (unsigned long)iocb;
+
+		ur->sq_array[idx] = idx;
+	}
+
+	__atomic_store_n(ur->sq_tail, tail, __ATOMIC_RELEASE);
+
+	submitted = __io_uring_enter(ur->ring_fd, merged, 0, 0);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	/* the kernel consumes in order; retract whatever it didn't take */
+	if (err)
+		__atomic_store_n(ur->sq_tail,
+				 __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static const struct tio td_tio_uring = {
+	.name        = "uring",
+	.data_size   = sizeof(struct uring),
+	.tio_setup   = tapdisk_uring_setup,
+	.tio_destroy = tapdisk_uring_destroy,
+	.tio_submit  = tapdisk_uring_submit,
+};
+
+#endif /* TAPDISK_URING */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +937,11 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef TAPDISK_URING
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -604,6 +971,20 @@ fail:
 	return err;
 }
 
+int
+tapdisk_queue_driver(const char *name)
+{
+	if (!strcmp(name, td_tio_lio.name))
+		return TIO_DRV_LIO;
+	if (!strcmp(name, td_tio_rwio.name))
+		return TIO_DRV_RWIO;
+#ifdef TAPDISK_URING
+	if (!strcmp(name, td_tio_uring.name))
+		return TIO_DRV_URING;
+#endif
+	return -EINVAL;
+}
+
 int
 tapdisk_init_queue(struct tqueue *queue, int size,
 		   int drv, struct tfilter *filter)
@@ -673,6 +1054,28 @@ tapdisk_debug_queue(struct tqueue *queue)
 	}
 }
 
+void
+tapdisk_queue_stats(struct tqueue *queue, td_stats_t *st)
+{
+	struct opioctx *ctx = &queue->opioctx;
+
+	tapdisk_stats_field(st, "tio", "s", queue->tio->name);
+	tapdisk_stats_field(st, "size", "d", queue->size);
+	tapdisk_stats_field(st, "queued", "d", queue->queued);
+	tapdisk_stats_field(st, "iocbs_pending", "d", queue->iocbs_pending);
+	tapdisk_stats_field(st, "tiocbs_pending", "d", queue->tiocbs_pending);
+	tapdisk_stats_field(st, "tiocbs_deferred", "d",
+			    queue->tiocbs_deferred);
+	tapdisk_stats_field(st, "deferrals", PRIu64, queue->deferrals);
+	tapdisk_stats_histogram(st, "depth", &queue->depth);
+
+	tapdisk_stats_field(st, "merge", "{");
+	tapdisk_stats_field(st, "batches", "llu", ctx->merge_batches);
+	tapdisk_stats_field(st, "iocbs", "llu", ctx->merge_iocbs);
+	tapdisk_stats_field(st, "merged", "llu", ctx->merge_merged);
+	tapdisk_stats_leave(st, '}');
+}
+
 void
 tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 		   long long offset, td_queue_callback_t cb, void *arg)
@@ -706,6 +1109,10 @@ tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 int
 tapdisk_submit_tiocbs(struct tqueue *queue)
 {
+	if (queue->queued)
+		tapdisk_histogram_add(&queue->depth,
+				      queue->tiocbs_pending + queue->queued);
+
 	return queue->tio->tio_submit(queue);
 }
 
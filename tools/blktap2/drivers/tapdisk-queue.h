@@ -33,6 +33,7 @@
 
 #include "io-optimize.h"
 #include "scheduler.h"
+#include "tapdisk-stats.h"
 
 struct tiocb;
 struct tfilter;
@@ -82,6 +83,9 @@ struct tqueue {
 	struct tfilter       *filter;
 
 	uint64_t              deferrals;
+
+	/* tiocbs in flight, sampled at each submission */
+	td_histogram_t        depth;
 };
 
 struct tio {
@@ -96,6 +100,7 @@ struct tio {
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
 };
 
 /*
@@ -111,9 +116,11 @@ enum {
 #define tapdisk_queue_empty(q) ((q)->queued == 0)
 #define tapdisk_queue_full(q)  \
 	(((q)->tiocbs_pending + (q)->queued) >= (q)->size)
+int tapdisk_queue_driver(const char *name);
 int tapdisk_init_queue(struct tqueue *, int size, int drv, struct tfilter *);
 void tapdisk_free_queue(struct tqueue *);
 void tapdisk_debug_queue(struct tqueue *);
+void tapdisk_queue_stats(struct tqueue *, td_stats_t *);
 void tapdisk_queue_tiocb(struct tqueue *, struct tiocb *);
 int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
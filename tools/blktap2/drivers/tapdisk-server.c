@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
 
@@ -36,14 +37,44 @@
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
+#include "libaio-compat.h"
 
 #define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
 #define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
 
  tapdisk_server_t server;
 
+/*
+ * Threaded mode: with tapdisk_server_set_threads(n), vbds are spread
+ * over n worker threads, each running its own tapdisk_loop. The
+ * control path stays on the server's loop and reaches a vbd by
+ * running a function on the owning loop with tapdisk_server_call(),
+ * blocking until it returns. Everything a vbd does, including its
+ * drivers' event and tiocb registration, therefore happens on the
+ * loop thread, and only the global vbd list needs a lock.
+ */
+
+struct tapdisk_loop_call {
+	int                        (*fn)(void *);
+	void                        *arg;
+	int                          err;
+	int                          done;
+};
+
+static __thread tapdisk_loop_t *td_loop;
+
+static int tapdisk_server_tio_drv = TIO_DRV_LIO;
+static int tapdisk_server_nr_threads;
+
+static inline tapdisk_loop_t *
+tapdisk_server_loop(void)
+{
+	return td_loop ? : &server.loop;
+}
+
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
+	list_for_each_entry_safe(vbd, tmp,				\
+				 &tapdisk_server_loop()->vbds, loop_next)
 
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
@@ -54,6 +85,7 @@ tapdisk_server_get_shared_image(td_image_t *image)
 	if (!td_flag_test(image->flags, TD_OPEN_SHAREABLE))
 		return NULL;
 
+	/* images are only shared between vbds on the same loop */
 	tapdisk_server_for_each_vbd(vbd, tmpv)
 		tapdisk_vbd_for_each_image(vbd, img, tmpi)
 			if (img->type == image->type &&
@@ -63,42 +95,73 @@ tapdisk_server_get_shared_image(td_image_t *image)
 	return NULL;
 }
 
+static td_vbd_t *
+__tapdisk_server_get_vbd(uint16_t uuid)
+{
+	td_vbd_t *vbd;
+
+	list_for_each_entry(vbd, &server.vbds, next)
+		if (vbd->uuid == uuid)
+			return vbd;
+
+	return NULL;
+}
+
+/*
+ * The vbds served by the calling thread's loop, linked by loop_next.
+ */
 struct list_head *
-tapdisk_server_get_all_vbds(void)
+tapdisk_server_get_loop_vbds(void)
 {
-	return &server.vbds;
+	return &tapdisk_server_loop()->vbds;
 }
 
 td_vbd_t *
 tapdisk_server_get_vbd(uint16_t uuid)
 {
-	td_vbd_t *vbd, *tmp;
+	td_vbd_t *vbd;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
-		if (vbd->uuid == uuid)
-			return vbd;
+	pthread_mutex_lock(&server.vbds_lock);
+	vbd = __tapdisk_server_get_vbd(uuid);
+	pthread_mutex_unlock(&server.vbds_lock);
 
-	return NULL;
+	return vbd;
 }
 
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
+	tapdisk_loop_t *loop = tapdisk_server_loop();
+
+	pthread_mutex_lock(&server.vbds_lock);
 	list_add_tail(&vbd->next, &server.vbds);
+	list_add_tail(&vbd->loop_next, &loop->vbds);
+	vbd->loop = loop;
+	loop->nr_vbds++;
+	pthread_mutex_unlock(&server.vbds_lock);
 }
 
 void
 tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
+	pthread_mutex_lock(&server.vbds_lock);
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	if (vbd->loop) {
+		list_del(&vbd->loop_next);
+		INIT_LIST_HEAD(&vbd->loop_next);
+		vbd->loop->nr_vbds--;
+		vbd->loop = NULL;
+	}
+	pthread_mutex_unlock(&server.vbds_lock);
+
 	tapdisk_server_check_state();
 }
 
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&tapdisk_server_loop()->aio_queue, tiocb);
 }
 
 void
@@ -106,7 +169,7 @@ tapdisk_server_debug(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	tapdisk_debug_queue(&tapdisk_server_loop()->aio_queue);
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
 		tapdisk_vbd_debug(vbd);
@@ -114,31 +177,140 @@ tapdisk_server_debug(void)
 	tlog_flush();
 }
 
+static void
+tapdisk_loop_kick(tapdisk_loop_t *loop)
+{
+	uint64_t val = 1;
+
+	if (write(loop->call_fd, &val, sizeof(val)) != sizeof(val))
+		DBG(TLOG_WARN, "kick failed: %d\n", errno);
+}
+
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
-		server.run = 0;
+	int empty;
+
+	pthread_mutex_lock(&server.vbds_lock);
+	empty = list_empty(&server.vbds);
+	pthread_mutex_unlock(&server.vbds_lock);
+
+	if (!empty)
+		return;
+
+	server.loop.run = 0;
+	if (tapdisk_server_loop() != &server.loop)
+		tapdisk_loop_kick(&server.loop);
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      int timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&tapdisk_server_loop()->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&tapdisk_server_loop()->scheduler,
+					  event);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, seconds);
+	scheduler_set_max_timeout(&tapdisk_server_loop()->scheduler, seconds);
+}
+
+/*
+ * Run fn on the given loop's thread and return its result. Only the
+ * server's loop calls into workers, so one pending call per loop
+ * suffices.
+ */
+int
+tapdisk_server_call(tapdisk_loop_t *loop, int (*fn)(void *), void *arg)
+{
+	struct tapdisk_loop_call call;
+
+	if (loop == tapdisk_server_loop())
+		return fn(arg);
+
+	call.fn   = fn;
+	call.arg  = arg;
+	call.err  = 0;
+	call.done = 0;
+
+	pthread_mutex_lock(&loop->call_lock);
+
+	loop->call = &call;
+	tapdisk_loop_kick(loop);
+
+	while (!call.done)
+		pthread_cond_wait(&loop->call_cond, &loop->call_lock);
+
+	pthread_mutex_unlock(&loop->call_lock);
+
+	return call.err;
+}
+
+/*
+ * The vbd may be gone by the time fn runs, so fn looks it up again
+ * on the loop thread, where it can no longer disappear under it.
+ */
+int
+tapdisk_server_call_vbd(td_uuid_t uuid, int (*fn)(void *), void *arg)
+{
+	tapdisk_loop_t *loop;
+	td_vbd_t *vbd;
+
+	pthread_mutex_lock(&server.vbds_lock);
+	vbd  = __tapdisk_server_get_vbd(uuid);
+	loop = vbd ? vbd->loop : NULL;
+	pthread_mutex_unlock(&server.vbds_lock);
+
+	if (!loop)
+		return -EINVAL;
+
+	return tapdisk_server_call(loop, fn, arg);
+}
+
+int
+tapdisk_server_call_all(int (*fn)(void *), void *arg)
+{
+	int i, err;
+
+	err = tapdisk_server_call(&server.loop, fn, arg);
+
+	for (i = 0; !err && i < server.nr_workers; i++)
+		err = tapdisk_server_call(&server.workers[i], fn, arg);
+
+	return err;
+}
+
+/*
+ * Loop for a new vbd: the least loaded worker, if there are any.
+ */
+tapdisk_loop_t *
+tapdisk_server_pick_loop(void)
+{
+	tapdisk_loop_t *loop;
+	int i;
+
+	if (!server.nr_workers)
+		return &server.loop;
+
+	pthread_mutex_lock(&server.vbds_lock);
+
+	loop = &server.workers[0];
+	for (i = 1; i < server.nr_workers; i++)
+		if (server.workers[i].nr_vbds < loop->nr_vbds)
+			loop = &server.workers[i];
+
+	pthread_mutex_unlock(&server.vbds_lock);
+
+	return loop;
 }
 
 static void
@@ -174,7 +346,7 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	tapdisk_submit_all_tiocbs(&tapdisk_server_loop()->aio_queue);
 }
 
 static void
@@ -205,23 +377,123 @@ tapdisk_server_stop_vbds(void)
 		tapdisk_vbd_kill_queue(vbd);
 }
 
+void
+tapdisk_server_set_queue_driver(int drv)
+{
+	tapdisk_server_tio_drv = drv;
+}
+
+void
+tapdisk_server_set_threads(int threads)
+{
+	tapdisk_server_nr_threads = threads;
+}
+
 static int
-tapdisk_server_init_aio(void)
+tapdisk_loop_init_aio(tapdisk_loop_t *loop)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	int err;
+
+	err = tapdisk_init_queue(&loop->aio_queue, TAPDISK_TIOCBS,
+				 tapdisk_server_tio_drv, NULL);
+	if (err && tapdisk_server_tio_drv != TIO_DRV_LIO) {
+		ERR(err, "I/O queue driver %d unavailable, using lio",
+		    tapdisk_server_tio_drv);
+		err = tapdisk_init_queue(&loop->aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_LIO, NULL);
+	}
+
+	return err;
 }
 
 static void
-tapdisk_server_close_aio(void)
+tapdisk_server_handle_signals(void);
+
+static void
+tapdisk_loop_call_event(event_id_t id, char mode, void *private)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	tapdisk_loop_t *loop = private;
+	struct tapdisk_loop_call *call;
+	uint64_t val;
+
+	read_exact(loop->call_fd, &val, sizeof(val));
+
+	if (loop == &server.loop)
+		tapdisk_server_handle_signals();
+
+	pthread_mutex_lock(&loop->call_lock);
+	call = loop->call;
+	loop->call = NULL;
+	pthread_mutex_unlock(&loop->call_lock);
+
+	if (!call)
+		return;
+
+	call->err = call->fn(call->arg);
+
+	pthread_mutex_lock(&loop->call_lock);
+	call->done = 1;
+	pthread_cond_broadcast(&loop->call_cond);
+	pthread_mutex_unlock(&loop->call_lock);
+}
+
+static int
+tapdisk_loop_init(tapdisk_loop_t *loop)
+{
+	int err;
+
+	INIT_LIST_HEAD(&loop->vbds);
+	pthread_mutex_init(&loop->call_lock, NULL);
+	pthread_cond_init(&loop->call_cond, NULL);
+
+	loop->call_fd    = -1;
+	loop->call_event = -1;
+
+	err = scheduler_initialize(&loop->scheduler);
+	if (err)
+		return err;
+
+	loop->call_fd = tapdisk_sys_eventfd(0);
+	if (loop->call_fd < 0)
+		return -errno;
+
+	err = scheduler_register_event(&loop->scheduler,
+				       SCHEDULER_POLL_READ_FD,
+				       loop->call_fd, 0,
+				       tapdisk_loop_call_event, loop);
+	if (err < 0)
+		return err;
+
+	loop->call_event = err;
+
+	return 0;
 }
 
 static void
-tapdisk_server_close(void)
+tapdisk_loop_close(tapdisk_loop_t *loop)
 {
-	tapdisk_server_close_aio();
+	tapdisk_loop_t *prev = td_loop;
+
+	/* the queue's events belong to the loop's scheduler */
+	td_loop = loop;
+	tapdisk_free_queue(&loop->aio_queue);
+	td_loop = prev;
+
+	if (loop->call_event >= 0) {
+		scheduler_unregister_event(&loop->scheduler, loop->call_event);
+		loop->call_event = -1;
+	}
+
+	if (loop->call_fd >= 0) {
+		close(loop->call_fd);
+		loop->call_fd = -1;
+	}
+}
+
+static void
+tapdisk_server_close_aio(void)
+{
+	tapdisk_free_queue(&server.loop.aio_queue);
 }
 
 void
@@ -233,7 +505,7 @@ tapdisk_server_iterate(void)
 	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
+	ret = scheduler_wait_for_events(&tapdisk_server_loop()->scheduler);
 	if (ret < 0)
 		DBG(TLOG_WARN, "server wait returned %d\n", ret);
 
@@ -242,15 +514,120 @@ tapdisk_server_iterate(void)
 	tapdisk_server_kick_responses();
 }
 
+static void *
+tapdisk_loop_thread(void *private)
+{
+	tapdisk_loop_t *loop = private;
+
+	td_loop = loop;
+
+	while (loop->run)
+		tapdisk_server_iterate();
+
+	return NULL;
+}
+
+static int
+__tapdisk_loop_stop(void *private)
+{
+	tapdisk_server_loop()->run = 0;
+	return 0;
+}
+
+static void
+tapdisk_server_stop_workers(void)
+{
+	tapdisk_loop_t *loop;
+	int i;
+
+	for (i = 0; i < server.nr_workers; i++) {
+		loop = &server.workers[i];
+
+		tapdisk_server_call(loop, __tapdisk_loop_stop, NULL);
+		pthread_join(loop->thread, NULL);
+
+		tapdisk_loop_close(loop);
+	}
+
+	free(server.workers);
+	server.workers    = NULL;
+	server.nr_workers = 0;
+}
+
+static int
+tapdisk_server_start_workers(void)
+{
+	sigset_t mask, omask;
+	tapdisk_loop_t *loop;
+	int i, err;
+
+	if (!tapdisk_server_nr_threads)
+		return 0;
+
+	server.workers = calloc(tapdisk_server_nr_threads,
+				sizeof(tapdisk_loop_t));
+	if (!server.workers)
+		return -ENOMEM;
+
+	/* process-directed signals are for the control thread */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+
+	err = 0;
+
+	for (i = 0; i < tapdisk_server_nr_threads; i++) {
+		loop = &server.workers[i];
+
+		err = tapdisk_loop_init(loop);
+		if (!err) {
+			td_loop = loop;
+			err = tapdisk_loop_init_aio(loop);
+			td_loop = NULL;
+		}
+
+		if (!err) {
+			loop->run = 1;
+			err = -pthread_create(&loop->thread, NULL,
+					      tapdisk_loop_thread, loop);
+		}
+
+		if (err) {
+			ERR(err, "failed to start worker %d", i);
+			tapdisk_loop_close(loop);
+			break;
+		}
+
+		server.nr_workers++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+	if (err)
+		tapdisk_server_stop_workers();
+	else
+		DPRINTF("serving vbds from %d threads\n", server.nr_workers);
+
+	return err;
+}
+
+static void
+tapdisk_server_close(void)
+{
+	tapdisk_server_stop_workers();
+	tapdisk_server_close_aio();
+}
+
 static void
 __tapdisk_server_run(void)
 {
-	while (server.run)
+	while (server.loop.run)
 		tapdisk_server_iterate();
 }
 
 static void
-tapdisk_server_signal_handler(int signal)
+tapdisk_server_handle_signal(int signal)
 {
 	td_vbd_t *vbd, *tmp;
 	static int xfsz_error_sent = 0;
@@ -277,15 +654,54 @@ tapdisk_server_signal_handler(int signal)
 	}
 }
 
+static int
+__tapdisk_server_handle_signal(void *private)
+{
+	tapdisk_server_handle_signal((long)private);
+	return 0;
+}
+
+static void
+tapdisk_server_handle_signals(void)
+{
+	int signal, pending;
+
+	pending = __sync_fetch_and_and(&server.signals, 0);
+
+	for (signal = 1; pending; signal++)
+		if (pending & (1 << signal)) {
+			pending &= ~(1 << signal);
+			tapdisk_server_call_all(__tapdisk_server_handle_signal,
+						(void *)(long)signal);
+		}
+}
+
+/*
+ * Faults (SIGBUS, SIGXFSZ) hit the thread that caused them and are
+ * dealt with on its own loop. The rest land on the control thread,
+ * which cannot safely reach into worker loops from signal context
+ * and passes them on to every loop from its event loop instead.
+ */
+static void
+tapdisk_server_signal_handler(int signal)
+{
+	if (!server.nr_workers || tapdisk_server_loop() != &server.loop) {
+		tapdisk_server_handle_signal(signal);
+		return;
+	}
+
+	__sync_fetch_and_or(&server.signals, 1 << signal);
+	tapdisk_loop_kick(&server.loop);
+}
+
 int
 tapdisk_server_init(void)
 {
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
+	pthread_mutex_init(&server.vbds_lock, NULL);
 
-	scheduler_initialize(&server.scheduler);
-
-	return 0;
+	return tapdisk_loop_init(&server.loop);
 }
 
 int
@@ -293,11 +709,15 @@ tapdisk_server_complete(void)
 {
 	int err;
 
-	err = tapdisk_server_init_aio();
+	err = tapdisk_loop_init_aio(&server.loop);
+	if (err)
+		goto fail;
+
+	err = tapdisk_server_start_workers();
 	if (err)
 		goto fail;
 
-	server.run = 1;
+	server.loop.run = 1;
 
 	return 0;
 
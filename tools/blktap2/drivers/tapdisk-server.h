@@ -28,6 +28,8 @@
 #ifndef _TAPDISK_SERVER_H_
 #define _TAPDISK_SERVER_H_
 
+#include <pthread.h>
+
 #include "list.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-queue.h"
@@ -36,7 +38,7 @@ struct tap_disk *tapdisk_server_find_driver_interface(int);
 
 td_image_t *tapdisk_server_get_shared_image(td_image_t *);
 
-struct list_head *tapdisk_server_get_all_vbds(void);
+struct list_head *tapdisk_server_get_loop_vbds(void);
 td_vbd_t *tapdisk_server_get_vbd(td_uuid_t);
 void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
@@ -49,6 +51,13 @@ event_id_t tapdisk_server_register_event(char, int, int, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_set_max_timeout(int);
 
+struct tapdisk_loop *tapdisk_server_pick_loop(void);
+int tapdisk_server_call(struct tapdisk_loop *, int (*)(void *), void *);
+int tapdisk_server_call_vbd(td_uuid_t, int (*)(void *), void *);
+int tapdisk_server_call_all(int (*)(void *), void *);
+
+void tapdisk_server_set_queue_driver(int);
+void tapdisk_server_set_threads(int);
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(void);
 int tapdisk_server_complete(void);
@@ -57,11 +66,40 @@ void tapdisk_server_iterate(void);
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
 
-typedef struct tapdisk_server {
+struct tapdisk_loop_call;
+
+/*
+ * An event loop with its own scheduler and I/O queue, serving the
+ * vbds on its list. The server's own loop runs the control path and,
+ * unless worker threads were requested, every vbd as well.
+ */
+typedef struct tapdisk_loop {
 	int                          run;
 	struct list_head             vbds;
+	int                          nr_vbds;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+
+	pthread_t                    thread;
+
+	int                          call_fd;
+	event_id_t                   call_event;
+	pthread_mutex_t              call_lock;
+	pthread_cond_t               call_cond;
+	struct tapdisk_loop_call    *call;
+} tapdisk_loop_t;
+
+typedef struct tapdisk_server {
+	tapdisk_loop_t               loop;
+
+	tapdisk_loop_t              *workers;
+	int                          nr_workers;
+
+	/* all vbds, across loops */
+	struct list_head             vbds;
+	pthread_mutex_t              vbds_lock;
+
+	int                          signals;
 } tapdisk_server_t;
 
 #endif
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "tapdisk-stats.h"
+
+static void
+__stats_vsprintf(td_stats_t *st, const char *fmt, va_list ap)
+{
+	size_t size;
+	int n;
+
+	size = st->buf + st->size - st->pos;
+	if (size <= 1)
+		return;
+
+	n = vsnprintf(st->pos, size, fmt, ap);
+	if (n < 0)
+		return;
+
+	st->pos += ((size_t)n < size ? (size_t)n : size - 1);
+}
+
+static void
+__stats_sprintf(td_stats_t *st, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	__stats_vsprintf(st, fmt, ap);
+	va_end(ap);
+}
+
+static int *
+__stats_n_elem(td_stats_t *st)
+{
+	int depth = st->depth;
+
+	if (depth >= TD_STATS_MAX_DEPTH)
+		depth = TD_STATS_MAX_DEPTH - 1;
+
+	return &st->n_elem[depth];
+}
+
+static void
+__stats_sep(td_stats_t *st)
+{
+	if ((*__stats_n_elem(st))++)
+		__stats_sprintf(st, ", ");
+}
+
+static void
+__stats_push(td_stats_t *st, char t)
+{
+	__stats_sprintf(st, "%c", t);
+	st->depth++;
+	*__stats_n_elem(st) = 0;
+}
+
+static void
+__stats_string(td_stats_t *st, const char *s)
+{
+	__stats_sprintf(st, "\"");
+
+	for (; s && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			__stats_sprintf(st, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			__stats_sprintf(st, "\\u%04x", *s);
+		else
+			__stats_sprintf(st, "%c", *s);
+	}
+
+	__stats_sprintf(st, "\"");
+}
+
+static void
+__stats_vval(td_stats_t *st, const char *conv, va_list ap)
+{
+	char fmt[16];
+
+	if (!strcmp(conv, "[") || !strcmp(conv, "{")) {
+		__stats_push(st, conv[0]);
+		return;
+	}
+
+	if (!strcmp(conv, "s")) {
+		__stats_string(st, va_arg(ap, const char *));
+		return;
+	}
+
+	snprintf(fmt, sizeof(fmt), "%%%s", conv);
+	__stats_vsprintf(st, fmt, ap);
+}
+
+void
+tapdisk_stats_init(td_stats_t *st, char *buf, size_t size)
+{
+	memset(st, 0, sizeof(*st));
+
+	st->buf  = buf;
+	st->pos  = buf;
+	st->size = size;
+
+	if (size)
+		buf[0] = 0;
+}
+
+void
+tapdisk_stats_enter(td_stats_t *st, char t)
+{
+	__stats_sep(st);
+	__stats_push(st, t);
+}
+
+void
+tapdisk_stats_leave(td_stats_t *st, char t)
+{
+	if (st->depth > 0)
+		st->depth--;
+
+	__stats_sprintf(st, "%c", t);
+}
+
+void
+tapdisk_stats_field(td_stats_t *st, const char *key, const char *conv, ...)
+{
+	va_list ap;
+
+	__stats_sep(st);
+	__stats_string(st, key);
+	__stats_sprintf(st, ": ");
+
+	va_start(ap, conv);
+	__stats_vval(st, conv, ap);
+	va_end(ap);
+}
+
+void
+tapdisk_stats_val(td_stats_t *st, const char *conv, ...)
+{
+	va_list ap;
+
+	__stats_sep(st);
+
+	va_start(ap, conv);
+	__stats_vval(st, conv, ap);
+	va_end(ap);
+}
+
+size_t
+tapdisk_stats_length(td_stats_t *st)
+{
+	return st->pos - st->buf;
+}
+
+void
+tapdisk_histogram_add(td_histogram_t *h, uint64_t val)
+{
+	int i;
+
+	for (i = 0; i < TD_HISTOGRAM_BUCKETS - 1 && val >> i; i++)
+		;
+
+	h->buckets[i]++;
+	h->count++;
+	h->sum += val;
+	if (val > h->max)
+		h->max = val;
+}
+
+/*
+ * Emits {"count": n, "sum": n, "max": n, "buckets": [...]}, dropping
+ * trailing empty buckets.
+ */
+void
+tapdisk_stats_histogram(td_stats_t *st, const char *key, td_histogram_t *h)
+{
+	int i, n;
+
+	for (n = TD_HISTOGRAM_BUCKETS; n > 0 && !h->buckets[n - 1]; n--)
+		;
+
+	tapdisk_stats_field(st, key, "{");
+	tapdisk_stats_field(st, "count", PRIu64, h->count);
+	tapdisk_stats_field(st, "sum", PRIu64, h->sum);
+	tapdisk_stats_field(st, "max", PRIu64, h->max);
+	tapdisk_stats_field(st, "buckets", "[");
+	for (i = 0; i < n; i++)
+		tapdisk_stats_val(st, PRIu64, h->buckets[i]);
+	tapdisk_stats_leave(st, ']');
+	tapdisk_stats_leave(st, '}');
+}
+
+/* monotonic time in microseconds, for latencies */
+uint64_t
+tapdisk_stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TAPDISK_STATS_H_
+#define _TAPDISK_STATS_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/*
+ * Builds a JSON document describing a vbd and its images, e.g.
+ *
+ *   tapdisk_stats_enter(st, '{');
+ *   tapdisk_stats_field(st, "name", "s", vbd->name);
+ *   tapdisk_stats_field(st, "images", "[");
+ *   ...
+ *   tapdisk_stats_leave(st, ']');
+ *   tapdisk_stats_leave(st, '}');
+ *
+ * Conversions are printf conversions without the leading '%'; "s"
+ * values are quoted, "[" and "{" open a nested array or object.
+ * Output is truncated silently if the buffer fills up.
+ */
+
+#define TD_STATS_MAX_DEPTH           8
+
+/*
+ * Log2 histograms: bucket 0 counts zeroes, bucket i values in
+ * [2^(i-1), 2^i); the last bucket takes everything larger.
+ */
+#define TD_HISTOGRAM_BUCKETS         24
+
+typedef struct td_stats              td_stats_t;
+typedef struct td_histogram          td_histogram_t;
+
+struct td_stats {
+	char                        *buf;
+	char                        *pos;
+	size_t                       size;
+
+	int                          depth;
+	int                          n_elem[TD_STATS_MAX_DEPTH];
+};
+
+struct td_histogram {
+	uint64_t                     count;
+	uint64_t                     sum;
+	uint64_t                     max;
+	uint64_t                     buckets[TD_HISTOGRAM_BUCKETS];
+};
+
+void tapdisk_stats_init(td_stats_t *, char *, size_t);
+void tapdisk_stats_enter(td_stats_t *, char);
+void tapdisk_stats_leave(td_stats_t *, char);
+void tapdisk_stats_field(td_stats_t *, const char *, const char *, ...);
+void tapdisk_stats_val(td_stats_t *, const char *, ...);
+size_t tapdisk_stats_length(td_stats_t *);
+
+void tapdisk_histogram_add(td_histogram_t *, uint64_t);
+void tapdisk_stats_histogram(td_stats_t *, const char *, td_histogram_t *);
+uint64_t tapdisk_stats_clock(void);
+
+#endif
@@ -67,6 +67,10 @@
 #define TD_VBD_EIO_SLEEP            1
 #define TD_VBD_WATCHDOG_TIMEOUT     10
 
+#define TD_VBD_CHAIN_BLOCK_SHIFT    12 /* 2MB, the vhd block size */
+#define TD_VBD_CHAIN_BLOCK_SECS     (1ULL << TD_VBD_CHAIN_BLOCK_SHIFT)
+#define TD_VBD_CHAIN_UNKNOWN        0xff
+
 static void tapdisk_vbd_ring_event(event_id_t, char, void *);
 static void tapdisk_vbd_callback(void *, blkif_response_t *);
 
@@ -123,6 +127,7 @@ tapdisk_vbd_create(uint16_t uuid)
 	INIT_LIST_HEAD(&vbd->failed_requests);
 	INIT_LIST_HEAD(&vbd->completed_requests);
 	INIT_LIST_HEAD(&vbd->next);
+	INIT_LIST_HEAD(&vbd->loop_next);
 	gettimeofday(&vbd->ts, NULL);
 
 	for (i = 0; i < MAX_REQUESTS; i++)
@@ -179,11 +184,139 @@ tapdisk_vbd_validate_chain(td_vbd_t *vbd)
 	return 0;
 }
 
+/*
+ * Chain index: a read of a block that the upper images of a chain
+ * don't hold is forwarded down the chain one image at a time. The
+ * chain map remembers, per block, the first image that may hold data
+ * for it (td_range_present), so reads are issued there directly. Map
+ * entries are filled in on first use, writes point their blocks back
+ * at the top image, and the whole map goes away with the chain.
+ */
+static void
+tapdisk_vbd_free_chain_index(td_vbd_t *vbd)
+{
+	free(vbd->chain_map);
+	free(vbd->chain_images);
+
+	vbd->chain_map    = NULL;
+	vbd->chain_images = NULL;
+	vbd->chain_depth  = 0;
+	vbd->chain_blocks = 0;
+}
+
+static int
+tapdisk_vbd_init_chain_index(td_vbd_t *vbd)
+{
+	td_image_t *image, *tmp;
+	int depth;
+
+	depth = 0;
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		depth++;
+
+	if (depth < 2 || depth >= TD_VBD_CHAIN_UNKNOWN)
+		return 0;
+
+	image = tapdisk_vbd_first_image(vbd);
+	if (!image->driver->ops->td_range_present)
+		return 0;
+
+	vbd->chain_blocks = (image->info.size + TD_VBD_CHAIN_BLOCK_SECS - 1) >>
+		TD_VBD_CHAIN_BLOCK_SHIFT;
+
+	vbd->chain_map    = malloc(vbd->chain_blocks);
+	vbd->chain_images = calloc(depth, sizeof(td_image_t *));
+	if (!vbd->chain_map || !vbd->chain_images) {
+		tapdisk_vbd_free_chain_index(vbd);
+		return -ENOMEM;
+	}
+
+	memset(vbd->chain_map, TD_VBD_CHAIN_UNKNOWN, vbd->chain_blocks);
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		vbd->chain_images[vbd->chain_depth++] = image;
+
+	return 0;
+}
+
+static int
+tapdisk_vbd_chain_owner(td_vbd_t *vbd, uint64_t blk)
+{
+	td_image_t *image, *parent;
+	td_sector_t sec, secs;
+	int i;
+
+	if (vbd->chain_map[blk] != TD_VBD_CHAIN_UNKNOWN)
+		return vbd->chain_map[blk];
+
+	image = vbd->chain_images[0];
+	sec   = blk << TD_VBD_CHAIN_BLOCK_SHIFT;
+	secs  = TD_VBD_CHAIN_BLOCK_SECS;
+	if (sec + secs > image->info.size)
+		secs = image->info.size - sec;
+
+	for (i = 0; i < vbd->chain_depth - 1; i++) {
+		image  = vbd->chain_images[i];
+		parent = vbd->chain_images[i + 1];
+
+		if (td_range_present(image, sec, secs))
+			break;
+
+		/* forwarding past the end of the parent returns zeros */
+		if (sec + secs > parent->info.size)
+			break;
+	}
+
+	vbd->chain_map[blk] = i;
+	return i;
+}
+
+static td_image_t *
+tapdisk_vbd_chain_lookup(td_vbd_t *vbd, td_request_t *treq)
+{
+	uint64_t blk, end;
+	int owner;
+
+	if (!vbd->chain_map)
+		return treq->image;
+
+	blk = treq->sec >> TD_VBD_CHAIN_BLOCK_SHIFT;
+	end = (treq->sec + treq->secs - 1) >> TD_VBD_CHAIN_BLOCK_SHIFT;
+	if (end >= vbd->chain_blocks)
+		return treq->image;
+
+	owner = vbd->chain_depth - 1;
+	for (; blk <= end && owner; blk++) {
+		int i = tapdisk_vbd_chain_owner(vbd, blk);
+		if (i < owner)
+			owner = i;
+	}
+
+	return vbd->chain_images[owner];
+}
+
+static void
+tapdisk_vbd_chain_update(td_vbd_t *vbd, td_request_t *treq)
+{
+	uint64_t blk, end;
+
+	if (!vbd->chain_map)
+		return;
+
+	blk = treq->sec >> TD_VBD_CHAIN_BLOCK_SHIFT;
+	end = (treq->sec + treq->secs - 1) >> TD_VBD_CHAIN_BLOCK_SHIFT;
+
+	for (; blk <= end && blk < vbd->chain_blocks; blk++)
+		vbd->chain_map[blk] = 0;
+}
+
 void
 tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
 	td_image_t *image, *tmp;
 
+	tapdisk_vbd_free_chain_index(vbd);
+
 	tapdisk_vbd_for_each_image(vbd, image, tmp) {
 		td_close(image);
 		tapdisk_image_free(image);
@@ -432,6 +565,10 @@ __tapdisk_vbd_open_vdi(td_vbd_t *vbd, td_flag_t extra_flags)
 	if (err)
 		goto fail;
 
+	err = tapdisk_vbd_init_chain_index(vbd);
+	if (err)
+		goto fail;
+
 	td_flag_clear(vbd->state, TD_VBD_CLOSED);
 
 	return 0;
@@ -828,6 +965,69 @@ tapdisk_vbd_debug(td_vbd_t *vbd)
 		td_debug(image);
 }
 
+void
+tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
+{
+	td_image_t *image, *tmp;
+	int new, pending, failed, completed;
+
+	tapdisk_vbd_queue_count(vbd, &new, &pending, &failed, &completed);
+
+	tapdisk_stats_enter(st, '{');
+	tapdisk_stats_field(st, "name", "s", vbd->name);
+	tapdisk_stats_field(st, "minor", "d", vbd->minor);
+	tapdisk_stats_field(st, "state", "u", vbd->state);
+
+	tapdisk_stats_field(st, "requests", "{");
+	tapdisk_stats_field(st, "new", "d", new);
+	tapdisk_stats_field(st, "pending", "d", pending);
+	tapdisk_stats_field(st, "failed", "d", failed);
+	tapdisk_stats_field(st, "completed", "d", completed);
+	tapdisk_stats_field(st, "received", PRIu64, vbd->received);
+	tapdisk_stats_field(st, "returned", PRIu64, vbd->returned);
+	tapdisk_stats_field(st, "kicked", PRIu64, vbd->kicked);
+	tapdisk_stats_field(st, "errors", PRIu64, vbd->errors);
+	tapdisk_stats_field(st, "retries", PRIu64, vbd->retries);
+	tapdisk_stats_leave(st, '}');
+
+	if (vbd->chain_map) {
+		uint64_t i, known = 0;
+
+		for (i = 0; i < vbd->chain_blocks; i++)
+			if (vbd->chain_map[i] != TD_VBD_CHAIN_UNKNOWN)
+				known++;
+
+		tapdisk_stats_field(st, "chain_index", "{");
+		tapdisk_stats_field(st, "depth", "d", vbd->chain_depth);
+		tapdisk_stats_field(st, "blocks", PRIu64, vbd->chain_blocks);
+		tapdisk_stats_field(st, "known", PRIu64, known);
+		tapdisk_stats_field(st, "skips", PRIu64, vbd->chain_skips);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	tapdisk_stats_histogram(st, "read_latency_us",
+				&vbd->latency[BLKIF_OP_READ]);
+	tapdisk_stats_histogram(st, "write_latency_us",
+				&vbd->latency[BLKIF_OP_WRITE]);
+	tapdisk_stats_histogram(st, "read_sectors", &vbd->size[BLKIF_OP_READ]);
+	tapdisk_stats_histogram(st, "write_sectors",
+				&vbd->size[BLKIF_OP_WRITE]);
+	tapdisk_stats_histogram(st, "depth", &vbd->depth);
+
+	if (vbd->loop) {
+		tapdisk_stats_field(st, "queue", "{");
+		tapdisk_queue_stats(&vbd->loop->aio_queue, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	tapdisk_stats_field(st, "images", "[");
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		td_stats(image, st);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_leave(st, '}');
+}
+
 static void
 tapdisk_vbd_drop_log(td_vbd_t *vbd)
 {
@@ -1071,6 +1271,18 @@ tapdisk_vbd_make_response(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	if (rsp->status != BLKIF_RSP_OKAY)
 		ERR(EIO, "returning BLKIF_RSP %d", rsp->status);
 
+	if (tmp.operation == BLKIF_OP_READ ||
+	    tmp.operation == BLKIF_OP_WRITE) {
+		int i, secs = 0;
+
+		for (i = 0; i < tmp.nr_segments; i++)
+			secs += tmp.seg[i].last_sect - tmp.seg[i].first_sect + 1;
+
+		tapdisk_histogram_add(&vbd->latency[tmp.operation],
+				      tapdisk_stats_clock() - vreq->ts);
+		tapdisk_histogram_add(&vbd->size[tmp.operation], secs);
+	}
+
 	vbd->returned++;
 	vbd->callback(vbd->argument, rsp);
 }
@@ -1235,6 +1447,36 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 	tapdisk_vbd_complete_vbd_request(vbd, vreq);
 }
 
+static void
+__tapdisk_vbd_queue_parent_read(td_vbd_request_t *vreq, td_request_t treq)
+{
+	td_image_t *parent = treq.image;
+
+#ifdef MEMSHR
+	if(td_flag_test(parent->flags, TD_OPEN_RDONLY)) {
+		int ret, seg = treq.sidx;
+		blkif_request_t *breq = &vreq->req;
+
+		ret = memshr_vbd_issue_ro_request(treq.buf,
+		      breq->seg[seg].gref,
+		      parent->memshr_id,
+		      treq.sec,
+		      treq.secs,
+		      &treq.memshr_hnd);
+		if(ret == 0) {
+			/* Reset memshr handle. This'll prevent
+			 * memshr_vbd_complete_ro_request being called
+			 */
+			treq.memshr_hnd.handle = 0;
+			td_complete_request(treq, 0);
+			return;
+		}
+	}
+#endif
+
+	td_queue_read(parent, treq);
+}
+
 static void
 __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 				 td_image_t *image, td_request_t treq)
@@ -1282,28 +1524,7 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 		break;
 
 	case TD_OP_READ:
-#ifdef MEMSHR
-		if(td_flag_test(parent->flags, TD_OPEN_RDONLY)) {
-			int ret, seg = treq.sidx;
-			blkif_request_t *breq = &vreq->req;
-        
-			ret = memshr_vbd_issue_ro_request(treq.buf,
-			      breq->seg[seg].gref,
-			      parent->memshr_id,
-			      treq.sec,
-			      treq.secs,
-			      &treq.memshr_hnd);
-			if(ret == 0) {
-				/* Reset memshr handle. This'll prevent
-				 * memshr_vbd_complete_ro_request being called
-				 */
-				treq.memshr_hnd.handle = 0;
-				td_complete_request(treq, 0);
-			} else
-				td_queue_read(parent, treq);
-		} else
-#endif
-			td_queue_read(parent, treq);
+		__tapdisk_vbd_queue_parent_read(vreq, treq);
 		break;
 	}
 
@@ -1400,6 +1621,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		treq.cb             = tapdisk_vbd_complete_td_request;
 		treq.cb_data        = NULL;
 		treq.private        = vreq;
+		treq.ts             = 0;
 
 		DBG(TLOG_DBG, "%s: req %d seg %d sec 0x%08"PRIx64" secs 0x%04x "
 		    "buf %p op %d\n", image->name, id, i, treq.sec, treq.secs,
@@ -1411,12 +1633,19 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		switch (req->operation)	{
 		case BLKIF_OP_WRITE:
 			treq.op = TD_OP_WRITE;
+			tapdisk_vbd_chain_update(vbd, &treq);
 			td_queue_write(image, treq);
 			break;
 
 		case BLKIF_OP_READ:
-			treq.op = TD_OP_READ;
-			td_queue_read(image, treq);
+			treq.op    = TD_OP_READ;
+			treq.image = tapdisk_vbd_chain_lookup(vbd, &treq);
+			if (treq.image == image)
+				td_queue_read(image, treq);
+			else {
+				vbd->chain_skips++;
+				__tapdisk_vbd_queue_parent_read(vreq, treq);
+			}
 			break;
 		}
 
@@ -1578,6 +1807,10 @@ tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 		memcpy(&vreq->req, req, sizeof(blkif_request_t));
 		vbd->received++;
 		vreq->vbd = vbd;
+		vreq->ts  = tapdisk_stats_clock();
+
+		tapdisk_histogram_add(&vbd->depth,
+				      vbd->received - vbd->returned);
 
 		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
 
@@ -56,6 +56,8 @@ typedef struct td_vbd_driver_info   td_vbd_driver_info_t;
 typedef struct td_vbd_handle        td_vbd_t;
 typedef void (*td_vbd_cb_t)        (void *, blkif_response_t *);
 
+struct tapdisk_loop;
+
 struct td_ring {
 	int                         fd;
 	char                       *mem;
@@ -74,6 +76,7 @@ struct td_vbd_request {
 	int                         secs_pending;
 	int                         num_retries;
 	struct timeval              last_try;
+	uint64_t                    ts; /* pulled off the ring */
 
 	td_vbd_t                   *vbd;
 	struct list_head            next;
@@ -102,6 +105,12 @@ struct td_vbd_handle {
 
 	struct list_head            images;
 
+	/* chain index, see tapdisk-vbd.c */
+	uint8_t                    *chain_map;
+	td_image_t                **chain_images;
+	int                         chain_depth;
+	uint64_t                    chain_blocks;
+
 	struct list_head            new_requests;
 	struct list_head            pending_requests;
 	struct list_head            failed_requests;
@@ -117,6 +126,10 @@ struct td_vbd_handle {
 
 	struct list_head            next;
 
+	/* event loop serving this vbd, see tapdisk-server.c */
+	struct tapdisk_loop        *loop;
+	struct list_head            loop_next;
+
 	struct timeval              ts;
 
 	uint64_t                    received;
@@ -125,6 +138,12 @@ struct td_vbd_handle {
 	uint64_t                    secs_pending;
 	uint64_t                    retries;
 	uint64_t                    errors;
+	uint64_t                    chain_skips;
+
+	/* ring request statistics, indexed by BLKIF_OP_READ/WRITE */
+	td_histogram_t              latency[2];	/* usecs */
+	td_histogram_t              size[2];	/* sectors */
+	td_histogram_t              depth;	/* requests in flight */
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
@@ -201,6 +220,7 @@ int tapdisk_vbd_kick(td_vbd_t *);
 void tapdisk_vbd_check_state(td_vbd_t *);
 void tapdisk_vbd_check_progress(td_vbd_t *);
 void tapdisk_vbd_debug(td_vbd_t *);
+void tapdisk_vbd_stats(td_vbd_t *, td_stats_t *);
 
 void tapdisk_vbd_complete_vbd_request(td_vbd_t *, td_vbd_request_t *);
 
@@ -51,6 +51,11 @@
  *     0 if parent id successfully retrieved
  *     TD_NO_PARENT if no parent exists
  *     -errno on error
+ *
+ * td_range_present (optional) returns:
+ *     0 if reads of every sector in the range would be forwarded
+ *       to the parent image
+ *     1 if the image may hold data for some of the range
  */
 
 #ifndef _TAPDISK_H_
@@ -63,6 +68,7 @@
 #include "blktaplib.h"
 #include "tapdisk-log.h"
 #include "tapdisk-utils.h"
+#include "tapdisk-stats.h"
 
 #ifdef MEMSHR
 #include "memshr.h"
@@ -138,6 +144,8 @@ struct td_request {
 	uint64_t                     id;
 	int                          sidx;
 	void                        *private;
+
+	uint64_t                     ts; /* submitted to image, see td_stats */
     
 #ifdef MEMSHR
 	share_tuple_t                memshr_hnd;
@@ -164,6 +172,8 @@ struct tap_disk {
 	void (*td_queue_read)        (td_driver_t *, td_request_t);
 	void (*td_queue_write)       (td_driver_t *, td_request_t);
 	void (*td_debug)             (td_driver_t *);
+	void (*td_stats)             (td_driver_t *, td_stats_t *);
+	int (*td_range_present)      (td_driver_t *, td_sector_t, int);
 };
 
 #endif
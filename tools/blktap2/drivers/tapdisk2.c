@@ -38,11 +38,14 @@
 #include "tapdisk-utils.h"
 #include "tapdisk-server.h"
 #include "tapdisk-control.h"
+#include "tapdisk-disktype.h"
 
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s [-D] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s [-D] [-q lio|uring|rwio] [-t threads] "
+		"[-b vhd bitmaps] [-l qcow l2 tables] "
+		"<-u uuid> <-c control socket>\n", app);
 	exit(err);
 }
 
@@ -50,12 +53,12 @@ int
 main(int argc, char *argv[])
 {
 	char *control;
-	int c, err, nodaemon;
+	int c, err, drv, threads, nodaemon;
 
 	control  = NULL;
 	nodaemon = 0;
 
-	while ((c = getopt(argc, argv, "s:Dh")) != -1) {
+	while ((c = getopt(argc, argv, "s:q:t:b:l:Dh")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
@@ -63,6 +66,38 @@ main(int argc, char *argv[])
 		case 'h':
 			usage(argv[0], 0);
 			break;
+		case 'q':
+			drv = tapdisk_queue_driver(optarg);
+			if (drv < 0) {
+				fprintf(stderr, "unknown I/O queue driver '%s'\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			tapdisk_server_set_queue_driver(drv);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 0) {
+				fprintf(stderr, "invalid thread count '%s'\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			tapdisk_server_set_threads(threads);
+			break;
+		case 'b':
+			if (vhd_set_bitmap_cache_size(atoi(optarg))) {
+				fprintf(stderr, "invalid bitmap cache size '%s'\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'l':
+			if (qcow_set_l2_cache_size(atoi(optarg))) {
+				fprintf(stderr, "invalid L2 cache size '%s'\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 's':
 #ifdef MEMSHR
 			memshr_set_domid(atoi(optarg));
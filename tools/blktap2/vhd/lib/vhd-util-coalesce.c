@@ -24,34 +24,74 @@
  * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
+#include <time.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "libvhd.h"
 
+#define VHD_COALESCE_THREADS      4
+#define VHD_COALESCE_THREADS_MAX  64
+#define VHD_COALESCE_BATCH        16 /* blocks per sequential run */
+#define VHD_COALESCE_BATCH_MAX    256
+#define VHD_COALESCE_MEM_MAX      (256ULL << 20) /* all run buffers */
+#define VHD_COALESCE_CHECKPOINT   5  /* seconds */
+
+/*
+ * Blocks are handed out to worker threads in runs of child blocks that
+ * are adjacent both logically and on disk, so each run is read with a
+ * single pread, bitmaps included.  Reads of the child proceed in
+ * parallel; writes to a raw parent do too, while writes to a vhd parent
+ * (which may allocate blocks and update its BAT) are serialized.
+ *
+ * Copying a block is idempotent, so progress is recorded as a low water
+ * mark below which every block has reached the parent.  With a
+ * checkpoint file the mark is saved every few seconds, after the parent
+ * has been synced, and an interrupted coalesce resumes from it.
+ */
+typedef struct vhd_coalesce {
+	vhd_context_t            *vhd;
+	vhd_context_t            *parent;
+	int                       parent_fd;
+	const char               *name;
+
+	pthread_mutex_t           lock;
+	pthread_mutex_t           parent_lock;
+
+	uint32_t                  batch;
+	uint64_t                  next;
+	uint64_t                  mark;
+	char                     *done;
+	int                       err;
+
+	uint64_t                  total;
+	uint64_t                  copied;
+	int                       progress;
+	int                       percent;
+
+	const char               *checkpoint;
+	int                       checkpointing;
+	time_t                    last_checkpoint;
+} vhd_coalesce_t;
+
 static int
 __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 {
-	off_t off;
-	size_t ret;
+	ssize_t ret;
 
 	errno = 0;
-	off = lseek(fd, vhd_sectors_to_bytes(sec), SEEK_SET);
-	if (off == (off_t)-1) {
-		printf("raw parent: seek(0x%08"PRIx64") failed: %d\n",
-		       vhd_sectors_to_bytes(sec), -errno);
-		return -errno;
-	}
-
-	ret = write(fd, buf, vhd_sectors_to_bytes(secs));
+	ret = pwrite(fd, buf, vhd_sectors_to_bytes(secs),
+		     vhd_sectors_to_bytes(sec));
 	if (ret == vhd_sectors_to_bytes(secs))
 		return 0;
 
-	printf("raw parent: write of 0x%"PRIx64" returned %zd, errno: %d\n",
-	       vhd_sectors_to_bytes(secs), ret, -errno);
+	printf("raw parent: write of 0x%"PRIx64" at 0x%08"PRIx64" "
+	       "returned %zd, errno: %d\n", vhd_sectors_to_bytes(secs),
+	       vhd_sectors_to_bytes(sec), ret, -errno);
 	return (errno ? -errno : -EIO);
 }
 
@@ -59,39 +99,45 @@ __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
  * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
  */
 static int
-vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-		int parent_fd, uint64_t block)
+vhd_coalesce_write(vhd_coalesce_t *c, char *buf, uint64_t sec, uint32_t secs)
 {
-	int i, err;
-	char *buf, *map;
-	uint64_t sec, secs;
+	int err;
 
-	buf = NULL;
-	map = NULL;
-	sec = block * vhd->spb;
+	if (!c->parent->file)
+		return __raw_io_write(c->parent_fd, buf, sec, secs);
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
-		return 0;
+	pthread_mutex_lock(&c->parent_lock);
+	err = vhd_io_write(c->parent, buf, sec, secs);
+	pthread_mutex_unlock(&c->parent_lock);
 
-	err = posix_memalign((void **)&buf, 4096, vhd->header.block_size);
-	if (err)
-		return -err;
+	return err;
+}
 
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
-	if (err)
-		goto done;
+static int
+vhd_coalesce_block_full(vhd_coalesce_t *c, uint64_t block, char *map)
+{
+	int i;
+	vhd_context_t *vhd = c->vhd;
 
-	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
-		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
-		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
-		goto done;
-	}
+	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block))
+		return 1;
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto done;
+	for (i = 0; i < vhd->spb >> 3; i++)
+		if ((unsigned char)map[i] != 0xff)
+			return 0;
+
+	return 1;
+}
+
+static int
+vhd_coalesce_block_partial(vhd_coalesce_t *c, uint64_t block,
+			   char *map, char *data)
+{
+	int i, err;
+	uint64_t sec, secs;
+	vhd_context_t *vhd = c->vhd;
+
+	sec = block * vhd->spb;
 
 	for (i = 0; i < vhd->spb; i++) {
 		if (!vhd_bitmap_test(vhd, map, i))
@@ -101,50 +147,411 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 			if (!vhd_bitmap_test(vhd, map, i + secs))
 				break;
 
-		if (parent->file)
-			err = vhd_io_write(parent,
-					   buf + vhd_sectors_to_bytes(i),
-					   sec + i, secs);
-		else
-			err = __raw_io_write(parent_fd,
-					     buf + vhd_sectors_to_bytes(i),
-					     sec + i, secs);
+		err = vhd_coalesce_write(c, data + vhd_sectors_to_bytes(i),
+					 sec + i, secs);
 		if (err)
-			goto done;
+			return err;
 
 		i += secs;
 	}
 
+	return 0;
+}
+
+/*
+ * copy the @n blocks starting at @first, which are stored back to back
+ * in the child.  runs of full blocks are compacted in @buf and written
+ * to the parent with one request.
+ */
+static int
+vhd_coalesce_run(vhd_coalesce_t *c, int fd, char *buf,
+		 uint64_t first, uint32_t n)
+{
+	int err;
+	ssize_t ret;
+	uint32_t i, full;
+	size_t stride, size;
+	char *map, *data, *run;
+	vhd_context_t *vhd = c->vhd;
+
+	stride = vhd_sectors_to_bytes(vhd->bm_secs + vhd->spb);
+	size   = stride * n;
+
+	ret = pread(fd, buf, size,
+		    vhd_sectors_to_bytes(vhd->bat.bat[first]));
+	if (ret < 0) {
+		err = -errno;
+		printf("error reading block 0x%"PRIx64": %d\n", first, err);
+		return err;
+	}
+
+	/* the last block may be cut short by the footer */
+	if (ret < size)
+		memset(buf + ret, 0, size - ret);
+
+	run  = NULL;
+	full = 0;
+
+	for (i = 0; i <= n; i++) {
+		map  = buf + stride * i;
+		data = map + vhd_sectors_to_bytes(vhd->bm_secs);
+
+		if (i < n && vhd_coalesce_block_full(c, first + i, map)) {
+			if (!full++)
+				run = data;
+			else
+				memmove(run + (full - 1) * vhd->header.block_size,
+					data, vhd->header.block_size);
+			continue;
+		}
+
+		if (full) {
+			err = vhd_coalesce_write(c, run,
+						 (first + i - full) * vhd->spb,
+						 full * vhd->spb);
+			if (err)
+				return err;
+			full = 0;
+		}
+
+		if (i == n)
+			break;
+
+		err = vhd_coalesce_block_partial(c, first + i, map, data);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int
+vhd_coalesce_sync(vhd_coalesce_t *c)
+{
+	int fd;
+
+	fd = (c->parent->file ? c->parent->fd : c->parent_fd);
+	if (fsync(fd))
+		return -errno;
+
+	return 0;
+}
+
+static int
+vhd_coalesce_read_checkpoint(vhd_coalesce_t *c)
+{
+	FILE *f;
+	uint64_t mark;
+	char uuid[37], saved[37];
+
+	f = fopen(c->checkpoint, "r");
+	if (!f)
+		return (errno == ENOENT ? 0 : -errno);
+
+	vhd_uuid_to_string(&c->vhd->footer.uuid, uuid, sizeof(uuid));
+
+	if (fscanf(f, "%36s %"SCNu64, saved, &mark) != 2 ||
+	    strcmp(saved, uuid) || mark > c->vhd->bat.entries) {
+		printf("ignoring stale checkpoint %s\n", c->checkpoint);
+		mark = 0;
+	}
+
+	fclose(f);
+
+	if (mark)
+		printf("resuming coalesce of %s at block 0x%"PRIx64"\n",
+		       c->name, mark);
+
+	c->mark = c->next = mark;
+	return 0;
+}
+
+static int
+vhd_coalesce_write_checkpoint(vhd_coalesce_t *c, uint64_t mark)
+{
+	FILE *f;
+	int err;
+	char uuid[37], *tmp;
+
+	err = vhd_coalesce_sync(c);
+	if (err)
+		return err;
+
+	if (asprintf(&tmp, "%s.tmp", c->checkpoint) == -1)
+		return -ENOMEM;
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		err = -errno;
+		goto out;
+	}
+
+	vhd_uuid_to_string(&c->vhd->footer.uuid, uuid, sizeof(uuid));
+	fprintf(f, "%s %"PRIu64"\n", uuid, mark);
+
+	if (fflush(f) || fsync(fileno(f)))
+		err = -errno;
+	if (fclose(f) && !err)
+		err = -errno;
+	if (!err && rename(tmp, c->checkpoint))
+		err = -errno;
+
+out:
+	if (err)
+		printf("error writing checkpoint %s: %d\n", c->checkpoint, err);
+	free(tmp);
+	return err;
+}
+
+/*
+ * hand out the next run of allocated blocks, or return 0 when done.
+ * called with the lock held.
+ */
+static uint32_t
+vhd_coalesce_next_run(vhd_coalesce_t *c, uint64_t *first)
+{
+	uint32_t n;
+	uint64_t blk, stride;
+	vhd_context_t *vhd = c->vhd;
+
+	stride = vhd->bm_secs + vhd->spb;
+
+	while (c->next < vhd->bat.entries &&
+	       vhd->bat.bat[c->next] == DD_BLK_UNUSED)
+		c->done[c->next++] = 1;
+
+	if (c->err || c->next >= vhd->bat.entries)
+		return 0;
+
+	*first = c->next;
+
+	for (n = 1; n < c->batch; n++) {
+		blk = *first + n;
+		if (blk >= vhd->bat.entries ||
+		    vhd->bat.bat[blk] == DD_BLK_UNUSED ||
+		    vhd->bat.bat[blk] != vhd->bat.bat[blk - 1] + stride)
+			break;
+	}
+
+	c->next = *first + n;
+	return n;
+}
+
+/*
+ * called with the lock held; drops it while checkpointing.
+ */
+static void
+vhd_coalesce_complete_run(vhd_coalesce_t *c, uint64_t first, uint32_t n)
+{
+	int err, percent;
+	uint64_t mark;
+	time_t now;
+
+	c->copied += n;
+	while (n--)
+		c->done[first + n] = 1;
+
+	while (c->mark < c->next && c->done[c->mark])
+		c->mark++;
+
+	if (c->progress && c->total) {
+		percent = c->copied * 100 / c->total;
+		if (percent != c->percent) {
+			c->percent = percent;
+			printf("coalesce: %"PRIu64"/%"PRIu64" blocks (%d%%)\n",
+			       c->copied, c->total, percent);
+			fflush(stdout);
+		}
+	}
+
+	if (!c->checkpoint || c->checkpointing)
+		return;
+
+	now = time(NULL);
+	if (now - c->last_checkpoint < VHD_COALESCE_CHECKPOINT)
+		return;
+
+	mark = c->mark;
+	c->checkpointing   = 1;
+	c->last_checkpoint = now;
+	pthread_mutex_unlock(&c->lock);
+
+	err = vhd_coalesce_write_checkpoint(c, mark);
+
+	pthread_mutex_lock(&c->lock);
+	c->checkpointing = 0;
+	if (err && !c->err)
+		c->err = err;
+}
+
+static void *
+vhd_coalesce_worker(void *arg)
+{
+	int fd, err;
+	char *buf;
+	uint32_t n;
+	uint64_t first;
+	vhd_coalesce_t *c = arg;
+
+	buf = NULL;
+	fd  = open(c->name, O_RDONLY | O_DIRECT | O_LARGEFILE);
+	if (fd == -1) {
+		err = -errno;
+		printf("error opening %s: %d\n", c->name, err);
+		goto out;
+	}
+
+	err = posix_memalign((void **)&buf, 4096,
+			     vhd_sectors_to_bytes(c->vhd->bm_secs +
+						  c->vhd->spb) * c->batch);
+	if (err) {
+		err = -err;
+		buf = NULL;
+		goto out;
+	}
+
+	pthread_mutex_lock(&c->lock);
+
+	while ((n = vhd_coalesce_next_run(c, &first))) {
+		pthread_mutex_unlock(&c->lock);
+		err = vhd_coalesce_run(c, fd, buf, first, n);
+		pthread_mutex_lock(&c->lock);
+
+		if (err) {
+			if (!c->err)
+				c->err = err;
+			break;
+		}
+
+		vhd_coalesce_complete_run(c, first, n);
+	}
+
+	pthread_mutex_unlock(&c->lock);
 	err = 0;
 
-done:
+out:
+	if (err) {
+		pthread_mutex_lock(&c->lock);
+		if (!c->err)
+			c->err = err;
+		pthread_mutex_unlock(&c->lock);
+	}
 	free(buf);
-	free(map);
+	if (fd != -1)
+		close(fd);
+	return NULL;
+}
+
+static int
+vhd_coalesce_blocks(vhd_coalesce_t *c, int threads)
+{
+	int i, err, started;
+	uint64_t blk;
+	pthread_t *tids;
+
+	c->done = calloc(c->vhd->bat.entries, 1);
+	tids    = calloc(threads, sizeof(pthread_t));
+	if (!c->done || !tids) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_mutex_init(&c->parent_lock, NULL);
+
+	if (c->checkpoint) {
+		err = vhd_coalesce_read_checkpoint(c);
+		if (err)
+			goto out;
+		c->last_checkpoint = time(NULL);
+	}
+
+	for (blk = 0; blk < c->vhd->bat.entries; blk++) {
+		if (blk < c->mark)
+			c->done[blk] = 1;
+		else if (c->vhd->bat.bat[blk] != DD_BLK_UNUSED)
+			c->total++;
+	}
+
+	for (started = 0; started < threads; started++) {
+		err = pthread_create(tids + started, NULL,
+				     vhd_coalesce_worker, c);
+		if (err) {
+			err = -err;
+			break;
+		}
+	}
+
+	if (!started)
+		goto out;
+
+	if (err) {
+		pthread_mutex_lock(&c->lock);
+		c->err = err;
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	err = c->err;
+	if (!err)
+		err = vhd_coalesce_sync(c);
+
+	if (!c->checkpoint)
+		goto out;
+
+	if (err)
+		vhd_coalesce_write_checkpoint(c, c->mark);
+	else
+		unlink(c->checkpoint);
+
+out:
+	free(tids);
+	free(c->done);
 	return err;
 }
 
 int
 vhd_util_coalesce(int argc, char **argv)
 {
-	int err, c;
-	uint64_t i;
-	char *name, *pname;
+	int err, c, threads, progress;
+	char *name, *pname, *checkpoint;
 	vhd_context_t vhd, parent;
+	vhd_coalesce_t coalesce;
 	int parent_fd = -1;
-
-	name  = NULL;
-	pname = NULL;
+	uint64_t block;
+	long batch;
+
+	name       = NULL;
+	pname      = NULL;
+	checkpoint = NULL;
+	progress   = 0;
+	threads    = VHD_COALESCE_THREADS;
+	batch      = VHD_COALESCE_BATCH;
 	parent.file = NULL;
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:t:b:c:ph")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
 			break;
+		case 't':
+			threads = strtol(optarg, NULL, 10);
+			break;
+		case 'b':
+			batch = strtol(optarg, NULL, 10);
+			break;
+		case 'c':
+			checkpoint = optarg;
+			break;
+		case 'p':
+			progress = 1;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -154,6 +561,10 @@ vhd_util_coalesce(int argc, char **argv)
 	if (!name || optind != argc)
 		goto usage;
 
+	if (threads < 1 || threads > VHD_COALESCE_THREADS_MAX ||
+	    batch < 1 || batch > VHD_COALESCE_BATCH_MAX)
+		goto usage;
+
 	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
 	if (err) {
 		printf("error opening %s: %d\n", name, err);
@@ -185,6 +596,14 @@ vhd_util_coalesce(int argc, char **argv)
 		}
 	}
 
+	/* each thread buffers a run of blocks: keep them within bounds */
+	block = vhd_sectors_to_bytes(vhd.bm_secs + vhd.spb);
+	if (threads * block * batch > VHD_COALESCE_MEM_MAX) {
+		batch = VHD_COALESCE_MEM_MAX / (threads * block) ? : 1;
+		if (progress)
+			printf("limiting runs to %ld blocks\n", batch);
+	}
+
 	err = vhd_get_bat(&vhd);
 	if (err)
 		goto done;
@@ -195,13 +614,23 @@ vhd_util_coalesce(int argc, char **argv)
 			goto done;
 	}
 
-	for (i = 0; i < vhd.bat.entries; i++) {
-		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd, i);
+	if (parent.file) {
+		err = vhd_get_bat(&parent);
 		if (err)
 			goto done;
 	}
 
-	err = 0;
+	memset(&coalesce, 0, sizeof(coalesce));
+	coalesce.vhd        = &vhd;
+	coalesce.parent     = &parent;
+	coalesce.parent_fd  = parent_fd;
+	coalesce.name       = name;
+	coalesce.batch      = batch;
+	coalesce.progress   = progress;
+	coalesce.percent    = -1;
+	coalesce.checkpoint = checkpoint;
+
+	err = vhd_coalesce_blocks(&coalesce, threads);
 
  done:
 	free(pname);
@@ -213,6 +642,7 @@ vhd_util_coalesce(int argc, char **argv)
 	return err;
 
 usage:
-	printf("options: <-n name> [-h help]\n");
+	printf("options: <-n name> [-t threads] [-b blocks per run] "
+	       "[-c checkpoint file] [-p progress] [-h help]\n");
 	return -EINVAL;
 }
@@ -24,6 +24,7 @@
 #include "xc_private.h"
 #include <xen/memory.h>
 #include <xen/grant_table.h>
+#include <xen/hvm/params.h>
 
 int xc_memshr_control(xc_interface *xch,
                       domid_t domid,
@@ -182,6 +183,275 @@ int xc_memshr_add_to_physmap(xc_interface *xch,
     return xc_memshr_memop(xch, source_domain, &mso);
 }
 
+static int xc_memshr_bulk_op(xc_interface *xch,
+                             uint8_t op,
+                             domid_t source_domain,
+                             xen_mem_sharing_bulk_entry_t *entries,
+                             uint32_t nr_entries,
+                             uint32_t *nr_shared)
+{
+    int rc;
+    xen_mem_sharing_op_t mso;
+    DECLARE_HYPERCALL_BOUNCE(entries, nr_entries * sizeof(*entries),
+                             XC_HYPERCALL_BUFFER_BOUNCE_BOTH);
+
+    if ( !entries || xc_hypercall_bounce_pre(xch, entries) )
+        return -1;
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = op;
+
+    set_xen_guest_handle(mso.u.bulk.entries, entries);
+    mso.u.bulk.nr_entries = nr_entries;
+
+    rc = xc_memshr_memop(xch, source_domain, &mso);
+
+    xc_hypercall_bounce_post(xch, entries);
+
+    if ( !rc && nr_shared )
+        *nr_shared = mso.u.bulk.nr_shared;
+
+    return rc;
+}
+
+int xc_memshr_bulk_share(xc_interface *xch,
+                         domid_t source_domain,
+                         xen_mem_sharing_bulk_entry_t *entries,
+                         uint32_t nr_entries,
+                         uint32_t *nr_shared)
+{
+    return xc_memshr_bulk_op(xch, XENMEM_sharing_op_bulk_share,
+                             source_domain, entries, nr_entries, nr_shared);
+}
+
+/* HVM params carried over to a fork when set in the parent.  The event
+ * channel params are not: event channels are not cloned. */
+static const int fork_hvm_params[] = {
+    HVM_PARAM_PAE_ENABLED,
+    HVM_PARAM_VIRIDIAN,
+    HVM_PARAM_TIMER_MODE,
+    HVM_PARAM_HPET_ENABLED,
+    HVM_PARAM_IDENT_PT,
+    HVM_PARAM_VM86_TSS,
+    HVM_PARAM_VPT_ALIGN,
+    HVM_PARAM_ACPI_IOPORTS_LOCATION,
+    HVM_PARAM_NESTEDHVM,
+    HVM_PARAM_STORE_PFN,
+    HVM_PARAM_CONSOLE_PFN,
+    HVM_PARAM_IO_PFN_FIRST,
+    HVM_PARAM_IO_PFN_LAST,
+};
+
+#define FORK_NR_PARAMS (sizeof(fork_hvm_params) / sizeof(fork_hvm_params[0]))
+#define FORK_BATCH     1024
+
+/* Give the child private copies of parent pages which couldn't be shared,
+ * or (if @clear) zeroed pages, mapping each side once for the whole batch.
+ * Gaps in the parent physmap are skipped. */
+static int fork_copy_pages(xc_interface *xch, domid_t parent, domid_t child,
+                           const xen_pfn_t *gfns, int nr, int clear)
+{
+    xen_pfn_t *valid = NULL;
+    char *src = NULL, *dst;
+    int *err, i, j, n, rc = -1;
+
+    if ( !nr )
+        return 0;
+
+    err = calloc(nr, sizeof(*err));
+    valid = malloc(nr * sizeof(*valid));
+    if ( !err || !valid )
+    {
+        PERROR("Could not allocate fork copy batch");
+        goto out;
+    }
+
+    src = xc_map_foreign_bulk(xch, parent, PROT_READ, gfns, err, nr);
+    if ( !src )
+    {
+        PERROR("Could not map pages of domain %d", parent);
+        goto out;
+    }
+
+    for ( i = n = 0; i < nr; i++ )
+        if ( !err[i] )
+            valid[n++] = gfns[i];
+
+    rc = 0;
+    if ( !n )
+        goto out;
+    rc = -1;
+
+    if ( xc_domain_populate_physmap_exact(xch, child, n, 0, 0, valid) )
+    {
+        PERROR("Could not populate %d pages in fork %d", n, child);
+        goto out;
+    }
+
+    dst = xc_map_foreign_pages(xch, child, PROT_WRITE, valid, n);
+    if ( !dst )
+    {
+        PERROR("Could not map %d pages in fork %d", n, child);
+        goto out;
+    }
+
+    for ( i = j = 0; i < nr; i++ )
+    {
+        if ( err[i] )
+            continue;
+        if ( clear )
+            memset(dst + j * XC_PAGE_SIZE, 0, XC_PAGE_SIZE);
+        else
+            memcpy(dst + j * XC_PAGE_SIZE, src + i * XC_PAGE_SIZE,
+                   XC_PAGE_SIZE);
+        j++;
+    }
+    munmap(dst, n * XC_PAGE_SIZE);
+    rc = 0;
+
+ out:
+    if ( src )
+        munmap(src, nr * XC_PAGE_SIZE);
+    free(valid);
+    free(err);
+    return rc;
+}
+
+/* Replace a page the child got from the parent with a zeroed one. */
+static int fork_reset_page(xc_interface *xch, domid_t parent, domid_t child,
+                           xen_pfn_t gfn)
+{
+    if ( xc_domain_decrease_reservation_exact(xch, child, 1, 0, &gfn) )
+    {
+        PERROR("Could not release gfn %#"PRI_xen_pfn" of fork %d", gfn, child);
+        return -1;
+    }
+
+    return fork_copy_pages(xch, parent, child, &gfn, 1, 1);
+}
+
+int xc_memshr_fork(xc_interface *xch, domid_t parent, domid_t child)
+{
+    xen_mem_sharing_bulk_entry_t *entries;
+    xen_pfn_t *copy;
+    unsigned long params[FORK_NR_PARAMS];
+    unsigned long gfn, max_gfn, io_first = 0, io_last = 0;
+    unsigned long store_pfn = 0, console_pfn = 0;
+    uint32_t tsc_mode, khz, incarn;
+    uint64_t nsec;
+    uint8_t *hvm_buf = NULL;
+    int i, n, nr_copy, hvm_size, rc = -1;
+
+    entries = calloc(FORK_BATCH, sizeof(*entries));
+    copy = calloc(FORK_BATCH, sizeof(*copy));
+    if ( !entries || !copy )
+    {
+        PERROR("Could not allocate fork batch");
+        goto out;
+    }
+
+    for ( i = 0; i < FORK_NR_PARAMS; i++ )
+    {
+        if ( xc_get_hvm_param(xch, parent, fork_hvm_params[i], &params[i]) )
+        {
+            PERROR("Could not read HVM param %d of domain %d",
+                   fork_hvm_params[i], parent);
+            goto out;
+        }
+        switch ( fork_hvm_params[i] )
+        {
+        case HVM_PARAM_STORE_PFN:     store_pfn = params[i];   break;
+        case HVM_PARAM_CONSOLE_PFN:   console_pfn = params[i]; break;
+        case HVM_PARAM_IO_PFN_FIRST:  io_first = params[i];    break;
+        case HVM_PARAM_IO_PFN_LAST:   io_last = params[i];     break;
+        }
+    }
+
+    max_gfn = xc_domain_maximum_gpfn(xch, parent);
+
+    /* Share all of the parent's memory into the child's empty physmap. */
+    for ( gfn = 0; gfn <= max_gfn; gfn += n )
+    {
+        n = (max_gfn - gfn + 1 < FORK_BATCH) ? max_gfn - gfn + 1 : FORK_BATCH;
+
+        for ( i = 0; i < n; i++ )
+        {
+            entries[i].source_gfn = gfn + i;
+            entries[i].client_gfn = gfn + i;
+            entries[i].client_domain = child;
+            entries[i].status = 0;
+        }
+
+        if ( xc_memshr_bulk_op(xch, XENMEM_sharing_op_bulk_add_physmap,
+                               parent, entries, n, NULL) )
+        {
+            PERROR("Could not share memory of domain %d into fork %d",
+                   parent, child);
+            goto out;
+        }
+
+        /* Anything which couldn't be shared (e.g. pages mapped by the
+         * parent's device model) gets copied instead. */
+        for ( i = nr_copy = 0; i < n; i++ )
+            if ( entries[i].status )
+                copy[nr_copy++] = gfn + i;
+
+        if ( fork_copy_pages(xch, parent, child, copy, nr_copy, 0) )
+            goto out;
+    }
+
+    /* The communication pages belong to connections the child doesn't
+     * have: give it fresh ones, as a restore would. */
+    if ( (store_pfn && fork_reset_page(xch, parent, child, store_pfn)) ||
+         (console_pfn && fork_reset_page(xch, parent, child, console_pfn)) )
+        goto out;
+    if ( io_first )
+        for ( gfn = io_first; gfn <= io_last; gfn++ )
+            if ( fork_reset_page(xch, parent, child, gfn) )
+                goto out;
+
+    for ( i = 0; i < FORK_NR_PARAMS; i++ )
+        if ( params[i] &&
+             xc_set_hvm_param(xch, child, fork_hvm_params[i], params[i]) )
+        {
+            PERROR("Could not set HVM param %d of fork %d",
+                   fork_hvm_params[i], child);
+            goto out;
+        }
+
+    if ( xc_domain_get_tsc_info(xch, parent, &tsc_mode, &nsec, &khz, &incarn) ||
+         xc_domain_set_tsc_info(xch, child, tsc_mode, nsec, khz, incarn) )
+    {
+        PERROR("Could not copy TSC info of domain %d", parent);
+        goto out;
+    }
+
+    /* Finally the vCPU and emulated platform state. */
+    hvm_size = xc_domain_hvm_getcontext(xch, parent, NULL, 0);
+    if ( hvm_size <= 0 || !(hvm_buf = malloc(hvm_size)) )
+    {
+        PERROR("Could not size HVM context of domain %d", parent);
+        goto out;
+    }
+
+    hvm_size = xc_domain_hvm_getcontext(xch, parent, hvm_buf, hvm_size);
+    if ( hvm_size <= 0 ||
+         xc_domain_hvm_setcontext(xch, child, hvm_buf, hvm_size) )
+    {
+        PERROR("Could not copy HVM context of domain %d", parent);
+        goto out;
+    }
+
+    rc = 0;
+
+ out:
+    free(hvm_buf);
+    free(copy);
+    free(entries);
+    return rc;
+}
+
 int xc_memshr_domain_resume(xc_interface *xch,
                             domid_t domid)
 {
@@ -333,9 +333,17 @@ xc_cpumap_t xc_cpumap_alloc(xc_interface *xch);
  /*
  * NODEMAP handling
  */
+typedef uint8_t *xc_nodemap_t;
+
 /* return maximum number of NUMA nodes the hypervisor supports */
 int xc_get_max_nodes(xc_interface *xch);
 
+/* return array size for nodemap */
+int xc_get_nodemap_size(xc_interface *xch);
+
+/* allocate a nodemap */
+xc_nodemap_t xc_nodemap_alloc(xc_interface *xch);
+
 /*
  * DOMAIN DEBUGGING FUNCTIONS
  */
@@ -513,6 +521,33 @@ int xc_watchdog(xc_interface *xch,
 		uint32_t id,
 		uint32_t timeout);
 
+/**
+ * This function sets the NUMA node-affinity of a domain: the nodes its
+ * memory is allocated from and, as a preference, the nodes whose pcpus its
+ * vcpus run on. Passing a map with all the nodes set reverts to the
+ * default, computed from the vcpus' cpu-affinity.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain id one is interested in
+ * @parm nodemap the map of the affine nodes
+ * @return 0 on success, -1 on failure
+ */
+int xc_domain_node_setaffinity(xc_interface *xch,
+                               uint32_t domid,
+                               xc_nodemap_t nodemap);
+
+/**
+ * This function retrieves the NUMA node-affinity of a domain.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain id one is interested in
+ * @parm nodemap the map of the affine nodes
+ * @return 0 on success, -1 on failure
+ */
+int xc_domain_node_getaffinity(xc_interface *xch,
+                               uint32_t domid,
+                               xc_nodemap_t nodemap);
+
 int xc_vcpu_setaffinity(xc_interface *xch,
                         uint32_t domid,
                         int vcpu,
@@ -654,6 +689,26 @@ int xc_vcpu_getinfo(xc_interface *xch,
                     uint32_t vcpu,
                     xc_vcpuinfo_t *info);
 
+/**
+ * This function returns the scheduling latency histograms of a vcpu: how
+ * long it waited for a pcpu each time it became runnable, and how long it
+ * then ran for.  See XEN_DOMCTL_getvcpuschedhist for the buckets.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain to get information from
+ * @parm vcpu the vcpu number
+ * @parm wait XEN_DOMCTL_SCHED_HIST_BUCKETS counts of waits, or NULL
+ * @parm run XEN_DOMCTL_SCHED_HIST_BUCKETS counts of running periods, or NULL
+ * @parm reset clear the histograms once read
+ * @return 0 on success, -1 on failure
+ */
+int xc_vcpu_sched_hist(xc_interface *xch,
+                       uint32_t domid,
+                       uint32_t vcpu,
+                       uint32_t *wait,
+                       uint32_t *run,
+                       int reset);
+
 long long xc_domain_get_cpu_usage(xc_interface *xch,
                                   domid_t domid,
                                   int vcpu);
@@ -703,6 +758,20 @@ int xc_sched_credit2_domain_set(xc_interface *xch,
 int xc_sched_credit2_domain_get(xc_interface *xch,
                                uint32_t domid,
                                struct xen_domctl_sched_credit2 *sdom);
+int xc_sched_credit2_params_set(xc_interface *xch,
+                               uint32_t cpupool_id,
+                               struct xen_sysctl_credit2_schedule *schedule);
+int xc_sched_credit2_params_get(xc_interface *xch,
+                               uint32_t cpupool_id,
+                               struct xen_sysctl_credit2_schedule *schedule);
+
+/* Period and budget in microseconds; deadline_misses is only read. */
+int xc_sched_rtds_domain_set(xc_interface *xch,
+                             uint32_t domid,
+                             struct xen_domctl_sched_rtds *sdom);
+int xc_sched_rtds_domain_get(xc_interface *xch,
+                             uint32_t domid,
+                             struct xen_domctl_sched_rtds *sdom);
 
 int
 xc_sched_arinc653_schedule_set(
@@ -2087,6 +2156,38 @@ int xc_memshr_share_grefs(xc_interface *xch,
                     grant_ref_t client_gref,
                     uint64_t client_handle);
 
+/* Share many pages in one call, e.g. when cloning domains from a template.
+ *
+ * Each entry names a source gfn (in source_domain) and a client <domain, gfn>
+ * pair.  Either page is nominated first if it isn't shared yet, then the two
+ * are shared as for xc_memshr_share_gfns().  Grant references are not
+ * accepted.  A failing entry doesn't stop the batch: its status field is set
+ * to the error (-errno, or one of the XENMEM_SHARING_OP_* codes above) and
+ * the rest are still processed.  On return, nr_shared (if not NULL) holds the
+ * number of entries shared successfully.
+ */
+int xc_memshr_bulk_share(xc_interface *xch,
+                         domid_t source_domain,
+                         xen_mem_sharing_bulk_entry_t *entries,
+                         uint32_t nr_entries,
+                         uint32_t *nr_shared);
+
+/* Make a domain a copy-on-write fork of a paused HVM parent.
+ *
+ * The child must be a freshly created HVM domain with no memory, its vcpus
+ * allocated (xc_domain_max_vcpus) and sharing enabled, as must the parent.
+ * All of the parent's memory is added to the child's physmap shared; pages
+ * which cannot be shared are copied.  The HVM params describing the guest,
+ * the TSC settings and the HVM context (vCPU and Xen-emulated platform
+ * state) are copied.  The xenstore, console and ioreq pages are given to
+ * the child zeroed, as on restore: event channels, xenstore and console
+ * connections and device model state are not cloned.
+ *
+ * The parent must be paused while it is forked.  Afterwards writes by
+ * either domain simply unshare the pages written to.
+ */
+int xc_memshr_fork(xc_interface *xch, domid_t parent, domid_t child);
+
 /* Allows to add to the guest physmap of the client domain a shared frame
  * directly.
  *
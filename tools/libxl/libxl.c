@@ -798,6 +798,131 @@ int libxl_domain_pause(libxl_ctx *ctx, uint32_t domid)
     return 0;
 }
 
+/* Callbacks for libxl_domain_fork, only used to clean up a failed fork */
+
+typedef struct {
+    libxl__domain_destroy_state dds;
+    int rc;
+} domain_fork_state;
+
+static void domain_fork_destroy_cb(libxl__egc *egc,
+                                   libxl__domain_destroy_state *dds, int rc)
+{
+    domain_fork_state *dfs = CONTAINER_OF(dds, *dfs, dds);
+    STATE_AO_GC(dds->ao);
+
+    if (rc)
+        LOG(ERROR, "destruction of failed fork %u failed", dds->domid);
+
+    libxl__ao_complete(egc, ao, dfs->rc);
+}
+
+int libxl_domain_fork(libxl_ctx *ctx, uint32_t domid, const char *name,
+                      uint32_t *child_r, const libxl_asyncop_how *ao_how)
+{
+    AO_CREATE(ctx, domid, ao_how);
+    libxl_dominfo info;
+    libxl_domain_create_info c_info;
+    domain_fork_state *dfs;
+    unsigned long shadow_mb;
+    uint32_t child = 0;
+    int rc;
+
+    libxl_dominfo_init(&info);
+    libxl_domain_create_info_init(&c_info);
+
+    rc = libxl_domain_info(ctx, &info, domid);
+    if (rc) {
+        LOG(ERROR, "unable to get info for domain %u", domid);
+        goto out;
+    }
+
+    if (libxl__domain_type(gc, domid) != LIBXL_DOMAIN_TYPE_HVM) {
+        LOG(ERROR, "domain %u is not HVM, only HVM domains can be forked",
+            domid);
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    if (!info.paused) {
+        LOG(ERROR, "domain %u must be paused to be forked", domid);
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    c_info.type = LIBXL_DOMAIN_TYPE_HVM;
+    libxl_defbool_set(&c_info.hap, true);
+    c_info.ssidref = info.ssidref;
+    c_info.poolid = info.cpupool;
+    c_info.name = libxl__strdup(NOGC, name ? name :
+                      libxl__sprintf(gc, "%s-fork",
+                                     libxl__domid_to_name(gc, domid)));
+    libxl_uuid_generate(&c_info.uuid);
+
+    rc = libxl__domain_create_info_setdefault(gc, &c_info);
+    if (rc)
+        goto out;
+
+    rc = libxl__domain_make(gc, &c_info, &child);
+    if (rc) {
+        child = 0;
+        goto out;
+    }
+
+    if (xc_domain_max_vcpus(CTX->xch, child, info.vcpu_max_id + 1) ||
+        xc_domain_setmaxmem(CTX->xch, child, info.max_memkb)) {
+        LOGE(ERROR, "unable to size fork %u of domain %u", child, domid);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    /* The child's p2m will map as much as the parent's: give it the same
+     * paging pool, as libxl__build_pre does from shadow_memkb. */
+    if (xc_shadow_control(CTX->xch, domid,
+                          XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION,
+                          NULL, 0, &shadow_mb, 0, NULL) ||
+        xc_shadow_control(CTX->xch, child,
+                          XEN_DOMCTL_SHADOW_OP_SET_ALLOCATION,
+                          NULL, 0, &shadow_mb, 0, NULL)) {
+        LOGE(ERROR, "unable to size paging pool of fork %u of domain %u",
+             child, domid);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    if (xc_memshr_control(CTX->xch, domid, 1) ||
+        xc_memshr_control(CTX->xch, child, 1)) {
+        LOGE(ERROR, "unable to enable memory sharing for domain %u", domid);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    if (xc_memshr_fork(CTX->xch, domid, child)) {
+        LOGE(ERROR, "unable to fork domain %u", domid);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    *child_r = child;
+
+out:
+    libxl_domain_create_info_dispose(&c_info);
+    libxl_dominfo_dispose(&info);
+
+    if (rc && libxl_domid_valid_guest(child)) {
+        GCNEW(dfs);
+        dfs->rc = rc;
+        dfs->dds.ao = ao;
+        dfs->dds.domid = child;
+        dfs->dds.callback = domain_fork_destroy_cb;
+        libxl__domain_destroy(egc, &dfs->dds);
+        return AO_INPROGRESS;
+    }
+
+    libxl__ao_complete(egc, ao, rc);
+    return AO_INPROGRESS;
+}
+
 int libxl_domain_core_dump(libxl_ctx *ctx, uint32_t domid,
                            const char *filename,
                            const libxl_asyncop_how *ao_how)
@@ -4216,6 +4341,7 @@ static int sched_credit_domain_get(libxl__gc *gc, uint32_t domid,
     scinfo->sched = LIBXL_SCHEDULER_CREDIT;
     scinfo->weight = sdom.weight;
     scinfo->cap = sdom.cap;
+    scinfo->gang = sdom.gang;
 
     return 0;
 }
@@ -4261,6 +4387,9 @@ static int sched_credit_domain_set(libxl__gc *gc, uint32_t domid,
         sdom.cap = scinfo->cap;
     }
 
+    if (scinfo->gang != LIBXL_DOMAIN_SCHED_PARAM_GANG_DEFAULT)
+        sdom.gang = !!scinfo->gang;
+
     rc = xc_sched_credit_domain_set(CTX->xch, domid, &sdom);
     if ( rc < 0 ) {
         LOGE(ERROR, "setting domain sched credit");
@@ -4331,6 +4460,54 @@ int libxl_sched_credit_params_set(libxl_ctx *ctx, uint32_t poolid,
     return 0;
 }
 
+int libxl_sched_credit2_params_get(libxl_ctx *ctx, uint32_t poolid,
+                                   libxl_sched_credit2_params *scinfo)
+{
+    struct xen_sysctl_credit2_schedule sparam;
+    int rc;
+
+    rc = xc_sched_credit2_params_get(ctx->xch, poolid, &sparam);
+    if (rc != 0) {
+        LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "getting sched credit2 param");
+        return ERROR_FAIL;
+    }
+
+    scinfo->runqueue = sparam.runqueue;
+
+    return 0;
+}
+
+int libxl_sched_credit2_params_set(libxl_ctx *ctx, uint32_t poolid,
+                                   libxl_sched_credit2_params *scinfo)
+{
+    struct xen_sysctl_credit2_schedule sparam;
+    int rc;
+
+    switch (scinfo->runqueue) {
+    case LIBXL_SCHED_CREDIT2_RUNQUEUE_CORE:
+    case LIBXL_SCHED_CREDIT2_RUNQUEUE_SOCKET:
+    case LIBXL_SCHED_CREDIT2_RUNQUEUE_NODE:
+    case LIBXL_SCHED_CREDIT2_RUNQUEUE_ALL:
+        break;
+    default:
+        LIBXL__LOG(ctx, LIBXL__LOG_ERROR, "Invalid runqueue arrangement %d",
+                   scinfo->runqueue);
+        return ERROR_INVAL;
+    }
+
+    sparam.runqueue = scinfo->runqueue;
+
+    rc = xc_sched_credit2_params_set(ctx->xch, poolid, &sparam);
+    if ( rc < 0 ) {
+        LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "setting sched credit2 param");
+        return ERROR_FAIL;
+    }
+
+    scinfo->runqueue = sparam.runqueue;
+
+    return 0;
+}
+
 static int sched_credit2_domain_get(libxl__gc *gc, uint32_t domid,
                                     libxl_domain_sched_params *scinfo)
 {
@@ -4447,6 +4624,58 @@ static int sched_sedf_domain_set(libxl__gc *gc, uint32_t domid,
     return 0;
 }
 
+/* The rtds period and budget are in microseconds. */
+static int sched_rtds_domain_get(libxl__gc *gc, uint32_t domid,
+                                 libxl_domain_sched_params *scinfo)
+{
+    struct xen_domctl_sched_rtds sdom;
+    int rc;
+
+    rc = xc_sched_rtds_domain_get(CTX->xch, domid, &sdom);
+    if (rc != 0) {
+        LOGE(ERROR, "getting domain sched rtds");
+        return ERROR_FAIL;
+    }
+
+    libxl_domain_sched_params_init(scinfo);
+    scinfo->sched = LIBXL_SCHEDULER_RTDS;
+    scinfo->period = sdom.period;
+    scinfo->budget = sdom.budget;
+
+    return 0;
+}
+
+static int sched_rtds_domain_set(libxl__gc *gc, uint32_t domid,
+                                 const libxl_domain_sched_params *scinfo)
+{
+    struct xen_domctl_sched_rtds sdom;
+    int rc;
+
+    rc = xc_sched_rtds_domain_get(CTX->xch, domid, &sdom);
+    if (rc != 0) {
+        LOGE(ERROR, "getting domain sched rtds");
+        return ERROR_FAIL;
+    }
+
+    if (scinfo->period != LIBXL_DOMAIN_SCHED_PARAM_PERIOD_DEFAULT)
+        sdom.period = scinfo->period;
+    if (scinfo->budget != LIBXL_DOMAIN_SCHED_PARAM_BUDGET_DEFAULT)
+        sdom.budget = scinfo->budget;
+    if (sdom.budget > sdom.period) {
+        LOG(ERROR, "Budget (%uus) cannot be greater than period (%uus)",
+            sdom.budget, sdom.period);
+        return ERROR_INVAL;
+    }
+
+    rc = xc_sched_rtds_domain_set(CTX->xch, domid, &sdom);
+    if ( rc < 0 ) {
+        LOGE(ERROR, "setting domain sched rtds");
+        return ERROR_FAIL;
+    }
+
+    return 0;
+}
+
 int libxl_domain_sched_params_set(libxl_ctx *ctx, uint32_t domid,
                                   const libxl_domain_sched_params *scinfo)
 {
@@ -4470,6 +4699,9 @@ int libxl_domain_sched_params_set(libxl_ctx *ctx, uint32_t domid,
     case LIBXL_SCHEDULER_ARINC653:
         ret=sched_arinc653_domain_set(gc, domid, scinfo);
         break;
+    case LIBXL_SCHEDULER_RTDS:
+        ret=sched_rtds_domain_set(gc, domid, scinfo);
+        break;
     default:
         LOG(ERROR, "Unknown scheduler");
         ret=ERROR_INVAL;
@@ -4500,6 +4732,9 @@ int libxl_domain_sched_params_get(libxl_ctx *ctx, uint32_t domid,
     case LIBXL_SCHEDULER_CREDIT2:
         ret=sched_credit2_domain_get(gc, domid, scinfo);
         break;
+    case LIBXL_SCHEDULER_RTDS:
+        ret=sched_rtds_domain_get(gc, domid, scinfo);
+        break;
     default:
         LOG(ERROR, "Unknown scheduler");
         ret=ERROR_INVAL;
@@ -4724,6 +4959,10 @@ static int32_t tmem_setop_from_string(char *set_name)
         return TMEMC_SET_CAP;
     else if (!strcmp(set_name, "compress"))
         return TMEMC_SET_COMPRESS;
+    else if (!strcmp(set_name, "codec"))
+        return TMEMC_SET_COMPRESS_CODEC;
+    else if (!strcmp(set_name, "compress_ratio"))
+        return TMEMC_SET_COMPRESS_RATIO;
     else
         return -1;
 }
@@ -4735,7 +4974,8 @@ int libxl_tmem_set(libxl_ctx *ctx, uint32_t domid, char* name, uint32_t set)
 
     if (subop == -1) {
         LIBXL__LOG_ERRNOVAL(ctx, LIBXL__LOG_ERROR, -1,
-            "Invalid set, valid sets are <weight|cap|compress>");
+            "Invalid set, valid sets are "
+            "<weight|cap|compress|codec|compress_ratio>");
         return ERROR_INVAL;
     }
     rc = xc_tmem_control(ctx->xch, -1, subop, domid, set, 0, 0, NULL);
@@ -67,6 +67,41 @@
  * the same $(XEN_VERSION) (e.g. throughout a major release).
  */
 
+/*
+ * LIBXL_HAVE_DOMAIN_FORK
+ *
+ * If this is defined, libxl_domain_fork is available to make a
+ * copy-on-write clone of a paused HVM domain.
+ */
+#define LIBXL_HAVE_DOMAIN_FORK 1
+
+/*
+ * LIBXL_HAVE_SCHED_CREDIT_GANG
+ *
+ * If this is defined, libxl_domain_sched_params has a gang field, which
+ * enables gang scheduling of the domain's vcpus under the credit
+ * scheduler.
+ */
+#define LIBXL_HAVE_SCHED_CREDIT_GANG 1
+
+/*
+ * LIBXL_HAVE_SCHED_CREDIT2_PARAMS
+ *
+ * If this is defined, libxl_sched_credit2_params and
+ * libxl_sched_credit2_params_{get,set} are available to query and set
+ * the runqueue arrangement of a credit2 cpupool.
+ */
+#define LIBXL_HAVE_SCHED_CREDIT2_PARAMS 1
+
+/*
+ * LIBXL_HAVE_SCHED_RTDS
+ *
+ * If this is defined, LIBXL_SCHEDULER_RTDS is available, together with
+ * the budget field of libxl_domain_sched_params.  For rtds, period and
+ * budget are in microseconds.
+ */
+#define LIBXL_HAVE_SCHED_RTDS 1
+
 /*
  * libxl ABI compatibility
  *
@@ -547,6 +582,15 @@ int libxl_domain_rename(libxl_ctx *ctx, uint32_t domid,
 int libxl_domain_pause(libxl_ctx *ctx, uint32_t domid);
 int libxl_domain_unpause(libxl_ctx *ctx, uint32_t domid);
 
+/* Create a copy-on-write clone of a paused HVM domain: the new domain
+ * shares all of the parent's memory and starts paused with the parent's
+ * vCPU state.  Devices, xenstore and console connections and device model
+ * state are not cloned.  If name is NULL the fork is called
+ * "<parent>-fork". */
+int libxl_domain_fork(libxl_ctx *ctx, uint32_t domid, const char *name,
+                      uint32_t *child_r, const libxl_asyncop_how *ao_how)
+                      LIBXL_EXTERNAL_CALLERS_ONLY;
+
 int libxl_domain_core_dump(libxl_ctx *ctx, uint32_t domid,
                            const char *filename,
                            const libxl_asyncop_how *ao_how)
@@ -876,6 +920,12 @@ int libxl_sched_credit_params_get(libxl_ctx *ctx, uint32_t poolid,
                                   libxl_sched_credit_params *scinfo);
 int libxl_sched_credit_params_set(libxl_ctx *ctx, uint32_t poolid,
                                   libxl_sched_credit_params *scinfo);
+/* The runqueue arrangement can only be changed while the cpupool has
+ * no cpus. */
+int libxl_sched_credit2_params_get(libxl_ctx *ctx, uint32_t poolid,
+                                   libxl_sched_credit2_params *scinfo);
+int libxl_sched_credit2_params_set(libxl_ctx *ctx, uint32_t poolid,
+                                   libxl_sched_credit2_params *scinfo);
 
 /* Scheduler Per-domain parameters */
 
@@ -885,6 +935,8 @@ int libxl_sched_credit_params_set(libxl_ctx *ctx, uint32_t poolid,
 #define LIBXL_DOMAIN_SCHED_PARAM_SLICE_DEFAULT     -1
 #define LIBXL_DOMAIN_SCHED_PARAM_LATENCY_DEFAULT   -1
 #define LIBXL_DOMAIN_SCHED_PARAM_EXTRATIME_DEFAULT -1
+#define LIBXL_DOMAIN_SCHED_PARAM_GANG_DEFAULT      -1
+#define LIBXL_DOMAIN_SCHED_PARAM_BUDGET_DEFAULT    -1
 
 int libxl_domain_sched_params_get(libxl_ctx *ctx, uint32_t domid,
                                   libxl_domain_sched_params *params);
@@ -135,7 +135,7 @@ static int numa_place_domain(libxl__gc *gc, uint32_t domid,
     libxl__numa_candidate candidate;
     libxl_bitmap candidate_nodemap;
     libxl_cpupoolinfo cpupool_info;
-    int i, cpupool, rc = 0;
+    int cpupool, rc = 0;
     uint32_t memkb;
 
     libxl__numa_candidate_init(&candidate);
@@ -170,21 +170,19 @@ static int numa_place_domain(libxl__gc *gc, uint32_t domid,
         goto out;
 
     /* Not even a suitable placement candidate! Let's just don't touch the
-     * domain's info->cpumap. It will have affinity with all nodes/cpus. */
+     * domain's node-affinity. It will have affinity with all nodes/cpus. */
     if (found == 0)
         goto out;
 
-    /* Map the candidate's node map to the domain's info->cpumap */
+    /* Make the candidate's nodes the domain's node-affinity. Memory comes
+     * from there and the scheduler prefers running the vcpus there, but
+     * they stay free to run anywhere in the cpupool when those nodes are
+     * busy. */
     libxl__numa_candidate_get_nodemap(gc, &candidate, &candidate_nodemap);
-    rc = libxl_nodemap_to_cpumap(CTX, &candidate_nodemap, &info->cpumap);
-    if (rc)
+    if (xc_domain_node_setaffinity(CTX->xch, domid, candidate_nodemap.map)) {
+        LOGE(ERROR, "setting node affinity of dom%"PRIu32, domid);
+        rc = ERROR_FAIL;
         goto out;
-
-    /* Avoid trying to set the affinity to cpus that might be in the
-     * nodemap but not in our cpupool. */
-    libxl_for_each_set_bit(i, info->cpumap) {
-        if (!libxl_bitmap_test(&cpupool_info.cpumap, i))
-            libxl_bitmap_reset(&info->cpumap, i);
     }
 
     LOG(DETAIL, "NUMA placement candidate with %d nodes, %d cpus and "
@@ -209,13 +207,13 @@ int libxl__build_pre(libxl__gc *gc, uint32_t domid,
     xc_domain_max_vcpus(ctx->xch, domid, info->max_vcpus);
 
     /*
-     * Check if the domain has any CPU affinity. If not, try to build
-     * up one. In case numa_place_domain() find at least a suitable
-     * candidate, it will affect info->cpumap accordingly; if it
-     * does not, it just leaves it as it is. This means (unless
-     * some weird error manifests) the subsequent call to
-     * libxl_set_vcpuaffinity_all() will do the actual placement,
-     * whatever that turns out to be.
+     * Check if the domain has any CPU affinity. If not, try to place it
+     * on a set of NUMA nodes. In case numa_place_domain() finds at least
+     * a suitable candidate, it sets the domain's node-affinity
+     * accordingly; if it does not, the domain is left affine to all the
+     * nodes. Either way info->cpumap is untouched, and the subsequent
+     * call to libxl_set_vcpuaffinity_all() only applies what the user
+     * asked for.
      */
     if (libxl_defbool_val(info->numa_placement)) {
         int rc;
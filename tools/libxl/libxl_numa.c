@@ -166,12 +166,14 @@ static uint32_t nodemap_to_free_memkb(libxl_numainfo *ninfo,
 }
 
 /* Retrieve the number of vcpus able to run on the cpus of the nodes
- * that are part of the nodemap. */
+ * that are part of the nodemap. A vcpu whose domain has a node-affinity
+ * is only counted on the nodes of that affinity, as that is where the
+ * scheduler prefers to run it. */
 static int nodemap_to_nr_vcpus(libxl__gc *gc, libxl_cputopology *tinfo,
                                const libxl_bitmap *nodemap)
 {
     libxl_dominfo *dinfo = NULL;
-    libxl_bitmap vcpu_nodemap;
+    libxl_bitmap vcpu_nodemap, dom_nodemap;
     int nr_doms, nr_cpus;
     int nr_vcpus = 0;
     int i, j, k;
@@ -180,7 +182,11 @@ static int nodemap_to_nr_vcpus(libxl__gc *gc, libxl_cputopology *tinfo,
     if (dinfo == NULL)
         return ERROR_FAIL;
 
-    if (libxl_node_bitmap_alloc(CTX, &vcpu_nodemap, 0) < 0) {
+    libxl_bitmap_init(&vcpu_nodemap);
+    libxl_bitmap_init(&dom_nodemap);
+    if (libxl_node_bitmap_alloc(CTX, &vcpu_nodemap, 0) < 0 ||
+        libxl_node_bitmap_alloc(CTX, &dom_nodemap, 0) < 0) {
+        libxl_bitmap_dispose(&vcpu_nodemap);
         libxl_dominfo_list_free(dinfo, nr_doms);
         return ERROR_FAIL;
     }
@@ -193,13 +199,22 @@ static int nodemap_to_nr_vcpus(libxl__gc *gc, libxl_cputopology *tinfo,
         if (vinfo == NULL)
             continue;
 
+        if (xc_domain_node_getaffinity(CTX->xch, dinfo[i].domid,
+                                       dom_nodemap.map))
+            libxl_bitmap_set_any(&dom_nodemap);
+
         /* For each vcpu of each domain ... */
         for (j = 0; j < nr_dom_vcpus; j++) {
 
-            /* Build up a map telling on which nodes the vcpu is runnable on */
+            /* Build up a map telling on which nodes the vcpu is runnable on,
+             * restricted to its domain's node-affinity if they overlap */
             libxl_bitmap_set_none(&vcpu_nodemap);
             libxl_for_each_set_bit(k, vinfo[j].cpumap)
-                libxl_bitmap_set(&vcpu_nodemap, tinfo[k].node);
+                if (libxl_bitmap_test(&dom_nodemap, tinfo[k].node))
+                    libxl_bitmap_set(&vcpu_nodemap, tinfo[k].node);
+            if (libxl_bitmap_is_empty(&vcpu_nodemap))
+                libxl_for_each_set_bit(k, vinfo[j].cpumap)
+                    libxl_bitmap_set(&vcpu_nodemap, tinfo[k].node);
 
             /* And check if that map has any intersection with our nodemap */
             libxl_for_each_set_bit(k, vcpu_nodemap) {
@@ -213,6 +228,7 @@ static int nodemap_to_nr_vcpus(libxl__gc *gc, libxl_cputopology *tinfo,
         libxl_vcpuinfo_list_free(vinfo, nr_dom_vcpus);
     }
 
+    libxl_bitmap_dispose(&dom_nodemap);
     libxl_bitmap_dispose(&vcpu_nodemap);
     libxl_dominfo_list_free(dinfo, nr_doms);
     return nr_vcpus;
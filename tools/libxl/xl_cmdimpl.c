@@ -670,6 +670,8 @@ static void parse_config_data(const char *config_source,
         b_info->sched_params.weight = l;
     if (!xlu_cfg_get_long (config, "cap", &l, 0))
         b_info->sched_params.cap = l;
+    if (!xlu_cfg_get_long (config, "gang", &l, 0))
+        b_info->sched_params.gang = l;
     if (!xlu_cfg_get_long (config, "period", &l, 0))
         b_info->sched_params.period = l;
     if (!xlu_cfg_get_long (config, "slice", &l, 0))
@@ -678,6 +680,8 @@ static void parse_config_data(const char *config_source,
         b_info->sched_params.latency = l;
     if (!xlu_cfg_get_long (config, "extratime", &l, 0))
         b_info->sched_params.extratime = l;
+    if (!xlu_cfg_get_long (config, "budget", &l, 0))
+        b_info->sched_params.budget = l;
 
     if (!xlu_cfg_get_long (config, "vcpus", &l, 0)) {
         b_info->max_vcpus = l;
@@ -3819,6 +3823,32 @@ int main_unpause(int argc, char **argv)
     return 0;
 }
 
+int main_fork_vm(int argc, char **argv)
+{
+    int opt;
+    const char *name = NULL;
+    uint32_t domid, child;
+
+    while ((opt = def_getopt(argc, argv, "n:", "fork-vm", 1)) != -1) {
+        switch (opt) {
+        case 0: case 2:
+            return opt;
+        case 'n':
+            name = optarg;
+            break;
+        }
+    }
+
+    domid = find_domain(argv[optind]);
+    if (libxl_domain_fork(ctx, domid, name, &child, 0)) {
+        fprintf(stderr, "Failed to fork domain %d.\n", domid);
+        return 1;
+    }
+
+    printf("%u\n", child);
+    return 0;
+}
+
 int main_destroy(int argc, char **argv)
 {
     int opt;
@@ -4812,18 +4842,20 @@ static int sched_credit_domain_output(int domid)
     int rc;
 
     if (domid < 0) {
-        printf("%-33s %4s %6s %4s\n", "Name", "ID", "Weight", "Cap");
+        printf("%-33s %4s %6s %4s %4s\n", "Name", "ID", "Weight", "Cap",
+               "Gang");
         return 0;
     }
     rc = sched_domain_get(LIBXL_SCHEDULER_CREDIT, domid, &scinfo);
     if (rc)
         return rc;
     domname = libxl_domid_to_name(ctx, domid);
-    printf("%-33s %4d %6d %4d\n",
+    printf("%-33s %4d %6d %4d %4d\n",
         domname,
         domid,
         scinfo.weight,
-        scinfo.cap);
+        scinfo.cap,
+        scinfo.gang);
     free(domname);
     libxl_domain_sched_params_dispose(&scinfo);
     return 0;
@@ -4850,6 +4882,50 @@ static int sched_credit_pool_output(uint32_t poolid)
     return 0;
 }
 
+static int sched_credit2_params_set(int poolid,
+                                   libxl_sched_credit2_params *scinfo)
+{
+    int rc;
+
+    rc = libxl_sched_credit2_params_set(ctx, poolid, scinfo);
+    if (rc)
+        fprintf(stderr, "libxl_sched_credit2_params_set failed.\n");
+
+    return rc;
+}
+
+static int sched_credit2_params_get(int poolid,
+                                   libxl_sched_credit2_params *scinfo)
+{
+    int rc;
+
+    rc = libxl_sched_credit2_params_get(ctx, poolid, scinfo);
+    if (rc)
+        fprintf(stderr, "libxl_sched_credit2_params_get failed.\n");
+
+    return rc;
+}
+
+static int sched_credit2_pool_output(uint32_t poolid)
+{
+    libxl_sched_credit2_params scparam;
+    char *poolname;
+    int rc;
+
+    poolname = libxl_cpupoolid_to_name(ctx, poolid);
+    rc = sched_credit2_params_get(poolid, &scparam);
+    if (rc) {
+        printf("Cpupool %s: [sched params unavailable]\n",
+               poolname);
+    } else {
+        printf("Cpupool %s: runqueue=%s\n",
+               poolname,
+               libxl_sched_credit2_runqueue_to_string(scparam.runqueue));
+    }
+    free(poolname);
+    return 0;
+}
+
 static int sched_credit2_domain_output(
     int domid)
 {
@@ -4903,6 +4979,31 @@ static int sched_sedf_domain_output(
     return 0;
 }
 
+static int sched_rtds_domain_output(
+    int domid)
+{
+    char *domname;
+    libxl_domain_sched_params scinfo;
+    int rc;
+
+    if (domid < 0) {
+        printf("%-33s %4s %9s %9s\n", "Name", "ID", "Period", "Budget");
+        return 0;
+    }
+    rc = sched_domain_get(LIBXL_SCHEDULER_RTDS, domid, &scinfo);
+    if (rc)
+        return rc;
+    domname = libxl_domid_to_name(ctx, domid);
+    printf("%-33s %4d %9d %9d\n",
+        domname,
+        domid,
+        scinfo.period,
+        scinfo.budget);
+    free(domname);
+    libxl_domain_sched_params_dispose(&scinfo);
+    return 0;
+}
+
 static int sched_default_pool_output(uint32_t poolid)
 {
     char *poolname;
@@ -4979,6 +5080,7 @@ int main_sched_credit(int argc, char **argv)
     const char *dom = NULL;
     const char *cpupool = NULL;
     int weight = 256, cap = 0, opt_w = 0, opt_c = 0;
+    int gang = 0, opt_g = 0;
     int opt_s = 0;
     int tslice = 0, opt_t = 0, ratelimit = 0, opt_r = 0;
     int opt, rc;
@@ -4987,6 +5089,7 @@ int main_sched_credit(int argc, char **argv)
         {"domain", 1, 0, 'd'},
         {"weight", 1, 0, 'w'},
         {"cap", 1, 0, 'c'},
+        {"gang", 1, 0, 'g'},
         {"schedparam", 0, 0, 's'},
         {"tslice_ms", 1, 0, 't'},
         {"ratelimit_us", 1, 0, 'r'},
@@ -4996,7 +5099,7 @@ int main_sched_credit(int argc, char **argv)
     };
 
     while (1) {
-        opt = getopt_long(argc, argv, "d:w:c:p:t:r:hs", long_options,
+        opt = getopt_long(argc, argv, "d:w:c:g:p:t:r:hs", long_options,
                           &option_index);
         if (opt == -1)
             break;
@@ -5014,6 +5117,10 @@ int main_sched_credit(int argc, char **argv)
             cap = strtol(optarg, NULL, 10);
             opt_c = 1;
             break;
+        case 'g':
+            gang = strtol(optarg, NULL, 10);
+            opt_g = 1;
+            break;
         case 't':
             tslice = strtol(optarg, NULL, 10);
             opt_t = 1;
@@ -5034,12 +5141,12 @@ int main_sched_credit(int argc, char **argv)
         }
     }
 
-    if ((cpupool || opt_s) && (dom || opt_w || opt_c)) {
+    if ((cpupool || opt_s) && (dom || opt_w || opt_c || opt_g)) {
         fprintf(stderr, "Specifying a cpupool or schedparam is not "
                 "allowed with domain options.\n");
         return 1;
     }
-    if (!dom && (opt_w || opt_c)) {
+    if (!dom && (opt_w || opt_c || opt_g)) {
         fprintf(stderr, "Must specify a domain.\n");
         return 1;
     }
@@ -5086,7 +5193,7 @@ int main_sched_credit(int argc, char **argv)
     } else {
         uint32_t domid = find_domain(dom);
 
-        if (!opt_w && !opt_c) { /* output credit scheduler info */
+        if (!opt_w && !opt_c && !opt_g) { /* output credit scheduler info */
             sched_credit_domain_output(-1);
             return -sched_credit_domain_output(domid);
         } else { /* set credit scheduler paramaters */
@@ -5097,6 +5204,8 @@ int main_sched_credit(int argc, char **argv)
                 scinfo.weight = weight;
             if (opt_c)
                 scinfo.cap = cap;
+            if (opt_g)
+                scinfo.gang = gang;
             rc = sched_domain_set(domid, &scinfo);
             libxl_domain_sched_params_dispose(&scinfo);
             if (rc)
@@ -5112,18 +5221,24 @@ int main_sched_credit2(int argc, char **argv)
     const char *dom = NULL;
     const char *cpupool = NULL;
     int weight = 256, opt_w = 0;
+    int opt_s = 0;
+    libxl_sched_credit2_runqueue runqueue = 0;
+    int opt_r = 0;
     int opt, rc;
     int option_index = 0;
     static struct option long_options[] = {
         {"domain", 1, 0, 'd'},
         {"weight", 1, 0, 'w'},
+        {"schedparam", 0, 0, 's'},
+        {"runqueue", 1, 0, 'r'},
         {"cpupool", 1, 0, 'p'},
         {"help", 0, 0, 'h'},
         {0, 0, 0, 0}
     };
 
     while (1) {
-        opt = getopt_long(argc, argv, "d:w:p:h", long_options, &option_index);
+        opt = getopt_long(argc, argv, "d:w:p:r:hs", long_options,
+                          &option_index);
         if (opt == -1)
             break;
         switch (opt) {
@@ -5136,29 +5251,66 @@ int main_sched_credit2(int argc, char **argv)
             weight = strtol(optarg, NULL, 10);
             opt_w = 1;
             break;
+        case 's':
+            opt_s = 1;
+            break;
+        case 'r':
+            if (libxl_sched_credit2_runqueue_from_string(optarg, &runqueue)) {
+                fprintf(stderr, "Invalid runqueue arrangement '%s'.\n",
+                        optarg);
+                return 1;
+            }
+            opt_r = 1;
+            break;
         case 'p':
             cpupool = optarg;
             break;
         case 'h':
-            help("sched-credit");
+            help("sched-credit2");
             return 0;
         }
     }
 
-    if (cpupool && (dom || opt_w)) {
-        fprintf(stderr, "Specifying a cpupool is not allowed with other "
-                "options.\n");
+    if ((cpupool || opt_s) && (dom || opt_w)) {
+        fprintf(stderr, "Specifying a cpupool or schedparam is not "
+                "allowed with domain options.\n");
         return 1;
     }
     if (!dom && opt_w) {
         fprintf(stderr, "Must specify a domain.\n");
         return 1;
     }
+    if (!opt_s && opt_r) {
+        fprintf(stderr, "Must specify schedparam to set schedule "
+                "parameter values.\n");
+        return 1;
+    }
 
-    if (!dom) { /* list all domain's credit scheduler info */
+    if (opt_s) {
+        libxl_sched_credit2_params scparam;
+        uint32_t poolid = 0;
+
+        if (cpupool) {
+            if (cpupool_qualifier_to_cpupoolid(cpupool, &poolid, NULL) ||
+                !libxl_cpupoolid_is_valid(ctx, poolid)) {
+                fprintf(stderr, "unknown cpupool \'%s\'\n", cpupool);
+                return -ERROR_FAIL;
+            }
+        }
+
+        if (!opt_r) { /* Output scheduling parameters */
+            return -sched_credit2_pool_output(poolid);
+        } else { /* Set scheduling parameters*/
+            scparam.runqueue = runqueue;
+
+            rc = sched_credit2_params_set(poolid, &scparam);
+            if (rc)
+                return -rc;
+        }
+    } else if (!dom) { /* list all domain's credit scheduler info */
         return -sched_domain_output(LIBXL_SCHEDULER_CREDIT2,
                                     sched_credit2_domain_output,
-                                    sched_default_pool_output,
+                                    sched_credit2_pool_output,
                                     cpupool);
     } else {
         uint32_t domid = find_domain(dom);
@@ -5302,6 +5454,90 @@ int main_sched_sedf(int argc, char **argv)
     return 0;
 }
 
+int main_sched_rtds(int argc, char **argv)
+{
+    const char *dom = NULL;
+    const char *cpupool = NULL;
+    int period = 0, opt_p = 0;
+    int budget = 0, opt_b = 0;
+    int opt, rc;
+    int option_index = 0;
+    static struct option long_options[] = {
+        {"domain", 1, 0, 'd'},
+        {"period", 1, 0, 'p'},
+        {"budget", 1, 0, 'b'},
+        {"cpupool", 1, 0, 'c'},
+        {"help", 0, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while (1) {
+        opt = getopt_long(argc, argv, "d:p:b:c:h", long_options,
+                          &option_index);
+        if (opt == -1)
+            break;
+        switch (opt) {
+        case 0: case 2:
+            return opt;
+        case 'd':
+            dom = optarg;
+            break;
+        case 'p':
+            period = strtol(optarg, NULL, 10);
+            opt_p = 1;
+            break;
+        case 'b':
+            budget = strtol(optarg, NULL, 10);
+            opt_b = 1;
+            break;
+        case 'c':
+            cpupool = optarg;
+            break;
+        case 'h':
+            help("sched-rtds");
+            return 0;
+        }
+    }
+
+    if (cpupool && (dom || opt_p || opt_b)) {
+        fprintf(stderr, "Specifying a cpupool is not allowed with other "
+                "options.\n");
+        return 1;
+    }
+    if (!dom && (opt_p || opt_b)) {
+        fprintf(stderr, "Must specify a domain.\n");
+        return 1;
+    }
+
+    if (!dom) { /* list all domain's rtds scheduler info */
+        return -sched_domain_output(LIBXL_SCHEDULER_RTDS,
+                                    sched_rtds_domain_output,
+                                    sched_default_pool_output,
+                                    cpupool);
+    } else {
+        uint32_t domid = find_domain(dom);
+
+        if (!opt_p && !opt_b) { /* output rtds scheduler info */
+            sched_rtds_domain_output(-1);
+            return -sched_rtds_domain_output(domid);
+        } else { /* set rtds scheduler paramaters */
+            libxl_domain_sched_params scinfo;
+            libxl_domain_sched_params_init(&scinfo);
+            scinfo.sched = LIBXL_SCHEDULER_RTDS;
+            if (opt_p)
+                scinfo.period = period;
+            if (opt_b)
+                scinfo.budget = budget;
+            rc = sched_domain_set(domid, &scinfo);
+            libxl_domain_sched_params_dispose(&scinfo);
+            if (rc)
+                return -rc;
+        }
+    }
+
+    return 0;
+}
+
 int main_domid(int argc, char **argv)
 {
     uint32_t domid;
@@ -6165,12 +6401,12 @@ int main_tmem_set(int argc, char **argv)
 {
     uint32_t domid;
     const char *dom = NULL;
-    uint32_t weight = 0, cap = 0, compress = 0;
-    int opt_w = 0, opt_c = 0, opt_p = 0;
+    uint32_t weight = 0, cap = 0, compress = 0, codec = 0, ratio = 0;
+    int opt_w = 0, opt_c = 0, opt_p = 0, opt_k = 0, opt_r = 0;
     int all = 0;
     int opt;
 
-    while ((opt = def_getopt(argc, argv, "aw:c:p:", "tmem-set", 0)) != -1) {
+    while ((opt = def_getopt(argc, argv, "aw:c:p:k:r:", "tmem-set", 0)) != -1) {
         switch (opt) {
         case 0: case 2:
             return opt;
@@ -6189,6 +6425,14 @@ int main_tmem_set(int argc, char **argv)
             compress = strtol(optarg, NULL, 10);
             opt_p = 1;
             break;
+        case 'k':
+            codec = strtol(optarg, NULL, 10);
+            opt_k = 1;
+            break;
+        case 'r':
+            ratio = strtol(optarg, NULL, 10);
+            opt_r = 1;
+            break;
         }
     }
 
@@ -6204,7 +6448,7 @@ int main_tmem_set(int argc, char **argv)
     else
         domid = find_domain(dom);
 
-    if (!opt_w && !opt_c && !opt_p) {
+    if (!opt_w && !opt_c && !opt_p && !opt_k && !opt_r) {
         fprintf(stderr, "No set value specified.\n\n");
         help("tmem-set");
         return 1;
@@ -6216,6 +6460,10 @@ int main_tmem_set(int argc, char **argv)
         libxl_tmem_set(ctx, domid, "cap", cap);
     if (opt_p)
         libxl_tmem_set(ctx, domid, "compress", compress);
+    if (opt_k)
+        libxl_tmem_set(ctx, domid, "codec", codec);
+    if (opt_r)
+        libxl_tmem_set(ctx, domid, "compress_ratio", ratio);
 
     return 0;
 }
@@ -121,6 +121,12 @@ struct cmd_spec cmd_table[] = {
       "Unpause a paused domain",
       "<Domain>",
     },
+    { "fork-vm",
+      &main_fork_vm, 0, 1,
+      "Create a copy-on-write clone of a paused HVM domain",
+      "[options] <Domain>",
+      "-n NAME                  Name of the new domain.",
+    },
     { "console",
       &main_console, 0, 0,
       "Attach to domain's console",
@@ -235,10 +241,11 @@ struct cmd_spec cmd_table[] = {
     { "sched-credit",
       &main_sched_credit, 0, 1,
       "Get/set credit scheduler parameters",
-      "[-d <Domain> [-w[=WEIGHT]|-c[=CAP]]] [-s [-t TSLICE] [-r RATELIMIT]] [-p CPUPOOL]",
+      "[-d <Domain> [-w[=WEIGHT]|-c[=CAP]|-g[=GANG]]] [-s [-t TSLICE] [-r RATELIMIT]] [-p CPUPOOL]",
       "-d DOMAIN, --domain=DOMAIN        Domain to modify\n"
       "-w WEIGHT, --weight=WEIGHT        Weight (int)\n"
       "-c CAP, --cap=CAP                 Cap (int)\n"
+      "-g GANG, --gang=GANG              Gang scheduling (0 or 1)\n"
       "-s         --schedparam           Query / modify scheduler parameters\n"
       "-t TSLICE, --tslice_ms=TSLICE     Set the timeslice, in milliseconds\n"
       "-r RLIMIT, --ratelimit_us=RLIMIT  Set the scheduling rate limit, in microseconds\n"
@@ -247,9 +254,12 @@ struct cmd_spec cmd_table[] = {
     { "sched-credit2",
       &main_sched_credit2, 0, 1,
       "Get/set credit2 scheduler parameters",
-      "[-d <Domain> [-w[=WEIGHT]]] [-p CPUPOOL]",
+      "[-d <Domain> [-w[=WEIGHT]]] [-s [-r RUNQUEUE]] [-p CPUPOOL]",
       "-d DOMAIN, --domain=DOMAIN     Domain to modify\n"
       "-w WEIGHT, --weight=WEIGHT     Weight (int)\n"
+      "-s         --schedparam        Query / modify scheduler parameters\n"
+      "-r RUNQ, --runqueue=RUNQ       Pcpus sharing a runqueue: core, socket,\n"
+      "                               node or all (empty cpupool only)\n"
       "-p CPUPOOL, --cpupool=CPUPOOL  Restrict output to CPUPOOL"
     },
     { "sched-sedf",
@@ -268,6 +278,16 @@ struct cmd_spec cmd_table[] = {
       "                               --period/--slice)\n"
       "-c CPUPOOL, --cpupool=CPUPOOL  Restrict output to CPUPOOL"
     },
+    { "sched-rtds",
+      &main_sched_rtds, 0, 1,
+      "Get/set rtds scheduler parameters",
+      "[-d <Domain> [-p[=PERIOD]] [-b[=BUDGET]]] [-c CPUPOOL]",
+      "-d DOMAIN, --domain=DOMAIN     Domain to modify\n"
+      "-p US, --period=US             Period (us)\n"
+      "-b US, --budget=US             CPU time per period (us),\n"
+      "                               for each vcpu (budget <= period)\n"
+      "-c CPUPOOL, --cpupool=CPUPOOL  Restrict output to CPUPOOL"
+    },
     { "domid",
       &main_domid, 0, 0,
       "Convert a domain name to domain id",
@@ -382,11 +402,14 @@ struct cmd_spec cmd_table[] = {
     { "tmem-set",
       &main_tmem_set, 0, 1,
       "Change tmem settings",
-      "[<Domain>|-a] [-w[=WEIGHT]|-c[=CAP]|-p[=COMPRESS]]",
+      "[<Domain>|-a] [-w[=WEIGHT]|-c[=CAP]|-p[=COMPRESS]|-k[=CODEC]|"
+      "-r[=RATIO]]",
       "  -a                             Operate on all tmem\n"
       "  -w WEIGHT                      Weight (int)\n"
       "  -c CAP                         Cap (int)\n"
-      "  -p COMPRESS                    Compress (int)",
+      "  -p COMPRESS                    Compress (int)\n"
+      "  -k CODEC                       Codec (int, 0=lzo 1=lz4)\n"
+      "  -r RATIO                       Max compressed size in % of a page",
     },
     { "tmem-shared-auth",
       &main_tmem_shared_auth, 0, 1,
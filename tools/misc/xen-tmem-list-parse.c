@@ -118,6 +118,7 @@ void parse_global(char *s)
     unsigned long long pcd_tot_csize = parse(s,"Gz");
     unsigned long long deduped_puts = parse(s,"Gd");
     unsigned long long tot_good_eph_puts = parse(s,"Ep");
+    unsigned long long eph_pcpu_drains = parse(s,"Ed");
 
     printf("total tmem ops=%llu (errors=%llu) -- tmem pages avail=%llu\n",
            total_ops, errored_ops, avail_pages);
@@ -146,11 +147,11 @@ void parse_global(char *s)
     printf("misc: failed_copies=%llu alloc_failed=%llu alloc_page_failed=%llu "
            "low_mem=%llu evicted=%llu/%llu relinq=%llu/%llu, "
            "max_evicts_per_relinq=%llu, flush_pools=%llu, "
-           "eph_count=%llu, eph_max=%llu\n",
+           "eph_count=%llu, eph_max=%llu, eph_pcpu_drains=%llu\n",
            failed_copies, alloc_failed, alloc_page_failed, low_on_memory,
            evicted_pgs, evict_attempts, relinq_pgs, relinq_attempts,
            max_evicts_per_relinq, total_flush_pool,
-           global_eph_count, global_eph_max);
+           global_eph_count, global_eph_max, eph_pcpu_drains);
 }
 
 #define PARSE_CYC_COUNTER(s,x,prefix) unsigned long long \
@@ -200,6 +201,13 @@ void parse_client(char *s)
     unsigned long long compressed_sum_size = parse(s,"cb");
     unsigned long long compress_poor = parse(s,"cn");
     unsigned long long compress_nomem = parse(s,"cm");
+    unsigned long codec = parse(s,"cc");
+    unsigned long compress_ratio = parse(s,"cr");
+    unsigned long long compress_attempts = parse(s,"cs");
+    unsigned long long compress_out_bytes = parse(s,"cz");
+    unsigned long long compress_skipped = parse(s,"ck");
+    unsigned long long compress_cycles = parse(s,"ct");
+    unsigned long long decompress_cycles = parse(s,"dt");
     unsigned long long total_cycles = parse(s,"Tc");
     unsigned long long succ_eph_gets = parse(s,"Ge");
     unsigned long long succ_pers_puts = parse(s,"Pp");
@@ -216,7 +224,15 @@ void parse_client(char *s)
            compressed_pages ?  (long)((compressed_sum_size*100LL) /
                                       (compressed_pages*PAGE_SIZE)) : 0,
            compressed_pages, compress_poor, compress_nomem);
-
+    printf("domid%lu: codec=%s,max_ratio=%lu%%,attempts=%llu,"
+           "attempt ratio=%lu%%,skipped=%llu,"
+           "compress_cycles/page=%llu,decompress_cycles=%llu\n",
+           cli_id, codec ? "lz4" : "lzo", compress_ratio, compress_attempts,
+           compress_attempts ? (long)((compress_out_bytes*100LL) /
+                                      (compress_attempts*PAGE_SIZE)) : 0,
+           compress_skipped,
+           compress_attempts ? compress_cycles / compress_attempts : 0,
+           decompress_cycles);
 }
 
 void parse_pool(char *s)
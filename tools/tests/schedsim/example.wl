@@ -0,0 +1,5 @@
+# A latency sensitive domain sharing the host with two CPU hogs, one of
+# which has twice the weight of the other.
+domain 1 vcpus=2 run=200 sleep=2000 period=1000 budget=250
+domain 2 vcpus=4 weight=512
+domain 3 vcpus=4
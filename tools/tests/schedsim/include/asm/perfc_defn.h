@@ -0,0 +1 @@
+/* No architecture specific counters in the simulator. */
@@ -0,0 +1 @@
+#include "schedsim.h"
@@ -0,0 +1,994 @@
+/******************************************************************************
+ * schedsim.c
+ *
+ * A discrete event simulator for the credit, credit2 and rtds schedulers.
+ *
+ * The scheduler sources are built unmodified against schedsim.h, and driven
+ * through the same hooks xen/common/schedule.c uses.  The workload is a set
+ * of vcpus alternating between sleeping and needing the CPU for a while,
+ * either described by hand or extracted from a xentrace recording of a real
+ * system (see workload.c).  When a vcpu has used up a burst it blocks, and
+ * when its sleep is over it is woken: everything else is up to the
+ * scheduler under test.
+ */
+
+#include <getopt.h>
+
+#include "schedsim.h"
+#include <xen/sched-if.h>
+
+#include "workload.h"
+
+/* Environment provided to the schedulers. */
+s_time_t sim_now;
+unsigned int sim_cpu;
+unsigned int nr_cpu_ids;
+cpumask_t cpu_online_map;
+cpumask_t cpupool_free_cpus;
+char keyhandler_scratch[1024];
+unsigned long sim_perfc[NUM_PERFCOUNTERS];
+
+unsigned int sim_nr_nodes;
+unsigned int sim_cpu_socket[NR_CPUS];
+unsigned int sim_cpu_core[NR_CPUS];
+unsigned int sim_cpu_node[NR_CPUS];
+cpumask_t sim_node_cpumask[MAX_NUMNODES];
+static cpumask_t cpumask_of_cpu[NR_CPUS];
+
+DEFINE_PER_CPU(cpumask_var_t, cpu_sibling_mask);
+DEFINE_PER_CPU(cpumask_var_t, cpu_core_mask);
+DEFINE_PER_CPU(struct schedule_data, schedule_data);
+DEFINE_PER_CPU(struct scheduler *, scheduler);
+DEFINE_PER_CPU(struct cpupool *, cpupool);
+
+struct vcpu *idle_vcpu[NR_CPUS];
+struct vcpu *sim_current[NR_CPUS];
+static struct domain idle_domain = { .domain_id = DOMID_IDLE };
+
+static struct cpupool sim_cpupool0;
+struct cpupool *cpupool0 = &sim_cpupool0;
+
+int sched_ratelimit_us = SCHED_DEFAULT_RATELIMIT_US;
+integer_param("sched_ratelimit_us", sched_ratelimit_us);
+bool_t sched_smt_power_savings = 0;
+boolean_param("sched_smt_power_savings", sched_smt_power_savings);
+
+static const struct scheduler *schedulers[] = {
+    &sched_credit_def,
+    &sched_credit2_def,
+    &sched_rtds_def,
+};
+
+static struct scheduler ops;
+
+#define SCHED_OP(opsptr, fn, ...)                                          \
+         (( (opsptr)->fn != NULL ) ? (opsptr)->fn(opsptr, ##__VA_ARGS__ )  \
+          : (typeof((opsptr)->fn(opsptr, ##__VA_ARGS__)))0 )
+
+#define VCPU2OP(_v)   (&ops)
+
+const cpumask_t *cpumask_of(unsigned int cpu)
+{
+    return &cpumask_of_cpu[cpu];
+}
+
+int cpulist_scnprintf(char *buf, int len, const cpumask_t *srcp)
+{
+    int cpu, n = 0;
+
+    buf[0] = '\0';
+    for_each_cpu ( cpu, srcp )
+        if ( n < len )
+            n += snprintf(buf + n, len - n, "%s%d", n ? "," : "", cpu);
+    return n < len ? n : len - 1;
+}
+
+int cpumask_scnprintf(char *buf, int len, const cpumask_t *srcp)
+{
+    return cpulist_scnprintf(buf, len, srcp);
+}
+
+/*
+ * Boot parameters.
+ */
+static struct kernel_param *params;
+
+void sim_register_param(struct kernel_param *param)
+{
+    param->next = params;
+    params = param;
+}
+
+static int sim_set_param(const char *arg)
+{
+    const char *val = strchr(arg, '=');
+    struct kernel_param *param;
+    size_t len = val ? val - arg : strlen(arg);
+
+    for ( param = params; param != NULL; param = param->next )
+    {
+        if ( strlen(param->name) != len || strncmp(param->name, arg, len) )
+            continue;
+
+        switch ( param->type )
+        {
+        case OPT_STR:
+            snprintf(param->var, param->len, "%s", val ? val + 1 : "");
+            break;
+        case OPT_UINT:
+        case OPT_BOOL:
+        {
+            unsigned long long v = 1;
+
+            if ( val != NULL )
+                v = strtoull(val + 1, NULL, 0);
+            switch ( param->len )
+            {
+            case sizeof(uint8_t):  *(uint8_t *)param->var = v;  break;
+            case sizeof(uint16_t): *(uint16_t *)param->var = v; break;
+            case sizeof(uint32_t): *(uint32_t *)param->var = v; break;
+            case sizeof(uint64_t): *(uint64_t *)param->var = v; break;
+            default: BUG();
+            }
+            break;
+        }
+        case OPT_CUSTOM:
+            ((void (*)(const char *))param->var)(val ? val + 1 : "");
+            break;
+        }
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+/*
+ * Timers.
+ */
+static struct timer *timers;
+
+void init_timer(struct timer *timer, void (*function)(void *), void *data,
+                unsigned int cpu)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->function = function;
+    timer->data = data;
+    timer->cpu = cpu;
+    timer->sim_next = timers;
+    timers = timer;
+}
+
+void set_timer(struct timer *timer, s_time_t expires)
+{
+    ASSERT(!timer->killed);
+    timer->expires = expires;
+    timer->active = 1;
+}
+
+void stop_timer(struct timer *timer)
+{
+    timer->active = 0;
+}
+
+void migrate_timer(struct timer *timer, unsigned int new_cpu)
+{
+    timer->cpu = new_cpu;
+}
+
+void kill_timer(struct timer *timer)
+{
+    struct timer **pprev;
+
+    for ( pprev = &timers; *pprev != NULL; pprev = &(*pprev)->sim_next )
+        if ( *pprev == timer )
+        {
+            *pprev = timer->sim_next;
+            break;
+        }
+    timer->active = 0;
+    timer->killed = 1;
+}
+
+static struct timer *next_timer(void)
+{
+    struct timer *t, *first = NULL;
+
+    for ( t = timers; t != NULL; t = t->sim_next )
+        if ( t->active && (first == NULL || t->expires < first->expires) )
+            first = t;
+
+    return first;
+}
+
+/*
+ * Softirqs.
+ */
+static cpumask_t schedule_pending;
+
+void cpu_raise_softirq(unsigned int cpu, unsigned int nr)
+{
+    if ( nr == SCHEDULE_SOFTIRQ )
+        cpumask_set_cpu(cpu, &schedule_pending);
+}
+
+void cpumask_raise_softirq(const cpumask_t *mask, unsigned int nr)
+{
+    if ( nr == SCHEDULE_SOFTIRQ )
+        cpumask_or(&schedule_pending, &schedule_pending, mask);
+}
+
+/*
+ * The generic scheduler, as in xen/common/schedule.c.
+ */
+static void vcpu_runstate_change(
+    struct vcpu *v, int new_state, s_time_t new_entry_time)
+{
+    s_time_t delta;
+
+    ASSERT(v->runstate.state != new_state);
+    ASSERT(spin_is_locked(per_cpu(schedule_data,v->processor).schedule_lock));
+
+    delta = new_entry_time - v->runstate.state_entry_time;
+    if ( delta > 0 )
+    {
+        v->runstate.time[v->runstate.state] += delta;
+        v->runstate.state_entry_time = new_entry_time;
+    }
+
+    v->runstate.state = new_state;
+}
+
+void vcpu_sleep_nosync(struct vcpu *v)
+{
+    unsigned long flags;
+
+    vcpu_schedule_lock_irqsave(v, flags);
+
+    if ( likely(!vcpu_runnable(v)) )
+    {
+        if ( v->runstate.state == RUNSTATE_runnable )
+            vcpu_runstate_change(v, RUNSTATE_offline, NOW());
+
+        SCHED_OP(VCPU2OP(v), sleep, v);
+    }
+
+    vcpu_schedule_unlock_irqrestore(v, flags);
+}
+
+void vcpu_wake(struct vcpu *v)
+{
+    unsigned long flags;
+
+    vcpu_schedule_lock_irqsave(v, flags);
+
+    if ( likely(vcpu_runnable(v)) )
+    {
+        if ( v->runstate.state >= RUNSTATE_blocked )
+            vcpu_runstate_change(v, RUNSTATE_runnable, NOW());
+        SCHED_OP(VCPU2OP(v), wake, v);
+    }
+    else if ( !test_bit(_VPF_blocked, &v->pause_flags) )
+    {
+        if ( v->runstate.state == RUNSTATE_blocked )
+            vcpu_runstate_change(v, RUNSTATE_offline, NOW());
+    }
+
+    vcpu_schedule_unlock_irqrestore(v, flags);
+}
+
+void vcpu_pause_nosync(struct vcpu *v)
+{
+    atomic_inc(&v->pause_count);
+    vcpu_sleep_nosync(v);
+}
+
+void vcpu_unpause(struct vcpu *v)
+{
+    if ( atomic_dec_and_test(&v->pause_count) )
+        vcpu_wake(v);
+}
+
+static void vcpu_migrate(struct vcpu *v)
+{
+    unsigned long flags;
+    unsigned int old_cpu, new_cpu;
+    spinlock_t *old_lock, *new_lock;
+
+    /*
+     * Nothing else can be running, so the retry loop of the real thing
+     * is not needed: one pick, under both locks.
+     */
+    old_cpu = v->processor;
+    old_lock = per_cpu(schedule_data, old_cpu).schedule_lock;
+    spin_lock_irqsave(old_lock, flags);
+
+    new_cpu = SCHED_OP(VCPU2OP(v), pick_cpu, v);
+    new_lock = per_cpu(schedule_data, new_cpu).schedule_lock;
+    if ( old_lock != new_lock )
+        spin_lock(new_lock);
+
+    if ( v->is_running ||
+         !test_and_clear_bit(_VPF_migrating, &v->pause_flags) )
+    {
+        if ( old_lock != new_lock )
+            spin_unlock(new_lock);
+        spin_unlock_irqrestore(old_lock, flags);
+        return;
+    }
+
+    if ( VCPU2OP(v)->migrate )
+        SCHED_OP(VCPU2OP(v), migrate, v, new_cpu);
+    else
+        v->processor = new_cpu;
+
+    if ( old_lock != new_lock )
+        spin_unlock(new_lock);
+    spin_unlock_irqrestore(old_lock, flags);
+
+    vcpu_wake(v);
+}
+
+static void context_saved(struct vcpu *prev)
+{
+    prev->is_running = 0;
+
+    SCHED_OP(VCPU2OP(prev), context_saved, prev);
+
+    if ( unlikely(test_bit(_VPF_migrating, &prev->pause_flags)) )
+        vcpu_migrate(prev);
+}
+
+static void s_timer_fn(void *unused)
+{
+    raise_softirq(SCHEDULE_SOFTIRQ);
+    SCHED_STAT_CRANK(sched_irq);
+}
+
+static void sim_dispatch(struct vcpu *v, unsigned int cpu, s_time_t now);
+static void sim_descheduled(struct vcpu *v, s_time_t now);
+
+static void schedule(void)
+{
+    struct vcpu          *prev = current, *next = NULL;
+    s_time_t              now = NOW();
+    struct schedule_data *sd;
+    struct task_slice     next_slice;
+    int cpu = smp_processor_id();
+
+    SCHED_STAT_CRANK(sched_run);
+
+    sd = &this_cpu(schedule_data);
+
+    pcpu_schedule_lock_irq(cpu);
+
+    stop_timer(&sd->s_timer);
+
+    next_slice = ops.do_schedule(&ops, now, 0);
+
+    next = next_slice.task;
+
+    sd->curr = next;
+
+    if ( next_slice.time >= 0 ) /* -ve means no limit */
+        set_timer(&sd->s_timer, now + next_slice.time);
+
+    if ( unlikely(prev == next) )
+    {
+        pcpu_schedule_unlock_irq(cpu);
+        return;
+    }
+
+    ASSERT(prev->runstate.state == RUNSTATE_running);
+
+    vcpu_runstate_change(
+        prev,
+        (test_bit(_VPF_blocked, &prev->pause_flags) ? RUNSTATE_blocked :
+         (vcpu_runnable(prev) ? RUNSTATE_runnable : RUNSTATE_offline)),
+        now);
+    prev->last_run_time = now;
+
+    ASSERT(next->runstate.state != RUNSTATE_running);
+    vcpu_runstate_change(next, RUNSTATE_running, now);
+
+    ASSERT(!next->is_running);
+    next->is_running = 1;
+
+    pcpu_schedule_unlock_irq(cpu);
+
+    SCHED_STAT_CRANK(sched_ctx);
+
+    /* The context switch itself is instantaneous. */
+    sim_descheduled(prev, now);
+    sim_current[cpu] = next;
+    sim_dispatch(next, cpu, now);
+    context_saved(prev);
+}
+
+/*
+ * Setup.
+ */
+static unsigned int topo_sockets = 1, topo_cores = 4, topo_threads = 1;
+
+static void sim_init_topology(void)
+{
+    unsigned int cpu, other;
+
+    nr_cpu_ids = topo_sockets * topo_cores * topo_threads;
+    if ( nr_cpu_ids == 0 || nr_cpu_ids > NR_CPUS ||
+         topo_sockets > MAX_NUMNODES )
+    {
+        fprintf(stderr, "Unsupported topology %ux%ux%u\n",
+                topo_sockets, topo_cores, topo_threads);
+        exit(1);
+    }
+
+    sim_nr_nodes = topo_sockets;
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        sim_cpu_socket[cpu] = cpu / (topo_cores * topo_threads);
+        sim_cpu_core[cpu] = (cpu / topo_threads) % topo_cores;
+        sim_cpu_node[cpu] = sim_cpu_socket[cpu];
+        cpumask_set_cpu(cpu, &cpumask_of_cpu[cpu]);
+        cpumask_set_cpu(cpu, &cpu_online_map);
+        cpumask_set_cpu(cpu, &sim_node_cpumask[sim_cpu_node[cpu]]);
+    }
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        if ( !zalloc_cpumask_var(&per_cpu(cpu_sibling_mask, cpu)) ||
+             !zalloc_cpumask_var(&per_cpu(cpu_core_mask, cpu)) )
+            BUG();
+        for ( other = 0; other < nr_cpu_ids; other++ )
+        {
+            if ( sim_cpu_socket[other] != sim_cpu_socket[cpu] )
+                continue;
+            cpumask_set_cpu(other, per_cpu(cpu_core_mask, cpu));
+            if ( sim_cpu_core[other] == sim_cpu_core[cpu] )
+                cpumask_set_cpu(other, per_cpu(cpu_sibling_mask, cpu));
+        }
+    }
+}
+
+static struct vcpu *sim_alloc_vcpu(struct domain *d, unsigned int vcpu_id)
+{
+    struct vcpu *v = xzalloc(struct vcpu);
+
+    if ( v == NULL || !zalloc_cpumask_var(&v->cpu_affinity) )
+        BUG();
+    v->domain = d;
+    v->vcpu_id = vcpu_id;
+    v->runstate.state = is_idle_domain(d) ? RUNSTATE_running : RUNSTATE_offline;
+    v->wake_at = -1;
+    v->last_cpu = -1;
+    d->vcpu[vcpu_id] = v;
+    if ( vcpu_id != 0 )
+        d->vcpu[vcpu_id - 1]->next_in_list = v;
+
+    return v;
+}
+
+static void sched_init_vcpu(struct vcpu *v, unsigned int processor)
+{
+    struct domain *d = v->domain;
+
+    v->processor = processor;
+    if ( is_idle_domain(d) )
+        cpumask_copy(v->cpu_affinity, cpumask_of(processor));
+    else
+        cpumask_setall(v->cpu_affinity);
+
+    if ( is_idle_domain(d) )
+    {
+        per_cpu(schedule_data, v->processor).curr = v;
+        sim_current[v->processor] = v;
+        v->is_running = 1;
+    }
+
+    v->sched_priv = SCHED_OP(&ops, alloc_vdata, v, d->sched_priv);
+    if ( v->sched_priv == NULL )
+        BUG();
+
+    SCHED_OP(&ops, insert_vcpu, v);
+}
+
+static void sim_init_scheduler(const char *name)
+{
+    unsigned int i, cpu;
+
+    for ( i = 0; i < ARRAY_SIZE(schedulers); i++ )
+        if ( !strcmp(schedulers[i]->opt_name, name) )
+            ops = *schedulers[i];
+    if ( ops.name == NULL )
+    {
+        fprintf(stderr, "Unknown scheduler '%s'\n", name);
+        exit(1);
+    }
+
+    if ( ops.global_init && ops.global_init() < 0 )
+        BUG();
+    if ( SCHED_OP(&ops, init) )
+        panic("scheduler returned error on init\n");
+
+    if ( !zalloc_cpumask_var(&cpupool0->cpu_valid) )
+        BUG();
+    cpumask_copy(cpupool0->cpu_valid, &cpu_online_map);
+    cpupool0->sched = &ops;
+
+    idle_domain.vcpu = idle_vcpu;
+    idle_domain.max_vcpus = nr_cpu_ids;
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        struct schedule_data *sd = &per_cpu(schedule_data, cpu);
+
+        per_cpu(scheduler, cpu) = &ops;
+        per_cpu(cpupool, cpu) = cpupool0;
+        spin_lock_init(&sd->_lock);
+        sd->schedule_lock = &sd->_lock;
+        init_timer(&sd->s_timer, s_timer_fn, NULL, cpu);
+        atomic_set(&sd->urgent_count, 0);
+
+        sim_cpu = cpu;
+        sched_init_vcpu(sim_alloc_vcpu(&idle_domain, cpu), cpu);
+        if ( ops.alloc_pdata &&
+             !(sd->sched_priv = ops.alloc_pdata(&ops, cpu)) )
+            BUG();
+    }
+    sim_cpu = 0;
+}
+
+static struct domain *domains;
+static struct vcpu **all_vcpus;
+static unsigned int nr_all_vcpus;
+
+static void sim_create_domain(struct sim_domain_desc *desc)
+{
+    struct xen_domctl_scheduler_op op;
+    struct domain *d = xzalloc(struct domain), **pd;
+    unsigned int i;
+
+    if ( d == NULL )
+        BUG();
+    d->domain_id = desc->domid;
+    d->max_vcpus = desc->nr_vcpus;
+    d->cpupool = cpupool0;
+    d->auto_node_affinity = 1;
+    d->sim_weight = desc->weight;
+    d->vcpu = xzalloc_array(struct vcpu *, d->max_vcpus);
+    if ( d->vcpu == NULL || SCHED_OP(&ops, init_domain, d) )
+        BUG();
+
+    all_vcpus = realloc(all_vcpus,
+                        (nr_all_vcpus + d->max_vcpus) * sizeof(*all_vcpus));
+    if ( all_vcpus == NULL )
+        BUG();
+
+    for ( i = 0; i < d->max_vcpus; i++ )
+    {
+        struct vcpu *v = sim_alloc_vcpu(d, i);
+
+        set_bit(_VPF_blocked, &v->pause_flags);
+        sched_init_vcpu(v, (desc->domid + i) % nr_cpu_ids);
+        v->phases = desc->vcpu[i].phases;
+        v->nr_phases = desc->vcpu[i].nr_phases;
+        v->loop_phases = desc->loop;
+        if ( v->nr_phases )
+            v->wake_at = v->phases[0].sleep;
+        all_vcpus[nr_all_vcpus++] = v;
+    }
+
+    memset(&op, 0, sizeof(op));
+    op.cmd = XEN_DOMCTL_SCHEDOP_putinfo;
+    op.sched_id = ops.sched_id;
+    switch ( ops.sched_id )
+    {
+    case XEN_SCHEDULER_CREDIT:
+        op.u.credit.weight = desc->weight;
+        op.u.credit.cap = desc->cap;
+        op.u.credit.gang = desc->gang ? 1 : 0;
+        break;
+    case XEN_SCHEDULER_CREDIT2:
+        op.u.credit2.weight = desc->weight;
+        break;
+    case XEN_SCHEDULER_RTDS:
+        op.cmd = XEN_DOMCTL_SCHEDOP_getinfo;
+        SCHED_OP(&ops, adjust, d, &op);
+        op.cmd = XEN_DOMCTL_SCHEDOP_putinfo;
+        if ( desc->period )
+            op.u.rtds.period = desc->period;
+        if ( desc->budget )
+            op.u.rtds.budget = desc->budget;
+        break;
+    }
+    if ( SCHED_OP(&ops, adjust, d, &op) )
+        fprintf(stderr, "d%d: scheduler rejected parameters\n", d->domain_id);
+
+    if ( !nodes_empty(desc->nodes) )
+    {
+        d->auto_node_affinity = 0;
+        d->node_affinity = desc->nodes;
+        SCHED_OP(&ops, set_node_affinity, d, &d->node_affinity);
+    }
+
+    for ( pd = &domains; *pd != NULL; pd = &(*pd)->next_in_list )
+        continue;
+    *pd = d;
+}
+
+/*
+ * The workload: vcpus run for a burst, block, and are woken when their
+ * sleep is over.
+ */
+static bool_t vcpu_hog(const struct vcpu *v)
+{
+    return v->nr_phases == 1 && v->loop_phases && v->phases[0].sleep == 0;
+}
+
+static unsigned int sim_hist_bucket(s_time_t ns)
+{
+    unsigned int e;
+
+    if ( ns < 16 )
+        return ns < 0 ? 0 : ns;
+    e = 63 - __builtin_clzll(ns);
+    return 16 + (e - 4) * 8 + ((ns >> (e - 3)) & 7);
+}
+
+static s_time_t sim_hist_value(unsigned int bucket)
+{
+    unsigned int e;
+
+    if ( bucket < 16 )
+        return bucket;
+    e = (bucket - 16) / 8 + 4;
+    return (s_time_t)(8 + (bucket - 16) % 8) << (e - 3);
+}
+
+static void sim_dispatch(struct vcpu *v, unsigned int cpu, s_time_t now)
+{
+    if ( is_idle_vcpu(v) )
+        return;
+
+    v->dispatched = now;
+    v->stats.switches++;
+    if ( v->last_cpu >= 0 && v->last_cpu != cpu )
+        v->stats.migrations++;
+    v->last_cpu = cpu;
+
+    if ( v->woken )
+    {
+        s_time_t lat = now - v->woken_at;
+
+        v->woken = 0;
+        v->stats.lat_total += lat;
+        if ( lat > v->stats.lat_max )
+            v->stats.lat_max = lat;
+        v->stats.lat_hist[sim_hist_bucket(lat)]++;
+    }
+}
+
+static void sim_descheduled(struct vcpu *v, s_time_t now)
+{
+    if ( is_idle_vcpu(v) || vcpu_hog(v) )
+        return;
+
+    v->remaining -= now - v->dispatched;
+}
+
+static void sim_vcpu_block(struct vcpu *v)
+{
+    unsigned int cpu = v->processor;
+
+    v->phase++;
+    if ( v->phase == v->nr_phases && v->loop_phases )
+        v->phase = 0;
+    v->wake_at = v->phase < v->nr_phases ?
+        NOW() + v->phases[v->phase].sleep : -1;
+
+    set_bit(_VPF_blocked, &v->pause_flags);
+    sim_cpu = cpu;
+    vcpu_sleep_nosync(v);
+    cpu_raise_softirq(cpu, SCHEDULE_SOFTIRQ);
+}
+
+static void sim_vcpu_unblock(struct vcpu *v)
+{
+    v->wake_at = -1;
+    v->remaining = v->phases[v->phase].run;
+    v->woken = 1;
+    v->woken_at = NOW();
+    v->stats.wakeups++;
+
+    clear_bit(_VPF_blocked, &v->pause_flags);
+    sim_cpu = v->processor;
+    vcpu_wake(v);
+}
+
+static void sim_do_softirqs(void)
+{
+    unsigned int cpu;
+
+    while ( !cpumask_empty(&schedule_pending) )
+    {
+        cpu = cpumask_first(&schedule_pending);
+        cpumask_clear_cpu(cpu, &schedule_pending);
+        sim_cpu = cpu;
+        schedule();
+    }
+}
+
+static void sim_run(s_time_t end)
+{
+    for ( ; ; )
+    {
+        struct timer *timer = next_timer();
+        struct vcpu *burst = NULL, *wake = NULL, *v;
+        s_time_t t = STIME_MAX, t_burst = STIME_MAX, t_wake = STIME_MAX;
+        unsigned int cpu, i;
+
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        {
+            v = curr_on_cpu(cpu);
+            if ( is_idle_vcpu(v) || vcpu_hog(v) )
+                continue;
+            if ( v->dispatched + v->remaining < t_burst )
+            {
+                t_burst = v->dispatched + v->remaining;
+                burst = v;
+            }
+        }
+
+        for ( i = 0; i < nr_all_vcpus; i++ )
+        {
+            v = all_vcpus[i];
+            if ( v->wake_at >= 0 && v->wake_at < t_wake )
+            {
+                t_wake = v->wake_at;
+                wake = v;
+            }
+        }
+
+        if ( timer != NULL )
+            t = timer->expires;
+        t = min(t, min(t_burst, t_wake));
+        if ( t > end )
+            break;
+        if ( t > sim_now )
+            sim_now = t;
+
+        /* Bursts end before timers at the same instant get to preempt. */
+        if ( burst != NULL && t_burst == t )
+            sim_vcpu_block(burst);
+        else if ( wake != NULL && t_wake == t )
+            sim_vcpu_unblock(wake);
+        else
+        {
+            timer->active = 0;
+            sim_cpu = timer->cpu;
+            timer->function(timer->data);
+        }
+
+        sim_do_softirqs();
+    }
+
+    sim_now = end;
+}
+
+/*
+ * Reporting.
+ */
+static s_time_t vcpu_runstate_time(const struct vcpu *v, int state)
+{
+    s_time_t t = v->runstate.time[state];
+
+    if ( v->runstate.state == state )
+        t += NOW() - v->runstate.state_entry_time;
+    return t;
+}
+
+static s_time_t hist_percentile(const struct sim_vcpu_stats *stats,
+                                unsigned int pct)
+{
+    unsigned long seen = 0, want = (stats->wakeups * pct + 99) / 100;
+    unsigned int b;
+
+    for ( b = 0; b < ARRAY_SIZE(stats->lat_hist); b++ )
+    {
+        seen += stats->lat_hist[b];
+        if ( seen >= want && seen )
+            return min(sim_hist_value(b + 1), stats->lat_max);
+    }
+    return 0;
+}
+
+static void sim_report(void)
+{
+    struct domain *d;
+    struct vcpu *v;
+    double sum = 0, sum_sq = 0;
+    unsigned int n = 0, i;
+    s_time_t idle = 0;
+
+    printf("\n%-8s %10s %10s %8s %10s %10s %10s %6s %8s\n",
+           "vcpu", "run(ms)", "wait(ms)", "wakeups", "lat-avg", "lat-p99",
+           "lat-max", "migr", "switches");
+    for ( d = domains; d != NULL; d = d->next_in_list )
+        for_each_vcpu ( d, v )
+        {
+            const struct sim_vcpu_stats *s = &v->stats;
+
+            printf("d%dv%-5d %10.3f %10.3f %8lu %8.1fus %8.1fus %8.1fus "
+                   "%6lu %8lu\n",
+                   d->domain_id, v->vcpu_id,
+                   vcpu_runstate_time(v, RUNSTATE_running) / 1e6,
+                   vcpu_runstate_time(v, RUNSTATE_runnable) / 1e6,
+                   s->wakeups,
+                   s->wakeups ? (double)s->lat_total / s->wakeups / 1e3 : 0,
+                   hist_percentile(s, 99) / 1e3, s->lat_max / 1e3,
+                   s->migrations, s->switches);
+        }
+
+    printf("\n%-8s %8s %10s %12s\n", "domain", "weight", "cpu(ms)",
+           "cpu/weight");
+    for ( d = domains; d != NULL; d = d->next_in_list )
+    {
+        s_time_t cpu_time = 0;
+        double share;
+
+        for_each_vcpu ( d, v )
+            cpu_time += vcpu_runstate_time(v, RUNSTATE_running);
+        share = (double)cpu_time / 1e6 / d->sim_weight;
+        sum += share;
+        sum_sq += share * share;
+        n++;
+        printf("d%-7d %8u %10.3f %12.4f\n", d->domain_id, d->sim_weight,
+               cpu_time / 1e6, share);
+    }
+    if ( n && sum_sq > 0 )
+        printf("Jain's fairness index (cpu/weight): %.4f\n",
+               sum * sum / (n * sum_sq));
+
+    for ( i = 0; i < nr_cpu_ids; i++ )
+        idle += vcpu_runstate_time(idle_vcpu[i], RUNSTATE_running);
+    printf("Idle: %.3fms of %.3fms (%.1f%%)\n", idle / 1e6,
+           (double)NOW() * nr_cpu_ids / 1e6,
+           NOW() ? 100.0 * idle / ((double)NOW() * nr_cpu_ids) : 0);
+}
+
+static const struct {
+    const char *name;
+    unsigned int idx, size;
+} perfc_info[] = {
+#define PERFCOUNTER(var, name)              { name, PERFC_##var, 1 },
+#define PERFCOUNTER_ARRAY(var, name, size)  { name, PERFC_##var, size },
+#define PERFSTATUS(var, name)               PERFCOUNTER(var, name)
+#define PERFSTATUS_ARRAY(var, name, size)   PERFCOUNTER_ARRAY(var, name, size)
+#include <xen/perfc_defn.h>
+};
+
+static void sim_report_perfc(void)
+{
+    unsigned int i, j;
+
+    printf("\nPerformance counters:\n");
+    for ( i = 0; i < ARRAY_SIZE(perfc_info); i++ )
+    {
+        unsigned long sum = 0;
+
+        for ( j = 0; j < perfc_info[i].size; j++ )
+            sum += sim_perfc[perfc_info[i].idx + j];
+        if ( sum )
+            printf("  %-32s %lu\n", perfc_info[i].name, sum);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [workload-file] [param=value ...]\n"
+            "  -s credit|credit2|rtds\n"
+            "                      scheduler to simulate (default credit)\n"
+            "  -T SxCxT            sockets x cores x threads (default 1x4x1)\n"
+            "  -t trace-file       replay a xentrace recording\n"
+            "  -k khz              TSC frequency of the traced host\n"
+            "  -d ms               simulated time (default: length of the\n"
+            "                      trace, or 10s)\n"
+            "  -p                  print performance counters\n"
+            "  -v                  dump the scheduler state at the end\n"
+            "Parameters are the schedulers' boot parameters, e.g.\n"
+            "sched_credit_tslice_ms=5 or credit2_runqueue=core.\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *sched = "credit", *trace = NULL;
+    unsigned long long khz = DEFAULT_TSC_KHZ;
+    s_time_t duration = -1;
+    bool_t dump = 0, perfc = 0;
+    struct sim_workload wl = { 0 };
+    unsigned int i;
+    int c;
+
+    while ( (c = getopt(argc, argv, "s:T:t:k:d:pvh")) != -1 )
+    {
+        switch ( c )
+        {
+        case 's':
+            sched = optarg;
+            break;
+        case 'T':
+            if ( sscanf(optarg, "%ux%ux%u", &topo_sockets, &topo_cores,
+                        &topo_threads) != 3 )
+                usage(argv[0]);
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        case 'k':
+            khz = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            duration = MILLISECS(strtoull(optarg, NULL, 0));
+            break;
+        case 'p':
+            perfc = 1;
+            break;
+        case 'v':
+            dump = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    for ( ; optind < argc; optind++ )
+    {
+        if ( strchr(argv[optind], '=') )
+        {
+            if ( sim_set_param(argv[optind]) )
+            {
+                fprintf(stderr, "Unknown parameter '%s'\n", argv[optind]);
+                return 1;
+            }
+        }
+        else if ( workload_parse_file(&wl, argv[optind]) )
+            return 1;
+    }
+
+    if ( trace != NULL && workload_parse_trace(&wl, trace, khz) )
+        return 1;
+    if ( wl.nr_domains == 0 )
+    {
+        fprintf(stderr, "No workload\n");
+        usage(argv[0]);
+    }
+    if ( duration < 0 )
+        duration = wl.length ? wl.length : SECONDS(10);
+
+    sim_init_topology();
+    sim_init_scheduler(sched);
+    printf("Simulating %s on %u cpus (%ux%ux%u) for %.3fms\n", ops.name,
+           nr_cpu_ids, topo_sockets, topo_cores, topo_threads,
+           duration / 1e6);
+
+    for ( i = 0; i < wl.nr_domains; i++ )
+        sim_create_domain(&wl.domains[i]);
+
+    /* Every CPU goes through the scheduler once it reaches its idle loop. */
+    cpumask_raise_softirq(&cpu_online_map, SCHEDULE_SOFTIRQ);
+
+    sim_run(duration);
+
+    sim_report();
+    if ( perfc )
+        sim_report_perfc();
+    if ( dump )
+    {
+        SCHED_OP(&ops, dump_settings);
+        for ( i = 0; i < nr_cpu_ids; i++ )
+            SCHED_OP(&ops, dump_cpu_state, i);
+    }
+
+    return 0;
+}
@@ -0,0 +1,735 @@
+/******************************************************************************
+ * schedsim.h
+ *
+ * Just enough of the hypervisor environment for xen/common/sched_credit.c
+ * and sched_credit2.c to build, unmodified, as part of a userspace program.
+ * Every <xen/...> and <asm/...> header the schedulers include is redirected
+ * here by the stubs in include/; xen/sched-if.h, xen/list.h, xen/rbtree.h
+ * and the public headers are the real ones.
+ *
+ * The simulated host is single threaded: locks are only checked for
+ * recursion, "the current CPU" is whichever one the simulator is running
+ * scheduler code for, and time only moves between events.
+ */
+
+#ifndef __SCHEDSIM_H__
+#define __SCHEDSIM_H__
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <public/xen.h>
+#include <public/vcpu.h>
+#include <public/domctl.h>
+#include <public/sysctl.h>
+#include <public/trace.h>
+
+/*
+ * Basic types and compiler helpers.
+ */
+typedef int8_t   s8;
+typedef uint8_t  u8;
+typedef int16_t  s16;
+typedef uint16_t u16;
+typedef int32_t  s32;
+typedef uint32_t u32;
+typedef int64_t  s64;
+typedef uint64_t u64;
+typedef uint8_t  bool_t;
+
+#define __init
+#define __initdata
+#define __devinit
+#define __exit
+#define __read_mostly
+#define __used                  __attribute__((__used__))
+#define EXPORT_SYMBOL(var)
+
+#define likely(x)               __builtin_expect(!!(x), 1)
+#define unlikely(x)             __builtin_expect(!!(x), 0)
+
+#define ARRAY_SIZE(x)           (sizeof(x) / sizeof((x)[0]))
+#define BITS_PER_LONG           (sizeof(long) * 8)
+#define BITS_TO_LONGS(bits)     (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define DIV_ROUND_UP(n, d)      (((n) + (d) - 1) / (d))
+
+#define container_of(ptr, type, member) ({                      \
+        typeof( ((type *)0)->member ) *__mptr = (ptr);          \
+        (type *)( (char *)__mptr - offsetof(type,member) );})
+
+#define min(x,y) ({                             \
+        const typeof(x) _x = (x);               \
+        const typeof(y) _y = (y);               \
+        (void) (&_x == &_y);                    \
+        _x < _y ? _x : _y; })
+#define max(x,y) ({                             \
+        const typeof(x) _x = (x);               \
+        const typeof(y) _y = (y);               \
+        (void) (&_x == &_y);                    \
+        _x > _y ? _x : _y; })
+#define min_t(type,x,y) \
+        ({ type __x = (x); type __y = (y); __x < __y ? __x: __y; })
+#define max_t(type,x,y) \
+        ({ type __x = (x); type __y = (y); __x > __y ? __x: __y; })
+
+#define prefetch(x)             ((void)(x))
+#define cpu_relax()             ((void)0)
+#define barrier()               __asm__ __volatile__("" : : : "memory")
+#define smp_mb()                barrier()
+#define smp_rmb()               barrier()
+#define smp_wmb()               barrier()
+
+/*
+ * Console and assertions.
+ */
+#define XENLOG_ERR              ""
+#define XENLOG_WARNING          ""
+#define XENLOG_INFO             ""
+#define XENLOG_DEBUG            ""
+#define XENLOG_G_ERR            ""
+#define XENLOG_G_WARNING        ""
+#define XENLOG_G_INFO           ""
+
+#define printk(fmt, args...)    printf(fmt, ## args)
+#define dprintk(lvl, fmt, args...) printf(fmt, ## args)
+#define gdprintk(lvl, fmt, args...) printf(fmt, ## args)
+#define panic(fmt, args...)     do {                                    \
+        fprintf(stderr, "panic: " fmt, ## args);                        \
+        abort();                                                        \
+    } while ( 0 )
+
+#define BUG()                   do {                                    \
+        fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__);         \
+        abort();                                                        \
+    } while ( 0 )
+#define BUG_ON(p)               do { if ( unlikely(p) ) BUG(); } while ( 0 )
+#define ASSERT(p)               do {                                    \
+        if ( unlikely(!(p)) )                                           \
+        {                                                               \
+            fprintf(stderr, "Assertion '%s' failed at %s:%d\n",         \
+                    #p, __FILE__, __LINE__);                            \
+            abort();                                                    \
+        }                                                               \
+    } while ( 0 )
+#define WARN_ON(p)              ((void)(p))
+
+/*
+ * Memory allocation.
+ */
+#define xmalloc(_type)          ((_type *)malloc(sizeof(_type)))
+#define xzalloc(_type)          ((_type *)calloc(1, sizeof(_type)))
+#define xmalloc_array(_type, _num) ((_type *)calloc(_num, sizeof(_type)))
+#define xzalloc_array(_type, _num) ((_type *)calloc(_num, sizeof(_type)))
+#define xfree(p)                free(p)
+
+/*
+ * Bit operations, on 32-bit words as on x86 (credit2 keeps its flags in
+ * an unsigned int).
+ */
+#define __BITOP_WORD(addr, nr)  (((volatile unsigned int *)(addr))[(nr) / 32])
+#define __BITOP_MASK(nr)        (1U << ((nr) % 32))
+
+#define test_bit(nr, addr) \
+    (!!(__BITOP_WORD(addr, nr) & __BITOP_MASK(nr)))
+#define set_bit(nr, addr) \
+    ((void)(__BITOP_WORD(addr, nr) |= __BITOP_MASK(nr)))
+#define clear_bit(nr, addr) \
+    ((void)(__BITOP_WORD(addr, nr) &= ~__BITOP_MASK(nr)))
+#define __set_bit(nr, addr)     set_bit(nr, addr)
+#define __clear_bit(nr, addr)   clear_bit(nr, addr)
+#define test_and_set_bit(nr, addr) ({                                   \
+        int __old = test_bit(nr, addr);                                 \
+        set_bit(nr, addr);                                              \
+        __old; })
+#define test_and_clear_bit(nr, addr) ({                                 \
+        int __old = test_bit(nr, addr);                                 \
+        clear_bit(nr, addr);                                            \
+        __old; })
+
+/*
+ * Atomics.
+ */
+typedef struct { int counter; } atomic_t;
+
+#define ATOMIC_INIT(i)          { (i) }
+#define atomic_read(v)          ((v)->counter)
+#define _atomic_read(v)         ((v).counter)
+#define atomic_set(v, i)        ((void)((v)->counter = (i)))
+#define atomic_add(i, v)        ((void)((v)->counter += (i)))
+#define atomic_sub(i, v)        ((void)((v)->counter -= (i)))
+#define atomic_inc(v)           ((void)((v)->counter++))
+#define atomic_dec(v)           ((void)((v)->counter--))
+#define atomic_add_return(i, v) ((v)->counter += (i))
+#define atomic_sub_return(i, v) ((v)->counter -= (i))
+#define atomic_inc_return(v)    (++(v)->counter)
+#define atomic_dec_return(v)    (--(v)->counter)
+#define atomic_dec_and_test(v)  (--(v)->counter == 0)
+#define atomic_inc_and_test(v)  (++(v)->counter == 0)
+#define atomic_sub_and_test(i, v) (((v)->counter -= (i)) == 0)
+
+/*
+ * Locks. There is only one thread, so a lock that is already held can
+ * never be released by someone else: taking it again is a bug, and trying
+ * to take it fails, just as it would on the real thing.
+ */
+typedef struct { int held; } spinlock_t;
+
+#define SPIN_LOCK_UNLOCKED      { 0 }
+#define DEFINE_SPINLOCK(l)      spinlock_t l = SPIN_LOCK_UNLOCKED
+#define spin_lock_init(l)       ((void)((l)->held = 0))
+#define spin_is_locked(l)       ((l)->held)
+
+static inline void spin_lock(spinlock_t *l)
+{
+    BUG_ON(l->held);
+    l->held = 1;
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+    BUG_ON(!l->held);
+    l->held = 0;
+}
+
+static inline int spin_trylock(spinlock_t *l)
+{
+    if ( l->held )
+        return 0;
+    l->held = 1;
+    return 1;
+}
+
+#define local_irq_disable()             ((void)0)
+#define local_irq_enable()              ((void)0)
+#define local_irq_save(f)               ((void)((f) = 0))
+#define local_irq_restore(f)            ((void)(f))
+
+#define spin_lock_irq(l)                spin_lock(l)
+#define spin_unlock_irq(l)              spin_unlock(l)
+#define spin_lock_irqsave(l, f)         ({ local_irq_save(f); spin_lock(l); })
+#define spin_unlock_irqrestore(l, f)    ({ spin_unlock(l); local_irq_restore(f); })
+
+/*
+ * Time.
+ */
+typedef s64 s_time_t;
+#define PRI_stime               PRId64
+
+extern s_time_t sim_now;
+
+#define NOW()                   (sim_now)
+#define SECONDS(_s)             ((s_time_t)((_s) * 1000000000ULL))
+#define MILLISECS(_ms)          ((s_time_t)((_ms) * 1000000ULL))
+#define MICROSECS(_us)          ((s_time_t)((_us) * 1000ULL))
+#define STIME_MAX               ((s_time_t)((uint64_t)~0ull >> 1))
+
+/*
+ * CPUs, per-CPU data and CPU masks.
+ */
+#define NR_CPUS                 256
+#define MAX_NUMNODES            64
+
+extern unsigned int nr_cpu_ids;
+extern unsigned int sim_cpu;
+
+#define smp_processor_id()      (sim_cpu)
+
+#define DECLARE_PER_CPU(type, name) \
+    extern __typeof__(type) per_cpu__##name[NR_CPUS]
+#define DEFINE_PER_CPU(type, name) \
+    __typeof__(type) per_cpu__##name[NR_CPUS]
+#define DEFINE_PER_CPU_READ_MOSTLY(type, name) DEFINE_PER_CPU(type, name)
+#define per_cpu(var, cpu)       (per_cpu__##var[cpu])
+#define this_cpu(var)           per_cpu(var, smp_processor_id())
+
+typedef struct cpumask { unsigned long bits[BITS_TO_LONGS(NR_CPUS)]; } cpumask_t;
+typedef cpumask_t *cpumask_var_t;
+
+static inline void cpumask_set_cpu(int cpu, cpumask_t *dstp)
+{
+    dstp->bits[cpu / BITS_PER_LONG] |= 1UL << (cpu % BITS_PER_LONG);
+}
+
+static inline void cpumask_clear_cpu(int cpu, cpumask_t *dstp)
+{
+    dstp->bits[cpu / BITS_PER_LONG] &= ~(1UL << (cpu % BITS_PER_LONG));
+}
+
+static inline int cpumask_test_cpu(int cpu, const cpumask_t *srcp)
+{
+    return !!(srcp->bits[cpu / BITS_PER_LONG] & (1UL << (cpu % BITS_PER_LONG)));
+}
+
+static inline int cpumask_test_and_set_cpu(int cpu, cpumask_t *addr)
+{
+    int old = cpumask_test_cpu(cpu, addr);
+
+    cpumask_set_cpu(cpu, addr);
+    return old;
+}
+
+static inline int cpumask_test_and_clear_cpu(int cpu, cpumask_t *addr)
+{
+    int old = cpumask_test_cpu(cpu, addr);
+
+    cpumask_clear_cpu(cpu, addr);
+    return old;
+}
+
+static inline void cpumask_clear(cpumask_t *dstp)
+{
+    memset(dstp, 0, sizeof(*dstp));
+}
+
+static inline void cpumask_setall(cpumask_t *dstp)
+{
+    unsigned int cpu;
+
+    cpumask_clear(dstp);
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        cpumask_set_cpu(cpu, dstp);
+}
+
+static inline void cpumask_copy(cpumask_t *dstp, const cpumask_t *srcp)
+{
+    *dstp = *srcp;
+}
+
+#define __CPUMASK_OP(name, op)                                          \
+static inline void cpumask_##name(cpumask_t *dstp, const cpumask_t *src1p, \
+                                  const cpumask_t *src2p)              \
+{                                                                       \
+    unsigned int i;                                                     \
+                                                                        \
+    for ( i = 0; i < ARRAY_SIZE(dstp->bits); i++ )                      \
+        dstp->bits[i] = src1p->bits[i] op src2p->bits[i];               \
+}
+__CPUMASK_OP(and, &)
+__CPUMASK_OP(or, |)
+__CPUMASK_OP(xor, ^)
+__CPUMASK_OP(andnot, & ~)
+#undef __CPUMASK_OP
+
+static inline void cpumask_complement(cpumask_t *dstp, const cpumask_t *srcp)
+{
+    unsigned int cpu;
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        if ( cpumask_test_cpu(cpu, srcp) )
+            cpumask_clear_cpu(cpu, dstp);
+        else
+            cpumask_set_cpu(cpu, dstp);
+}
+
+static inline int cpumask_weight(const cpumask_t *srcp)
+{
+    unsigned int i;
+    int w = 0;
+
+    for ( i = 0; i < ARRAY_SIZE(srcp->bits); i++ )
+        w += __builtin_popcountl(srcp->bits[i]);
+    return w;
+}
+
+static inline int cpumask_empty(const cpumask_t *srcp)
+{
+    return cpumask_weight(srcp) == 0;
+}
+
+static inline int cpumask_full(const cpumask_t *srcp)
+{
+    return cpumask_weight(srcp) == nr_cpu_ids;
+}
+
+static inline int cpumask_equal(const cpumask_t *src1p, const cpumask_t *src2p)
+{
+    return !memcmp(src1p, src2p, sizeof(*src1p));
+}
+
+static inline int cpumask_intersects(const cpumask_t *src1p,
+                                     const cpumask_t *src2p)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(src1p->bits); i++ )
+        if ( src1p->bits[i] & src2p->bits[i] )
+            return 1;
+    return 0;
+}
+
+static inline int cpumask_subset(const cpumask_t *src1p,
+                                 const cpumask_t *src2p)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(src1p->bits); i++ )
+        if ( src1p->bits[i] & ~src2p->bits[i] )
+            return 0;
+    return 1;
+}
+
+/* Like the hypervisor's, these return nr_cpu_ids when there is no such CPU. */
+static inline int cpumask_next(int n, const cpumask_t *srcp)
+{
+    unsigned int cpu;
+
+    for ( cpu = n + 1; cpu < nr_cpu_ids; cpu++ )
+        if ( cpumask_test_cpu(cpu, srcp) )
+            return cpu;
+    return nr_cpu_ids;
+}
+
+#define cpumask_first(srcp)     cpumask_next(-1, srcp)
+
+static inline int cpumask_last(const cpumask_t *srcp)
+{
+    int cpu, last = nr_cpu_ids;
+
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        if ( cpumask_test_cpu(cpu, srcp) )
+            last = cpu;
+    return last;
+}
+
+static inline int cpumask_cycle(int n, const cpumask_t *srcp)
+{
+    int nxt = cpumask_next(n, srcp);
+
+    if ( nxt == nr_cpu_ids )
+        nxt = cpumask_first(srcp);
+    return nxt;
+}
+
+#define cpumask_any(srcp)       cpumask_first(srcp)
+
+#define for_each_cpu(cpu, mask)                         \
+    for ( (cpu) = cpumask_first(mask);                  \
+          (cpu) < nr_cpu_ids;                           \
+          (cpu) = cpumask_next(cpu, mask) )
+
+extern cpumask_t cpu_online_map;
+extern const cpumask_t *cpumask_of(unsigned int cpu);
+
+#define cpu_online(cpu)         cpumask_test_cpu(cpu, &cpu_online_map)
+#define num_online_cpus()       cpumask_weight(&cpu_online_map)
+#define for_each_online_cpu(cpu) for_each_cpu(cpu, &cpu_online_map)
+#define for_each_possible_cpu(cpu) \
+    for ( (cpu) = 0; (cpu) < nr_cpu_ids; (cpu)++ )
+
+static inline int alloc_cpumask_var(cpumask_var_t *mask)
+{
+    *mask = malloc(sizeof(cpumask_t));
+    return *mask != NULL;
+}
+
+static inline int zalloc_cpumask_var(cpumask_var_t *mask)
+{
+    *mask = calloc(1, sizeof(cpumask_t));
+    return *mask != NULL;
+}
+
+static inline void free_cpumask_var(cpumask_var_t mask)
+{
+    free(mask);
+}
+
+int cpumask_scnprintf(char *buf, int len, const cpumask_t *srcp);
+int cpulist_scnprintf(char *buf, int len, const cpumask_t *srcp);
+
+/*
+ * NUMA and CPU topology, as described on the simulator's command line.
+ */
+typedef struct { unsigned long bits[BITS_TO_LONGS(MAX_NUMNODES)]; } nodemask_t;
+
+#define node_set(node, mask)    ((void)((mask).bits[0] |= 1UL << (node)))
+#define node_clear(node, mask)  ((void)((mask).bits[0] &= ~(1UL << (node))))
+#define node_isset(node, mask)  (!!((mask).bits[0] & (1UL << (node))))
+#define nodes_clear(mask)       ((void)((mask).bits[0] = 0))
+#define nodes_empty(mask)       ((mask).bits[0] == 0)
+#define nodes_weight(mask)      __builtin_popcountl((mask).bits[0])
+#define for_each_node_mask(node, mask)                  \
+    for ( (node) = 0; (node) < MAX_NUMNODES; (node)++ ) \
+        if ( node_isset(node, mask) )
+
+extern unsigned int sim_nr_nodes;
+extern unsigned int sim_cpu_socket[NR_CPUS];
+extern unsigned int sim_cpu_core[NR_CPUS];
+extern unsigned int sim_cpu_node[NR_CPUS];
+extern cpumask_t sim_node_cpumask[MAX_NUMNODES];
+
+#define cpu_to_socket(cpu)      (sim_cpu_socket[cpu])
+#define cpu_to_core(cpu)        (sim_cpu_core[cpu])
+#define cpu_to_node(cpu)        (sim_cpu_node[cpu])
+#define node_to_cpumask(node)   (sim_node_cpumask[node])
+#define num_online_nodes()      (sim_nr_nodes)
+
+DECLARE_PER_CPU(cpumask_var_t, cpu_sibling_mask);
+DECLARE_PER_CPU(cpumask_var_t, cpu_core_mask);
+
+/*
+ * Timers. All of them live in one list, and the simulator fires whichever
+ * expires first.
+ */
+struct timer {
+    s_time_t expires;
+    void (*function)(void *);
+    void *data;
+    unsigned int cpu;
+    bool_t active;
+    bool_t killed;
+    struct timer *sim_next;
+};
+
+void init_timer(struct timer *timer, void (*function)(void *), void *data,
+                unsigned int cpu);
+void set_timer(struct timer *timer, s_time_t expires);
+void stop_timer(struct timer *timer);
+void migrate_timer(struct timer *timer, unsigned int new_cpu);
+void kill_timer(struct timer *timer);
+
+static inline int active_timer(struct timer *timer)
+{
+    return timer->active;
+}
+
+/*
+ * Softirqs. Only SCHEDULE_SOFTIRQ means anything to the simulator.
+ */
+enum {
+    TIMER_SOFTIRQ = 0,
+    SCHEDULE_SOFTIRQ,
+    NEW_TLBFLUSH_CLOCK_PERIOD_SOFTIRQ,
+    RCU_SOFTIRQ,
+    TASKLET_SOFTIRQ,
+    NR_COMMON_SOFTIRQS
+};
+
+void cpu_raise_softirq(unsigned int cpu, unsigned int nr);
+void cpumask_raise_softirq(const cpumask_t *mask, unsigned int nr);
+#define raise_softirq(nr)       cpu_raise_softirq(smp_processor_id(), nr)
+
+/*
+ * CPU notifiers: CPUs never come and go in the simulator.
+ */
+struct notifier_block {
+    int (*notifier_call)(struct notifier_block *, unsigned long, void *);
+    struct notifier_block *next;
+    int priority;
+};
+
+#define NOTIFY_DONE             0x0000
+#define NOTIFY_OK               0x0001
+#define NOTIFY_STOP_MASK        0x8000
+#define NOTIFY_BAD              (NOTIFY_STOP_MASK|0x0002)
+#define notifier_from_errno(e)  ((e) ? (NOTIFY_STOP_MASK | -(e)) : NOTIFY_DONE)
+
+#define CPU_UP_PREPARE          (0x0001 | NOTIFY_FORWARD)
+#define CPU_UP_CANCELED         (0x0002 | NOTIFY_REVERSE)
+#define CPU_STARTING            (0x0003 | NOTIFY_FORWARD)
+#define CPU_ONLINE              (0x0004 | NOTIFY_FORWARD)
+#define CPU_DOWN_PREPARE        (0x0005 | NOTIFY_REVERSE)
+#define CPU_DOWN_FAILED         (0x0006 | NOTIFY_FORWARD)
+#define CPU_DYING               (0x0007 | NOTIFY_REVERSE)
+#define CPU_DEAD                (0x0008 | NOTIFY_REVERSE)
+#define NOTIFY_FORWARD          0x10000
+#define NOTIFY_REVERSE          0x20000
+
+static inline void register_cpu_notifier(struct notifier_block *nb)
+{
+    (void)nb;
+}
+
+/*
+ * Command line parameters: the simulator accepts the schedulers' boot
+ * parameters as "name=value" arguments.
+ */
+struct kernel_param {
+    const char *name;
+    enum { OPT_STR, OPT_UINT, OPT_BOOL, OPT_CUSTOM } type;
+    void *var;
+    unsigned int len;
+    struct kernel_param *next;
+};
+
+void sim_register_param(struct kernel_param *param);
+
+#define __param(_name, _type, _var, _len)                               \
+    static struct kernel_param __param_##_var =                         \
+        { _name, _type, (void *)&_var, _len, NULL };                    \
+    static void __attribute__((__constructor__))                        \
+    __param_register_##_var(void)                                       \
+    {                                                                   \
+        sim_register_param(&__param_##_var);                            \
+    }
+#define custom_param(_name, _var)   __param(_name, OPT_CUSTOM, _var, 0)
+#define boolean_param(_name, _var)  __param(_name, OPT_BOOL, _var, sizeof(_var))
+#define integer_param(_name, _var)  __param(_name, OPT_UINT, _var, sizeof(_var))
+#define string_param(_name, _var)   __param(_name, OPT_STR, _var, sizeof(_var))
+
+/*
+ * Tracing is not simulated.
+ */
+#define tb_init_done            0
+
+static inline void __trace_var(u32 event, bool_t cycles, unsigned int extra,
+                               const void *extra_data)
+{
+    (void)event; (void)cycles; (void)extra; (void)extra_data;
+}
+
+static inline void trace_var(u32 event, int cycles, int extra,
+                             const void *extra_data)
+{
+    (void)event; (void)cycles; (void)extra; (void)extra_data;
+}
+
+#define TRACE_0D(e)                         ((void)(e))
+#define TRACE_1D(e,d1)                      ((void)(e), (void)(d1))
+#define TRACE_2D(e,d1,d2)                   ((void)(d1), TRACE_1D(e,d2))
+#define TRACE_3D(e,d1,d2,d3)                ((void)(d1), TRACE_2D(e,d2,d3))
+#define TRACE_4D(e,d1,d2,d3,d4)             ((void)(d1), TRACE_3D(e,d2,d3,d4))
+#define TRACE_5D(e,d1,d2,d3,d4,d5)          ((void)(d1), TRACE_4D(e,d2,d3,d4,d5))
+#define TRACE_6D(e,d1,d2,d3,d4,d5,d6)       ((void)(d1), TRACE_5D(e,d2,d3,d4,d5,d6))
+
+/*
+ * Performance counters, counted and reported by the simulator.
+ */
+#define NR_hypercalls           64
+
+#define PERFCOUNTER(var, name)              PERFC_##var,
+#define PERFCOUNTER_ARRAY(var, name, size)  PERFC_##var, \
+                                            PERFC_LAST_##var = PERFC_##var + (size) - 1,
+#define PERFSTATUS(var, name)               PERFC_##var,
+#define PERFSTATUS_ARRAY(var, name, size)   PERFCOUNTER_ARRAY(var, name, size)
+enum perfcounter {
+#include <xen/perfc_defn.h>
+    NUM_PERFCOUNTERS
+};
+#undef PERFCOUNTER
+#undef PERFCOUNTER_ARRAY
+#undef PERFSTATUS
+#undef PERFSTATUS_ARRAY
+
+extern unsigned long sim_perfc[NUM_PERFCOUNTERS];
+
+#define perfc_incr(x)           ((void)sim_perfc[PERFC_##x]++)
+#define perfc_decr(x)           ((void)sim_perfc[PERFC_##x]--)
+#define perfc_add(x, v)         ((void)(sim_perfc[PERFC_##x] += (v)))
+#define perfc_set(x, v)         ((void)(sim_perfc[PERFC_##x] = (v)))
+#define perfc_incra(x, y)       ((void)sim_perfc[PERFC_##x + (y)]++)
+
+/*
+ * Domains and VCPUs: the fields the schedulers look at, plus the
+ * simulator's own bookkeeping.
+ */
+struct sim_phase {
+    s_time_t sleep;                 /* blocked for this long, then ... */
+    s_time_t run;                   /* ... needs this much CPU time */
+};
+
+struct sim_vcpu_stats {
+    s_time_t run_time;
+    s_time_t wait_time;
+    unsigned long wakeups;
+    unsigned long switches;
+    unsigned long migrations;
+    s_time_t lat_total;
+    s_time_t lat_max;
+    uint32_t lat_hist[512];         /* see sim_hist_bucket() */
+};
+
+struct vcpu {
+    int              vcpu_id;
+    int              processor;
+    struct vcpu_runstate_info runstate;
+    uint64_t         last_run_time;
+    struct vcpu     *next_in_list;
+    struct domain   *domain;
+    void            *sched_priv;
+    bool_t           is_running;
+    bool_t           is_urgent;
+    unsigned long    pause_flags;
+    atomic_t         pause_count;
+    cpumask_var_t    cpu_affinity;
+
+    /* Simulator state */
+    struct sim_phase *phases;
+    unsigned int     nr_phases, phase;
+    bool_t           loop_phases;   /* synthetic workloads never end */
+    s_time_t         remaining;     /* CPU time left in the current burst */
+    s_time_t         wake_at;       /* when blocked: next wakeup, or -1 */
+    s_time_t         dispatched;    /* when it last started running */
+    int              last_cpu;
+    bool_t           woken;         /* runnable because it woke up ... */
+    s_time_t         woken_at;      /* ... at this time */
+    struct sim_vcpu_stats stats;
+};
+
+struct cpupool;
+
+struct domain {
+    domid_t          domain_id;
+    unsigned int     max_vcpus;
+    struct vcpu    **vcpu;
+    void            *sched_priv;
+    struct cpupool  *cpupool;
+    nodemask_t       node_affinity;
+    bool_t           auto_node_affinity;
+    bool_t           is_pinned;
+    atomic_t         pause_count;
+    struct domain   *next_in_list;
+
+    /* Simulator state */
+    unsigned int     sim_weight;
+};
+
+#define _VPF_blocked            0
+#define VPF_blocked             (1UL<<_VPF_blocked)
+#define _VPF_down               1
+#define VPF_down                (1UL<<_VPF_down)
+#define _VPF_blocked_in_xen     2
+#define VPF_blocked_in_xen      (1UL<<_VPF_blocked_in_xen)
+#define _VPF_migrating          3
+#define VPF_migrating           (1UL<<_VPF_migrating)
+
+#define for_each_vcpu(_d,_v)                    \
+ for ( (_v) = (_d)->vcpu ? (_d)->vcpu[0] : NULL; \
+       (_v) != NULL;                            \
+       (_v) = (_v)->next_in_list )
+
+#define is_idle_domain(d)       ((d)->domain_id == DOMID_IDLE)
+#define is_idle_vcpu(v)         (is_idle_domain((v)->domain))
+
+static inline int vcpu_runnable(struct vcpu *v)
+{
+    return !(v->pause_flags |
+             atomic_read(&v->pause_count) |
+             atomic_read(&v->domain->pause_count));
+}
+
+extern struct vcpu *idle_vcpu[NR_CPUS];
+extern struct vcpu *sim_current[NR_CPUS];
+
+#define current                 (sim_current[smp_processor_id()])
+
+void vcpu_pause_nosync(struct vcpu *v);
+void vcpu_unpause(struct vcpu *v);
+void vcpu_wake(struct vcpu *v);
+void vcpu_sleep_nosync(struct vcpu *v);
+
+#define SCHED_STAT_CRANK(_X)    (perfc_incr(_X))
+
+extern bool_t sched_smt_power_savings;
+
+extern char keyhandler_scratch[1024];
+
+#include <xen/list.h>
+
+#endif /* __SCHEDSIM_H__ */
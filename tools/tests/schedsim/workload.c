@@ -0,0 +1,325 @@
+/******************************************************************************
+ * workload.c
+ *
+ * Workloads for the scheduler simulator.
+ *
+ * A workload file describes domains, one per line:
+ *
+ *   domain <id> [vcpus=N] [weight=N] [cap=N] [gang=0|1] [nodes=N,N...]
+ *               [period=us] [budget=us] [run=us] [sleep=us]
+ *
+ * Each vcpu of the domain needs the CPU for 'run' microseconds, then blocks
+ * for 'sleep' microseconds, forever.  Without 'sleep' the vcpus never block.
+ * A domain described by several lines takes the last 'run' and 'sleep'.
+ *
+ * A xentrace recording of the scheduler class (xentrace -e 0x0002f000) is
+ * turned into the same thing, from the runstate changes of every vcpu: the
+ * time spent running between two blocks is a burst, the time spent blocked
+ * before the next wakeup is the following sleep.  Time spent waiting for a
+ * CPU is what the scheduler is responsible for, so it is dropped.  Lines of
+ * a workload file then only set parameters of the traced domains.
+ */
+
+#include "schedsim.h"
+#include "workload.h"
+
+static struct sim_domain_desc *get_domain(struct sim_workload *wl,
+                                          domid_t domid)
+{
+    struct sim_domain_desc *desc;
+    unsigned int i;
+
+    for ( i = 0; i < wl->nr_domains; i++ )
+        if ( wl->domains[i].domid == domid )
+            return &wl->domains[i];
+
+    wl->domains = realloc(wl->domains,
+                          (wl->nr_domains + 1) * sizeof(*wl->domains));
+    if ( wl->domains == NULL )
+        BUG();
+    desc = &wl->domains[wl->nr_domains++];
+    memset(desc, 0, sizeof(*desc));
+    desc->domid = domid;
+    desc->weight = 256;
+
+    return desc;
+}
+
+static void set_vcpus(struct sim_domain_desc *desc, unsigned int nr)
+{
+    if ( nr <= desc->nr_vcpus )
+        return;
+
+    desc->vcpu = realloc(desc->vcpu, nr * sizeof(*desc->vcpu));
+    if ( desc->vcpu == NULL )
+        BUG();
+    memset(&desc->vcpu[desc->nr_vcpus], 0,
+           (nr - desc->nr_vcpus) * sizeof(*desc->vcpu));
+    desc->nr_vcpus = nr;
+}
+
+static void add_phase(struct sim_vcpu_desc *vdesc, s_time_t sleep,
+                      s_time_t run)
+{
+    if ( vdesc->nr_phases == vdesc->max_phases )
+    {
+        vdesc->max_phases = vdesc->max_phases ? vdesc->max_phases * 2 : 16;
+        vdesc->phases = realloc(vdesc->phases,
+                                vdesc->max_phases * sizeof(*vdesc->phases));
+        if ( vdesc->phases == NULL )
+            BUG();
+    }
+    vdesc->phases[vdesc->nr_phases].sleep = sleep;
+    vdesc->phases[vdesc->nr_phases].run = run;
+    vdesc->nr_phases++;
+}
+
+int workload_parse_file(struct sim_workload *wl, const char *path)
+{
+    char line[256], *tok, *val, *pos, *npos;
+    unsigned int lineno = 0, i;
+    FILE *f = fopen(path, "r");
+
+    if ( f == NULL )
+    {
+        perror(path);
+        return -1;
+    }
+
+    while ( fgets(line, sizeof(line), f) )
+    {
+        struct sim_domain_desc *desc;
+        s_time_t run = 0, sleep = 0;
+        unsigned int vcpus = 1;
+
+        lineno++;
+        if ( (tok = strchr(line, '#')) != NULL )
+            *tok = '\0';
+        if ( (tok = strtok_r(line, " \t\n", &pos)) == NULL )
+            continue;
+        if ( strcmp(tok, "domain") ||
+             (tok = strtok_r(NULL, " \t\n", &pos)) == NULL )
+            goto bad;
+
+        desc = get_domain(wl, strtoul(tok, NULL, 0));
+
+        while ( (tok = strtok_r(NULL, " \t\n", &pos)) != NULL )
+        {
+            if ( (val = strchr(tok, '=')) == NULL )
+                goto bad;
+            *val++ = '\0';
+
+            if ( !strcmp(tok, "vcpus") )
+                vcpus = strtoul(val, NULL, 0);
+            else if ( !strcmp(tok, "weight") )
+                desc->weight = strtoul(val, NULL, 0);
+            else if ( !strcmp(tok, "cap") )
+                desc->cap = strtoul(val, NULL, 0);
+            else if ( !strcmp(tok, "gang") )
+                desc->gang = !!strtoul(val, NULL, 0);
+            else if ( !strcmp(tok, "period") )
+                desc->period = strtoul(val, NULL, 0);
+            else if ( !strcmp(tok, "budget") )
+                desc->budget = strtoul(val, NULL, 0);
+            else if ( !strcmp(tok, "nodes") )
+                for ( val = strtok_r(val, ",", &npos); val != NULL;
+                      val = strtok_r(NULL, ",", &npos) )
+                    node_set(strtoul(val, NULL, 0), desc->nodes);
+            else if ( !strcmp(tok, "run") )
+                run = MICROSECS(strtoull(val, NULL, 0));
+            else if ( !strcmp(tok, "sleep") )
+                sleep = MICROSECS(strtoull(val, NULL, 0));
+            else
+                goto bad;
+        }
+
+        if ( vcpus == 0 || desc->weight == 0 )
+            goto bad;
+        set_vcpus(desc, vcpus);
+
+        desc->loop = 1;
+        for ( i = 0; i < desc->nr_vcpus; i++ )
+        {
+            if ( !run && !sleep && desc->vcpu[i].nr_phases )
+                continue;
+            desc->vcpu[i].nr_phases = 0;
+            add_phase(&desc->vcpu[i], sleep, run);
+        }
+    }
+
+    fclose(f);
+    return 0;
+
+ bad:
+    fprintf(stderr, "%s:%u: malformed line\n", path, lineno);
+    fclose(f);
+    return -1;
+}
+
+/*
+ * Trace records, as written by xentrace: a header word, the TSC if bit 31
+ * of the header is set, then up to 7 words of data.
+ */
+#define TRC_HDR_EXTRA(h)        (((h) >> 28) & 7)
+#define TRC_HDR_CYCLES(h)       ((h) >> 31)
+#define TRC_HDR_EVENT(h)        ((h) & 0x0fffffff)
+
+struct runstate_rec {
+    uint64_t tsc;
+    domid_t domid;
+    unsigned int vcpu;
+    unsigned int old, new;
+    unsigned long seq;              /* keeps qsort() stable */
+};
+
+static int rec_cmp(const void *a, const void *b)
+{
+    const struct runstate_rec *ra = a, *rb = b;
+
+    if ( ra->tsc != rb->tsc )
+        return ra->tsc < rb->tsc ? -1 : 1;
+    return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static s_time_t tsc_to_ns(uint64_t delta, unsigned long long khz)
+{
+    return (delta / khz) * 1000000ULL + (delta % khz) * 1000000ULL / khz;
+}
+
+/* Per-vcpu state while turning runstate changes into phases. */
+struct vcpu_track {
+    domid_t domid;
+    unsigned int vcpu;
+    unsigned int state;
+    uint64_t since;
+    s_time_t run, sleep;
+};
+
+int workload_parse_trace(struct sim_workload *wl, const char *path,
+                         unsigned long long tsc_khz)
+{
+    struct runstate_rec *recs = NULL;
+    unsigned long nr = 0, max = 0, i;
+    struct vcpu_track *tracks = NULL;
+    unsigned int nr_tracks = 0, j;
+    uint64_t start, end;
+    uint32_t hdr, data[9];
+    FILE *f = fopen(path, "rb");
+
+    if ( f == NULL )
+    {
+        perror(path);
+        return -1;
+    }
+
+    /* The trace replaces whatever the workload file said the vcpus do. */
+    for ( j = 0; j < wl->nr_domains; j++ )
+    {
+        wl->domains[j].loop = 0;
+        for ( i = 0; i < wl->domains[j].nr_vcpus; i++ )
+            wl->domains[j].vcpu[i].nr_phases = 0;
+    }
+
+    while ( fread(&hdr, sizeof(hdr), 1, f) == 1 )
+    {
+        unsigned int n = TRC_HDR_EXTRA(hdr) + (TRC_HDR_CYCLES(hdr) ? 2 : 0);
+        uint32_t event = TRC_HDR_EVENT(hdr);
+
+        if ( n && fread(data, sizeof(data[0]), n, f) != n )
+            break;
+
+        /* Old and new state are encoded in the event. */
+        if ( (event & ~0xff0U) != TRC_SCHED_RUNSTATE_CHANGE ||
+             !TRC_HDR_CYCLES(hdr) || TRC_HDR_EXTRA(hdr) < 1 )
+            continue;
+        if ( (data[2] >> 16) == DOMID_IDLE )
+            continue;
+
+        if ( nr == max )
+        {
+            max = max ? max * 2 : 4096;
+            recs = realloc(recs, max * sizeof(*recs));
+            if ( recs == NULL )
+                BUG();
+        }
+        recs[nr].tsc = ((uint64_t)data[1] << 32) | data[0];
+        recs[nr].vcpu = data[2] & 0xffff;
+        recs[nr].domid = data[2] >> 16;
+        recs[nr].old = (event >> 8) & 0x3;
+        recs[nr].new = (event >> 4) & 0x3;
+        recs[nr].seq = nr;
+        nr++;
+    }
+    fclose(f);
+
+    if ( nr == 0 )
+    {
+        fprintf(stderr, "%s: no runstate changes found\n", path);
+        free(recs);
+        return -1;
+    }
+
+    /* Each CPU's buffer is written out separately. */
+    qsort(recs, nr, sizeof(*recs), rec_cmp);
+    start = recs[0].tsc;
+    end = recs[nr - 1].tsc;
+    wl->length = tsc_to_ns(end - start, tsc_khz);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct runstate_rec *r = &recs[i];
+        struct vcpu_track *t = NULL;
+        s_time_t delta;
+
+        for ( j = 0; j < nr_tracks; j++ )
+            if ( tracks[j].domid == r->domid && tracks[j].vcpu == r->vcpu )
+                t = &tracks[j];
+        if ( t == NULL )
+        {
+            tracks = realloc(tracks, (nr_tracks + 1) * sizeof(*tracks));
+            if ( tracks == NULL )
+                BUG();
+            t = &tracks[nr_tracks++];
+            memset(t, 0, sizeof(*t));
+            t->domid = r->domid;
+            t->vcpu = r->vcpu;
+            t->state = r->old;
+            t->since = start;
+        }
+
+        delta = tsc_to_ns(r->tsc - t->since, tsc_khz);
+        if ( r->old == RUNSTATE_running )
+            t->run += delta;
+        else if ( r->old >= RUNSTATE_blocked )
+            t->sleep += delta;
+
+        if ( r->new >= RUNSTATE_blocked && t->run )
+        {
+            struct sim_domain_desc *desc = get_domain(wl, t->domid);
+
+            set_vcpus(desc, t->vcpu + 1);
+            add_phase(&desc->vcpu[t->vcpu], t->sleep, t->run);
+            t->run = t->sleep = 0;
+        }
+
+        t->state = r->new;
+        t->since = r->tsc;
+    }
+
+    /* Whatever was still running at the end is a last, truncated burst. */
+    for ( j = 0; j < nr_tracks; j++ )
+    {
+        struct vcpu_track *t = &tracks[j];
+        struct sim_domain_desc *desc = get_domain(wl, t->domid);
+
+        set_vcpus(desc, t->vcpu + 1);
+        if ( t->state == RUNSTATE_running )
+            t->run += tsc_to_ns(end - t->since, tsc_khz);
+        if ( t->run )
+            add_phase(&desc->vcpu[t->vcpu], t->sleep, t->run);
+    }
+
+    free(tracks);
+    free(recs);
+    return 0;
+}
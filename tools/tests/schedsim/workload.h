@@ -0,0 +1,34 @@
+#ifndef __SCHEDSIM_WORKLOAD_H__
+#define __SCHEDSIM_WORKLOAD_H__
+
+/* xenalyze assumes the same when not told the TSC frequency. */
+#define DEFAULT_TSC_KHZ         2400000ULL
+
+struct sim_vcpu_desc {
+    struct sim_phase *phases;
+    unsigned int nr_phases, max_phases;
+};
+
+struct sim_domain_desc {
+    domid_t domid;
+    unsigned int nr_vcpus;
+    struct sim_vcpu_desc *vcpu;
+    unsigned int weight;
+    uint16_t cap;
+    unsigned int period, budget;    /* rtds, in us; 0 for the default */
+    bool_t gang;
+    bool_t loop;                    /* repeat the phases forever */
+    nodemask_t nodes;
+};
+
+struct sim_workload {
+    struct sim_domain_desc *domains;
+    unsigned int nr_domains;
+    s_time_t length;                /* of the trace, if any */
+};
+
+int workload_parse_file(struct sim_workload *wl, const char *path);
+int workload_parse_trace(struct sim_workload *wl, const char *path,
+                         unsigned long long tsc_khz);
+
+#endif /* __SCHEDSIM_WORKLOAD_H__ */
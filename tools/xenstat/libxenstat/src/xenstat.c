@@ -510,8 +510,20 @@ static int xenstat_collect_vcpus(xenstat_node * node)
 				}
 			}
 			else {
-				node->domains[i].vcpus[vcpu].online = info.online;
-				node->domains[i].vcpus[vcpu].ns = info.cpu_time;
+				xenstat_vcpu *v = &node->domains[i].vcpus[vcpu];
+
+				v->online = info.online;
+				v->ns = info.cpu_time;
+				/* Not fatal: the hypervisor may not keep them */
+				if (xc_vcpu_sched_hist(node->handle->xc_handle,
+						       node->domains[i].id, vcpu,
+						       v->wait_hist,
+						       v->run_hist, 0) != 0) {
+					memset(v->wait_hist, 0,
+					       sizeof(v->wait_hist));
+					memset(v->run_hist, 0,
+					       sizeof(v->run_hist));
+				}
 			}
 		}
 	}
@@ -543,6 +555,21 @@ unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu)
 	return vcpu->ns;
 }
 
+/* Get VCPU scheduling latency histograms */
+unsigned int xenstat_vcpu_wait_hist(xenstat_vcpu * vcpu, unsigned int bucket)
+{
+	if (bucket >= XENSTAT_SCHED_HIST_BUCKETS)
+		return 0;
+	return vcpu->wait_hist[bucket];
+}
+
+unsigned int xenstat_vcpu_run_hist(xenstat_vcpu * vcpu, unsigned int bucket)
+{
+	if (bucket >= XENSTAT_SCHED_HIST_BUCKETS)
+		return 0;
+	return vcpu->run_hist[bucket];
+}
+
 /*
  * Network functions
  */
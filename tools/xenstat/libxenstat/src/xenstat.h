@@ -144,6 +144,14 @@ xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain);
 unsigned int xenstat_vcpu_online(xenstat_vcpu * vcpu);
 unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu);
 
+/* Get VCPU scheduling latency histograms: how long the VCPU waited for a
+ * CPU each time it became runnable, and how long it then ran for.  Bucket
+ * 0 counts intervals shorter than 1024ns, bucket i intervals in
+ * [2^(i+9), 2^(i+10)) ns, and the last bucket everything longer. */
+#define XENSTAT_SCHED_HIST_BUCKETS 24
+unsigned int xenstat_vcpu_wait_hist(xenstat_vcpu * vcpu, unsigned int bucket);
+unsigned int xenstat_vcpu_run_hist(xenstat_vcpu * vcpu, unsigned int bucket);
+
 
 /*
  * Network functions - extract information from a xenstat_network
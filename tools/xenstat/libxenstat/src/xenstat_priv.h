@@ -76,9 +76,15 @@ struct xenstat_domain {
 	xenstat_tmem tmem_stats;
 };
 
+#if XENSTAT_SCHED_HIST_BUCKETS != XEN_DOMCTL_SCHED_HIST_BUCKETS
+#error "XENSTAT_SCHED_HIST_BUCKETS does not match the hypervisor"
+#endif
+
 struct xenstat_vcpu {
 	unsigned int online;
 	unsigned long long ns;
+	uint32_t wait_hist[XENSTAT_SCHED_HIST_BUCKETS];
+	uint32_t run_hist[XENSTAT_SCHED_HIST_BUCKETS];
 };
 
 struct xenstat_network {
@@ -105,6 +105,8 @@ static void print_maxmem(xenstat_domain *domain);
 static void print_max_pct(xenstat_domain *domain);
 static int compare_vcpus(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_vcpus(xenstat_domain *domain);
+static int compare_vcpu_wait(xenstat_domain *domain1, xenstat_domain *domain2);
+static void print_vcpu_wait(xenstat_domain *domain);
 static int compare_nets(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_nets(xenstat_domain *domain);
 static int compare_net_tx(xenstat_domain *domain1, xenstat_domain *domain2);
@@ -151,6 +153,7 @@ typedef enum field_id {
 	FIELD_MAXMEM,
 	FIELD_MAX_PCT,
 	FIELD_VCPUS,
+	FIELD_VCPU_WAIT,
 	FIELD_NETS,
 	FIELD_NET_TX,
 	FIELD_NET_RX,
@@ -181,6 +184,7 @@ field fields[] = {
 	{ FIELD_MAXMEM,    "MAXMEM(k)", 10, compare_maxmem,    print_maxmem  },
 	{ FIELD_MAX_PCT,   "MAXMEM(%)",  9, compare_maxmem,    print_max_pct },
 	{ FIELD_VCPUS,     "VCPUS",      5, compare_vcpus,     print_vcpus   },
+	{ FIELD_VCPU_WAIT, "WAIT99(us)", 10, compare_vcpu_wait, print_vcpu_wait },
 	{ FIELD_NETS,      "NETS",       4, compare_nets,      print_nets    },
 	{ FIELD_NET_TX,    "NETTX(k)",   8, compare_net_tx,    print_net_tx  },
 	{ FIELD_NET_RX,    "NETRX(k)",   8, compare_net_rx,    print_net_rx  },
@@ -598,6 +602,70 @@ static void print_vcpus(xenstat_domain *domain)
 	print("%5u", xenstat_domain_num_vcpus(domain));
 }
 
+/* Computes the time, in microseconds, within which the domain's VCPUs got
+ * a CPU in 99% of the cases where they became runnable since the previous
+ * sample.  This is the upper bound of a histogram bucket, so within a
+ * factor of two of the real value. */
+static unsigned long long get_vcpu_wait_p99(xenstat_domain *domain)
+{
+	xenstat_domain *old_domain = NULL;
+	unsigned long long hist[XENSTAT_SCHED_HIST_BUCKETS] = { 0 };
+	unsigned long long total = 0, seen = 0;
+	unsigned int i, b;
+
+	if (prev_node != NULL)
+		old_domain = xenstat_node_domain(prev_node,
+						 xenstat_domain_id(domain));
+
+	for (i = 0; i < xenstat_domain_num_vcpus(domain); i++) {
+		xenstat_vcpu *vcpu = xenstat_domain_vcpu(domain, i);
+		xenstat_vcpu *old_vcpu = NULL;
+
+		if (old_domain != NULL)
+			old_vcpu = xenstat_domain_vcpu(old_domain, i);
+
+		/* A count going backwards means the histogram was reset (or
+		 * the domid reused, or the old sample failed): take the new
+		 * counts as they are. */
+		for (b = 0; old_vcpu != NULL &&
+			    b < XENSTAT_SCHED_HIST_BUCKETS; b++)
+			if (xenstat_vcpu_wait_hist(vcpu, b) <
+			    xenstat_vcpu_wait_hist(old_vcpu, b))
+				old_vcpu = NULL;
+
+		for (b = 0; b < XENSTAT_SCHED_HIST_BUCKETS; b++) {
+			unsigned int n = xenstat_vcpu_wait_hist(vcpu, b);
+
+			if (old_vcpu != NULL)
+				n -= xenstat_vcpu_wait_hist(old_vcpu, b);
+			hist[b] += n;
+			total += n;
+		}
+	}
+
+	for (b = 0; b < XENSTAT_SCHED_HIST_BUCKETS && total; b++) {
+		seen += hist[b];
+		if (seen * 100 >= total * 99)
+			return ((1ULL << (b + 10)) + 999) / 1000;
+	}
+
+	return 0;
+}
+
+/* Compares VCPU scheduling latencies of two domains, returning -1,0,1 for
+ * <,=,> */
+static int compare_vcpu_wait(xenstat_domain *domain1, xenstat_domain *domain2)
+{
+	return -compare(get_vcpu_wait_p99(domain1),
+	                get_vcpu_wait_p99(domain2));
+}
+
+/* Prints VCPU scheduling latency statistic */
+static void print_vcpu_wait(xenstat_domain *domain)
+{
+	print("%10llu", get_vcpu_wait_p99(domain));
+}
+
 /* Compares number of virtual networks of two domains, returning -1,0,1 for
  * <,=,> */
 static int compare_nets(xenstat_domain *domain1, xenstat_domain *domain2)
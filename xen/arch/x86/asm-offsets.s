@@ -0,0 +1,850 @@
+	.file	"asm-offsets.c"
+	.text
+.Ltext0:
+	.cfi_sections	.debug_frame
+	.file 0 "/root/repo/xen/arch/x86" "x86_64/asm-offsets.c"
+	.globl	__dummy__
+	.hidden	__dummy__
+	.type	__dummy__, @function
+__dummy__:
+.LFB387:
+	.file 1 "x86_64/asm-offsets.c"
+	.loc 1 31 1 view -0
+	.cfi_startproc
+	.loc 1 32 5 view .LVU1
+#APP
+# 32 "x86_64/asm-offsets.c" 1
+	
+->UREGS_r15 $0 offsetof(struct cpu_user_regs, r15)
+# 0 "" 2
+	.loc 1 32 49 view .LVU2
+	.loc 1 33 5 view .LVU3
+# 33 "x86_64/asm-offsets.c" 1
+	
+->UREGS_r14 $8 offsetof(struct cpu_user_regs, r14)
+# 0 "" 2
+	.loc 1 33 49 view .LVU4
+	.loc 1 34 5 view .LVU5
+# 34 "x86_64/asm-offsets.c" 1
+	
+->UREGS_r13 $16 offsetof(struct cpu_user_regs, r13)
+# 0 "" 2
+	.loc 1 34 49 view .LVU6
+	.loc 1 35 5 view .LVU7
+# 35 "x86_64/asm-offsets.c" 1
+	
+->UREGS_r12 $24 offsetof(struct cpu_user_regs, r12)
+# 0 "" 2
+	.loc 1 35 49 view .LVU8
+	.loc 1 36 5 view .LVU9
+# 36 "x86_64/asm-offsets.c" 1
+	
+->UREGS_rbp $32 offsetof(struct cpu_user_regs, rbp)
+# 0 "" 2
+	.loc 1 36 49 view .LVU10
+	.loc 1 37 5 view .LVU11
+# 37 "x86_64/asm-offsets.c" 1
+	
+->UREGS_rbx $40 offsetof(struct cpu_user_regs, rbx)
+# 0 "" 2
+	.loc 1 37 49 view .LVU12
+	.loc 1 38 5 view .LVU13
+# 38 "x86_64/asm-offsets.c" 1
+	
+->UREGS_r11 $48 offsetof(struct cpu_user_regs, r11)
+# 0 "" 2
+	.loc 1 38 49 view .LVU14
+	.loc 1 39 5 view .LVU15
+# 39 "x86_64/asm-offsets.c" 1
+	
+->UREGS_r10 $56 offsetof(struct cpu_user_regs, r10)
+# 0 "" 2
+	.loc 1 39 49 view .LVU16
+	.loc 1 40 5 view .LVU17
+# 40 "x86_64/asm-offsets.c" 1
+	
+->UREGS_r9 $64 offsetof(struct cpu_user_regs, r9)
+# 0 "" 2
+	.loc 1 40 47 view .LVU18
+	.loc 1 41 5 view .LVU19
+# 41 "x86_64/asm-offsets.c" 1
+	
+->UREGS_r8 $72 offsetof(struct cpu_user_regs, r8)
+# 0 "" 2
+	.loc 1 41 47 view .LVU20
+	.loc 1 42 5 view .LVU21
+# 42 "x86_64/asm-offsets.c" 1
+	
+->UREGS_rax $80 offsetof(struct cpu_user_regs, rax)
+# 0 "" 2
+	.loc 1 42 49 view .LVU22
+	.loc 1 43 5 view .LVU23
+# 43 "x86_64/asm-offsets.c" 1
+	
+->UREGS_rcx $88 offsetof(struct cpu_user_regs, rcx)
+# 0 "" 2
+	.loc 1 43 49 view .LVU24
+	.loc 1 44 5 view .LVU25
+# 44 "x86_64/asm-offsets.c" 1
+	
+->UREGS_rdx $96 offsetof(struct cpu_user_regs, rdx)
+# 0 "" 2
+	.loc 1 44 49 view .LVU26
+	.loc 1 45 5 view .LVU27
+# 45 "x86_64/asm-offsets.c" 1
+	
+->UREGS_rsi $104 offsetof(struct cpu_user_regs, rsi)
+# 0 "" 2
+	.loc 1 45 49 view .LVU28
+	.loc 1 46 5 view .LVU29
+# 46 "x86_64/asm-offsets.c" 1
+	
+->UREGS_rdi $112 offsetof(struct cpu_user_regs, rdi)
+# 0 "" 2
+	.loc 1 46 49 view .LVU30
+	.loc 1 47 5 view .LVU31
+# 47 "x86_64/asm-offsets.c" 1
+	
+->UREGS_error_code $120 offsetof(struct cpu_user_regs, error_code)
+# 0 "" 2
+	.loc 1 47 63 view .LVU32
+	.loc 1 48 5 view .LVU33
+# 48 "x86_64/asm-offsets.c" 1
+	
+->UREGS_entry_vector $124 offsetof(struct cpu_user_regs, entry_vector)
+# 0 "" 2
+	.loc 1 48 67 view .LVU34
+	.loc 1 49 5 view .LVU35
+# 49 "x86_64/asm-offsets.c" 1
+	
+->UREGS_saved_upcall_mask $140 offsetof(struct cpu_user_regs, saved_upcall_mask)
+# 0 "" 2
+	.loc 1 49 77 view .LVU36
+	.loc 1 50 5 view .LVU37
+# 50 "x86_64/asm-offsets.c" 1
+	
+->UREGS_rip $128 offsetof(struct cpu_user_regs, rip)
+# 0 "" 2
+	.loc 1 50 49 view .LVU38
+	.loc 1 51 5 view .LVU39
+# 51 "x86_64/asm-offsets.c" 1
+	
+->UREGS_cs $136 offsetof(struct cpu_user_regs, cs)
+# 0 "" 2
+	.loc 1 51 47 view .LVU40
+	.loc 1 52 5 view .LVU41
+# 52 "x86_64/asm-offsets.c" 1
+	
+->UREGS_eflags $144 offsetof(struct cpu_user_regs, eflags)
+# 0 "" 2
+	.loc 1 52 55 view .LVU42
+	.loc 1 53 5 view .LVU43
+# 53 "x86_64/asm-offsets.c" 1
+	
+->UREGS_rsp $152 offsetof(struct cpu_user_regs, rsp)
+# 0 "" 2
+	.loc 1 53 49 view .LVU44
+	.loc 1 54 5 view .LVU45
+# 54 "x86_64/asm-offsets.c" 1
+	
+->UREGS_ss $160 offsetof(struct cpu_user_regs, ss)
+# 0 "" 2
+	.loc 1 54 47 view .LVU46
+	.loc 1 55 5 view .LVU47
+# 55 "x86_64/asm-offsets.c" 1
+	
+->UREGS_ds $176 offsetof(struct cpu_user_regs, ds)
+# 0 "" 2
+	.loc 1 55 47 view .LVU48
+	.loc 1 56 5 view .LVU49
+# 56 "x86_64/asm-offsets.c" 1
+	
+->UREGS_es $168 offsetof(struct cpu_user_regs, es)
+# 0 "" 2
+	.loc 1 56 47 view .LVU50
+	.loc 1 57 5 view .LVU51
+# 57 "x86_64/asm-offsets.c" 1
+	
+->UREGS_fs $184 offsetof(struct cpu_user_regs, fs)
+# 0 "" 2
+	.loc 1 57 47 view .LVU52
+	.loc 1 58 5 view .LVU53
+# 58 "x86_64/asm-offsets.c" 1
+	
+->UREGS_gs $192 offsetof(struct cpu_user_regs, gs)
+# 0 "" 2
+	.loc 1 58 47 view .LVU54
+	.loc 1 59 5 view .LVU55
+# 59 "x86_64/asm-offsets.c" 1
+	
+->UREGS_kernel_sizeof $168 offsetof(struct cpu_user_regs, es)
+# 0 "" 2
+	.loc 1 59 58 view .LVU56
+	.loc 1 60 5 view .LVU57
+# 60 "x86_64/asm-offsets.c" 1
+	
+->UREGS_user_sizeof $200 sizeof(struct cpu_user_regs)
+# 0 "" 2
+	.loc 1 61 5 view .LVU58
+# 61 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 63 5 view .LVU59
+# 63 "x86_64/asm-offsets.c" 1
+	
+->irq_caps_offset $472 offsetof(struct domain, irq_caps)
+# 0 "" 2
+	.loc 1 63 53 view .LVU60
+	.loc 1 64 5 view .LVU61
+# 64 "x86_64/asm-offsets.c" 1
+	
+->next_in_list_offset $104 offsetof(struct domain, next_in_list)
+# 0 "" 2
+	.loc 1 64 61 view .LVU62
+	.loc 1 65 5 view .LVU63
+# 65 "x86_64/asm-offsets.c" 1
+	
+->VCPU_processor $4 offsetof(struct vcpu, processor)
+# 0 "" 2
+	.loc 1 65 51 view .LVU64
+	.loc 1 66 5 view .LVU65
+# 66 "x86_64/asm-offsets.c" 1
+	
+->VCPU_domain $16 offsetof(struct vcpu, domain)
+# 0 "" 2
+	.loc 1 66 45 view .LVU66
+	.loc 1 67 5 view .LVU67
+# 67 "x86_64/asm-offsets.c" 1
+	
+->VCPU_vcpu_info $8 offsetof(struct vcpu, vcpu_info)
+# 0 "" 2
+	.loc 1 67 51 view .LVU68
+	.loc 1 68 5 view .LVU69
+# 68 "x86_64/asm-offsets.c" 1
+	
+->VCPU_trap_bounce $1376 offsetof(struct vcpu, arch.pv_vcpu.trap_bounce)
+# 0 "" 2
+	.loc 1 68 68 view .LVU70
+	.loc 1 69 5 view .LVU71
+# 69 "x86_64/asm-offsets.c" 1
+	
+->VCPU_int80_bounce $1392 offsetof(struct vcpu, arch.pv_vcpu.int80_bounce)
+# 0 "" 2
+	.loc 1 69 70 view .LVU72
+	.loc 1 70 5 view .LVU73
+# 70 "x86_64/asm-offsets.c" 1
+	
+->VCPU_thread_flags $1048 offsetof(struct vcpu, arch.flags)
+# 0 "" 2
+	.loc 1 70 55 view .LVU74
+	.loc 1 71 5 view .LVU75
+# 71 "x86_64/asm-offsets.c" 1
+	
+->VCPU_event_addr $1296 offsetof(struct vcpu, arch.pv_vcpu.event_callback_eip)
+# 0 "" 2
+	.loc 1 71 74 view .LVU76
+	.loc 1 72 5 view .LVU77
+# 72 "x86_64/asm-offsets.c" 1
+	
+->VCPU_event_sel $1312 offsetof(struct vcpu, arch.pv_vcpu.event_callback_cs)
+# 0 "" 2
+	.loc 1 72 72 view .LVU78
+	.loc 1 73 5 view .LVU79
+# 73 "x86_64/asm-offsets.c" 1
+	
+->VCPU_failsafe_addr $1304 offsetof(struct vcpu, arch.pv_vcpu.failsafe_callback_eip)
+# 0 "" 2
+	.loc 1 74 47 view .LVU80
+	.loc 1 75 5 view .LVU81
+# 75 "x86_64/asm-offsets.c" 1
+	
+->VCPU_failsafe_sel $1316 offsetof(struct vcpu, arch.pv_vcpu.failsafe_callback_cs)
+# 0 "" 2
+	.loc 1 76 46 view .LVU82
+	.loc 1 77 5 view .LVU83
+# 77 "x86_64/asm-offsets.c" 1
+	
+->VCPU_syscall_addr $1312 offsetof(struct vcpu, arch.pv_vcpu.syscall_callback_eip)
+# 0 "" 2
+	.loc 1 78 46 view .LVU84
+	.loc 1 79 5 view .LVU85
+# 79 "x86_64/asm-offsets.c" 1
+	
+->VCPU_syscall32_addr $1328 offsetof(struct vcpu, arch.pv_vcpu.syscall32_callback_eip)
+# 0 "" 2
+	.loc 1 80 48 view .LVU86
+	.loc 1 81 5 view .LVU87
+# 81 "x86_64/asm-offsets.c" 1
+	
+->VCPU_syscall32_sel $1344 offsetof(struct vcpu, arch.pv_vcpu.syscall32_callback_cs)
+# 0 "" 2
+	.loc 1 82 47 view .LVU88
+	.loc 1 83 5 view .LVU89
+# 83 "x86_64/asm-offsets.c" 1
+	
+->VCPU_syscall32_disables_events $1348 offsetof(struct vcpu, arch.pv_vcpu.syscall32_disables_events)
+# 0 "" 2
+	.loc 1 84 51 view .LVU90
+	.loc 1 85 5 view .LVU91
+# 85 "x86_64/asm-offsets.c" 1
+	
+->VCPU_sysenter_addr $1336 offsetof(struct vcpu, arch.pv_vcpu.sysenter_callback_eip)
+# 0 "" 2
+	.loc 1 86 47 view .LVU92
+	.loc 1 87 5 view .LVU93
+# 87 "x86_64/asm-offsets.c" 1
+	
+->VCPU_sysenter_sel $1346 offsetof(struct vcpu, arch.pv_vcpu.sysenter_callback_cs)
+# 0 "" 2
+	.loc 1 88 46 view .LVU94
+	.loc 1 89 5 view .LVU95
+# 89 "x86_64/asm-offsets.c" 1
+	
+->VCPU_sysenter_disables_events $1349 offsetof(struct vcpu, arch.pv_vcpu.sysenter_disables_events)
+# 0 "" 2
+	.loc 1 90 50 view .LVU96
+	.loc 1 91 5 view .LVU97
+# 91 "x86_64/asm-offsets.c" 1
+	
+->VCPU_trap_ctxt $1080 offsetof(struct vcpu, arch.pv_vcpu.trap_ctxt)
+# 0 "" 2
+	.loc 1 91 64 view .LVU98
+	.loc 1 92 5 view .LVU99
+# 92 "x86_64/asm-offsets.c" 1
+	
+->VCPU_kernel_sp $1224 offsetof(struct vcpu, arch.pv_vcpu.kernel_sp)
+# 0 "" 2
+	.loc 1 92 64 view .LVU100
+	.loc 1 93 5 view .LVU101
+# 93 "x86_64/asm-offsets.c" 1
+	
+->VCPU_kernel_ss $1216 offsetof(struct vcpu, arch.pv_vcpu.kernel_ss)
+# 0 "" 2
+	.loc 1 93 64 view .LVU102
+	.loc 1 94 5 view .LVU103
+# 94 "x86_64/asm-offsets.c" 1
+	
+->VCPU_guest_context_flags $776 offsetof(struct vcpu, arch.vgc_flags)
+# 0 "" 2
+	.loc 1 94 66 view .LVU104
+	.loc 1 95 5 view .LVU105
+# 95 "x86_64/asm-offsets.c" 1
+	
+->VCPU_nmi_pending $461 offsetof(struct vcpu, async_exception_state[(1)-1].pending)
+# 0 "" 2
+	.loc 1 95 55 view .LVU106
+	.loc 1 96 5 view .LVU107
+# 96 "x86_64/asm-offsets.c" 1
+	
+->VCPU_mce_pending $463 offsetof(struct vcpu, async_exception_state[(2)-1].pending)
+# 0 "" 2
+	.loc 1 96 55 view .LVU108
+	.loc 1 97 5 view .LVU109
+# 97 "x86_64/asm-offsets.c" 1
+	
+->VCPU_nmi_old_mask $462 offsetof(struct vcpu, async_exception_state[(1)-1].old_mask)
+# 0 "" 2
+	.loc 1 97 63 view .LVU110
+	.loc 1 98 5 view .LVU111
+# 98 "x86_64/asm-offsets.c" 1
+	
+->VCPU_mce_old_mask $464 offsetof(struct vcpu, async_exception_state[(2)-1].old_mask)
+# 0 "" 2
+	.loc 1 98 63 view .LVU112
+	.loc 1 99 5 view .LVU113
+# 99 "x86_64/asm-offsets.c" 1
+	
+->VCPU_async_exception_mask $465 offsetof(struct vcpu, async_exception_mask)
+# 0 "" 2
+	.loc 1 99 73 view .LVU114
+	.loc 1 100 5 view .LVU115
+# 100 "x86_64/asm-offsets.c" 1
+	
+->VCPU_TRAP_NMI $1 VCPU_TRAP_NMI
+# 0 "" 2
+	.loc 1 101 5 view .LVU116
+# 101 "x86_64/asm-offsets.c" 1
+	
+->VCPU_TRAP_MCE $2 VCPU_TRAP_MCE
+# 0 "" 2
+	.loc 1 102 5 view .LVU117
+# 102 "x86_64/asm-offsets.c" 1
+	
+->_VGCF_failsafe_disables_events $3 _VGCF_failsafe_disables_events
+# 0 "" 2
+	.loc 1 103 5 view .LVU118
+# 103 "x86_64/asm-offsets.c" 1
+	
+->_VGCF_syscall_disables_events $4 _VGCF_syscall_disables_events
+# 0 "" 2
+	.loc 1 104 5 view .LVU119
+# 104 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 106 5 view .LVU120
+# 106 "x86_64/asm-offsets.c" 1
+	
+->VCPU_svm_vmcb_pa $1528 offsetof(struct vcpu, arch.hvm_vcpu.u.svm.vmcb_pa)
+# 0 "" 2
+	.loc 1 106 64 view .LVU121
+	.loc 1 107 5 view .LVU122
+# 107 "x86_64/asm-offsets.c" 1
+	
+->VCPU_svm_vmcb $1520 offsetof(struct vcpu, arch.hvm_vcpu.u.svm.vmcb)
+# 0 "" 2
+	.loc 1 107 58 view .LVU123
+	.loc 1 108 5 view .LVU124
+# 108 "x86_64/asm-offsets.c" 1
+	
+->VCPU_svm_vmcb_in_sync $1548 offsetof(struct vcpu, arch.hvm_vcpu.u.svm.vmcb_in_sync)
+# 0 "" 2
+	.loc 1 108 74 view .LVU125
+	.loc 1 109 5 view .LVU126
+# 109 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 111 5 view .LVU127
+# 111 "x86_64/asm-offsets.c" 1
+	
+->VCPU_vmx_launched $1556 offsetof(struct vcpu, arch.hvm_vcpu.u.vmx.launched)
+# 0 "" 2
+	.loc 1 111 66 view .LVU128
+	.loc 1 112 5 view .LVU129
+# 112 "x86_64/asm-offsets.c" 1
+	
+->VCPU_vmx_realmode $1712 offsetof(struct vcpu, arch.hvm_vcpu.u.vmx.vmx_realmode)
+# 0 "" 2
+	.loc 1 112 70 view .LVU130
+	.loc 1 113 5 view .LVU131
+# 113 "x86_64/asm-offsets.c" 1
+	
+->VCPU_vmx_emulate $1713 offsetof(struct vcpu, arch.hvm_vcpu.u.vmx.vmx_emulate)
+# 0 "" 2
+	.loc 1 113 68 view .LVU132
+	.loc 1 114 5 view .LVU133
+# 114 "x86_64/asm-offsets.c" 1
+	
+->VCPU_vm86_seg_mask $1714 offsetof(struct vcpu, arch.hvm_vcpu.u.vmx.vm86_segment_mask)
+# 0 "" 2
+	.loc 1 114 76 view .LVU134
+	.loc 1 115 5 view .LVU135
+# 115 "x86_64/asm-offsets.c" 1
+	
+->VCPU_hvm_guest_cr2 $1096 offsetof(struct vcpu, arch.hvm_vcpu.guest_cr[2])
+# 0 "" 2
+	.loc 1 115 71 view .LVU136
+	.loc 1 116 5 view .LVU137
+# 116 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 118 5 view .LVU138
+# 118 "x86_64/asm-offsets.c" 1
+	
+->VCPU_nhvm_guestmode $1880 offsetof(struct vcpu, arch.hvm_vcpu.nvcpu.nv_guestmode)
+# 0 "" 2
+	.loc 1 118 79 view .LVU139
+	.loc 1 119 5 view .LVU140
+# 119 "x86_64/asm-offsets.c" 1
+	
+->VCPU_nhvm_p2m $2112 offsetof(struct vcpu, arch.hvm_vcpu.nvcpu.nv_p2m)
+# 0 "" 2
+	.loc 1 119 67 view .LVU141
+	.loc 1 120 5 view .LVU142
+# 120 "x86_64/asm-offsets.c" 1
+	
+->VCPU_nsvm_hap_enabled $2068 offsetof(struct vcpu, arch.hvm_vcpu.nvcpu.u.nsvm.ns_hap_enabled)
+# 0 "" 2
+	.loc 1 120 90 view .LVU143
+	.loc 1 121 5 view .LVU144
+# 121 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 123 5 view .LVU145
+# 123 "x86_64/asm-offsets.c" 1
+	
+->DOMAIN_is_32bit_pv $3252 offsetof(struct domain, arch.is_32bit_pv)
+# 0 "" 2
+	.loc 1 123 64 view .LVU146
+	.loc 1 124 5 view .LVU147
+# 124 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 126 5 view .LVU148
+# 126 "x86_64/asm-offsets.c" 1
+	
+->VMCB_rax $1528 offsetof(struct vmcb_struct, rax)
+# 0 "" 2
+	.loc 1 126 46 view .LVU149
+	.loc 1 127 5 view .LVU150
+# 127 "x86_64/asm-offsets.c" 1
+	
+->VMCB_rip $1400 offsetof(struct vmcb_struct, rip)
+# 0 "" 2
+	.loc 1 127 46 view .LVU151
+	.loc 1 128 5 view .LVU152
+# 128 "x86_64/asm-offsets.c" 1
+	
+->VMCB_rsp $1496 offsetof(struct vmcb_struct, rsp)
+# 0 "" 2
+	.loc 1 128 46 view .LVU153
+	.loc 1 129 5 view .LVU154
+# 129 "x86_64/asm-offsets.c" 1
+	
+->VMCB_rflags $1392 offsetof(struct vmcb_struct, rflags)
+# 0 "" 2
+	.loc 1 129 52 view .LVU155
+	.loc 1 130 5 view .LVU156
+# 130 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 132 5 view .LVU157
+# 132 "x86_64/asm-offsets.c" 1
+	
+->VCPUINFO_upcall_pending $0 offsetof(struct vcpu_info, evtchn_upcall_pending)
+# 0 "" 2
+	.loc 1 132 77 view .LVU158
+	.loc 1 133 5 view .LVU159
+# 133 "x86_64/asm-offsets.c" 1
+	
+->VCPUINFO_upcall_mask $1 offsetof(struct vcpu_info, evtchn_upcall_mask)
+# 0 "" 2
+	.loc 1 133 71 view .LVU160
+	.loc 1 134 5 view .LVU161
+# 134 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 136 5 view .LVU162
+# 136 "x86_64/asm-offsets.c" 1
+	
+->COMPAT_VCPUINFO_upcall_pending $0 offsetof(struct compat_vcpu_info, evtchn_upcall_pending)
+# 0 "" 2
+	.loc 1 136 91 view .LVU163
+	.loc 1 137 5 view .LVU164
+# 137 "x86_64/asm-offsets.c" 1
+	
+->COMPAT_VCPUINFO_upcall_mask $1 offsetof(struct compat_vcpu_info, evtchn_upcall_mask)
+# 0 "" 2
+	.loc 1 137 85 view .LVU165
+	.loc 1 138 5 view .LVU166
+# 138 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 140 5 view .LVU167
+# 140 "x86_64/asm-offsets.c" 1
+	
+->CPUINFO_guest_cpu_user_regs $0 offsetof(struct cpu_info, guest_cpu_user_regs)
+# 0 "" 2
+	.loc 1 140 78 view .LVU168
+	.loc 1 141 5 view .LVU169
+# 141 "x86_64/asm-offsets.c" 1
+	
+->CPUINFO_processor_id $200 offsetof(struct cpu_info, processor_id)
+# 0 "" 2
+	.loc 1 141 64 view .LVU170
+	.loc 1 142 5 view .LVU171
+# 142 "x86_64/asm-offsets.c" 1
+	
+->CPUINFO_current_vcpu $208 offsetof(struct cpu_info, current_vcpu)
+# 0 "" 2
+	.loc 1 142 64 view .LVU172
+	.loc 1 143 5 view .LVU173
+# 143 "x86_64/asm-offsets.c" 1
+	
+->CPUINFO_sizeof $232 sizeof(struct cpu_info)
+# 0 "" 2
+	.loc 1 144 5 view .LVU174
+# 144 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 146 5 view .LVU175
+# 146 "x86_64/asm-offsets.c" 1
+	
+->TRAPINFO_eip $8 offsetof(struct trap_info, address)
+# 0 "" 2
+	.loc 1 146 52 view .LVU176
+	.loc 1 147 5 view .LVU177
+# 147 "x86_64/asm-offsets.c" 1
+	
+->TRAPINFO_cs $2 offsetof(struct trap_info, cs)
+# 0 "" 2
+	.loc 1 147 46 view .LVU178
+	.loc 1 148 5 view .LVU179
+# 148 "x86_64/asm-offsets.c" 1
+	
+->TRAPINFO_flags $1 offsetof(struct trap_info, flags)
+# 0 "" 2
+	.loc 1 148 52 view .LVU180
+	.loc 1 149 5 view .LVU181
+# 149 "x86_64/asm-offsets.c" 1
+	
+->TRAPINFO_sizeof $16 sizeof(struct trap_info)
+# 0 "" 2
+	.loc 1 150 5 view .LVU182
+# 150 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 152 5 view .LVU183
+# 152 "x86_64/asm-offsets.c" 1
+	
+->TRAPBOUNCE_error_code $0 offsetof(struct trap_bounce, error_code)
+# 0 "" 2
+	.loc 1 152 66 view .LVU184
+	.loc 1 153 5 view .LVU185
+# 153 "x86_64/asm-offsets.c" 1
+	
+->TRAPBOUNCE_flags $4 offsetof(struct trap_bounce, flags)
+# 0 "" 2
+	.loc 1 153 56 view .LVU186
+	.loc 1 154 5 view .LVU187
+# 154 "x86_64/asm-offsets.c" 1
+	
+->TRAPBOUNCE_cs $6 offsetof(struct trap_bounce, cs)
+# 0 "" 2
+	.loc 1 154 50 view .LVU188
+	.loc 1 155 5 view .LVU189
+# 155 "x86_64/asm-offsets.c" 1
+	
+->TRAPBOUNCE_eip $8 offsetof(struct trap_bounce, eip)
+# 0 "" 2
+	.loc 1 155 52 view .LVU190
+	.loc 1 156 5 view .LVU191
+# 156 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 164 5 view .LVU192
+# 164 "x86_64/asm-offsets.c" 1
+	
+->IRQSTAT_shift $7 LOG_2(sizeof(irq_cpustat_t))
+# 0 "" 2
+	.loc 1 165 5 view .LVU193
+# 165 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 167 5 view .LVU194
+# 167 "x86_64/asm-offsets.c" 1
+	
+->CPUINFO86_ext_features $12 offsetof(struct cpuinfo_x86, x86_capability[1])
+# 0 "" 2
+	.loc 1 167 74 view .LVU195
+	.loc 1 168 5 view .LVU196
+# 168 "x86_64/asm-offsets.c" 1
+	
+->
+# 0 "" 2
+	.loc 1 170 5 view .LVU197
+# 170 "x86_64/asm-offsets.c" 1
+	
+->MB_flags $0 offsetof(multiboot_info_t, flags)
+# 0 "" 2
+	.loc 1 170 46 view .LVU198
+	.loc 1 171 5 view .LVU199
+# 171 "x86_64/asm-offsets.c" 1
+	
+->MB_cmdline $16 offsetof(multiboot_info_t, cmdline)
+# 0 "" 2
+	.loc 1 171 50 view .LVU200
+	.loc 1 172 1 is_stmt 0 view .LVU201
+#NO_APP
+	ret
+	.cfi_endproc
+.LFE387:
+	.size	__dummy__, .-__dummy__
+.Letext0:
+	.section	.debug_info,"",@progbits
+.Ldebug_info0:
+	.long	0x92
+	.value	0x5
+	.byte	0x1
+	.byte	0x8
+	.long	.Ldebug_abbrev0
+	.uleb128 0x2
+	.long	.LASF12
+	.byte	0xc
+	.long	.LASF0
+	.long	.LASF1
+	.quad	.Ltext0
+	.quad	.Letext0-.Ltext0
+	.long	.Ldebug_line0
+	.uleb128 0x1
+	.byte	0x8
+	.byte	0x7
+	.long	.LASF2
+	.uleb128 0x1
+	.byte	0x1
+	.byte	0x6
+	.long	.LASF3
+	.uleb128 0x1
+	.byte	0x4
+	.byte	0x7
+	.long	.LASF4
+	.uleb128 0x1
+	.byte	0x1
+	.byte	0x8
+	.long	.LASF5
+	.uleb128 0x1
+	.byte	0x2
+	.byte	0x7
+	.long	.LASF6
+	.uleb128 0x1
+	.byte	0x1
+	.byte	0x6
+	.long	.LASF7
+	.uleb128 0x1
+	.byte	0x2
+	.byte	0x5
+	.long	.LASF8
+	.uleb128 0x3
+	.byte	0x4
+	.byte	0x5
+	.string	"int"
+	.uleb128 0x1
+	.byte	0x8
+	.byte	0x5
+	.long	.LASF9
+	.uleb128 0x1
+	.byte	0x8
+	.byte	0x7
+	.long	.LASF10
+	.uleb128 0x1
+	.byte	0x8
+	.byte	0x5
+	.long	.LASF11
+	.uleb128 0x4
+	.long	.LASF13
+	.byte	0x1
+	.byte	0x1e
+	.byte	0x6
+	.quad	.LFB387
+	.quad	.LFE387-.LFB387
+	.uleb128 0x1
+	.byte	0x9c
+	.byte	0
+	.section	.debug_abbrev,"",@progbits
+.Ldebug_abbrev0:
+	.uleb128 0x1
+	.uleb128 0x24
+	.byte	0
+	.uleb128 0xb
+	.uleb128 0xb
+	.uleb128 0x3e
+	.uleb128 0xb
+	.uleb128 0x3
+	.uleb128 0xe
+	.byte	0
+	.byte	0
+	.uleb128 0x2
+	.uleb128 0x11
+	.byte	0x1
+	.uleb128 0x25
+	.uleb128 0xe
+	.uleb128 0x13
+	.uleb128 0xb
+	.uleb128 0x3
+	.uleb128 0x1f
+	.uleb128 0x1b
+	.uleb128 0x1f
+	.uleb128 0x11
+	.uleb128 0x1
+	.uleb128 0x12
+	.uleb128 0x7
+	.uleb128 0x10
+	.uleb128 0x17
+	.byte	0
+	.byte	0
+	.uleb128 0x3
+	.uleb128 0x24
+	.byte	0
+	.uleb128 0xb
+	.uleb128 0xb
+	.uleb128 0x3e
+	.uleb128 0xb
+	.uleb128 0x3
+	.uleb128 0x8
+	.byte	0
+	.byte	0
+	.uleb128 0x4
+	.uleb128 0x2e
+	.byte	0
+	.uleb128 0x3f
+	.uleb128 0x19
+	.uleb128 0x3
+	.uleb128 0xe
+	.uleb128 0x3a
+	.uleb128 0xb
+	.uleb128 0x3b
+	.uleb128 0xb
+	.uleb128 0x39
+	.uleb128 0xb
+	.uleb128 0x27
+	.uleb128 0x19
+	.uleb128 0x11
+	.uleb128 0x1
+	.uleb128 0x12
+	.uleb128 0x7
+	.uleb128 0x40
+	.uleb128 0x18
+	.uleb128 0x7a
+	.uleb128 0x19
+	.byte	0
+	.byte	0
+	.byte	0
+	.section	.debug_aranges,"",@progbits
+	.long	0x2c
+	.value	0x2
+	.long	.Ldebug_info0
+	.byte	0x8
+	.byte	0
+	.value	0
+	.value	0
+	.quad	.Ltext0
+	.quad	.Letext0-.Ltext0
+	.quad	0
+	.quad	0
+	.section	.debug_line,"",@progbits
+.Ldebug_line0:
+	.section	.debug_str,"MS",@progbits,1
+.LASF13:
+	.string	"__dummy__"
+.LASF12:
+	.ascii	"GNU C99 12.2.0 -m64"
+	.string	" -msoft-float -mno-red-zone -mno-sse -mtune=generic -march=x86-64 -g -g -O1 -std=gnu99 -fno-strict-aliasing -fno-builtin -fno-stack-protector -fno-exceptions -fpic -fno-asynchronous-unwind-tables -fno-optimize-sibling-calls -fno-omit-frame-pointer -fcommon"
+.LASF2:
+	.string	"long unsigned int"
+.LASF4:
+	.string	"unsigned int"
+.LASF7:
+	.string	"signed char"
+.LASF6:
+	.string	"short unsigned int"
+.LASF8:
+	.string	"short int"
+.LASF10:
+	.string	"long long unsigned int"
+.LASF5:
+	.string	"unsigned char"
+.LASF9:
+	.string	"long int"
+.LASF3:
+	.string	"char"
+.LASF11:
+	.string	"long long int"
+	.section	.debug_line_str,"MS",@progbits,1
+.LASF0:
+	.string	"x86_64/asm-offsets.c"
+.LASF1:
+	.string	"/root/repo/xen/arch/x86"
+	.ident	"GCC: (Debian 12.2.0-14+deb12u1) 12.2.0"
+	.section	.note.GNU-stack,"",@progbits
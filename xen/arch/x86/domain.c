@@ -2118,6 +2118,8 @@ int domain_relinquish_resources(struct domain *d)
 void arch_dump_domain_info(struct domain *d)
 {
     paging_dump_domain_info(d);
+    if ( is_hvm_domain(d) )
+        hvm_dump_io_handlers(d);
 }
 
 void arch_dump_vcpu_info(struct vcpu *v)
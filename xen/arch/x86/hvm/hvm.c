@@ -579,12 +579,13 @@ int hvm_domain_initialise(struct domain *d)
 
     d->arch.hvm_domain.pbuf = xzalloc_array(char, HVM_PBUF_SIZE);
     d->arch.hvm_domain.params = xzalloc_array(uint64_t, HVM_NR_PARAMS);
-    d->arch.hvm_domain.io_handler = xmalloc(struct hvm_io_handler);
     rc = -ENOMEM;
-    if ( !d->arch.hvm_domain.pbuf || !d->arch.hvm_domain.params ||
-         !d->arch.hvm_domain.io_handler )
+    if ( !d->arch.hvm_domain.pbuf || !d->arch.hvm_domain.params )
+        goto fail0;
+
+    rc = hvm_init_io_handler(d);
+    if ( rc != 0 )
         goto fail0;
-    d->arch.hvm_domain.io_handler->num_slot = 0;
 
     hvm_init_guest_time(d);
 
@@ -627,7 +628,7 @@ int hvm_domain_initialise(struct domain *d)
  fail1:
     hvm_destroy_cacheattr_region_list(d);
  fail0:
-    xfree(d->arch.hvm_domain.io_handler);
+    hvm_destroy_io_handler(d);
     xfree(d->arch.hvm_domain.params);
     xfree(d->arch.hvm_domain.pbuf);
     return rc;
@@ -706,7 +707,7 @@ void hvm_domain_relinquish_resources(struct domain *d)
         hpet_deinit(d);
     }
 
-    xfree(d->arch.hvm_domain.io_handler);
+    hvm_destroy_io_handler(d);
     xfree(d->arch.hvm_domain.params);
     xfree(d->arch.hvm_domain.pbuf);
 }
@@ -31,6 +31,7 @@
 #include <io_ports.h>
 #include <xen/event.h>
 #include <xen/iommu.h>
+#include <xen/symbols.h>
 
 static const struct hvm_mmio_handler *const
 hvm_mmio_handlers[HVM_MMIO_HANDLER_NR] =
@@ -42,6 +43,13 @@ hvm_mmio_handlers[HVM_MMIO_HANDLER_NR] =
     &iommu_mmio_handler
 };
 
+static const char *const hvm_mmio_handler_names[HVM_MMIO_HANDLER_NR] =
+{
+    "hpet", "vlapic", "vioapic", "msixtbl", "iommu"
+};
+
+static DEFINE_RCU_READ_LOCK(io_handler_rcu_lock);
+
 static int hvm_mmio_access(struct vcpu *v,
                            ioreq_t *p,
                            hvm_mmio_read_t read_handler,
@@ -121,10 +129,13 @@ int hvm_mmio_intercept(ioreq_t *p)
 
     for ( i = 0; i < HVM_MMIO_HANDLER_NR; i++ )
         if ( hvm_mmio_handlers[i]->check_handler(v, p->addr) )
+        {
+            v->arch.hvm_vcpu.hvm_io.mmio_hits[i]++;
             return hvm_mmio_access(
                 v, p,
                 hvm_mmio_handlers[i]->read_handler,
                 hvm_mmio_handlers[i]->write_handler);
+        }
 
     return X86EMUL_UNHANDLEABLE;
 }
@@ -190,8 +201,10 @@ int hvm_io_intercept(ioreq_t *p, int type)
 {
     struct vcpu *v = current;
     struct hvm_io_handler *handler = v->domain->arch.hvm_domain.io_handler;
-    int i;
-    unsigned long addr, size;
+    struct io_handler_list *list;
+    struct io_handler *hdl;
+    int lo, hi, mid;
+    void *action;
 
     if ( type == HVM_PORTIO )
     {
@@ -200,53 +213,202 @@ int hvm_io_intercept(ioreq_t *p, int type)
             return rc;
     }
 
-    for ( i = 0; i < handler->num_slot; i++ )
+    /*
+     * hdl_list is sorted by type and then address, and ranges of the same
+     * type do not overlap: only the last handler of this type starting at
+     * or below the access can contain it.  Relocation never changes a
+     * published list: it publishes a sorted copy and frees the old one
+     * only once we are out of our read-side critical section.
+     */
+    rcu_read_lock(&io_handler_rcu_lock);
+    list = rcu_dereference(handler->list);
+    lo = 0;
+    hi = list->num_slot;
+    while ( lo < hi )
     {
-        if ( type != handler->hdl_list[i].type )
-            continue;
-        addr = handler->hdl_list[i].addr;
-        size = handler->hdl_list[i].size;
-        if ( (p->addr >= addr) &&
-             ((p->addr + p->size) <= (addr + size)) )
-        {
-            if ( type == HVM_PORTIO )
-                return process_portio_intercept(
-                    handler->hdl_list[i].action.portio, p);
-            return handler->hdl_list[i].action.mmio(p);
-        }
+        mid = (lo + hi) / 2;
+        hdl = &list->hdl_list[mid];
+        if ( (hdl->type < type) ||
+             ((hdl->type == type) && (hdl->addr <= p->addr)) )
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    return X86EMUL_UNHANDLEABLE;
+    hdl = lo ? &list->hdl_list[lo - 1] : NULL;
+    if ( !hdl || (hdl->type != type) ||
+         ((p->addr + p->size) > (hdl->addr + hdl->size)) )
+    {
+        rcu_read_unlock(&io_handler_rcu_lock);
+        return X86EMUL_UNHANDLEABLE;
+    }
+
+    v->arch.hvm_vcpu.hvm_io.io_hits[hdl->idx]++;
+    action = hdl->action.ptr;
+    rcu_read_unlock(&io_handler_rcu_lock);
+
+    if ( type == HVM_PORTIO )
+        return process_portio_intercept((portio_action_t)action, p);
+    return ((mmio_action_t)action)(p);
+}
+
+static bool_t io_handler_before(const struct io_handler *a,
+                                const struct io_handler *b)
+{
+    return (a->type < b->type) ||
+           ((a->type == b->type) && (a->addr < b->addr));
+}
+
+/* Move slot i, whose address just changed, to its place in hdl_list. */
+static void sort_io_handler(struct io_handler_list *list, int i)
+{
+    struct io_handler tmp = list->hdl_list[i];
+
+    for ( ; (i > 0) && io_handler_before(&tmp, &list->hdl_list[i - 1]); i-- )
+        list->hdl_list[i] = list->hdl_list[i - 1];
+    for ( ; (i < list->num_slot - 1) &&
+            io_handler_before(&list->hdl_list[i + 1], &tmp); i++ )
+        list->hdl_list[i] = list->hdl_list[i + 1];
+    list->hdl_list[i] = tmp;
+}
+
+int hvm_init_io_handler(struct domain *d)
+{
+    struct hvm_io_handler *handler = xzalloc(struct hvm_io_handler);
+
+    if ( handler == NULL )
+        return -ENOMEM;
+
+    handler->list = xzalloc(struct io_handler_list);
+    if ( handler->list == NULL )
+    {
+        xfree(handler);
+        return -ENOMEM;
+    }
+
+    spin_lock_init(&handler->lock);
+    d->arch.hvm_domain.io_handler = handler;
+    return 0;
 }
 
+void hvm_destroy_io_handler(struct domain *d)
+{
+    struct hvm_io_handler *handler = d->arch.hvm_domain.io_handler;
+
+    if ( handler == NULL )
+        return;
+
+    /* Lists replaced by relocation are freed by their own RCU callbacks. */
+    xfree(handler->list);
+    xfree(handler);
+    d->arch.hvm_domain.io_handler = NULL;
+}
+
+/*
+ * Handlers are only registered while the domain is being built, before any
+ * of its vcpus runs, so the published list can be extended in place.
+ */
 void register_io_handler(
     struct domain *d, unsigned long addr, unsigned long size,
     void *action, int type)
 {
     struct hvm_io_handler *handler = d->arch.hvm_domain.io_handler;
-    int num = handler->num_slot;
+    struct io_handler_list *list;
+    int num;
 
+    spin_lock(&handler->lock);
+    list = handler->list;
+    num = list->num_slot;
     BUG_ON(num >= MAX_IO_HANDLER);
 
-    handler->hdl_list[num].addr = addr;
-    handler->hdl_list[num].size = size;
-    handler->hdl_list[num].action.ptr = action;
-    handler->hdl_list[num].type = type;
-    handler->num_slot++;
+    list->hdl_list[num].addr = addr;
+    list->hdl_list[num].size = size;
+    list->hdl_list[num].action.ptr = action;
+    list->hdl_list[num].type = type;
+    list->hdl_list[num].idx = num;
+    list->num_slot++;
+    sort_io_handler(list, num);
+    spin_unlock(&handler->lock);
 }
 
-void relocate_io_handler(
+static void free_io_handler_list(struct rcu_head *head)
+{
+    xfree(container_of(head, struct io_handler_list, rcu));
+}
+
+/* The guest can ask for this itself, with its other vcpus running. */
+int relocate_io_handler(
     struct domain *d, unsigned long old_addr, unsigned long new_addr,
     unsigned long size, int type)
 {
     struct hvm_io_handler *handler = d->arch.hvm_domain.io_handler;
+    struct io_handler_list *old, *new;
     int i;
 
-    for ( i = 0; i < handler->num_slot; i++ )
-        if ( (handler->hdl_list[i].addr == old_addr) &&
-             (handler->hdl_list[i].size == size) &&
-             (handler->hdl_list[i].type == type) )
-            handler->hdl_list[i].addr = new_addr;
+    new = xmalloc(struct io_handler_list);
+    if ( new == NULL )
+        return -ENOMEM;
+
+    spin_lock(&handler->lock);
+    old = handler->list;
+    for ( i = 0; i < old->num_slot; i++ )
+        if ( (old->hdl_list[i].addr == old_addr) &&
+             (old->hdl_list[i].size == size) &&
+             (old->hdl_list[i].type == type) )
+            break;
+
+    if ( i == old->num_slot )
+    {
+        spin_unlock(&handler->lock);
+        xfree(new);
+        return 0;
+    }
+
+    *new = *old;
+    new->hdl_list[i].addr = new_addr;
+    sort_io_handler(new, i);
+    rcu_assign_pointer(handler->list, new);
+    spin_unlock(&handler->lock);
+
+    call_rcu(&old->rcu, free_io_handler_list);
+    return 0;
+}
+
+void hvm_dump_io_handlers(struct domain *d)
+{
+    struct hvm_io_handler *handler = d->arch.hvm_domain.io_handler;
+    struct io_handler_list *list;
+    struct vcpu *v;
+    unsigned long hits;
+    int i;
+
+    if ( !handler )
+        return;
+
+    printk("    I/O handler hits:\n");
+    for ( i = 0; i < HVM_MMIO_HANDLER_NR; i++ )
+    {
+        hits = 0;
+        for_each_vcpu ( d, v )
+            hits += v->arch.hvm_vcpu.hvm_io.mmio_hits[i];
+        printk("      mmio %-8s %lu\n", hvm_mmio_handler_names[i], hits);
+    }
+
+    rcu_read_lock(&io_handler_rcu_lock);
+    list = rcu_dereference(handler->list);
+    for ( i = 0; i < list->num_slot; i++ )
+    {
+        struct io_handler *hdl = &list->hdl_list[i];
+
+        hits = 0;
+        for_each_vcpu ( d, v )
+            hits += v->arch.hvm_vcpu.hvm_io.io_hits[hdl->idx];
+        printk("      %s %#lx+%lu %lu",
+               (hdl->type == HVM_PORTIO) ? "port" : "bufio",
+               hdl->addr, hdl->size, hits);
+        print_symbol(" %s\n", (unsigned long)hdl->action.ptr);
+    }
+    rcu_read_unlock(&io_handler_rcu_lock);
 }
 
 /*
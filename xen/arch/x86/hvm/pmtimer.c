@@ -298,6 +298,8 @@ HVM_REGISTER_SAVE_RESTORE(PMTIMER, pmtimer_save, pmtimer_load,
 int pmtimer_change_ioport(struct domain *d, unsigned int version)
 {
     unsigned int old_version;
+    unsigned long tmr_old, tmr_new, sts_old, sts_new;
+    int rc;
 
     /* Check that version is changing. */
     old_version = d->arch.hvm_domain.params[HVM_PARAM_ACPI_IOPORTS_LOCATION];
@@ -311,17 +313,26 @@ int pmtimer_change_ioport(struct domain *d, unsigned int version)
     if ( version == 1 )
     {
         /* Moving from version 0 to version 1. */
-        relocate_portio_handler(d, TMR_VAL_ADDR_V0, TMR_VAL_ADDR_V1, 4);
-        relocate_portio_handler(d, PM1a_STS_ADDR_V0, PM1a_STS_ADDR_V1, 4);
+        tmr_old = TMR_VAL_ADDR_V0; tmr_new = TMR_VAL_ADDR_V1;
+        sts_old = PM1a_STS_ADDR_V0; sts_new = PM1a_STS_ADDR_V1;
     }
     else
     {
         /* Moving from version 1 to version 0. */
-        relocate_portio_handler(d, TMR_VAL_ADDR_V1, TMR_VAL_ADDR_V0, 4);
-        relocate_portio_handler(d, PM1a_STS_ADDR_V1, PM1a_STS_ADDR_V0, 4);
+        tmr_old = TMR_VAL_ADDR_V1; tmr_new = TMR_VAL_ADDR_V0;
+        sts_old = PM1a_STS_ADDR_V1; sts_new = PM1a_STS_ADDR_V0;
     }
 
-    return 0;
+    rc = relocate_portio_handler(d, tmr_old, tmr_new, 4);
+    if ( rc != 0 )
+        return rc;
+
+    rc = relocate_portio_handler(d, sts_old, sts_new, 4);
+    if ( rc != 0 )
+        /* Put the timer back so that both stay in the old block. */
+        relocate_portio_handler(d, tmr_new, tmr_old, 4);
+
+    return rc;
 }
 
 void pmtimer_init(struct vcpu *v)
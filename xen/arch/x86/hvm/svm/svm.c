@@ -1759,10 +1759,12 @@ static void svm_vmexit_do_pause(struct cpu_user_regs *regs)
 
     /*
      * The guest is running a contended spinlock and we've detected it.
-     * Do something useful, like reschedule the guest
+     * Do something useful, like letting a preempted sibling, which may
+     * well be the lock holder, run in its place.
      */
     perfc_incr(pauseloop_exits);
-    do_sched_op_compat(SCHEDOP_yield, 0);
+    HVMTRACE_0D(PAUSE);
+    vcpu_directed_yield();
 }
 
 static void
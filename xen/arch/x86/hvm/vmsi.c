@@ -180,6 +180,11 @@ static struct msixtbl_entry *msixtbl_find_entry(
     struct msixtbl_entry *entry;
     struct domain *d = v->domain;
 
+    /* Most MMIO accesses are not to any MSI-X table. */
+    if ( addr < d->arch.hvm_domain.msixtbl_start ||
+         addr >= d->arch.hvm_domain.msixtbl_end )
+        return NULL;
+
     list_for_each_entry( entry, &d->arch.hvm_domain.msixtbl_list, list )
         if ( addr >= entry->gtable &&
              addr < entry->gtable + entry->table_len )
@@ -344,6 +349,24 @@ static void add_msixtbl_entry(struct domain *d,
     entry->pdev = pdev;
     entry->gtable = (unsigned long) gtable;
 
+    /*
+     * Widen the span before publishing the entry.  Lookups racing with
+     * this see a span at least as wide as the old one.
+     */
+    if ( list_empty(&d->arch.hvm_domain.msixtbl_list) )
+    {
+        d->arch.hvm_domain.msixtbl_start = entry->gtable;
+        d->arch.hvm_domain.msixtbl_end = entry->gtable + len;
+    }
+    else
+    {
+        if ( entry->gtable < d->arch.hvm_domain.msixtbl_start )
+            d->arch.hvm_domain.msixtbl_start = entry->gtable;
+        if ( entry->gtable + len > d->arch.hvm_domain.msixtbl_end )
+            d->arch.hvm_domain.msixtbl_end = entry->gtable + len;
+    }
+    smp_wmb();
+
     list_add_rcu(&entry->list, &d->arch.hvm_domain.msixtbl_list);
 }
 
@@ -356,10 +379,22 @@ static void free_msixtbl_entry(struct rcu_head *rcu)
     xfree(entry);
 }
 
-static void del_msixtbl_entry(struct msixtbl_entry *entry)
+static void del_msixtbl_entry(struct domain *d, struct msixtbl_entry *entry)
 {
+    unsigned long start = ~0UL, end = 0;
+    struct msixtbl_entry *e;
+
     list_del_rcu(&entry->list);
     call_rcu(&entry->rcu, free_msixtbl_entry);
+
+    /* Narrowing the span only hides the entry just removed. */
+    list_for_each_entry( e, &d->arch.hvm_domain.msixtbl_list, list )
+    {
+        start = min(start, e->gtable);
+        end = max(end, e->gtable + e->table_len);
+    }
+    d->arch.hvm_domain.msixtbl_start = start;
+    d->arch.hvm_domain.msixtbl_end = end;
 }
 
 int msixtbl_pt_register(struct domain *d, struct pirq *pirq, uint64_t gtable)
@@ -456,7 +491,7 @@ out:
 
 found:
     if ( !atomic_dec_and_test(&entry->refcnt) )
-        del_msixtbl_entry(entry);
+        del_msixtbl_entry(d, entry);
 
     spin_unlock(&d->arch.hvm_domain.msixtbl_list_lock);
     spin_unlock_irq(&irq_desc->lock);
@@ -473,7 +508,7 @@ void msixtbl_pt_cleanup(struct domain *d)
 
     list_for_each_entry_safe( entry, temp,
                               &d->arch.hvm_domain.msixtbl_list, list )
-        del_msixtbl_entry(entry);
+        del_msixtbl_entry(d, entry);
 
     spin_unlock(&d->arch.hvm_domain.msixtbl_list_lock);
     local_irq_restore(flags);
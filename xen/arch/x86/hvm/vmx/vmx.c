@@ -2687,7 +2687,8 @@ void vmx_vmexit_handler(struct cpu_user_regs *regs)
 
     case EXIT_REASON_PAUSE_INSTRUCTION:
         perfc_incr(pauseloop_exits);
-        do_sched_op_compat(SCHEDOP_yield, 0);
+        HVMTRACE_0D(PAUSE);
+        vcpu_directed_yield();
         break;
 
     case EXIT_REASON_XSETBV:
@@ -33,6 +33,7 @@
 #include <asm/mem_event.h>
 #include <asm/atomic.h>
 #include <xen/rcupdate.h>
+#include <xen/guest_access.h>
 #include <asm/event.h>
 
 #include "mm-locks.h"
@@ -1300,6 +1301,99 @@ int relinquish_shared_pages(struct domain *d)
     return rc;
 }
 
+/* Nominate the source page if it isn't shared yet, then either share it
+ * with the (likewise nominated) client page or add it to the client's
+ * physmap. */
+static int mem_sharing_share_one(struct domain *sd, unsigned long sgfn,
+                                 struct domain *cd, unsigned long cgfn,
+                                 int add_physmap)
+{
+    shr_handle_t sh, ch;
+    int rc;
+
+    if ( XENMEM_SHARING_OP_FIELD_IS_GREF(sgfn) ||
+         XENMEM_SHARING_OP_FIELD_IS_GREF(cgfn) )
+        return -EINVAL;
+
+    rc = mem_sharing_nominate_page(sd, sgfn, 0, &sh);
+    if ( rc )
+        return rc;
+
+    if ( add_physmap )
+        return mem_sharing_add_to_physmap(sd, sgfn, sh, cd, cgfn);
+
+    rc = mem_sharing_nominate_page(cd, cgfn, 0, &ch);
+    if ( rc )
+        return rc;
+
+    return mem_sharing_share_pages(sd, sgfn, sh, cd, cgfn, ch);
+}
+
+/* Work through an array of (source gfn, client domain, client gfn) entries,
+ * recording a status for each.  A failed entry doesn't stop the batch.
+ * Returns -ERESTART, with bulk->nr_done updated, if preempted. */
+static int mem_sharing_bulk_share(struct domain *d,
+                                  struct mem_sharing_op_bulk *bulk,
+                                  int add_physmap)
+{
+    xen_mem_sharing_bulk_entry_t ent;
+    struct domain *cd = NULL;
+    int rc = 0;
+
+    while ( bulk->nr_done < bulk->nr_entries )
+    {
+        if ( copy_from_guest_offset(&ent, bulk->entries, bulk->nr_done, 1) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        /* Batches usually target a handful of clients in turn, so keep
+         * hold of the last one rather than looking it up every time. */
+        if ( cd && cd->domain_id != ent.client_domain )
+        {
+            rcu_unlock_domain(cd);
+            cd = NULL;
+        }
+        if ( !cd )
+        {
+            cd = get_mem_event_op_target(ent.client_domain, &rc);
+            if ( cd && !mem_sharing_enabled(cd) )
+            {
+                rcu_unlock_domain(cd);
+                cd = NULL;
+                rc = -EINVAL;
+            }
+        }
+
+        ent.status = cd ? mem_sharing_share_one(d, ent.source_gfn,
+                                                cd, ent.client_gfn,
+                                                add_physmap) : rc;
+        rc = 0;
+
+        if ( copy_to_guest_offset(bulk->entries, bulk->nr_done, &ent, 1) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        if ( ent.status == 0 )
+            bulk->nr_shared++;
+        bulk->nr_done++;
+
+        if ( bulk->nr_done < bulk->nr_entries && hypercall_preempt_check() )
+        {
+            rc = -ERESTART;
+            break;
+        }
+    }
+
+    if ( cd )
+        rcu_unlock_domain(cd);
+
+    return rc;
+}
+
 int mem_sharing_memop(struct domain *d, xen_mem_sharing_op_t *mec)
 {
     int rc = 0;
@@ -1428,6 +1522,16 @@ int mem_sharing_memop(struct domain *d, xen_mem_sharing_op_t *mec)
         }
         break;
 
+        case XENMEM_sharing_op_bulk_share:
+        case XENMEM_sharing_op_bulk_add_physmap:
+        {
+            if ( !mem_sharing_enabled(d) )
+                return -EINVAL;
+            rc = mem_sharing_bulk_share(d, &mec->u.bulk,
+                    mec->op == XENMEM_sharing_op_bulk_add_physmap);
+        }
+        break;
+
         case XENMEM_sharing_op_resume:
         {
             if ( !mem_sharing_enabled(d) )
@@ -45,6 +45,29 @@
 
 #define superpage_aligned(_x)  (((_x)&(SUPERPAGE_PAGES-1))==0)
 
+/* Number of words looked at by the quick zero-check before we bother
+ * unmapping a page from the guest */
+#define POD_QUICK_CHECK_WORDS 16
+#define POD_PAGE_WORDS        (PAGE_SIZE/sizeof(unsigned long))
+
+/* Check whether @words words at @p are all zero.  We can't use the vector
+ * registers here without saving the guest's FPU state, so instead OR a
+ * cache line's worth of words together at a time: the loads are
+ * independent and we only take one branch per line. */
+static bool_t
+pod_words_are_zero(const unsigned long *p, unsigned int words)
+{
+    const unsigned long *end = p + words;
+
+    ASSERT((words & 7) == 0);
+
+    for ( ; p < end; p += 8 )
+        if ( p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7] )
+            return 0;
+
+    return 1;
+}
+
 /* Enforce lock ordering when grabbing the "external" page_alloc lock */
 static inline void lock_page_alloc(struct p2m_domain *p2m)
 {
@@ -648,7 +671,8 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     p2m_type_t type, type0 = 0;
     unsigned long * map = NULL;
     int ret=0, reset = 0;
-    int i, j;
+    bool_t zero;
+    int i;
     int max_ref = 1;
     struct domain *d = p2m->domain;
 
@@ -705,14 +729,10 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     {
         /* Quick zero-check */
         map = map_domain_page(mfn_x(mfn0) + i);
-
-        for ( j=0; j<16; j++ )
-            if( *(map+j) != 0 )
-                break;
-
+        zero = pod_words_are_zero(map, POD_QUICK_CHECK_WORDS);
         unmap_domain_page(map);
 
-        if ( j < 16 )
+        if ( !zero )
             goto out;
 
     }
@@ -738,14 +758,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     for ( i=0; i < SUPERPAGE_PAGES; i++ )
     {
         map = map_domain_page(mfn_x(mfn0) + i);
-
-        for ( j=0; j<PAGE_SIZE/sizeof(*map); j++ )
-            if( *(map+j) != 0 )
-            {
-                reset = 1;
-                break;
-            }
-
+        reset = !pod_words_are_zero(map, POD_PAGE_WORDS);
         unmap_domain_page(map);
 
         if ( reset )
@@ -791,7 +804,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
     unsigned long * map[count];
     struct domain *d = p2m->domain;
 
-    int i, j;
+    int i;
     int max_ref = 1;
 
     /* Allow an extra refcount for one shadow pt mapping in shadowed domains */
@@ -822,11 +835,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
             continue;
 
         /* Quick zero-check */
-        for ( j=0; j<16; j++ )
-            if( *(map[i]+j) != 0 )
-                break;
-
-        if ( j < 16 )
+        if ( !pod_words_are_zero(map[i], POD_QUICK_CHECK_WORDS) )
         {
             unmap_domain_page(map[i]);
             map[i] = NULL;
@@ -854,18 +863,18 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
     /* Now check each page for real */
     for ( i=0; i < count; i++ )
     {
+        bool_t zero;
+
         if(!map[i])
             continue;
 
-        for ( j=0; j<PAGE_SIZE/sizeof(*map[i]); j++ )
-            if( *(map[i]+j) != 0 )
-                break;
+        zero = pod_words_are_zero(map[i], POD_PAGE_WORDS);
 
         unmap_domain_page(map[i]);
 
         /* See comment in p2m_pod_zero_check_superpage() re gnttab
          * check timing.  */
-        if ( j < PAGE_SIZE/sizeof(*map[i]) )
+        if ( !zero )
         {
             set_p2m_entry(p2m, gfns[i], mfns[i], PAGE_ORDER_4K,
                 types[i], p2m->default_access);
@@ -919,21 +928,41 @@ p2m_pod_check_last_super(struct p2m_domain *p2m, unsigned long gfn_aligned)
 
 
 #define POD_SWEEP_STRIDE  16
-static void
-p2m_pod_emergency_sweep(struct p2m_domain *p2m)
+
+/* Background sweep tuning.  The sweeper is armed when a demand-populate
+ * leaves fewer than POD_SWEEP_LOW_WATER pages in the cache while the guest
+ * still has outstanding PoD entries, and scans POD_SWEEP_BG_LIMIT gfns per
+ * tick.  Ticks that reclaim nothing back off exponentially, so a guest
+ * with no zero pages left costs us very little. */
+#define POD_SWEEP_LOW_WATER  (2 * SUPERPAGE_PAGES)
+#define POD_SWEEP_BG_LIMIT   256
+#define POD_SWEEP_DELAY_MIN  MILLISECS(1)
+#define POD_SWEEP_DELAY_MAX  MILLISECS(128)
+
+/* Scan downwards from reclaim_single looking for zeroed pages to return to
+ * the cache.  An emergency sweep is done from the fault path with an empty
+ * cache, so it keeps going past @limit gfns until it has found something.
+ * A background sweep stops after @limit gfns regardless, and doesn't
+ * splinter superpages: it either reclaims a 2M mapping whole or skips it.
+ * Must be called w/ pod lock held.  Returns the number of pages reclaimed. */
+static long
+p2m_pod_sweep(struct p2m_domain *p2m, unsigned long limit, bool_t background)
 {
     unsigned long gfns[POD_SWEEP_STRIDE];
-    unsigned long i, j=0, start, limit;
-    p2m_type_t t;
+    unsigned long i, j=0, start, scanned;
+    long count = p2m->pod.count;
+    s_time_t t0 = NOW();
+    p2m_type_t type;
 
+    ASSERT(pod_locked_by_me(p2m));
 
     if ( p2m->pod.reclaim_single == 0 )
         p2m->pod.reclaim_single = p2m->pod.max_guest;
 
     start = p2m->pod.reclaim_single;
-    limit = (start > POD_SWEEP_LIMIT) ? (start - POD_SWEEP_LIMIT) : 0;
+    limit = (start > limit) ? (start - limit) : 0;
 
-    /* FIXME: Figure out how to avoid superpages */
+    /* FIXME: Figure out how to avoid superpages in the emergency case */
     /* NOTE: Promote to globally locking the p2m. This will get complicated
      * in a fine-grained scenario. If we lock each gfn individually we must be
      * careful about spinlock recursion limits and POD_SWEEP_STRIDE. */
@@ -941,8 +970,25 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
     for ( i=p2m->pod.reclaim_single; i > 0 ; i-- )
     {
         p2m_access_t a;
-        (void)p2m->get_entry(p2m, i, &t, &a, 0, NULL);
-        if ( p2m_is_ram(t) )
+        unsigned int order = PAGE_ORDER_4K;
+
+        (void)p2m->get_entry(p2m, i, &type, &a, 0, &order);
+        if ( background && order != PAGE_ORDER_4K )
+        {
+            unsigned long base = i & ~((1UL << order) - 1);
+
+            if ( p2m_is_ram(type) && order == PAGE_ORDER_2M )
+                p2m_pod_zero_check_superpage(p2m, base);
+
+            /* Carry on below the mapping; i is decremented by the loop. */
+            if ( base == 0 )
+            {
+                i = 0;
+                break;
+            }
+            i = base;
+        }
+        else if ( p2m_is_ram(type) )
         {
             gfns[j] = i;
             j++;
@@ -958,7 +1004,7 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
          * NB that this is a zero-sum game; we're increasing our cache size
          * by re-increasing our 'debt'.  Since we hold the pod lock,
          * (entry_count - count) must remain the same. */
-        if ( p2m->pod.count > 0 && i < limit )
+        if ( (background || p2m->pod.count > 0) && i < limit )
             break;
     }
 
@@ -968,6 +1014,103 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
     p2m_unlock(p2m);
     p2m->pod.reclaim_single = i ? i - 1 : i;
 
+    scanned = start - i;
+    count = p2m->pod.count - count;
+
+    if ( tb_init_done )
+    {
+        struct {
+            u64 gfn;
+            int d:16,background:16;
+            u32 scanned, reclaimed, ns;
+        } t;
+
+        t.gfn = start;
+        t.d = p2m->domain->domain_id;
+        t.background = background;
+        t.scanned = scanned;
+        t.reclaimed = count;
+        t.ns = NOW() - t0;
+
+        __trace_var(TRC_MEM_POD_SWEEP, 0, sizeof(t), &t);
+    }
+
+    return count;
+}
+
+static void
+p2m_pod_emergency_sweep(struct p2m_domain *p2m)
+{
+    p2m_pod_sweep(p2m, POD_SWEEP_LIMIT, 0);
+}
+
+/* Is the cache low enough, with enough guest demand outstanding, that it's
+ * worth looking for zero pages in the background? */
+static inline bool_t
+p2m_pod_sweep_wanted(struct p2m_domain *p2m)
+{
+    return p2m->pod.entry_count > p2m->pod.count
+           && p2m->pod.count < POD_SWEEP_LOW_WATER;
+}
+
+/* Must be called w/ pod lock held */
+static void
+p2m_pod_sweep_arm(struct p2m_domain *p2m)
+{
+    ASSERT(pod_locked_by_me(p2m));
+
+    /* Only the host p2m has a sweeper; see p2m_init(). */
+    if ( p2m_is_nestedp2m(p2m) )
+        return;
+
+    if ( p2m->pod.sweep_pending || !p2m_pod_sweep_wanted(p2m) )
+        return;
+
+    p2m->pod.sweep_pending = 1;
+    set_timer(&p2m->pod.sweep_timer, NOW() + p2m->pod.sweep_delay);
+}
+
+static void
+p2m_pod_sweep_timer_fn(void *data)
+{
+    struct p2m_domain *p2m = data;
+
+    /* Lock order is p2m then pod; p2m_pod_sweep() takes the p2m lock
+     * again, recursively. */
+    p2m_lock(p2m);
+    pod_lock(p2m);
+
+    p2m->pod.sweep_pending = 0;
+
+    /* As in p2m_pod_demand_populate(), checking this under the pod lock
+     * keeps us out of the way of p2m_pod_empty_cache(). */
+    if ( unlikely(p2m->domain->is_dying) || !p2m_pod_sweep_wanted(p2m) )
+        goto out;
+
+    if ( p2m_pod_sweep(p2m, POD_SWEEP_BG_LIMIT, 1) > 0 )
+        p2m->pod.sweep_delay = POD_SWEEP_DELAY_MIN;
+    else if ( p2m->pod.sweep_delay < POD_SWEEP_DELAY_MAX )
+        p2m->pod.sweep_delay *= 2;
+
+    p2m_pod_sweep_arm(p2m);
+
+out:
+    pod_unlock(p2m);
+    p2m_unlock(p2m);
+}
+
+void
+p2m_pod_init(struct p2m_domain *p2m)
+{
+    p2m->pod.sweep_delay = POD_SWEEP_DELAY_MIN;
+    init_timer(&p2m->pod.sweep_timer, p2m_pod_sweep_timer_fn, p2m,
+               smp_processor_id());
+}
+
+void
+p2m_pod_teardown(struct p2m_domain *p2m)
+{
+    kill_timer(&p2m->pod.sweep_timer);
 }
 
 int
@@ -1045,6 +1188,9 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
     p2m->pod.entry_count -= (1 << order);
     BUG_ON(p2m->pod.entry_count < 0);
 
+    /* Start refilling the cache before the next fault finds it empty */
+    p2m_pod_sweep_arm(p2m);
+
     if ( tb_init_done )
     {
         struct {
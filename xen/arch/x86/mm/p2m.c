@@ -114,6 +114,7 @@ int p2m_init(struct domain *d)
         return -ENOMEM;
     }
     p2m_initialise(d, p2m);
+    p2m_pod_init(p2m);
 
     /* Must initialise nestedp2m unconditionally
      * since nestedhvm_enabled(d) returns false here.
@@ -439,6 +440,7 @@ void p2m_final_teardown(struct domain *d)
     /* Iterate over all p2m tables per domain */
     if ( d->arch.p2m )
     {
+        p2m_pod_teardown(d->arch.p2m);
         free_cpumask_var(d->arch.p2m->dirty_cpumask);
         xfree(d->arch.p2m);
         d->arch.p2m = NULL;
@@ -94,6 +94,64 @@ int xenctl_cpumap_to_cpumask(
     return err;
 }
 
+static int nodemask_to_xenctl_cpumap(
+    struct xenctl_cpumap *xenctl_nodemap, const nodemask_t *nodemask)
+{
+    unsigned int guest_bytes, copy_bytes, i;
+    uint8_t zero = 0;
+    int err = 0;
+    uint8_t *bytemap = xmalloc_array(uint8_t, (MAX_NUMNODES + 7) / 8);
+
+    if ( !bytemap )
+        return -ENOMEM;
+
+    guest_bytes = (xenctl_nodemap->nr_cpus + 7) / 8;
+    copy_bytes  = min_t(unsigned int, guest_bytes, (MAX_NUMNODES + 7) / 8);
+
+    bitmap_long_to_byte(bytemap, nodes_addr(*nodemask), MAX_NUMNODES);
+
+    if ( copy_bytes != 0 )
+        if ( copy_to_guest(xenctl_nodemap->bitmap, bytemap, copy_bytes) )
+            err = -EFAULT;
+
+    for ( i = copy_bytes; !err && i < guest_bytes; i++ )
+        if ( copy_to_guest_offset(xenctl_nodemap->bitmap, i, &zero, 1) )
+            err = -EFAULT;
+
+    xfree(bytemap);
+
+    return err;
+}
+
+static int xenctl_cpumap_to_nodemask(
+    nodemask_t *nodemask, const struct xenctl_cpumap *xenctl_nodemap)
+{
+    unsigned int guest_bytes, copy_bytes;
+    int err = 0;
+    uint8_t *bytemap = xzalloc_array(uint8_t, (MAX_NUMNODES + 7) / 8);
+
+    if ( !bytemap )
+        return -ENOMEM;
+
+    guest_bytes = (xenctl_nodemap->nr_cpus + 7) / 8;
+    copy_bytes  = min_t(unsigned int, guest_bytes, (MAX_NUMNODES + 7) / 8);
+
+    if ( copy_bytes != 0 )
+    {
+        if ( copy_from_guest(bytemap, xenctl_nodemap->bitmap, copy_bytes) )
+            err = -EFAULT;
+        if ( (xenctl_nodemap->nr_cpus & 7) && (guest_bytes == copy_bytes) )
+            bytemap[guest_bytes-1] &= ~(0xff << (xenctl_nodemap->nr_cpus & 7));
+    }
+
+    if ( !err )
+        bitmap_byte_to_long(nodes_addr(*nodemask), bytemap, MAX_NUMNODES);
+
+    xfree(bytemap);
+
+    return err;
+}
+
 static inline int is_free_domid(domid_t dom)
 {
     struct domain *d;
@@ -599,6 +657,30 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     }
     break;
 
+    case XEN_DOMCTL_setnodeaffinity:
+    case XEN_DOMCTL_getnodeaffinity:
+    {
+        ret = xsm_vcpuaffinity(op->cmd, d);
+        if ( ret )
+            break;
+
+        if ( op->cmd == XEN_DOMCTL_setnodeaffinity )
+        {
+            nodemask_t new_affinity;
+
+            ret = xenctl_cpumap_to_nodemask(&new_affinity,
+                                            &op->u.nodeaffinity.nodemap);
+            if ( !ret )
+                ret = domain_set_node_affinity(d, &new_affinity);
+        }
+        else
+        {
+            ret = nodemask_to_xenctl_cpumap(&op->u.nodeaffinity.nodemap,
+                                            &d->node_affinity);
+        }
+    }
+    break;
+
     case XEN_DOMCTL_scheduler_op:
     {
         ret = xsm_scheduler(d);
@@ -728,6 +810,38 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
     }
     break;
 
+    case XEN_DOMCTL_getvcpuschedhist:
+    {
+        struct xen_domctl_vcpuschedhist *hist = &op->u.vcpuschedhist;
+        uint32_t wait[XEN_DOMCTL_SCHED_HIST_BUCKETS];
+        uint32_t run[XEN_DOMCTL_SCHED_HIST_BUCKETS];
+        struct vcpu *v;
+
+        ret = xsm_getvcpuinfo(d);
+        if ( ret )
+            break;
+
+        ret = -EINVAL;
+        if ( hist->vcpu >= d->max_vcpus ||
+             (hist->flags & ~XEN_DOMCTL_SCHED_HIST_RESET) )
+            break;
+
+        ret = -ESRCH;
+        if ( (v = d->vcpu[hist->vcpu]) == NULL )
+            break;
+
+        vcpu_sched_hist_get(v, wait, run,
+                            !!(hist->flags & XEN_DOMCTL_SCHED_HIST_RESET));
+
+        ret = 0;
+        if ( (!guest_handle_is_null(hist->wait) &&
+              copy_to_guest(hist->wait, wait, ARRAY_SIZE(wait))) ||
+             (!guest_handle_is_null(hist->run) &&
+              copy_to_guest(hist->run, run, ARRAY_SIZE(run))) )
+            ret = -EFAULT;
+    }
+    break;
+
     case XEN_DOMCTL_max_mem:
     {
         unsigned long new_max;
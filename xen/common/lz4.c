@@ -0,0 +1,214 @@
+/*
+ *  lz4.c -- LZ4 block format compressor and decompressor
+ *
+ *  Implements the LZ4 block format: a sequence of (token, literal length,
+ *  literals, 16-bit little-endian match offset, match length) records,
+ *  the last of which carries literals only.  The compressor is a single
+ *  pass greedy matcher over a 4096-entry hash table and only handles
+ *  inputs below 64KiB, which is all tmem ever needs to compress.
+ */
+
+#include <xen/types.h>
+#include <xen/string.h>
+#include <xen/lz4.h>
+
+#define get_unaligned32(_p) (*(const uint32_t *)(_p))
+
+#define MINMATCH        4
+#define LASTLITERALS    5   /* last 5 bytes are always literals */
+#define MFLIMIT         12  /* last match must start 12 bytes before end */
+#define MIN_LENGTH      (MFLIMIT + 1)
+#define SKIP_TRIGGER    6   /* speed up over incompressible data */
+
+#define ML_BITS  4
+#define ML_MASK  ((1U << ML_BITS) - 1)
+#define RUN_BITS (8 - ML_BITS)
+#define RUN_MASK ((1U << RUN_BITS) - 1)
+
+static inline uint32_t lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline unsigned char *lz4_put_len(unsigned char *op, size_t len)
+{
+    for ( ; len >= 255; len -= 255 )
+        *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+static unsigned char *lz4_put_sequence(unsigned char *op,
+                                       const unsigned char *lit,
+                                       size_t lit_len, size_t offset,
+                                       size_t match_len)
+{
+    unsigned char *token = op++;
+
+    if ( lit_len >= RUN_MASK )
+    {
+        *token = RUN_MASK << ML_BITS;
+        op = lz4_put_len(op, lit_len - RUN_MASK);
+    }
+    else
+        *token = lit_len << ML_BITS;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    /* a sequence without offset terminates the block */
+    if ( offset == 0 )
+        return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match_len -= MINMATCH;
+    if ( match_len >= ML_MASK )
+    {
+        *token |= ML_MASK;
+        op = lz4_put_len(op, match_len - ML_MASK);
+    }
+    else
+        *token |= match_len;
+    return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+                 unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+    uint16_t *table = wrkmem;
+    const unsigned char *ip = src, *anchor = src, *ref, *mip, *mref;
+    const unsigned char *const iend = src + src_len;
+    const unsigned char *const mflimit = iend - MFLIMIT;
+    const unsigned char *const matchlimit = iend - LASTLITERALS;
+    unsigned char *op = dst;
+    unsigned int misses = 0;
+    uint32_t h;
+
+    if ( src_len > LZ4_MAX_INPUT_SIZE )
+        return LZ4_E_ERROR;
+
+    memset(table, 0, LZ4_MEM_COMPRESS);
+    if ( src_len < MIN_LENGTH )
+        goto last_literals;
+
+    table[lz4_hash(get_unaligned32(ip))] = 0;
+    ip++;
+    while ( ip < mflimit )
+    {
+        h = lz4_hash(get_unaligned32(ip));
+        ref = src + table[h];
+        table[h] = ip - src;
+        if ( get_unaligned32(ref) != get_unaligned32(ip) || ref >= ip )
+        {
+            ip += 1 + (misses++ >> SKIP_TRIGGER);
+            continue;
+        }
+        misses = 0;
+
+        /* extend the match backwards over pending literals */
+        while ( ip > anchor && ref > src && ip[-1] == ref[-1] )
+        {
+            ip--;
+            ref--;
+        }
+
+        /* and forwards as far as the last literals allow */
+        mip = ip + MINMATCH;
+        mref = ref + MINMATCH;
+        while ( mip < matchlimit && *mip == *mref )
+        {
+            mip++;
+            mref++;
+        }
+
+        op = lz4_put_sequence(op, anchor, ip - anchor, ip - ref, mip - ip);
+        ip = anchor = mip;
+
+        /* seed the table with the position just before the new anchor */
+        if ( ip < mflimit )
+            table[lz4_hash(get_unaligned32(ip - 2))] = ip - 2 - src;
+    }
+
+ last_literals:
+    op = lz4_put_sequence(op, anchor, iend - anchor, 0, 0);
+    *dst_len = op - dst;
+    return LZ4_E_OK;
+}
+
+static inline int lz4_get_len(const unsigned char **pip,
+                              const unsigned char *iend, size_t *len)
+{
+    const unsigned char *ip = *pip;
+    unsigned char s;
+
+    do {
+        if ( ip >= iend )
+            return LZ4_E_INPUT_OVERRUN;
+        s = *ip++;
+        *len += s;
+    } while ( s == 255 );
+    *pip = ip;
+    return LZ4_E_OK;
+}
+
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+                        unsigned char *dst, size_t *dst_len)
+{
+    const unsigned char *ip = src;
+    const unsigned char *const iend = src + src_len;
+    unsigned char *op = dst;
+    unsigned char *const oend = dst + *dst_len;
+    const unsigned char *ref;
+    unsigned int token;
+    size_t len, offset;
+
+    for ( ; ; )
+    {
+        if ( ip >= iend )
+            return LZ4_E_INPUT_OVERRUN;
+        token = *ip++;
+
+        len = token >> ML_BITS;
+        if ( len == RUN_MASK && lz4_get_len(&ip, iend, &len) )
+            return LZ4_E_INPUT_OVERRUN;
+        if ( len > (size_t)(iend - ip) )
+            return LZ4_E_INPUT_OVERRUN;
+        if ( len > (size_t)(oend - op) )
+            return LZ4_E_OUTPUT_OVERRUN;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        /* the last sequence carries literals only */
+        if ( ip == iend )
+            break;
+
+        if ( iend - ip < 2 )
+            return LZ4_E_INPUT_OVERRUN;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ( offset == 0 || offset > (size_t)(op - dst) )
+            return LZ4_E_LOOKBEHIND_OVERRUN;
+
+        len = token & ML_MASK;
+        if ( len == ML_MASK && lz4_get_len(&ip, iend, &len) )
+            return LZ4_E_INPUT_OVERRUN;
+        len += MINMATCH;
+        if ( len > (size_t)(oend - op) )
+            return LZ4_E_OUTPUT_OVERRUN;
+
+        ref = op - offset;
+        if ( offset >= len )
+        {
+            memcpy(op, ref, len);
+            op += len;
+        }
+        else
+            /* overlapping match, replicate byte by byte */
+            while ( len-- )
+                *op++ = *ref++;
+    }
+
+    *dst_len = op - dst;
+    return LZ4_E_OK;
+}
@@ -50,6 +50,43 @@
 #define CSCHED_FLAG_VCPU_YIELD     0x0002  /* VCPU yielding */
 
 
+/*
+ * Node affinity balancing steps
+ *
+ * When picking a PCPU, tickling idlers or stealing work, a VCPU is first
+ * placed among the PCPUs of its domain's home nodes (the domain's
+ * node-affinity, intersected with the VCPU's cpu-affinity), and only if
+ * that fails anywhere its cpu-affinity allows.
+ */
+#define CSCHED_BALANCE_NODE_AFFINITY    0
+#define CSCHED_BALANCE_CPU_AFFINITY     1
+
+#define for_each_csched_balance_step(step) \
+    for ( (step) = 0; (step) <= CSCHED_BALANCE_CPU_AFFINITY; (step)++ )
+
+
+/*
+ * Work stealing levels
+ *
+ * An idle (or out of credits) PCPU looks for work to steal on its SMT
+ * siblings first, then on the other cores of its socket, then on its NUMA
+ * node and finally anywhere in its cpupool. The farther away the peer, the
+ * more cache a stolen VCPU leaves behind: a VCPU that ran recently (within
+ * the migration cost of the level) is considered cache-hot and left alone.
+ */
+#define CSCHED_STEAL_SMT        0   /* threads of the same core */
+#define CSCHED_STEAL_SOCKET     1   /* cores of the same socket */
+#define CSCHED_STEAL_NODE       2   /* PCPUs of the same NUMA node */
+#define CSCHED_STEAL_SYSTEM     3   /* everything else */
+#define CSCHED_STEAL_LEVELS     4
+
+/* Default migration cost of the socket level, see csched_migrate_cost() */
+#define CSCHED_DEFAULT_MIGRATE_COST_US  50
+
+/* Gang windows closing sooner than this are not joined, but reopened */
+#define CSCHED_GANG_MIN_SLICE   MICROSECS(500)
+
+
 /*
  * Useful macros
  */
@@ -108,6 +145,9 @@
 #define TRC_CSCHED_STOLEN_VCPU   TRC_SCHED_CLASS_EVT(CSCHED, 4)
 #define TRC_CSCHED_PICKED_CPU    TRC_SCHED_CLASS_EVT(CSCHED, 5)
 #define TRC_CSCHED_TICKLE        TRC_SCHED_CLASS_EVT(CSCHED, 6)
+#define TRC_CSCHED_YIELD_TO      TRC_SCHED_CLASS_EVT(CSCHED, 7)
+#define TRC_CSCHED_GANG_START    TRC_SCHED_CLASS_EVT(CSCHED, 8)
+#define TRC_CSCHED_GANG_JOIN     TRC_SCHED_CLASS_EVT(CSCHED, 9)
 
 
 /*
@@ -115,6 +155,9 @@
  */
 static int __read_mostly sched_credit_tslice_ms = CSCHED_DEFAULT_TSLICE_MS;
 integer_param("sched_credit_tslice_ms", sched_credit_tslice_ms);
+static unsigned int __read_mostly sched_credit_migrate_cost_us =
+    CSCHED_DEFAULT_MIGRATE_COST_US;
+integer_param("sched_credit_migrate_cost_us", sched_credit_migrate_cost_us);
 
 /*
  * Physical CPU
@@ -125,6 +168,9 @@ struct csched_pcpu {
     struct timer ticker;
     unsigned int tick;
     unsigned int idle_bias;
+    /* VCPUs stolen, and cache-hot VCPUs left alone, per steal level */
+    uint32_t steals[CSCHED_STEAL_LEVELS];
+    uint32_t steals_hot[CSCHED_STEAL_LEVELS];
 };
 
 /*
@@ -139,6 +185,9 @@ struct csched_vcpu {
     s_time_t start_time;   /* When we were scheduled (used for credit) */
     uint16_t flags;
     int16_t pri;
+    s_time_t numa_stamp;   /* Run time accounted up to here */
+    s_time_t local_time;   /* Run time on PCPUs of the home nodes */
+    s_time_t remote_time;  /* Run time elsewhere */
 #ifdef CSCHED_STATS
     struct {
         int credit_last;
@@ -159,9 +208,16 @@ struct csched_dom {
     struct list_head active_vcpu;
     struct list_head active_sdom_elem;
     struct domain *dom;
+    /* cpumask translated from the domain's node-affinity */
+    cpumask_var_t node_affinity_cpumask;
     uint16_t active_vcpu_count;
     uint16_t weight;
     uint16_t cap;
+    /* Gang scheduling, see csched_gang_dispatch() */
+    bool_t gang;
+    spinlock_t gang_lock;
+    s_time_t gang_start;
+    s_time_t gang_end;
 };
 
 /*
@@ -184,6 +240,8 @@ struct csched_private {
     /* Period of master and tick in milliseconds */
     unsigned tslice_ms, tick_period_us, ticks_per_tslice;
     unsigned credits_per_tslice;
+    /* Number of domains with gang scheduling enabled */
+    unsigned int gang_doms;
 };
 
 static void csched_tick(void *_cpu);
@@ -239,6 +297,68 @@ __runq_remove(struct csched_vcpu *svc)
     list_del_init(&svc->runq_elem);
 }
 
+/*
+ * Is the node-affinity of vc's domain worth a balancing step of its own?
+ * It is not if it was computed automatically (and hence just mirrors the
+ * cpu-affinity of the domain's VCPUs), if it spans all the PCPUs, or if
+ * it has nothing in common with mask.
+ */
+static inline int
+__vcpu_has_node_affinity(const struct vcpu *vc, const cpumask_t *mask)
+{
+    const struct domain *d = vc->domain;
+    const struct csched_dom *sdom = CSCHED_DOM(d);
+
+    if ( d->auto_node_affinity
+         || cpumask_full(sdom->node_affinity_cpumask)
+         || !cpumask_intersects(sdom->node_affinity_cpumask, mask) )
+        return 0;
+
+    return 1;
+}
+
+/*
+ * Each balancing step only considers the PCPUs that make sense for it:
+ * the VCPU's cpu-affinity restricted to its home nodes first, then the
+ * plain cpu-affinity.
+ */
+static void
+csched_balance_cpumask(const struct vcpu *vc, int step, cpumask_t *mask)
+{
+    if ( step == CSCHED_BALANCE_NODE_AFFINITY )
+    {
+        cpumask_and(mask, CSCHED_DOM(vc->domain)->node_affinity_cpumask,
+                    vc->cpu_affinity);
+
+        if ( unlikely(cpumask_empty(mask)) )
+            cpumask_copy(mask, vc->cpu_affinity);
+    }
+    else /* step == CSCHED_BALANCE_CPU_AFFINITY */
+        cpumask_copy(mask, vc->cpu_affinity);
+}
+
+/*
+ * Charge the time svc has been running on cpu since it was last accounted
+ * to either its local or its remote run time.
+ */
+static inline void
+__csched_vcpu_numa_acct(struct csched_vcpu *svc, unsigned int cpu,
+                        s_time_t now)
+{
+    s_time_t since = max_t(s_time_t, svc->vcpu->runstate.state_entry_time,
+                           svc->numa_stamp);
+
+    if ( now > since )
+    {
+        if ( node_isset(cpu_to_node(cpu), svc->vcpu->domain->node_affinity) )
+            svc->local_time += now - since;
+        else
+            svc->remote_time += now - since;
+    }
+
+    svc->numa_stamp = now;
+}
+
 static void burn_credits(struct csched_vcpu *svc, s_time_t now)
 {
     s_time_t delta;
@@ -291,41 +411,67 @@ __runq_tickle(unsigned int cpu, struct csched_vcpu *new)
     }
     else if ( !idlers_empty )
     {
-        /* Check whether or not there are idlers that can run new */
-        cpumask_and(&idle_mask, prv->idlers, new->vcpu->cpu_affinity);
+        int new_idlers_empty;
+        int balance_step;
 
-        /*
-         * If there are no suitable idlers for new, and it's higher
-         * priority than cur, ask the scheduler to migrate cur away.
-         * We have to act like this (instead of just waking some of
-         * the idlers suitable for cur) because cur is running.
-         *
-         * If there are suitable idlers for new, no matter priorities,
-         * leave cur alone (as it is running and is, likely, cache-hot)
-         * and wake some of them (which is waking up and so is, likely,
-         * cache cold anyway).
-         */
-        if ( cpumask_empty(&idle_mask) && new->pri > cur->pri )
+        for_each_csched_balance_step( balance_step )
         {
-            SCHED_STAT_CRANK(tickle_idlers_none);
-            SCHED_VCPU_STAT_CRANK(cur, kicked_away);
-            SCHED_VCPU_STAT_CRANK(cur, migrate_r);
-            SCHED_STAT_CRANK(migrate_kicked_away);
-            set_bit(_VPF_migrating, &cur->vcpu->pause_flags);
-            cpumask_set_cpu(cpu, &mask);
-        }
-        else if ( !cpumask_empty(&idle_mask) )
-        {
-            /* Which of the idlers suitable for new shall we wake up? */
-            SCHED_STAT_CRANK(tickle_idlers_some);
-            if ( opt_tickle_one_idle )
+            if ( balance_step == CSCHED_BALANCE_NODE_AFFINITY
+                 && !__vcpu_has_node_affinity(new->vcpu,
+                                              new->vcpu->cpu_affinity) )
+                continue;
+
+            /* Check whether or not there are idlers that can run new */
+            csched_balance_cpumask(new->vcpu, balance_step, &idle_mask);
+            cpumask_and(&idle_mask, &idle_mask, prv->idlers);
+            new_idlers_empty = cpumask_empty(&idle_mask);
+
+            /*
+             * Idlers on new's home nodes are only a preference: if there
+             * are none, look at its whole cpu-affinity before deciding
+             * anything.
+             */
+            if ( new_idlers_empty
+                 && balance_step == CSCHED_BALANCE_NODE_AFFINITY )
+                continue;
+
+            /*
+             * If there are no suitable idlers for new, and it's higher
+             * priority than cur, ask the scheduler to migrate cur away.
+             * We have to act like this (instead of just waking some of
+             * the idlers suitable for cur) because cur is running.
+             *
+             * If there are suitable idlers for new, no matter priorities,
+             * leave cur alone (as it is running and is, likely, cache-hot)
+             * and wake some of them (which is waking up and so is, likely,
+             * cache cold anyway).
+             */
+            if ( new_idlers_empty && new->pri > cur->pri )
             {
-                this_cpu(last_tickle_cpu) =
-                    cpumask_cycle(this_cpu(last_tickle_cpu), &idle_mask);
-                cpumask_set_cpu(this_cpu(last_tickle_cpu), &mask);
+                SCHED_STAT_CRANK(tickle_idlers_none);
+                SCHED_VCPU_STAT_CRANK(cur, kicked_away);
+                SCHED_VCPU_STAT_CRANK(cur, migrate_r);
+                SCHED_STAT_CRANK(migrate_kicked_away);
+                set_bit(_VPF_migrating, &cur->vcpu->pause_flags);
+                cpumask_set_cpu(cpu, &mask);
             }
-            else
-                cpumask_or(&mask, &mask, &idle_mask);
+            else if ( !new_idlers_empty )
+            {
+                /* Which of the idlers suitable for new shall we wake up? */
+                SCHED_STAT_CRANK(tickle_idlers_some);
+                if ( opt_tickle_one_idle )
+                {
+                    this_cpu(last_tickle_cpu) =
+                        cpumask_cycle(this_cpu(last_tickle_cpu), &idle_mask);
+                    cpumask_set_cpu(this_cpu(last_tickle_cpu), &mask);
+                }
+                else
+                    cpumask_or(&mask, &mask, &idle_mask);
+            }
+
+            /* Did we find anyone? */
+            if ( !cpumask_empty(&mask) )
+                break;
         }
     }
 
@@ -462,28 +608,59 @@ unsigned int get_vcpu_migration_delay(void)
     return vcpu_migration_delay;
 }
 
+/*
+ * How long after it last ran a VCPU is considered cache-hot when stealing
+ * it at a given level. SMT siblings share all the caches, so moving there
+ * is free. Within a socket only the private caches are lost, across sockets
+ * or nodes the last level cache (and possibly local memory) is too.
+ *
+ * If the stealing PCPU would otherwise go idle, only the (admin set)
+ * vcpu_migration_delay applies, at every level: running somewhere beats
+ * waiting for a warm cache. This matters most for a VCPU that was just
+ * woken, as __runq_tickle() kicks idle PCPUs precisely so they take it,
+ * and it necessarily ran recently.
+ */
+static inline s_time_t
+csched_migrate_cost(int level, bool_t idling)
+{
+    static const unsigned int factor[CSCHED_STEAL_LEVELS] = { 0, 1, 2, 4 };
+    s_time_t cost = MICROSECS((uint64_t)vcpu_migration_delay);
+
+    if ( idling )
+        return cost;
+
+    return max_t(s_time_t, cost,
+                 MICROSECS((uint64_t)sched_credit_migrate_cost_us *
+                           factor[level]));
+}
+
 static inline int
-__csched_vcpu_is_cache_hot(struct vcpu *v)
+__csched_vcpu_is_cache_hot(struct vcpu *v, int dest_cpu, int level,
+                           bool_t idling)
 {
-    int hot = ((NOW() - v->last_run_time) <
-               ((uint64_t)vcpu_migration_delay * 1000u));
+    int hot = ((NOW() - v->last_run_time) < csched_migrate_cost(level, idling));
 
     if ( hot )
+    {
         SCHED_STAT_CRANK(vcpu_hot);
+        CSCHED_PCPU(dest_cpu)->steals_hot[level]++;
+    }
 
     return hot;
 }
 
 static inline int
-__csched_vcpu_is_migrateable(struct vcpu *vc, int dest_cpu)
+__csched_vcpu_is_migrateable(struct vcpu *vc, int dest_cpu, cpumask_t *mask,
+                             int level, bool_t idling)
 {
     /*
      * Don't pick up work that's in the peer's scheduling tail or hot on
-     * peer PCPU. Only pick up work that's allowed to run on our CPU.
+     * peer PCPU. Only pick up work that prefers and/or is allowed to run
+     * on our CPU.
      */
     return !vc->is_running &&
-           !__csched_vcpu_is_cache_hot(vc) &&
-           cpumask_test_cpu(dest_cpu, vc->cpu_affinity);
+           cpumask_test_cpu(dest_cpu, mask) &&
+           !__csched_vcpu_is_cache_hot(vc, dest_cpu, level, idling);
 }
 
 static int
@@ -493,21 +670,14 @@ _csched_cpu_pick(const struct scheduler *ops, struct vcpu *vc, bool_t commit)
     cpumask_t idlers;
     cpumask_t *online;
     struct csched_pcpu *spc = NULL;
-    int cpu;
+    int cpu = vc->processor;
+    int balance_step;
 
-    /*
-     * Pick from online CPUs in VCPU's affinity mask, giving a
-     * preference to its current processor if it's in there.
-     */
     online = cpupool_scheduler_cpumask(vc->domain->cpupool);
-    cpumask_and(&cpus, online, vc->cpu_affinity);
-    cpu = cpumask_test_cpu(vc->processor, &cpus)
-            ? vc->processor
-            : cpumask_cycle(vc->processor, &cpus);
-    ASSERT( !cpumask_empty(&cpus) && cpumask_test_cpu(cpu, &cpus) );
 
     /*
-     * Try to find an idle processor within the above constraints.
+     * Try to find an idle processor within the VCPU's affinity, first
+     * among the PCPUs of its home nodes, then in its whole cpu-affinity.
      *
      * In multi-core and multi-threaded CPUs, not all idle execution
      * vehicles are equal!
@@ -522,56 +692,85 @@ _csched_cpu_pick(const struct scheduler *ops, struct vcpu *vc, bool_t commit)
      * discount vc. That is, iff vc is the currently running and the only
      * runnable vcpu on cpu, we add cpu to the idlers.
      */
-    cpumask_and(&idlers, &cpu_online_map, CSCHED_PRIV(ops)->idlers);
-    if ( vc->processor == cpu && IS_RUNQ_IDLE(cpu) )
-        cpumask_set_cpu(cpu, &idlers);
-    cpumask_and(&cpus, &cpus, &idlers);
-    cpumask_clear_cpu(cpu, &cpus);
-
-    while ( !cpumask_empty(&cpus) )
+    for_each_csched_balance_step( balance_step )
     {
-        cpumask_t cpu_idlers;
-        cpumask_t nxt_idlers;
-        int nxt, weight_cpu, weight_nxt;
-        int migrate_factor;
+        if ( balance_step == CSCHED_BALANCE_NODE_AFFINITY
+             && !__vcpu_has_node_affinity(vc, online) )
+            continue;
 
-        nxt = cpumask_cycle(cpu, &cpus);
+        /*
+         * Pick from online CPUs in the mask for this step, giving a
+         * preference to the VCPU's current processor if it's in there.
+         */
+        csched_balance_cpumask(vc, balance_step, &cpus);
+        cpumask_and(&cpus, &cpus, online);
+        if ( balance_step == CSCHED_BALANCE_NODE_AFFINITY
+             && cpumask_empty(&cpus) )
+            continue;
 
-        if ( cpumask_test_cpu(cpu, per_cpu(cpu_core_mask, nxt)) )
-        {
-            /* We're on the same socket, so check the busy-ness of threads.
-             * Migrate if # of idlers is less at all */
-            ASSERT( cpumask_test_cpu(nxt, per_cpu(cpu_core_mask, cpu)) );
-            migrate_factor = 1;
-            cpumask_and(&cpu_idlers, &idlers, per_cpu(cpu_sibling_mask, cpu));
-            cpumask_and(&nxt_idlers, &idlers, per_cpu(cpu_sibling_mask, nxt));
-        }
-        else
-        {
-            /* We're on different sockets, so check the busy-ness of cores.
-             * Migrate only if the other core is twice as idle */
-            ASSERT( !cpumask_test_cpu(nxt, per_cpu(cpu_core_mask, cpu)) );
-            migrate_factor = 2;
-            cpumask_and(&cpu_idlers, &idlers, per_cpu(cpu_core_mask, cpu));
-            cpumask_and(&nxt_idlers, &idlers, per_cpu(cpu_core_mask, nxt));
-        }
+        cpu = cpumask_test_cpu(vc->processor, &cpus)
+                ? vc->processor
+                : cpumask_cycle(vc->processor, &cpus);
+        ASSERT( !cpumask_empty(&cpus) && cpumask_test_cpu(cpu, &cpus) );
 
-        weight_cpu = cpumask_weight(&cpu_idlers);
-        weight_nxt = cpumask_weight(&nxt_idlers);
-        /* smt_power_savings: consolidate work rather than spreading it */
-        if ( sched_smt_power_savings ?
-             weight_cpu > weight_nxt :
-             weight_cpu * migrate_factor < weight_nxt )
-        {
-            cpumask_and(&nxt_idlers, &cpus, &nxt_idlers);
-            spc = CSCHED_PCPU(nxt);
-            cpu = cpumask_cycle(spc->idle_bias, &nxt_idlers);
-            cpumask_andnot(&cpus, &cpus, per_cpu(cpu_sibling_mask, cpu));
-        }
-        else
+        cpumask_and(&idlers, &cpu_online_map, CSCHED_PRIV(ops)->idlers);
+        if ( vc->processor == cpu && IS_RUNQ_IDLE(cpu) )
+            cpumask_set_cpu(cpu, &idlers);
+        cpumask_and(&cpus, &cpus, &idlers);
+        cpumask_clear_cpu(cpu, &cpus);
+        spc = NULL;
+
+        while ( !cpumask_empty(&cpus) )
         {
-            cpumask_andnot(&cpus, &cpus, &nxt_idlers);
+            cpumask_t cpu_idlers;
+            cpumask_t nxt_idlers;
+            int nxt, weight_cpu, weight_nxt;
+            int migrate_factor;
+
+            nxt = cpumask_cycle(cpu, &cpus);
+
+            if ( cpumask_test_cpu(cpu, per_cpu(cpu_core_mask, nxt)) )
+            {
+                /* We're on the same socket, so check the busy-ness of threads.
+                 * Migrate if # of idlers is less at all */
+                ASSERT( cpumask_test_cpu(nxt, per_cpu(cpu_core_mask, cpu)) );
+                migrate_factor = 1;
+                cpumask_and(&cpu_idlers, &idlers,
+                            per_cpu(cpu_sibling_mask, cpu));
+                cpumask_and(&nxt_idlers, &idlers,
+                            per_cpu(cpu_sibling_mask, nxt));
+            }
+            else
+            {
+                /* We're on different sockets, so check the busy-ness of cores.
+                 * Migrate only if the other core is twice as idle */
+                ASSERT( !cpumask_test_cpu(nxt, per_cpu(cpu_core_mask, cpu)) );
+                migrate_factor = 2;
+                cpumask_and(&cpu_idlers, &idlers, per_cpu(cpu_core_mask, cpu));
+                cpumask_and(&nxt_idlers, &idlers, per_cpu(cpu_core_mask, nxt));
+            }
+
+            weight_cpu = cpumask_weight(&cpu_idlers);
+            weight_nxt = cpumask_weight(&nxt_idlers);
+            /* smt_power_savings: consolidate work rather than spreading it */
+            if ( sched_smt_power_savings ?
+                 weight_cpu > weight_nxt :
+                 weight_cpu * migrate_factor < weight_nxt )
+            {
+                cpumask_and(&nxt_idlers, &cpus, &nxt_idlers);
+                spc = CSCHED_PCPU(nxt);
+                cpu = cpumask_cycle(spc->idle_bias, &nxt_idlers);
+                cpumask_andnot(&cpus, &cpus, per_cpu(cpu_sibling_mask, cpu));
+            }
+            else
+            {
+                cpumask_andnot(&cpus, &cpus, &nxt_idlers);
+            }
         }
+
+        /* Stop if cpu is idle (or if we've tried all the steps) */
+        if ( cpumask_test_cpu(cpu, &idlers) )
+            break;
     }
 
     if ( commit && spc )
@@ -830,6 +1029,35 @@ csched_vcpu_yield(const struct scheduler *ops, struct vcpu *vc)
     sv->flags |= CSCHED_FLAG_VCPU_YIELD;
 }
 
+static void
+csched_vcpu_yield_to(const struct scheduler *ops, struct vcpu *vc,
+                     struct vcpu *target)
+{
+    struct csched_vcpu * const svc = CSCHED_VCPU(target);
+    unsigned int cpu = target->processor;
+    int boosted = 0;
+
+    /*
+     * vc is spinning, most likely on a lock held by target, so get target
+     * running again as soon as possible by giving it the same boost it
+     * would get on wakeup.  As there, only VCPUs which are still under
+     * their fair share qualify, so that no credit is handed out.
+     */
+    if ( __vcpu_on_runq(svc) && svc->pri == CSCHED_PRI_TS_UNDER &&
+         !(svc->flags & CSCHED_FLAG_VCPU_PARKED) )
+    {
+        SCHED_STAT_CRANK(vcpu_yield_to_boost);
+        __runq_remove(svc);
+        svc->pri = CSCHED_PRI_TS_BOOST;
+        __runq_insert(cpu, svc);
+        __runq_tickle(cpu, svc);
+        boosted = 1;
+    }
+
+    TRACE_3D(TRC_CSCHED_YIELD_TO, target->domain->domain_id,
+             target->vcpu_id, boosted);
+}
+
 static int
 csched_dom_cntl(
     const struct scheduler *ops,
@@ -848,6 +1076,7 @@ csched_dom_cntl(
     {
         op->u.credit.weight = sdom->weight;
         op->u.credit.cap = sdom->cap;
+        op->u.credit.gang = sdom->gang;
     }
     else
     {
@@ -866,6 +1095,15 @@ csched_dom_cntl(
         if ( op->u.credit.cap != (uint16_t)~0U )
             sdom->cap = op->u.credit.cap;
 
+        if ( op->u.credit.gang != (uint16_t)~0U &&
+             !!op->u.credit.gang != sdom->gang )
+        {
+            sdom->gang = !!op->u.credit.gang;
+            if ( sdom->gang )
+                prv->gang_doms++;
+            else
+                prv->gang_doms--;
+        }
     }
 
     spin_unlock_irqrestore(&prv->lock, flags);
@@ -913,6 +1151,13 @@ csched_alloc_domdata(const struct scheduler *ops, struct domain *dom)
     if ( sdom == NULL )
         return NULL;
 
+    if ( !alloc_cpumask_var(&sdom->node_affinity_cpumask) )
+    {
+        xfree(sdom);
+        return NULL;
+    }
+    cpumask_setall(sdom->node_affinity_cpumask);
+
     /* Initialize credit and weight */
     INIT_LIST_HEAD(&sdom->active_vcpu);
     sdom->active_vcpu_count = 0;
@@ -920,6 +1165,7 @@ csched_alloc_domdata(const struct scheduler *ops, struct domain *dom)
     sdom->dom = dom;
     sdom->weight = CSCHED_DEFAULT_WEIGHT;
     sdom->cap = 0U;
+    spin_lock_init(&sdom->gang_lock);
 
     return (void *)sdom;
 }
@@ -944,6 +1190,18 @@ csched_dom_init(const struct scheduler *ops, struct domain *dom)
 static void
 csched_free_domdata(const struct scheduler *ops, void *data)
 {
+    struct csched_dom *sdom = data;
+    struct csched_private *prv = CSCHED_PRIV(ops);
+    unsigned long flags;
+
+    if ( sdom->gang )
+    {
+        spin_lock_irqsave(&prv->lock, flags);
+        prv->gang_doms--;
+        spin_unlock_irqrestore(&prv->lock, flags);
+    }
+
+    free_cpumask_var(sdom->node_affinity_cpumask);
     xfree(data);
 }
 
@@ -953,6 +1211,26 @@ csched_dom_destroy(const struct scheduler *ops, struct domain *dom)
     csched_free_domdata(ops, CSCHED_DOM(dom));
 }
 
+static void
+csched_set_node_affinity(
+    const struct scheduler *ops,
+    struct domain *d,
+    nodemask_t *mask)
+{
+    struct csched_dom *sdom;
+    int node;
+
+    /* The idle domain has no csched_dom, and no node-affinity to speak of */
+    if ( unlikely(is_idle_domain(d)) )
+        return;
+
+    sdom = CSCHED_DOM(d);
+    cpumask_clear(sdom->node_affinity_cpumask);
+    for_each_node_mask( node, *mask )
+        cpumask_or(sdom->node_affinity_cpumask, sdom->node_affinity_cpumask,
+                   &node_to_cpumask(node));
+}
+
 /*
  * This is a O(n) optimized sort of the runq.
  *
@@ -1240,13 +1518,15 @@ csched_tick(void *_cpu)
 }
 
 static struct csched_vcpu *
-csched_runq_steal(int peer_cpu, int cpu, int pri)
+csched_runq_steal(int peer_cpu, int cpu, int pri, int balance_step,
+                  int level)
 {
     const struct csched_pcpu * const peer_pcpu = CSCHED_PCPU(peer_cpu);
     const struct vcpu * const peer_vcpu = curr_on_cpu(peer_cpu);
     struct csched_vcpu *speer;
     struct list_head *iter;
     struct vcpu *vc;
+    cpumask_t mask;
 
     /*
      * Don't steal from an idle CPU's runq because it's about to
@@ -1269,7 +1549,18 @@ csched_runq_steal(int peer_cpu, int cpu, int pri)
             vc = speer->vcpu;
             BUG_ON( is_idle_vcpu(vc) );
 
-            if (__csched_vcpu_is_migrateable(vc, cpu))
+            /*
+             * In the node-affinity step, only VCPUs for which our PCPU
+             * is on a home node are candidates: everything else is left
+             * for the cpu-affinity step.
+             */
+            if ( balance_step == CSCHED_BALANCE_NODE_AFFINITY
+                 && !__vcpu_has_node_affinity(vc, vc->cpu_affinity) )
+                continue;
+
+            csched_balance_cpumask(vc, balance_step, &mask);
+            if ( __csched_vcpu_is_migrateable(vc, cpu, &mask, level,
+                                              pri == CSCHED_PRI_IDLE) )
             {
                 /* We got a candidate. Grab it! */
                 TRACE_3D(TRC_CSCHED_STOLEN_VCPU, peer_cpu,
@@ -1288,14 +1579,32 @@ csched_runq_steal(int peer_cpu, int cpu, int pri)
     return NULL;
 }
 
+/* PCPUs that are at most level away from cpu, see CSCHED_STEAL_* */
+static inline const cpumask_t *
+csched_steal_mask(int cpu, int level)
+{
+    switch ( level )
+    {
+    case CSCHED_STEAL_SMT:
+        return per_cpu(cpu_sibling_mask, cpu);
+    case CSCHED_STEAL_SOCKET:
+        return per_cpu(cpu_core_mask, cpu);
+    case CSCHED_STEAL_NODE:
+        return &node_to_cpumask(cpu_to_node(cpu));
+    default:
+        return &cpu_online_map;
+    }
+}
+
 static struct csched_vcpu *
 csched_load_balance(struct csched_private *prv, int cpu,
     struct csched_vcpu *snext, bool_t *stolen)
 {
     struct csched_vcpu *speer;
     cpumask_t workers;
+    cpumask_t peers;
     cpumask_t *online;
-    int peer_cpu;
+    int peer_cpu, bstep, level;
 
     BUG_ON( cpu != snext->vcpu->processor );
     online = cpupool_scheduler_cpumask(per_cpu(cpupool, cpu));
@@ -1312,41 +1621,61 @@ csched_load_balance(struct csched_private *prv, int cpu,
         SCHED_STAT_CRANK(load_balance_other);
 
     /*
-     * Peek at non-idling CPUs in the system, starting with our
-     * immediate neighbour.
+     * Let's look around for work to steal, taking both vcpu-affinity
+     * and node-affinity into account. More specifically, we check all
+     * the non-idle CPUs' runq, looking for:
+     *  1. any node-affine work to steal first,
+     *  2. if not finding anything, any vcpu-affine work to steal.
      */
-    cpumask_andnot(&workers, online, prv->idlers);
-    cpumask_clear_cpu(cpu, &workers);
-    peer_cpu = cpu;
-
-    while ( !cpumask_empty(&workers) )
+    for_each_csched_balance_step( bstep )
     {
-        peer_cpu = cpumask_cycle(peer_cpu, &workers);
-        cpumask_clear_cpu(peer_cpu, &workers);
+        cpumask_andnot(&workers, online, prv->idlers);
+        cpumask_clear_cpu(cpu, &workers);
 
         /*
-         * Get ahold of the scheduler lock for this peer CPU.
-         *
-         * Note: We don't spin on this lock but simply try it. Spinning could
-         * cause a deadlock if the peer CPU is also load balancing and trying
-         * to lock this CPU.
+         * Peek at non-idling CPUs in the system, nearest first: SMT
+         * siblings, then the rest of our socket, our node, everybody.
          */
-        if ( !pcpu_schedule_trylock(peer_cpu) )
+        for ( level = 0;
+              level < CSCHED_STEAL_LEVELS && !cpumask_empty(&workers);
+              level++ )
         {
-            SCHED_STAT_CRANK(steal_trylock_failed);
-            continue;
-        }
+            cpumask_and(&peers, &workers, csched_steal_mask(cpu, level));
+            cpumask_andnot(&workers, &workers, &peers);
+            peer_cpu = cpu;
 
-        /*
-         * Any work over there to steal?
-         */
-        speer = cpumask_test_cpu(peer_cpu, online) ?
-            csched_runq_steal(peer_cpu, cpu, snext->pri) : NULL;
-        pcpu_schedule_unlock(peer_cpu);
-        if ( speer != NULL )
-        {
-            *stolen = 1;
-            return speer;
+            while ( !cpumask_empty(&peers) )
+            {
+                peer_cpu = cpumask_cycle(peer_cpu, &peers);
+                cpumask_clear_cpu(peer_cpu, &peers);
+
+                /*
+                 * Get ahold of the scheduler lock for this peer CPU.
+                 *
+                 * Note: We don't spin on this lock but simply try it.
+                 * Spinning could cause a deadlock if the peer CPU is also
+                 * load balancing and trying to lock this CPU.
+                 */
+                if ( !pcpu_schedule_trylock(peer_cpu) )
+                {
+                    SCHED_STAT_CRANK(steal_trylock_failed);
+                    continue;
+                }
+
+                /*
+                 * Any work over there to steal?
+                 */
+                speer = cpumask_test_cpu(peer_cpu, online) ?
+                    csched_runq_steal(peer_cpu, cpu, snext->pri,
+                                      bstep, level) : NULL;
+                pcpu_schedule_unlock(peer_cpu);
+                if ( speer != NULL )
+                {
+                    CSCHED_PCPU(cpu)->steals[level]++;
+                    *stolen = 1;
+                    return speer;
+                }
+            }
         }
     }
 
@@ -1356,6 +1685,81 @@ csched_load_balance(struct csched_private *prv, int cpu,
     return snext;
 }
 
+/*
+ * Gang scheduling.
+ *
+ * The VCPUs of a domain with gang scheduling enabled are dispatched
+ * together. The first one to be picked opens a gang window, one time slice
+ * long, and kicks the PCPUs its runnable siblings are queued on. There,
+ * while the window is open, csched_runq_gang() lets the siblings jump the
+ * queue, but only ahead of VCPUs of the same priority: an OVER sibling does
+ * not preempt UNDER work, nor anything BOOSTed. All members of the gang run
+ * until the window closes, so that their time slices end together too.
+ *
+ * Credit accounting is not affected: a gang domain still gets its fair
+ * share of the CPU, it just gets it in a synchronized fashion.
+ */
+static struct csched_vcpu *
+csched_runq_gang(struct list_head *runq, s_time_t now, int min_pri)
+{
+    struct list_head *iter;
+
+    list_for_each( iter, runq )
+    {
+        struct csched_vcpu * const iter_svc = __runq_elem(iter);
+
+        if ( iter_svc->pri < min_pri || iter_svc->pri == CSCHED_PRI_IDLE )
+            break;
+
+        if ( iter_svc->sdom->gang &&
+             now < iter_svc->sdom->gang_end - CSCHED_GANG_MIN_SLICE )
+            return iter_svc;
+    }
+
+    return NULL;
+}
+
+/* Open a gang window for svc's domain, or join the one already open. */
+static s_time_t
+csched_gang_dispatch(struct csched_vcpu *svc, unsigned int cpu, s_time_t now,
+                     s_time_t tslice)
+{
+    struct csched_dom * const sdom = svc->sdom;
+    struct vcpu *v;
+    cpumask_t mask;
+
+    spin_lock(&sdom->gang_lock);
+
+    if ( now < sdom->gang_end - CSCHED_GANG_MIN_SLICE )
+    {
+        /* Trace how far behind the first member of the gang we are. */
+        SCHED_STAT_CRANK(gang_join);
+        TRACE_3D(TRC_CSCHED_GANG_JOIN, svc->vcpu->domain->domain_id,
+                 svc->vcpu->vcpu_id, now - sdom->gang_start);
+        tslice = sdom->gang_end - now;
+    }
+    else
+    {
+        sdom->gang_start = now;
+        sdom->gang_end = now + tslice;
+
+        cpumask_clear(&mask);
+        for_each_vcpu ( sdom->dom, v )
+            if ( v != svc->vcpu && !v->is_running && vcpu_runnable(v) )
+                cpumask_set_cpu(v->processor, &mask);
+        cpumask_clear_cpu(cpu, &mask);
+
+        SCHED_STAT_CRANK(gang_start);
+        TRACE_3D(TRC_CSCHED_GANG_START, svc->vcpu->domain->domain_id,
+                 svc->vcpu->vcpu_id, cpumask_weight(&mask));
+        cpumask_raise_softirq(&mask, SCHEDULE_SOFTIRQ);
+    }
+
+    spin_unlock(&sdom->gang_lock);
+
+    return tslice;
+}
+
 /*
  * This function is in the critical path. It is designed to be simple and
  * fast for the common case.
@@ -1368,7 +1772,7 @@ csched_schedule(
     struct list_head * const runq = RUNQ(cpu);
     struct csched_vcpu * const scurr = CSCHED_VCPU(current);
     struct csched_private *prv = CSCHED_PRIV(ops);
-    struct csched_vcpu *snext;
+    struct csched_vcpu *snext, *sgang = NULL;
     struct task_slice ret;
     s_time_t runtime, tslice;
 
@@ -1384,6 +1788,7 @@ csched_schedule(
         /* Update credits of a non-idle VCPU. */
         burn_credits(scurr, now);
         scurr->start_time -= now;
+        __csched_vcpu_numa_acct(scurr, cpu, now);
     }
     else
     {
@@ -1431,6 +1836,14 @@ csched_schedule(
     snext = __runq_elem(runq->next);
     ret.migrated = 0;
 
+    /* Siblings of a running gang member go first, see csched_runq_gang(). */
+    if ( prv->gang_doms && snext->pri != CSCHED_PRI_TS_BOOST )
+    {
+        sgang = csched_runq_gang(runq, now, snext->pri);
+        if ( sgang != NULL )
+            snext = sgang;
+    }
+
     /* Tasklet work (which runs in idle VCPU context) overrides all else. */
     if ( tasklet_work_scheduled )
     {
@@ -1473,7 +1886,11 @@ csched_schedule(
     }
 
     if ( !is_idle_vcpu(snext->vcpu) )
+    {
         snext->start_time += now;
+        if ( snext->sdom->gang )
+            tslice = csched_gang_dispatch(snext, cpu, now, tslice);
+    }
 
 out:
     /*
@@ -1501,7 +1918,11 @@ csched_dump_vcpu(struct csched_vcpu *svc)
 
     if ( sdom )
     {
-        printk(" credit=%i [w=%u]", atomic_read(&svc->credit), sdom->weight);
+        printk(" credit=%i [w=%u%s]", atomic_read(&svc->credit), sdom->weight,
+               sdom->gang ? ",gang" : "");
+        printk(" numa=%"PRI_stime"/%"PRI_stime"ms",
+               svc->local_time / MILLISECS(1),
+               svc->remote_time / MILLISECS(1));
 #ifdef CSCHED_STATS
         printk(" (%d+%u) {a/i=%u/%u m=%u+%u (k=%u)}",
                 svc->stats.credit_last,
@@ -1533,6 +1954,14 @@ csched_dump_pcpu(const struct scheduler *ops, int cpu)
     printk(" sort=%d, sibling=%s, ", spc->runq_sort_last, cpustr);
     cpumask_scnprintf(cpustr, sizeof(cpustr), per_cpu(cpu_core_mask, cpu));
     printk("core=%s\n", cpustr);
+    printk(" steals smt/socket/node/system=%u/%u/%u/%u"
+           " (hot %u/%u/%u/%u)\n",
+           spc->steals[CSCHED_STEAL_SMT], spc->steals[CSCHED_STEAL_SOCKET],
+           spc->steals[CSCHED_STEAL_NODE], spc->steals[CSCHED_STEAL_SYSTEM],
+           spc->steals_hot[CSCHED_STEAL_SMT],
+           spc->steals_hot[CSCHED_STEAL_SOCKET],
+           spc->steals_hot[CSCHED_STEAL_NODE],
+           spc->steals_hot[CSCHED_STEAL_SYSTEM]);
 
     /* current VCPU */
     svc = CSCHED_VCPU(curr_on_cpu(cpu));
@@ -1579,7 +2008,8 @@ csched_dump(const struct scheduler *ops)
            "\tratelimit          = %dus\n"
            "\tcredits per msec   = %d\n"
            "\tticks per tslice   = %d\n"
-           "\tmigration delay    = %uus\n",
+           "\tmigration delay    = %uus\n"
+           "\tmigration cost     = %uus\n",
            prv->ncpus,
            prv->master,
            prv->credit,
@@ -1591,7 +2021,8 @@ csched_dump(const struct scheduler *ops)
            prv->ratelimit_us,
            CSCHED_CREDITS_PER_MSEC,
            prv->ticks_per_tslice,
-           vcpu_migration_delay);
+           vcpu_migration_delay,
+           sched_credit_migrate_cost_us);
 
     cpumask_scnprintf(idlers_buf, sizeof(idlers_buf), prv->idlers);
     printk("idlers: %s\n", idlers_buf);
@@ -1716,12 +2147,15 @@ const struct scheduler sched_credit_def = {
     .init_domain    = csched_dom_init,
     .destroy_domain = csched_dom_destroy,
 
+    .set_node_affinity  = csched_set_node_affinity,
+
     .insert_vcpu    = csched_vcpu_insert,
     .remove_vcpu    = csched_vcpu_remove,
 
     .sleep          = csched_vcpu_sleep,
     .wake           = csched_vcpu_wake,
     .yield          = csched_vcpu_yield,
+    .yield_to       = csched_vcpu_yield_to,
 
     .adjust         = csched_dom_cntl,
     .adjust_global  = csched_sys_cntl,
@@ -25,6 +25,7 @@
 #include <xen/errno.h>
 #include <xen/trace.h>
 #include <xen/cpu.h>
+#include <xen/rbtree.h>
 
 #define d2printk(x...)
 //#define d2printk printk
@@ -194,6 +195,34 @@ integer_param("credit2_balance_under", opt_underload_balance_tolerance);
 int opt_overload_balance_tolerance=-3;
 integer_param("credit2_balance_over", opt_overload_balance_tolerance);
 
+/*
+ * Runqueue arrangement: which pcpus share a runqueue (and its lock).
+ * Per socket by default; on many-core sockets per core (the pcpus
+ * sharing L1/L2) trades load balancing quality for lock contention.
+ */
+static const char *const runqueue_names[] = {
+    [XEN_SYSCTL_CSCHED2_RUNQ_CORE]   = "core",
+    [XEN_SYSCTL_CSCHED2_RUNQ_SOCKET] = "socket",
+    [XEN_SYSCTL_CSCHED2_RUNQ_NODE]   = "node",
+    [XEN_SYSCTL_CSCHED2_RUNQ_ALL]    = "all",
+};
+static unsigned int __read_mostly opt_runqueue = XEN_SYSCTL_CSCHED2_RUNQ_SOCKET;
+
+static void __init parse_credit2_runqueue(const char *s)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(runqueue_names); i++ )
+        if ( !strcmp(s, runqueue_names[i]) )
+        {
+            opt_runqueue = i;
+            return;
+        }
+
+    printk("WARNING, unrecognized value of credit2_runqueue option!\n");
+}
+custom_param("credit2_runqueue", parse_credit2_runqueue);
+
 /*
  * Per-runqueue data
  */
@@ -203,7 +232,7 @@ struct csched_runqueue_data {
     spinlock_t lock;      /* Lock for this runqueue. */
     cpumask_t active;      /* CPUs enabled for this runqueue */
 
-    struct list_head runq; /* Ordered list of runnable vms */
+    struct rb_root runq;   /* Runnable vms, ordered by credit */
     struct list_head svc;  /* List of all vcpus assigned to this runqueue */
     int max_weight;
 
@@ -229,6 +258,7 @@ struct csched_private {
     struct csched_runqueue_data rqd[NR_CPUS];
 
     int load_window_shift;
+    unsigned int runqueue;   /* XEN_SYSCTL_CSCHED2_RUNQ_* arrangement */
 };
 
 /*
@@ -237,7 +267,7 @@ struct csched_private {
 struct csched_vcpu {
     struct list_head rqd_elem;  /* On the runqueue data list */
     struct list_head sdom_elem; /* On the domain vcpu list */
-    struct list_head runq_elem; /* On the runqueue         */
+    struct rb_node runq_elem;   /* On the runqueue         */
     struct csched_runqueue_data *rqd; /* Up-pointer to the runqueue */
 
     /* Up-pointers */
@@ -290,13 +320,13 @@ static s_time_t c2t(struct csched_runqueue_data *rqd, s_time_t credit, struct cs
 static /*inline*/ int
 __vcpu_on_runq(struct csched_vcpu *svc)
 {
-    return !list_empty(&svc->runq_elem);
+    return !RB_EMPTY_NODE(&svc->runq_elem);
 }
 
 static /*inline*/ struct csched_vcpu *
-__runq_elem(struct list_head *elem)
+__runq_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct csched_vcpu, runq_elem);
+    return rb_entry(elem, struct csched_vcpu, runq_elem);
 }
 
 static void
@@ -398,10 +428,17 @@ update_load(const struct scheduler *ops,
         __update_svc_load(ops, svc, change, now);
 }
 
+/*
+ * The runqueue is a red-black tree sorted by decreasing credit; vcpus with
+ * equal credit are kept in insertion order.  Credits of queued vcpus only
+ * change in reset_credit(), which preserves their relative order.
+ *
+ * Returns 0 if svc went to the head of the runqueue, 1 otherwise.
+ */
 static int
-__runq_insert(struct list_head *runq, struct csched_vcpu *svc)
+__runq_insert(struct rb_root *runq, struct csched_vcpu *svc)
 {
-    struct list_head *iter;
+    struct rb_node **link = &runq->rb_node, *parent = NULL;
     int pos = 0;
 
     d2printk("rqi d%dv%d\n",
@@ -414,22 +451,22 @@ __runq_insert(struct list_head *runq, struct csched_vcpu *svc)
     BUG_ON(svc->vcpu->is_running);
     BUG_ON(test_bit(__CSFLAG_scheduled, &svc->flags));
 
-    list_for_each( iter, runq )
+    while ( *link )
     {
-        struct csched_vcpu * iter_svc = __runq_elem(iter);
+        struct csched_vcpu *iter_svc = __runq_elem(*link);
 
+        parent = *link;
         if ( svc->credit > iter_svc->credit )
+            link = &parent->rb_left;
+        else
         {
-            d2printk(" p%d d%dv%d\n",
-                   pos,
-                   iter_svc->vcpu->domain->domain_id,
-                   iter_svc->vcpu->vcpu_id);
-            break;
+            link = &parent->rb_right;
+            pos = 1;
         }
-        pos++;
     }
 
-    list_add_tail(&svc->runq_elem, iter);
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, runq);
 
     return pos;
 }
@@ -437,7 +474,7 @@ __runq_insert(struct list_head *runq, struct csched_vcpu *svc)
 static void
 runq_insert(const struct scheduler *ops, unsigned int cpu, struct csched_vcpu *svc)
 {
-    struct list_head * runq = &RQD(ops, cpu)->runq;
+    struct rb_root *runq = &RQD(ops, cpu)->runq;
     int pos = 0;
 
     ASSERT( spin_is_locked(per_cpu(schedule_data, cpu).schedule_lock) );
@@ -467,7 +504,8 @@ static inline void
 __runq_remove(struct csched_vcpu *svc)
 {
     BUG_ON( !__vcpu_on_runq(svc) );
-    list_del_init(&svc->runq_elem);
+    rb_erase(&svc->runq_elem, &svc->rqd->runq);
+    RB_CLEAR_NODE(&svc->runq_elem);
 }
 
 void burn_credits(struct csched_runqueue_data *rqd, struct csched_vcpu *, s_time_t);
@@ -734,7 +772,7 @@ csched_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
 
     INIT_LIST_HEAD(&svc->rqd_elem);
     INIT_LIST_HEAD(&svc->sdom_elem);
-    INIT_LIST_HEAD(&svc->runq_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
 
     svc->sdom = dd;
     svc->vcpu = vc;
@@ -872,7 +910,7 @@ csched_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
     struct csched_dom * const sdom = svc->sdom;
 
     BUG_ON( sdom == NULL );
-    BUG_ON( !list_empty(&svc->runq_elem) );
+    BUG_ON( __vcpu_on_runq(svc) );
 
     if ( ! is_idle_vcpu(vc) )
     {
@@ -1431,6 +1469,47 @@ csched_dom_cntl(
     return 0;
 }
 
+static int
+csched_sys_cntl(const struct scheduler *ops,
+                struct xen_sysctl_scheduler_op *sc)
+{
+    xen_sysctl_credit2_schedule_t *params = &sc->u.sched_credit2;
+    struct csched_private *prv = CSCHED_PRIV(ops);
+    unsigned long flags;
+    int rc = 0;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    switch ( sc->cmd )
+    {
+    case XEN_SYSCTL_SCHEDOP_putinfo:
+        if ( params->runqueue >= ARRAY_SIZE(runqueue_names) )
+        {
+            rc = -EINVAL;
+            break;
+        }
+        /* Runqueues are built as cpus are added: only empty pools. */
+        if ( params->runqueue != prv->runqueue
+             && !cpumask_empty(&prv->initialized) )
+        {
+            rc = -EBUSY;
+            break;
+        }
+        prv->runqueue = params->runqueue;
+        /* FALLTHRU */
+    case XEN_SYSCTL_SCHEDOP_getinfo:
+        params->runqueue = prv->runqueue;
+        break;
+    default:
+        rc = -EINVAL;
+        break;
+    }
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    return rc;
+}
+
 static void *
 csched_alloc_domdata(const struct scheduler *ops, struct domain *dom)
 {
@@ -1507,7 +1586,7 @@ csched_runtime(const struct scheduler *ops, int cpu, struct csched_vcpu *snext)
 {
     s_time_t time = CSCHED_MAX_TIMER;
     struct csched_runqueue_data *rqd = RQD(ops, cpu);
-    struct list_head *runq = &rqd->runq;
+    struct rb_node *first = rb_first(&rqd->runq);
 
     if ( is_idle_vcpu(snext->vcpu) )
         return CSCHED_MAX_TIMER;
@@ -1516,9 +1595,9 @@ csched_runtime(const struct scheduler *ops, int cpu, struct csched_vcpu *snext)
     time = c2t(rqd, snext->credit, snext);
 
     /* Next guy on runqueue */
-    if ( ! list_empty(runq) )
+    if ( first != NULL )
     {
-        struct csched_vcpu *svc = __runq_elem(runq->next);
+        struct csched_vcpu *svc = __runq_elem(first);
         s_time_t ntime;
 
         if ( ! is_idle_vcpu(svc->vcpu) )
@@ -1549,7 +1628,7 @@ runq_candidate(struct csched_runqueue_data *rqd,
                struct csched_vcpu *scurr,
                int cpu, s_time_t now)
 {
-    struct list_head *iter;
+    struct rb_node *iter;
     struct csched_vcpu *snext = NULL;
 
     /* Default to current if runnable, idle otherwise */
@@ -1558,9 +1637,9 @@ runq_candidate(struct csched_runqueue_data *rqd,
     else
         snext = CSCHED_VCPU(idle_vcpu[cpu]);
 
-    list_for_each( iter, &rqd->runq )
+    for ( iter = rb_first(&rqd->runq); iter != NULL; iter = rb_next(iter) )
     {
-        struct csched_vcpu * svc = list_entry(iter, struct csched_vcpu, runq_elem);
+        struct csched_vcpu * svc = __runq_elem(iter);
 
         /* If this is on a different processor, don't pull it unless
          * its credit is at least CSCHED_MIGRATE_RESIST higher. */
@@ -1760,7 +1839,8 @@ csched_dump_vcpu(struct csched_vcpu *svc)
 static void
 csched_dump_pcpu(const struct scheduler *ops, int cpu)
 {
-    struct list_head *runq, *iter;
+    struct rb_root *runq;
+    struct rb_node *iter;
     struct csched_vcpu *svc;
     int loop;
     char cpustr[100];
@@ -1783,7 +1863,7 @@ csched_dump_pcpu(const struct scheduler *ops, int cpu)
     }
 
     loop = 0;
-    list_for_each( iter, runq )
+    for ( iter = rb_first(runq); iter != NULL; iter = rb_next(iter) )
     {
         svc = __runq_elem(iter);
         if ( svc )
@@ -1802,9 +1882,11 @@ csched_dump(const struct scheduler *ops)
     int i, loop;
 
     printk("Active queues: %d\n"
-           "\tdefault-weight     = %d\n",
+           "\tdefault-weight     = %d\n"
+           "\trunqueues          = per %s\n",
            cpumask_weight(&prv->active_queues),
-           CSCHED_DEFAULT_WEIGHT);
+           CSCHED_DEFAULT_WEIGHT,
+           runqueue_names[prv->runqueue]);
     for_each_cpu(i, &prv->active_queues)
     {
         s_time_t fraction;
@@ -1859,7 +1941,7 @@ static void activate_runqueue(struct csched_private *prv, int rqi)
     rqd->max_weight = 1;
     rqd->id = rqi;
     INIT_LIST_HEAD(&rqd->svc);
-    INIT_LIST_HEAD(&rqd->runq);
+    rqd->runq = RB_ROOT;
     spin_lock_init(&rqd->lock);
 
     cpumask_set_cpu(rqi, &prv->active_queues);
@@ -1878,6 +1960,55 @@ static void deactivate_runqueue(struct csched_private *prv, int rqi)
     cpumask_clear_cpu(rqi, &prv->active_queues);
 }
 
+/* Do cpu and peer belong on the same runqueue, as arranged by prv? */
+static bool_t
+cpu_runqueue_match(const struct csched_private *prv, unsigned int cpu,
+                   unsigned int peer)
+{
+    switch ( prv->runqueue )
+    {
+    case XEN_SYSCTL_CSCHED2_RUNQ_CORE:
+        return cpu_to_socket(cpu) == cpu_to_socket(peer) &&
+               cpu_to_core(cpu) == cpu_to_core(peer);
+    case XEN_SYSCTL_CSCHED2_RUNQ_SOCKET:
+        return cpu_to_socket(cpu) == cpu_to_socket(peer);
+    case XEN_SYSCTL_CSCHED2_RUNQ_NODE:
+        return cpu_to_node(cpu) == cpu_to_node(peer);
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Find the runqueue of the first active peer of cpu, or the first unused
+ * runqueue if there is none.
+ *
+ * NB: cpu 0 doesn't get a STARTING callback, and is set up before its
+ * topology is known: as the first cpu of the pool it gets runqueue 0, and
+ * is matched against by its peers later on.
+ */
+static int
+cpu_to_runqueue(const struct csched_private *prv, unsigned int cpu)
+{
+    int rqi;
+
+    for_each_cpu ( rqi, &prv->active_queues )
+    {
+        const struct csched_runqueue_data *rqd = prv->rqd + rqi;
+
+        BUG_ON(cpumask_empty(&rqd->active));
+        if ( cpu_runqueue_match(prv, cpu, cpumask_first(&rqd->active)) )
+            return rqi;
+    }
+
+    for ( rqi = 0; rqi < nr_cpu_ids; rqi++ )
+        if ( !cpumask_test_cpu(rqi, &prv->active_queues) )
+            return rqi;
+
+    BUG();
+    return -1;
+}
+
 static void init_pcpu(const struct scheduler *ops, int cpu)
 {
     int rqi, flags;
@@ -1895,21 +2026,7 @@ static void init_pcpu(const struct scheduler *ops, int cpu)
     }
 
     /* Figure out which runqueue to put it in */
-    rqi = 0;
-
-    /* Figure out which runqueue to put it in */
-    /* NB: cpu 0 doesn't get a STARTING callback, so we hard-code it to runqueue 0. */
-    if ( cpu == 0 )
-        rqi = 0;
-    else
-        rqi = cpu_to_socket(cpu);
-
-    if ( rqi < 0 )
-    {
-        printk("%s: cpu_to_socket(%d) returned %d!\n",
-               __func__, cpu, rqi);
-        BUG();
-    }
+    rqi = cpu_to_runqueue(prv, cpu);
 
     rqd=prv->rqd + rqi;
 
@@ -2059,6 +2176,7 @@ csched_init(struct scheduler *ops)
     printk(" load_window_shift: %d\n", opt_load_window_shift);
     printk(" underload_balance_tolerance: %d\n", opt_underload_balance_tolerance);
     printk(" overload_balance_tolerance: %d\n", opt_overload_balance_tolerance);
+    printk(" runqueues arrangement: per %s\n", runqueue_names[opt_runqueue]);
 
     if ( opt_load_window_shift < LOADAVG_WINDOW_SHIFT_MIN )
     {
@@ -2086,6 +2204,7 @@ csched_init(struct scheduler *ops)
     }
 
     prv->load_window_shift = opt_load_window_shift;
+    prv->runqueue = opt_runqueue;
 
     return 0;
 }
@@ -2119,6 +2238,7 @@ const struct scheduler sched_credit2_def = {
     .wake           = csched_vcpu_wake,
 
     .adjust         = csched_dom_cntl,
+    .adjust_global  = csched_sys_cntl,
 
     .pick_cpu       = csched_cpu_pick,
     .migrate        = csched_vcpu_migrate,
@@ -0,0 +1,1093 @@
+/******************************************************************************
+ * sched_rt.c
+ *
+ * Global Earliest Deadline First real-time scheduler ("rtds").
+ *
+ * Every vcpu is a deferrable server: it is guaranteed 'budget' of CPU time
+ * in each 'period', with the end of the current period as its deadline.
+ * Budget is only consumed while running, and whatever is left over when
+ * the deadline passes is lost.  A vcpu that runs out of budget waits for
+ * the start of its next period, whatever the load on the pcpus.
+ *
+ * Scheduling is global within a cpupool: the pcpus of a pool share a single
+ * runqueue, and at any time run the runnable vcpus with the earliest
+ * deadlines, subject to their affinity.  Clustered EDF is obtained by
+ * splitting the pcpus into several pools using this scheduler.
+ *
+ * No admission control is done: a pool overcommitted by the sum of the
+ * budget/period of its vcpus misses deadlines, which is accounted for per
+ * vcpu (a "deadline miss" is a period that ended with budget left, the vcpu
+ * having waited on the runq at least as long as that) and reported through
+ * XEN_DOMCTL_SCHEDOP_getinfo.
+ */
+
+#include <xen/config.h>
+#include <xen/init.h>
+#include <xen/lib.h>
+#include <xen/sched.h>
+#include <xen/domain.h>
+#include <xen/time.h>
+#include <xen/timer.h>
+#include <xen/perfc.h>
+#include <xen/sched-if.h>
+#include <xen/softirq.h>
+#include <xen/errno.h>
+#include <xen/trace.h>
+#include <xen/cpu.h>
+#include <xen/rbtree.h>
+
+/*
+ * RTDS tracing events. Check include/public/trace.h for more details.
+ */
+#define TRC_RTDS_TICKLE           TRC_SCHED_CLASS_EVT(RTDS, 1)
+#define TRC_RTDS_RUNQ_PICK        TRC_SCHED_CLASS_EVT(RTDS, 2)
+#define TRC_RTDS_BUDGET_REPLENISH TRC_SCHED_CLASS_EVT(RTDS, 3)
+#define TRC_RTDS_DEADLINE_MISS    TRC_SCHED_CLASS_EVT(RTDS, 4)
+
+/*
+ * Locking:
+ * - The schedule lock of every pcpu of the pool is the pool's private lock
+ *  + Protects both queues, the private vcpu and domain structures, and the
+ *    list of domains.
+ *  + A vcpu's processor can be changed by any pcpu of the pool picking it;
+ *    vcpu_schedule_lock() still works, as all of them map to the same lock.
+ * - The replenishment timer takes the same lock.  It must not be killed with
+ *   the lock held.
+ */
+
+/*
+ * Basic constants
+ */
+/* Parameters new domains start with */
+#define RTDS_DEFAULT_PERIOD     MILLISECS(10)
+#define RTDS_DEFAULT_BUDGET     MILLISECS(4)
+/* Limits on what can be asked for, in microseconds */
+#define RTDS_MIN_PERIOD_US      100
+#define RTDS_MIN_BUDGET_US      10
+
+/*
+ * Flags
+ */
+/* RTFLAG_scheduled: Is this vcpu either running on, or context-switching off,
+ * a physical cpu?
+ * + Set when chosen as next in rt_schedule().
+ * + Cleared after context switch has been saved in rt_context_saved()
+ * + Checked in rt_vcpu_wake to see if we can queue it, or if we should
+ *   set RTFLAG_delayed_runq_add
+ */
+#define __RTFLAG_scheduled 1
+#define RTFLAG_scheduled (1<<__RTFLAG_scheduled)
+/* RTFLAG_delayed_runq_add: Do we need to queue this vcpu once it's done
+ * being context switched out?
+ * + Set when scheduling out in rt_schedule() if prev is runnable
+ * + Set in rt_vcpu_wake if it finds RTFLAG_scheduled set
+ * + Read in rt_context_saved().  If set, it queues prev and clears the bit.
+ */
+#define __RTFLAG_delayed_runq_add 2
+#define RTFLAG_delayed_runq_add (1<<__RTFLAG_delayed_runq_add)
+
+/*
+ * Useful macros
+ */
+#define RT_PRIV(_ops)   \
+    ((struct rt_private *)((_ops)->sched_data))
+#define RT_VCPU(_vcpu)  ((struct rt_vcpu *) (_vcpu)->sched_priv)
+#define RT_DOM(_dom)    ((struct rt_dom *) (_dom)->sched_priv)
+
+/*
+ * System-wide (well, pool-wide) private data
+ */
+struct rt_private {
+    spinlock_t lock;            /* Schedule lock of all our pcpus */
+    struct list_head sdom;      /* All domains, for the dump keyhandler */
+
+    struct rb_root runq;        /* Runnable vcpus with budget, by deadline */
+    struct rb_root depletedq;   /* Runnable vcpus without, by deadline */
+
+    cpumask_t cpus;             /* pcpus of the pool */
+    cpumask_t tickled;          /* Asked to reschedule, and not done yet */
+
+    struct timer repl_timer;    /* Earliest deadline of a queued vcpu */
+    unsigned int repl_cpu;      /* The pcpu it runs on */
+};
+
+/*
+ * Virtual CPU
+ */
+struct rt_vcpu {
+    struct rb_node q_elem;      /* On the runq or the depletedq */
+    struct list_head sdom_elem; /* On the domain vcpu list */
+
+    /* Up-pointers */
+    struct rt_dom *sdom;
+    struct vcpu *vcpu;
+
+    /* Parameters */
+    s_time_t period;
+    s_time_t budget;
+
+    s_time_t cur_budget;        /* Left in the current period */
+    s_time_t cur_deadline;      /* End of the current period */
+    s_time_t last_start;        /* When we were scheduled (used for budget) */
+    s_time_t queued;            /* When we were last put on the runq */
+    s_time_t period_wait;       /* Time spent on the runq this period */
+    unsigned flags;
+
+    uint64_t deadline_misses;
+};
+
+/*
+ * Domain
+ */
+struct rt_dom {
+    struct list_head vcpu;
+    struct list_head sdom_elem;
+    struct domain *dom;
+    s_time_t period;
+    s_time_t budget;
+};
+
+/*
+ * Queue related code
+ *
+ * Both queues are red-black trees sorted by increasing deadline; vcpus with
+ * equal deadlines are kept in insertion order.  A queued vcpu is on the
+ * runq if it has budget left, on the depletedq otherwise.  Neither the
+ * budget nor the deadline of a queued vcpu change without it being taken
+ * off its queue first.  Time spent on the runq, i.e. runnable with budget
+ * but without a pcpu, is added up per period for deadline-miss accounting.
+ */
+
+static inline int
+__vcpu_on_q(const struct rt_vcpu *svc)
+{
+    return !RB_EMPTY_NODE(&svc->q_elem);
+}
+
+static inline struct rt_vcpu *
+__q_elem(struct rb_node *elem)
+{
+    return rb_entry(elem, struct rt_vcpu, q_elem);
+}
+
+static inline struct rb_root *
+__q_root(struct rt_private *prv, const struct rt_vcpu *svc)
+{
+    return svc->cur_budget > 0 ? &prv->runq : &prv->depletedq;
+}
+
+/* Returns 1 if svc went to the head of its queue, 0 otherwise. */
+static int
+__q_insert(struct rt_private *prv, struct rt_vcpu *svc, s_time_t now)
+{
+    struct rb_root *q = __q_root(prv, svc);
+    struct rb_node **link = &q->rb_node, *parent = NULL;
+    int head = 1;
+
+    BUG_ON( __vcpu_on_q(svc) );
+    BUG_ON( is_idle_vcpu(svc->vcpu) );
+    BUG_ON( svc->vcpu->is_running );
+    BUG_ON( test_bit(__RTFLAG_scheduled, &svc->flags) );
+
+    while ( *link )
+    {
+        parent = *link;
+        if ( svc->cur_deadline < __q_elem(parent)->cur_deadline )
+            link = &parent->rb_left;
+        else
+        {
+            link = &parent->rb_right;
+            head = 0;
+        }
+    }
+
+    rb_link_node(&svc->q_elem, parent, link);
+    rb_insert_color(&svc->q_elem, q);
+    svc->queued = now;
+
+    return head;
+}
+
+static inline void
+__q_remove(struct rt_private *prv, struct rt_vcpu *svc, s_time_t now)
+{
+    BUG_ON( !__vcpu_on_q(svc) );
+    if ( svc->cur_budget > 0 )
+        svc->period_wait += now - svc->queued;
+    rb_erase(&svc->q_elem, __q_root(prv, svc));
+    RB_CLEAR_NODE(&svc->q_elem);
+}
+
+/*
+ * Budget and deadline handling
+ */
+
+/* Charge a running vcpu for the time since it was last accounted for. */
+static void
+burn_budget(struct rt_vcpu *svc, s_time_t now)
+{
+    s_time_t delta = now - svc->last_start;
+
+    if ( is_idle_vcpu(svc->vcpu) || delta <= 0 )
+        return;
+
+    svc->cur_budget -= delta;
+    if ( svc->cur_budget < 0 )
+        svc->cur_budget = 0;
+    svc->last_start = now;
+}
+
+/*
+ * Move to the period now is in, and refill the budget.  Periods follow each
+ * other back to back, so that a vcpu which is always runnable gets its
+ * budget in every one of them.
+ */
+static void
+rt_replenish(struct rt_vcpu *svc, s_time_t now)
+{
+    s_time_t periods;
+
+    ASSERT(now >= svc->cur_deadline);
+
+    periods = (now - svc->cur_deadline) / svc->period + 1;
+    svc->cur_deadline += periods * svc->period;
+    svc->cur_budget = svc->budget;
+    svc->period_wait = 0;
+
+    SCHED_STAT_CRANK(rtds_replenish);
+
+    {
+        struct {
+            unsigned dom:16,vcpu:16;
+            unsigned periods;
+        } d;
+        d.dom = svc->vcpu->domain->domain_id;
+        d.vcpu = svc->vcpu->vcpu_id;
+        d.periods = periods;
+        trace_var(TRC_RTDS_BUDGET_REPLENISH, 1,
+                  sizeof(d),
+                  (unsigned char *)&d);
+    }
+}
+
+/*
+ * The deadline of a vcpu passed before it used up its budget, and it spent
+ * at least as long on the runq this period as the budget it has left: it
+ * would have used the budget had it been given a pcpu.  A vcpu which was
+ * asleep, or which woke too late in its period, did not miss anything.
+ */
+static void
+rt_deadline_miss(struct rt_vcpu *svc, s_time_t now)
+{
+    svc->deadline_misses++;
+    SCHED_STAT_CRANK(rtds_deadline_miss);
+
+    {
+        struct {
+            unsigned dom:16,vcpu:16;
+            unsigned budget_left, late;
+        } d;
+        d.dom = svc->vcpu->domain->domain_id;
+        d.vcpu = svc->vcpu->vcpu_id;
+        d.budget_left = svc->cur_budget;
+        d.late = now - svc->cur_deadline;
+        trace_var(TRC_RTDS_DEADLINE_MISS, 1,
+                  sizeof(d),
+                  (unsigned char *)&d);
+    }
+}
+
+/* Fire the replenishment timer at the earliest deadline in either queue. */
+static void
+rt_update_timer(struct rt_private *prv)
+{
+    struct rb_node *r = rb_first(&prv->runq), *d = rb_first(&prv->depletedq);
+    s_time_t expires;
+
+    if ( cpumask_empty(&prv->cpus) )
+        return;
+
+    if ( r == NULL && d == NULL )
+    {
+        stop_timer(&prv->repl_timer);
+        return;
+    }
+
+    if ( r == NULL )
+        expires = __q_elem(d)->cur_deadline;
+    else if ( d == NULL )
+        expires = __q_elem(r)->cur_deadline;
+    else
+        expires = min(__q_elem(r)->cur_deadline, __q_elem(d)->cur_deadline);
+
+    set_timer(&prv->repl_timer, expires);
+}
+
+/*
+ * Check to see if a vcpu which just became eligible to run has an earlier
+ * deadline than what one of the pcpus it may run on is running; if so, make
+ * that pcpu reschedule.  Idle pcpus come first, the one the vcpu last ran on
+ * before any other; then the pcpu running the latest deadline.
+ */
+static void
+runq_tickle(struct rt_private *prv, struct rt_vcpu *new)
+{
+    struct rt_vcpu *latest = NULL;
+    unsigned int cpu, ipid = nr_cpu_ids;
+    cpumask_t mask;
+
+    cpumask_and(&mask, &prv->cpus, new->vcpu->cpu_affinity);
+    cpumask_andnot(&mask, &mask, &prv->tickled);
+
+    if ( cpumask_test_cpu(new->vcpu->processor, &mask) &&
+         is_idle_vcpu(curr_on_cpu(new->vcpu->processor)) )
+    {
+        ipid = new->vcpu->processor;
+        goto tickle;
+    }
+
+    for_each_cpu ( cpu, &mask )
+    {
+        struct rt_vcpu *cur = RT_VCPU(curr_on_cpu(cpu));
+
+        if ( is_idle_vcpu(cur->vcpu) )
+        {
+            ipid = cpu;
+            goto tickle;
+        }
+        if ( latest == NULL || cur->cur_deadline > latest->cur_deadline )
+        {
+            latest = cur;
+            ipid = cpu;
+        }
+    }
+
+    if ( latest == NULL || latest->cur_deadline <= new->cur_deadline )
+        return;
+
+ tickle:
+    SCHED_STAT_CRANK(rtds_tickle);
+
+    {
+        struct {
+            unsigned dom:16,vcpu:16;
+            unsigned cpu;
+        } d;
+        d.dom = new->vcpu->domain->domain_id;
+        d.vcpu = new->vcpu->vcpu_id;
+        d.cpu = ipid;
+        trace_var(TRC_RTDS_TICKLE, 1,
+                  sizeof(d),
+                  (unsigned char *)&d);
+    }
+
+    cpumask_set_cpu(ipid, &prv->tickled);
+    cpu_raise_softirq(ipid, SCHEDULE_SOFTIRQ);
+}
+
+/*
+ * Queue a runnable vcpu that is not running.  One whose deadline passed
+ * while it was blocked starts a new period now.
+ */
+static void
+rt_queue(struct rt_private *prv, struct rt_vcpu *svc, s_time_t now)
+{
+    if ( now >= svc->cur_deadline )
+    {
+        svc->cur_deadline = now;
+        rt_replenish(svc, now);
+    }
+
+    if ( __q_insert(prv, svc, now) )
+        rt_update_timer(prv);
+
+    if ( svc->cur_budget > 0 )
+        runq_tickle(prv, svc);
+}
+
+/*
+ * Deal with every queued vcpu whose deadline has passed: those on the runq
+ * may have missed it, those on the depletedq get their budget back and
+ * become eligible to run.  Only the heads of the queues need looking at.
+ */
+static void
+rt_replenish_due(struct rt_private *prv, s_time_t now)
+{
+    struct rb_node *node;
+    struct rt_vcpu *svc;
+    bool_t changed = 0;
+
+    while ( (node = rb_first(&prv->runq)) != NULL &&
+            (svc = __q_elem(node))->cur_deadline <= now )
+    {
+        __q_remove(prv, svc, now);
+        if ( svc->period_wait >= svc->cur_budget )
+            rt_deadline_miss(svc, now);
+        rt_replenish(svc, now);
+        __q_insert(prv, svc, now);
+        changed = 1;
+    }
+
+    while ( (node = rb_first(&prv->depletedq)) != NULL &&
+            (svc = __q_elem(node))->cur_deadline <= now )
+    {
+        __q_remove(prv, svc, now);
+        rt_replenish(svc, now);
+        __q_insert(prv, svc, now);
+        runq_tickle(prv, svc);
+        changed = 1;
+    }
+
+    if ( changed )
+        rt_update_timer(prv);
+}
+
+static void
+rt_repl_timer_fn(void *data)
+{
+    struct rt_private *prv = data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    rt_replenish_due(prv, NOW());
+    rt_update_timer(prv);
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+}
+
+/*
+ * Vcpu and domain hooks
+ */
+
+static void *
+rt_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
+{
+    struct rt_vcpu *svc;
+
+    /* Allocate per-VCPU info */
+    svc = xzalloc(struct rt_vcpu);
+    if ( svc == NULL )
+        return NULL;
+
+    INIT_LIST_HEAD(&svc->sdom_elem);
+    RB_CLEAR_NODE(&svc->q_elem);
+
+    svc->sdom = dd;
+    svc->vcpu = vc;
+    svc->flags = 0U;
+
+    if ( ! is_idle_vcpu(vc) )
+    {
+        BUG_ON( svc->sdom == NULL );
+
+        svc->period = svc->sdom->period;
+        svc->budget = svc->sdom->budget;
+        /* The first period starts when it is first queued. */
+        svc->cur_deadline = 0;
+    }
+    else
+        BUG_ON( svc->sdom != NULL );
+
+    SCHED_STAT_CRANK(vcpu_init);
+
+    return svc;
+}
+
+static void
+rt_free_vdata(const struct scheduler *ops, void *priv)
+{
+    struct rt_vcpu *svc = priv;
+
+    xfree(svc);
+}
+
+static void
+rt_vcpu_insert(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu *svc = RT_VCPU(vc);
+
+    if ( is_idle_vcpu(vc) )
+        return;
+
+    vcpu_schedule_lock_irq(vc);
+
+    list_add_tail(&svc->sdom_elem, &svc->sdom->vcpu);
+
+    if ( !__vcpu_on_q(svc) && vcpu_runnable(vc) && !vc->is_running )
+        rt_queue(RT_PRIV(ops), svc, NOW());
+
+    vcpu_schedule_unlock_irq(vc);
+}
+
+static void
+rt_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu * const svc = RT_VCPU(vc);
+
+    BUG_ON( is_idle_vcpu(vc) );
+
+    SCHED_STAT_CRANK(vcpu_destroy);
+
+    vcpu_schedule_lock_irq(vc);
+
+    if ( __vcpu_on_q(svc) )
+        __q_remove(RT_PRIV(ops), svc, NOW());
+    clear_bit(__RTFLAG_delayed_runq_add, &svc->flags);
+
+    list_del_init(&svc->sdom_elem);
+
+    vcpu_schedule_unlock_irq(vc);
+}
+
+static void
+rt_vcpu_sleep(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu * const svc = RT_VCPU(vc);
+
+    BUG_ON( is_idle_vcpu(vc) );
+
+    if ( curr_on_cpu(vc->processor) == vc )
+        cpu_raise_softirq(vc->processor, SCHEDULE_SOFTIRQ);
+    else if ( __vcpu_on_q(svc) )
+        __q_remove(RT_PRIV(ops), svc, NOW());
+    else if ( test_bit(__RTFLAG_delayed_runq_add, &svc->flags) )
+        clear_bit(__RTFLAG_delayed_runq_add, &svc->flags);
+}
+
+static void
+rt_vcpu_wake(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu * const svc = RT_VCPU(vc);
+
+    /* Schedule lock should be held at this point. */
+
+    BUG_ON( is_idle_vcpu(vc) );
+
+    if ( unlikely(curr_on_cpu(vc->processor) == vc) )
+        return;
+
+    if ( unlikely(__vcpu_on_q(svc)) )
+        return;
+
+    /* If the context hasn't been saved for this vcpu yet, another pcpu could
+     * pick it before it is.  Instead, we set a flag so that it will be
+     * queued after the context has been saved. */
+    if ( unlikely(test_bit(__RTFLAG_scheduled, &svc->flags)) )
+    {
+        set_bit(__RTFLAG_delayed_runq_add, &svc->flags);
+        return;
+    }
+
+    rt_queue(RT_PRIV(ops), svc, NOW());
+}
+
+static void
+rt_context_saved(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu * const svc = RT_VCPU(vc);
+
+    if ( is_idle_vcpu(vc) )
+        return;
+
+    vcpu_schedule_lock_irq(vc);
+
+    /* This vcpu is now eligible to be queued again */
+    clear_bit(__RTFLAG_scheduled, &svc->flags);
+
+    if ( test_and_clear_bit(__RTFLAG_delayed_runq_add, &svc->flags)
+         && likely(vcpu_runnable(vc)) )
+        rt_queue(RT_PRIV(ops), svc, NOW());
+
+    vcpu_schedule_unlock_irq(vc);
+}
+
+static int
+rt_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
+{
+    cpumask_t cpus;
+
+    cpumask_and(&cpus, &RT_PRIV(ops)->cpus, vc->cpu_affinity);
+    if ( cpumask_empty(&cpus) )
+        cpumask_copy(&cpus, &RT_PRIV(ops)->cpus);
+    ASSERT(!cpumask_empty(&cpus));
+
+    /* Any pcpu will pull it from the runqueue: stay put if possible. */
+    if ( cpumask_test_cpu(vc->processor, &cpus) )
+        return vc->processor;
+
+    return cpumask_cycle(vc->processor, &cpus);
+}
+
+static int
+rt_dom_cntl(
+    const struct scheduler *ops,
+    struct domain *d,
+    struct xen_domctl_scheduler_op *op)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_dom * const sdom = RT_DOM(d);
+    struct rt_vcpu *svc;
+    unsigned long flags;
+    int rc = 0;
+
+    /* The private lock is the schedule lock of all our vcpus. */
+    spin_lock_irqsave(&prv->lock, flags);
+
+    if ( op->cmd == XEN_DOMCTL_SCHEDOP_getinfo )
+    {
+        op->u.rtds.period = sdom->period / MICROSECS(1);
+        op->u.rtds.budget = sdom->budget / MICROSECS(1);
+        op->u.rtds.deadline_misses = 0;
+        list_for_each_entry ( svc, &sdom->vcpu, sdom_elem )
+            op->u.rtds.deadline_misses += svc->deadline_misses;
+    }
+    else
+    {
+        ASSERT(op->cmd == XEN_DOMCTL_SCHEDOP_putinfo);
+
+        if ( op->u.rtds.period < RTDS_MIN_PERIOD_US ||
+             op->u.rtds.budget < RTDS_MIN_BUDGET_US ||
+             op->u.rtds.budget > op->u.rtds.period )
+        {
+            rc = -EINVAL;
+            goto out;
+        }
+
+        sdom->period = MICROSECS(op->u.rtds.period);
+        sdom->budget = MICROSECS(op->u.rtds.budget);
+
+        /*
+         * The new parameters apply from the next period on.  Lowering the
+         * budget leaves a queued vcpu on the same queue, and the deadlines
+         * are untouched: the queues stay sorted.
+         */
+        list_for_each_entry ( svc, &sdom->vcpu, sdom_elem )
+        {
+            svc->period = sdom->period;
+            svc->budget = sdom->budget;
+            if ( svc->cur_budget > svc->budget )
+                svc->cur_budget = svc->budget;
+        }
+    }
+
+ out:
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    return rc;
+}
+
+static void *
+rt_alloc_domdata(const struct scheduler *ops, struct domain *dom)
+{
+    struct rt_dom *sdom;
+    unsigned long flags;
+
+    sdom = xzalloc(struct rt_dom);
+    if ( sdom == NULL )
+        return NULL;
+
+    INIT_LIST_HEAD(&sdom->vcpu);
+    INIT_LIST_HEAD(&sdom->sdom_elem);
+    sdom->dom = dom;
+    sdom->period = RTDS_DEFAULT_PERIOD;
+    sdom->budget = RTDS_DEFAULT_BUDGET;
+
+    spin_lock_irqsave(&RT_PRIV(ops)->lock, flags);
+
+    list_add_tail(&sdom->sdom_elem, &RT_PRIV(ops)->sdom);
+
+    spin_unlock_irqrestore(&RT_PRIV(ops)->lock, flags);
+
+    return (void *)sdom;
+}
+
+static void
+rt_free_domdata(const struct scheduler *ops, void *data)
+{
+    struct rt_dom *sdom = data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&RT_PRIV(ops)->lock, flags);
+
+    list_del_init(&sdom->sdom_elem);
+
+    spin_unlock_irqrestore(&RT_PRIV(ops)->lock, flags);
+
+    xfree(data);
+}
+
+static int
+rt_dom_init(const struct scheduler *ops, struct domain *dom)
+{
+    struct rt_dom *sdom;
+
+    if ( is_idle_domain(dom) )
+        return 0;
+
+    sdom = rt_alloc_domdata(ops, dom);
+    if ( sdom == NULL )
+        return -ENOMEM;
+
+    dom->sched_priv = sdom;
+
+    return 0;
+}
+
+static void
+rt_dom_destroy(const struct scheduler *ops, struct domain *dom)
+{
+    BUG_ON(!list_empty(&RT_DOM(dom)->vcpu));
+
+    rt_free_domdata(ops, RT_DOM(dom));
+}
+
+/*
+ * Find the queued vcpu with the earliest deadline that may run here.  The
+ * current one keeps running on ties, as long as it has budget.
+ */
+static struct rt_vcpu *
+runq_candidate(struct rt_private *prv, struct rt_vcpu *scurr, int cpu)
+{
+    struct rb_node *iter;
+    struct rt_vcpu *snext = NULL;
+
+    for ( iter = rb_first(&prv->runq); iter != NULL; iter = rb_next(iter) )
+    {
+        struct rt_vcpu *svc = __q_elem(iter);
+
+        if ( cpumask_test_cpu(cpu, svc->vcpu->cpu_affinity) )
+        {
+            snext = svc;
+            break;
+        }
+    }
+
+    if ( !is_idle_vcpu(scurr->vcpu) && vcpu_runnable(scurr->vcpu) &&
+         scurr->cur_budget > 0 &&
+         (snext == NULL || scurr->cur_deadline <= snext->cur_deadline) )
+        snext = scurr;
+
+    return snext ?: RT_VCPU(idle_vcpu[cpu]);
+}
+
+/*
+ * This function is in the critical path. It is designed to be simple and
+ * fast for the common case.
+ */
+static struct task_slice
+rt_schedule(
+    const struct scheduler *ops, s_time_t now, bool_t tasklet_work_scheduled)
+{
+    const int cpu = smp_processor_id();
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu * const scurr = RT_VCPU(current);
+    struct rt_vcpu *snext;
+    struct task_slice ret;
+
+    SCHED_STAT_CRANK(schedule);
+
+    /* Protected by the private lock */
+
+    cpumask_clear_cpu(cpu, &prv->tickled);
+
+    /*
+     * Charge the current vcpu, and move it on if its period is over.  Being
+     * on a pcpu at the deadline does not make budget left a miss; under EDF
+     * a vcpu kept waiting all period typically gets to run at its end
+     * though, so the time it spent queued still counts.
+     */
+    if ( !is_idle_vcpu(current) )
+    {
+        burn_budget(scurr, now);
+        if ( vcpu_runnable(current) && now >= scurr->cur_deadline )
+        {
+            if ( scurr->cur_budget > 0 &&
+                 scurr->period_wait >= scurr->cur_budget )
+                rt_deadline_miss(scurr, now);
+            rt_replenish(scurr, now);
+        }
+    }
+
+    /* The replenishment timer may not have run yet. */
+    rt_replenish_due(prv, now);
+
+    if ( tasklet_work_scheduled )
+        snext = RT_VCPU(idle_vcpu[cpu]);
+    else
+        snext = runq_candidate(prv, scurr, cpu);
+
+    /* If switching from a non-idle runnable vcpu, queue it once its
+     * context is saved: on the depletedq if it ran out of budget. */
+    if ( snext != scurr
+         && !is_idle_vcpu(current)
+         && vcpu_runnable(current) )
+        set_bit(__RTFLAG_delayed_runq_add, &scurr->flags);
+
+    ret.migrated = 0;
+
+    if ( !is_idle_vcpu(snext->vcpu) )
+    {
+        if ( snext != scurr )
+        {
+            __q_remove(prv, snext, now);
+            set_bit(__RTFLAG_scheduled, &snext->flags);
+
+            {
+                struct {
+                    unsigned dom:16,vcpu:16;
+                    unsigned budget_left, slack;
+                } d;
+                d.dom = snext->vcpu->domain->domain_id;
+                d.vcpu = snext->vcpu->vcpu_id;
+                d.budget_left = snext->cur_budget;
+                d.slack = snext->cur_deadline - now;
+                trace_var(TRC_RTDS_RUNQ_PICK, 1,
+                          sizeof(d),
+                          (unsigned char *)&d);
+            }
+        }
+
+        snext->last_start = now;
+
+        /* Safe because the lock of the old processor is the same */
+        if ( snext->vcpu->processor != cpu )
+        {
+            snext->vcpu->processor = cpu;
+            ret.migrated = 1;
+        }
+
+        /* Run until out of budget or the end of the period. */
+        ret.time = min(snext->cur_budget, snext->cur_deadline - now);
+    }
+    else
+        ret.time = -1; /* Woken by a tickle or the replenishment timer */
+
+    ret.task = snext->vcpu;
+
+    return ret;
+}
+
+static void
+rt_dump_vcpu(const struct rt_vcpu *svc)
+{
+    printk("[%i.%i] flags=%x cpu=%i",
+           svc->vcpu->domain->domain_id,
+           svc->vcpu->vcpu_id,
+           svc->flags,
+           svc->vcpu->processor);
+
+    if ( !is_idle_vcpu(svc->vcpu) )
+        printk(" budget=%"PRI_stime"/%"PRI_stime" period=%"PRI_stime
+               " deadline=%"PRI_stime" misses=%"PRIu64"%s",
+               svc->cur_budget, svc->budget, svc->period,
+               svc->cur_deadline, svc->deadline_misses,
+               __vcpu_on_q(svc) ? (svc->cur_budget > 0 ? " runq" : " depleted")
+                                : "");
+
+    printk("\n");
+}
+
+static void
+rt_dump_pcpu(const struct scheduler *ops, int cpu)
+{
+    struct rt_vcpu *svc;
+    char cpustr[100];
+
+    cpumask_scnprintf(cpustr, sizeof(cpustr), per_cpu(cpu_sibling_mask, cpu));
+    printk(" sibling=%s, ", cpustr);
+    cpumask_scnprintf(cpustr, sizeof(cpustr), per_cpu(cpu_core_mask, cpu));
+    printk("core=%s\n", cpustr);
+
+    /* current VCPU */
+    svc = RT_VCPU(curr_on_cpu(cpu));
+    if ( svc )
+    {
+        printk("\trun: ");
+        rt_dump_vcpu(svc);
+    }
+}
+
+static void
+rt_dump(const struct scheduler *ops)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_dom *sdom;
+    struct rt_vcpu *svc;
+    struct rb_node *iter;
+    unsigned long flags;
+    uint64_t util = 0;
+    int loop;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    printk("Domain info:\n");
+    list_for_each_entry ( sdom, &prv->sdom, sdom_elem )
+    {
+        printk("\tDomain: %d period %"PRI_stime"us budget %"PRI_stime"us\n",
+               sdom->dom->domain_id,
+               sdom->period / MICROSECS(1),
+               sdom->budget / MICROSECS(1));
+
+        loop = 0;
+        list_for_each_entry ( svc, &sdom->vcpu, sdom_elem )
+        {
+            printk("\t%3d: ", ++loop);
+            rt_dump_vcpu(svc);
+            util += svc->budget * 1000 / svc->period;
+        }
+    }
+
+    printk("Utilization: %"PRIu64".%"PRIu64" of %u cpus\n",
+           util / 1000, (util % 1000) / 10, cpumask_weight(&prv->cpus));
+
+    printk("Runqueue:\n");
+    loop = 0;
+    for ( iter = rb_first(&prv->runq); iter != NULL; iter = rb_next(iter) )
+    {
+        printk("\t%3d: ", ++loop);
+        rt_dump_vcpu(__q_elem(iter));
+    }
+
+    printk("Depleted queue:\n");
+    loop = 0;
+    for ( iter = rb_first(&prv->depletedq); iter != NULL;
+          iter = rb_next(iter) )
+    {
+        printk("\t%3d: ", ++loop);
+        rt_dump_vcpu(__q_elem(iter));
+    }
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+}
+
+/*
+ * Pcpu hooks
+ */
+
+static void *
+rt_alloc_pdata(const struct scheduler *ops, int cpu)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    spinlock_t *old_lock;
+    unsigned long flags;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    if ( cpumask_empty(&prv->cpus) )
+    {
+        prv->repl_cpu = cpu;
+        init_timer(&prv->repl_timer, rt_repl_timer_fn, prv, cpu);
+    }
+
+    /* IRQs already disabled */
+    old_lock = pcpu_schedule_lock(cpu);
+
+    /* Move spinlock to the pool-wide lock.  */
+    per_cpu(schedule_data, cpu).schedule_lock = &prv->lock;
+
+    spin_unlock(old_lock);
+
+    cpumask_set_cpu(cpu, &prv->cpus);
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    return (void *)1;
+}
+
+static void
+rt_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct schedule_data *sd = &per_cpu(schedule_data, cpu);
+    unsigned long flags;
+    bool_t last;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    BUG_ON(!cpumask_test_cpu(cpu, &prv->cpus));
+
+    cpumask_clear_cpu(cpu, &prv->cpus);
+    cpumask_clear_cpu(cpu, &prv->tickled);
+
+    last = cpumask_empty(&prv->cpus);
+    if ( !last && prv->repl_cpu == cpu )
+    {
+        prv->repl_cpu = cpumask_first(&prv->cpus);
+        migrate_timer(&prv->repl_timer, prv->repl_cpu);
+    }
+
+    /* Move spinlock to the original lock.  */
+    ASSERT(sd->schedule_lock == &prv->lock);
+    ASSERT(!spin_is_locked(&sd->_lock));
+    sd->schedule_lock = &sd->_lock;
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    /* The timer function takes the private lock. */
+    if ( last )
+        kill_timer(&prv->repl_timer);
+}
+
+static int
+rt_init(struct scheduler *ops)
+{
+    struct rt_private *prv;
+
+    prv = xzalloc(struct rt_private);
+    if ( prv == NULL )
+        return -ENOMEM;
+    ops->sched_data = prv;
+    spin_lock_init(&prv->lock);
+    INIT_LIST_HEAD(&prv->sdom);
+    prv->runq = RB_ROOT;
+    prv->depletedq = RB_ROOT;
+
+    return 0;
+}
+
+static void
+rt_deinit(const struct scheduler *ops)
+{
+    struct rt_private *prv;
+
+    prv = RT_PRIV(ops);
+    if ( prv != NULL )
+        xfree(prv);
+}
+
+
+static struct rt_private _rt_priv;
+
+const struct scheduler sched_rtds_def = {
+    .name           = "SMP RTDS Scheduler (global EDF)",
+    .opt_name       = "rtds",
+    .sched_id       = XEN_SCHEDULER_RTDS,
+    .sched_data     = &_rt_priv,
+
+    .init_domain    = rt_dom_init,
+    .destroy_domain = rt_dom_destroy,
+
+    .insert_vcpu    = rt_vcpu_insert,
+    .remove_vcpu    = rt_vcpu_remove,
+
+    .sleep          = rt_vcpu_sleep,
+    .wake           = rt_vcpu_wake,
+
+    .adjust         = rt_dom_cntl,
+
+    .pick_cpu       = rt_cpu_pick,
+    .do_schedule    = rt_schedule,
+    .context_saved  = rt_context_saved,
+
+    .dump_cpu_state = rt_dump_pcpu,
+    .dump_settings  = rt_dump,
+    .init           = rt_init,
+    .deinit         = rt_deinit,
+    .alloc_vdata    = rt_alloc_vdata,
+    .free_vdata     = rt_free_vdata,
+    .alloc_pdata    = rt_alloc_pdata,
+    .free_pdata     = rt_free_pdata,
+    .alloc_domdata  = rt_alloc_domdata,
+    .free_domdata   = rt_free_domdata,
+};
@@ -67,6 +67,7 @@ static const struct scheduler *schedulers[] = {
     &sched_credit_def,
     &sched_credit2_def,
     &sched_arinc653_def,
+    &sched_rtds_def,
 };
 
 static struct scheduler __read_mostly ops;
@@ -135,6 +136,17 @@ static inline void vcpu_urgent_count_update(struct vcpu *v)
     }
 }
 
+/* See XEN_DOMCTL_getvcpuschedhist for the bucket boundaries. */
+static inline void sched_hist_add(uint32_t *hist, s_time_t delta)
+{
+    unsigned int b = 0;
+
+    if ( delta >= 1024 )
+        b = min_t(unsigned int, fls(min_t(uint64_t, delta >> 10, ~0U)),
+                  XEN_DOMCTL_SCHED_HIST_BUCKETS - 1);
+    hist[b]++;
+}
+
 static inline void vcpu_runstate_change(
     struct vcpu *v, int new_state, s_time_t new_entry_time)
 {
@@ -154,6 +166,12 @@ static inline void vcpu_runstate_change(
         v->runstate.state_entry_time = new_entry_time;
     }
 
+    if ( v->runstate.state == RUNSTATE_running )
+        sched_hist_add(v->sched_run_hist, delta);
+    else if ( v->runstate.state == RUNSTATE_runnable &&
+              new_state == RUNSTATE_running )
+        sched_hist_add(v->sched_wait_hist, delta);
+
     v->runstate.state = new_state;
 }
 
@@ -173,6 +191,22 @@ void vcpu_runstate_get(struct vcpu *v, struct vcpu_runstate_info *runstate)
         vcpu_schedule_unlock_irq(v);
 }
 
+void vcpu_sched_hist_get(struct vcpu *v, uint32_t *wait, uint32_t *run,
+                         bool_t reset)
+{
+    vcpu_schedule_lock_irq(v);
+
+    memcpy(wait, v->sched_wait_hist, sizeof(v->sched_wait_hist));
+    memcpy(run, v->sched_run_hist, sizeof(v->sched_run_hist));
+    if ( reset )
+    {
+        memset(v->sched_wait_hist, 0, sizeof(v->sched_wait_hist));
+        memset(v->sched_run_hist, 0, sizeof(v->sched_run_hist));
+    }
+
+    vcpu_schedule_unlock_irq(v);
+}
+
 uint64_t get_cpu_idle_time(unsigned int cpu)
 {
     struct vcpu_runstate_info state;
@@ -276,9 +310,11 @@ int sched_move_domain(struct domain *d, struct cpupool *c)
     new_p = cpumask_first(c->cpu_valid);
     for_each_vcpu ( d, v )
     {
-        migrate_timer(&v->periodic_timer, new_p);
-        migrate_timer(&v->singleshot_timer, new_p);
-        migrate_timer(&v->poll_timer, new_p);
+        struct timer *timers[] = {
+            &v->periodic_timer, &v->singleshot_timer, &v->poll_timer
+        };
+
+        migrate_timers(timers, ARRAY_SIZE(timers), new_p);
 
         cpumask_setall(v->cpu_affinity);
         v->processor = new_p;
@@ -322,6 +358,11 @@ void sched_destroy_domain(struct domain *d)
     SCHED_OP(DOM2OP(d), destroy_domain, d);
 }
 
+void sched_set_node_affinity(struct domain *d, nodemask_t *mask)
+{
+    SCHED_OP(DOM2OP(d), set_node_affinity, d, mask);
+}
+
 void vcpu_sleep_nosync(struct vcpu *v)
 {
     unsigned long flags;
@@ -395,13 +436,45 @@ void vcpu_unblock(struct vcpu *v)
     vcpu_wake(v);
 }
 
-static void vcpu_migrate(struct vcpu *v)
+/*
+ * Lock the schedule locks of v's current cpu and of the cpu picked for it.
+ * The usual case takes v's lock once, picks a cpu, and then either shares
+ * that lock or gets the second one without backing off.  Only if the second
+ * lock is contended in the wrong order, or a cpupool operation remaps a lock
+ * under our feet, do we drop everything and retry.
+ */
+static unsigned int vcpu_migrate_lock(struct vcpu *v, unsigned long *flags,
+                                      spinlock_t **old_lockp,
+                                      spinlock_t **new_lockp)
 {
-    unsigned long flags;
     unsigned int old_cpu, new_cpu;
     spinlock_t *old_lock, *new_lock;
     bool_t pick_called = 0;
 
+    vcpu_schedule_lock_irqsave(v, *flags);
+    old_cpu = v->processor;
+    old_lock = per_cpu(schedule_data, old_cpu).schedule_lock;
+
+    new_cpu = SCHED_OP(VCPU2OP(v), pick_cpu, v);
+    new_lock = per_cpu(schedule_data, new_cpu).schedule_lock;
+    if ( cpumask_test_cpu(new_cpu, v->domain->cpupool->cpu_valid) )
+    {
+        if ( new_lock == old_lock )
+            goto out;
+        if ( new_lock > old_lock )
+            spin_lock(new_lock);
+        else if ( !spin_trylock(new_lock) )
+            goto slow;
+        if ( likely(new_lock == per_cpu(schedule_data, new_cpu).schedule_lock) )
+            goto out;
+        spin_unlock(new_lock);
+    }
+
+ slow:
+    this_cpu(schedule_data).nr_migrate_slow++;
+    perfc_incr(vcpu_migrate_slow);
+    spin_unlock_irqrestore(old_lock, *flags);
+
     old_cpu = new_cpu = v->processor;
     for ( ; ; )
     {
@@ -419,16 +492,16 @@ static void vcpu_migrate(struct vcpu *v)
 
         if ( old_lock == new_lock )
         {
-            spin_lock_irqsave(old_lock, flags);
+            spin_lock_irqsave(old_lock, *flags);
         }
         else if ( old_lock < new_lock )
         {
-            spin_lock_irqsave(old_lock, flags);
+            spin_lock_irqsave(old_lock, *flags);
             spin_lock(new_lock);
         }
         else
         {
-            spin_lock_irqsave(new_lock, flags);
+            spin_lock_irqsave(new_lock, *flags);
             spin_lock(old_lock);
         }
 
@@ -463,9 +536,25 @@ static void vcpu_migrate(struct vcpu *v)
 
         if ( old_lock != new_lock )
             spin_unlock(new_lock);
-        spin_unlock_irqrestore(old_lock, flags);
+        spin_unlock_irqrestore(old_lock, *flags);
     }
 
+ out:
+    *old_lockp = old_lock;
+    *new_lockp = new_lock;
+    return new_cpu;
+}
+
+static void vcpu_migrate(struct vcpu *v)
+{
+    unsigned long flags;
+    unsigned int old_cpu, new_cpu;
+    spinlock_t *old_lock, *new_lock;
+    s_time_t start = NOW();
+
+    new_cpu = vcpu_migrate_lock(v, &flags, &old_lock, &new_lock);
+    old_cpu = v->processor;
+
     /*
      * NB. Check of v->running happens /after/ setting migration flag
      * because they both happen in (different) spinlock regions, and those
@@ -500,6 +589,12 @@ static void vcpu_migrate(struct vcpu *v)
     else
         v->processor = new_cpu;
 
+    if ( old_cpu != new_cpu )
+    {
+        this_cpu(schedule_data).nr_migrations++;
+        this_cpu(schedule_data).migrate_time += NOW() - start;
+        perfc_incr(vcpu_migrate);
+    }
 
     if ( old_lock != new_lock )
         spin_unlock(new_lock);
@@ -729,6 +824,65 @@ static long do_yield(void)
     return 0;
 }
 
+/*
+ * Pick the sibling a spinning vcpu should yield to: a runnable, but not
+ * running, vcpu of the same domain.  Vcpus that were descheduled while
+ * still runnable (i.e., preempted, and hence possibly holding the lock
+ * being spun on) are preferred over ones which just woke up, and the most
+ * recently preempted of them wins.  This is only a hint, so no locks.
+ */
+static struct vcpu *directed_yield_target(struct vcpu *curr)
+{
+    struct vcpu *v, *target = NULL;
+    bool_t preempted, target_preempted = 0;
+
+    for_each_vcpu ( curr->domain, v )
+    {
+        if ( v == curr || v->is_running || !vcpu_runnable(v) ||
+             v->runstate.state != RUNSTATE_runnable )
+            continue;
+
+        /* schedule() stamps both at once when preempting a vcpu. */
+        preempted = (v->runstate.state_entry_time == v->last_run_time);
+
+        if ( target == NULL || (preempted && !target_preempted) ||
+             (preempted == target_preempted &&
+              v->last_run_time > target->last_run_time) )
+        {
+            target = v;
+            target_preempted = preempted;
+        }
+    }
+
+    return target;
+}
+
+/*
+ * Yield on behalf of a vcpu caught spinning by pause-loop exiting.  A plain
+ * yield often hands the pcpu straight back to the spinner while the lock
+ * holder stays descheduled, so let the scheduler boost a preempted sibling
+ * first, if there is one.
+ */
+void vcpu_directed_yield(void)
+{
+    struct vcpu *curr = current, *target;
+    unsigned long flags;
+
+    target = directed_yield_target(curr);
+
+    TRACE_3D(TRC_SCHED_YIELD_TO, curr->domain->domain_id, curr->vcpu_id,
+             target ? target->vcpu_id : -1);
+
+    if ( target != NULL )
+    {
+        vcpu_schedule_lock_irqsave(target, flags);
+        SCHED_OP(VCPU2OP(target), yield_to, curr, target);
+        vcpu_schedule_unlock_irqrestore(target, flags);
+    }
+
+    do_yield();
+}
+
 static void domain_watchdog_timeout(void *data)
 {
     struct domain *d = data;
@@ -1438,10 +1592,15 @@ void schedule_dump(struct cpupool *c)
 
     for_each_cpu (i, cpus)
     {
+        struct schedule_data *sd = &per_cpu(schedule_data, i);
+
         pcpu_schedule_lock(i);
         printk("CPU[%02d] ", i);
         SCHED_OP(sched, dump_cpu_state, i);
         pcpu_schedule_unlock(i);
+        printk("CPU[%02d] migrations=%lu slow=%lu avg_cost=%"PRI_stime"ns\n",
+               i, sd->nr_migrations, sd->nr_migrate_slow,
+               sd->nr_migrations ? sd->migrate_time / sd->nr_migrations : 0);
     }
 }
 
@@ -386,6 +386,78 @@ void migrate_timer(struct timer *timer, unsigned int new_cpu)
 }
 
 
+void migrate_timers(struct timer **timers, unsigned int nr,
+                    unsigned int new_cpu)
+{
+    unsigned int i, old_cpu = 0;
+    struct timers *old_ts, *new_ts = &per_cpu(timers, new_cpu);
+    struct timer *t;
+    bool_t old_notify, new_notify;
+    unsigned long flags;
+
+    rcu_read_lock(&timer_cpu_read_lock);
+
+    for ( ; ; )
+    {
+        for ( i = 0; i < nr; i++ )
+        {
+            old_cpu = read_atomic(&timers[i]->cpu);
+            if ( (old_cpu != new_cpu) && (old_cpu != TIMER_CPU_status_killed) )
+                break;
+        }
+        if ( i == nr )
+            break;
+
+        old_ts = &per_cpu(timers, old_cpu);
+        if ( old_cpu < new_cpu )
+        {
+            spin_lock_irqsave(&old_ts->lock, flags);
+            spin_lock(&new_ts->lock);
+        }
+        else
+        {
+            spin_lock_irqsave(&new_ts->lock, flags);
+            spin_lock(&old_ts->lock);
+        }
+
+        /*
+         * Move every timer found on old_cpu under this one pair of locks.
+         * Any that changed cpu before we got here is left for the next pass.
+         */
+        old_notify = new_notify = 0;
+        for ( ; i < nr; i++ )
+        {
+            t = timers[i];
+            if ( t->cpu != old_cpu )
+                continue;
+
+            if ( active_timer(t) )
+            {
+                old_notify |= remove_entry(t);
+                write_atomic(&t->cpu, new_cpu);
+                new_notify |= add_entry(t);
+            }
+            else
+            {
+                list_del(&t->inactive);
+                write_atomic(&t->cpu, new_cpu);
+                list_add(&t->inactive, &new_ts->inactive);
+            }
+        }
+
+        spin_unlock(&old_ts->lock);
+        spin_unlock_irqrestore(&new_ts->lock, flags);
+
+        if ( old_notify )
+            cpu_raise_softirq(old_cpu, TIMER_SOFTIRQ);
+        if ( new_notify )
+            cpu_raise_softirq(new_cpu, TIMER_SOFTIRQ);
+    }
+
+    rcu_read_unlock(&timer_cpu_read_lock);
+}
+
+
 void kill_timer(struct timer *timer)
 {
     unsigned int old_cpu, cpu;
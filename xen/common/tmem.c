@@ -23,6 +23,7 @@
 #include <xen/radix-tree.h>
 #include <xen/list.h>
 #include <xen/init.h>
+#include <xen/cpu.h>
 
 #define EXPORT /* indicates code other modules are dependent upon */
 #define FORWARD
@@ -88,6 +89,7 @@ static long global_eph_count_max = 0;
 static unsigned long failed_copies;
 static unsigned long pcd_tot_tze_size = 0;
 static unsigned long pcd_tot_csize = 0;
+static unsigned long eph_pcpu_drains = 0;
 
 DECL_CYC_COUNTER(succ_get);
 DECL_CYC_COUNTER(succ_put);
@@ -124,6 +126,8 @@ struct client {
     uint32_t weight;
     uint32_t cap;
     bool_t compress;
+    uint8_t codec; /* TMH_CODEC_xxx used for new pools */
+    unsigned int compress_ratio; /* initial policy for new pools */
     bool_t frozen;
     bool_t shared_auth_required;
     /* for save/restore/migration */
@@ -135,6 +139,9 @@ struct client {
     unsigned long compress_poor, compress_nomem;
     unsigned long compressed_pages;
     uint64_t compressed_sum_size;
+    unsigned long compress_attempts, compress_skipped;
+    uint64_t compress_out_bytes; /* sum over all attempts */
+    uint64_t compress_cycles, decompress_cycles;
     uint64_t total_cycles;
     unsigned long succ_pers_puts, succ_eph_gets, succ_pers_gets;
     /* shared pool authentication */
@@ -167,6 +174,12 @@ struct tm_pool {
     /* for save/restore/migration */
     struct list_head persistent_page_list;
     struct tmem_page_descriptor *cur_pgp;
+    /* compression policy, see do_tmem_put_compress */
+    uint8_t codec;
+    unsigned int compress_ratio; /* max compressed size, % of a page */
+    /* puts to different objects race on these: atomic updates only */
+    atomic_t compress_poor_run;
+    unsigned int compress_backoff;
     /* statistics collection */
     atomic_t pgp_count;
     int pgp_count_max;
@@ -237,6 +250,8 @@ struct tmem_page_descriptor {
     /* must hold pcd_tree_rwlocks[firstbyte] to use pcd pointer/siblings */
     uint16_t firstbyte; /* NON_SHAREABLE->pfp  otherwise->pcd */
     bool_t eviction_attempted;  /* CHANGE TO lifetimes? (settable) */
+    uint16_t eph_cpu; /* NO_EPH_CPU unless queued on a per-cpu eph list */
+    uint8_t codec; /* TMH_CODEC_xxx if compressed */
     struct list_head pcd_siblings;
     union {
         pfp_t *pfp;  /* page frame pointer */
@@ -299,6 +314,28 @@ static DEFINE_SPINLOCK(pers_lists_spinlock);
 #define ASSERT_SPINLOCK(_l) ASSERT(tmh_lock_all || spin_is_locked(_l))
 #define ASSERT_WRITELOCK(_l) ASSERT(tmh_lock_all || rw_is_write_locked(_l))
 
+/*
+ * Successful ephemeral puts are first queued on a per-cpu list and only
+ * moved onto the global and per-client LRU lists in batches (or when an
+ * eviction needs to walk them), so that puts from many guests running on
+ * different cpus don't all serialize on eph_lists_spinlock.
+ * Lock ordering is obj_spinlock -> eph_lists_spinlock -> eph_pcpu lock.
+ */
+#define EPH_PCPU_BATCH 64
+#define NO_EPH_CPU ((uint16_t)-1)
+
+struct eph_pcpu_list {
+    spinlock_t lock;
+    struct list_head pages; /* linked through pgp->global_eph_pages */
+    unsigned int count;
+};
+static DEFINE_PER_CPU(struct eph_pcpu_list, eph_pcpu_lists);
+/*
+ * cpus whose list may hold pages: unlike cpu_online_map, this still covers
+ * a cpu on its way down until CPU_DEAD has drained it.
+ */
+static cpumask_t eph_pcpu_queued;
+
 /* global counters (should use long_atomic_t access) */
 static long global_eph_count = 0; /* atomicity depends on eph_lists_spinlock */
 static atomic_t global_obj_count = ATOMIC_INIT(0);
@@ -388,8 +425,9 @@ static NOINLINE int pcd_copy_to_client(tmem_cli_mfn_t cmfn, pgp_t *pgp)
     pcd = pgp->pcd;
     if ( pgp->size < PAGE_SIZE && pgp->size != 0 &&
          pcd->size < PAGE_SIZE && pcd->size != 0 )
+        /* codecs can't be changed with dedup, so all pcds share one */
         ret = tmh_decompress_to_client(cmfn, pcd->cdata, pcd->size,
-                                       tmh_cli_buf_null);
+                                       tmh_cli_buf_null, pgp->codec);
     else if ( tmh_tze_enabled() && pcd->size < PAGE_SIZE )
         ret = tmh_copy_tze_to_client(cmfn, pcd->tze, pcd->size);
     else
@@ -614,6 +652,7 @@ static NOINLINE pgp_t *pgp_alloc(obj_t *obj)
     pgp->us.obj = obj;
     INIT_LIST_HEAD(&pgp->global_eph_pages);
     INIT_LIST_HEAD(&pgp->us.client_eph_pages);
+    pgp->eph_cpu = NO_EPH_CPU;
     pgp->pfp = NULL;
     if ( tmh_dedup_enabled() )
     {
@@ -707,6 +746,133 @@ static NOINLINE void pgp_free_from_inv_list(client_t *client, pgp_t *pgp)
     tmem_free(pgp,sizeof(pgp_t),pool);
 }
 
+/* move pages queued by cpu onto the LRU lists, eph_lists_spinlock held */
+static void eph_pcpu_drain(unsigned int cpu)
+{
+    struct eph_pcpu_list *epl = &per_cpu(eph_pcpu_lists, cpu);
+    pgp_t *pgp, *pgp2;
+    client_t *client;
+
+    ASSERT_SPINLOCK(&eph_lists_spinlock);
+    if ( !read_atomic(&epl->count) )
+        return;
+    tmem_spin_lock(&epl->lock);
+    list_for_each_entry_safe(pgp,pgp2,&epl->pages,global_eph_pages)
+    {
+        ASSERT(pgp->eph_cpu == cpu);
+        client = pgp->us.obj->pool->client;
+        list_del(&pgp->global_eph_pages);
+        list_add_tail(&pgp->global_eph_pages,&global_ephemeral_page_list);
+        if (++global_eph_count > global_eph_count_max)
+            global_eph_count_max = global_eph_count;
+        list_add_tail(&pgp->us.client_eph_pages,&client->ephemeral_page_list);
+        if (++client->eph_count > client->eph_count_max)
+            client->eph_count_max = client->eph_count;
+        pgp->eph_cpu = NO_EPH_CPU;
+    }
+    epl->count = 0;
+    cpumask_clear_cpu(cpu, &eph_pcpu_queued);
+    tmem_spin_unlock(&epl->lock);
+    eph_pcpu_drains++;
+}
+
+static void eph_pcpu_drain_all(void)
+{
+    unsigned int cpu;
+
+    for_each_cpu ( cpu, &eph_pcpu_queued )
+        eph_pcpu_drain(cpu);
+}
+
+/* queue a newly put ephemeral page on this cpu's list */
+static void eph_pcpu_add(pgp_t *pgp)
+{
+    unsigned int cpu = smp_processor_id();
+    struct eph_pcpu_list *epl = &per_cpu(eph_pcpu_lists, cpu);
+    bool_t drain;
+
+    ASSERT(list_empty(&pgp->global_eph_pages));
+    ASSERT(list_empty(&pgp->us.client_eph_pages));
+    tmem_spin_lock(&epl->lock);
+    list_add_tail(&pgp->global_eph_pages,&epl->pages);
+    pgp->eph_cpu = cpu;
+    if ( epl->count++ == 0 )
+        cpumask_set_cpu(cpu, &eph_pcpu_queued);
+    drain = (epl->count >= EPH_PCPU_BATCH);
+    tmem_spin_unlock(&epl->lock);
+    if ( drain )
+    {
+        tmem_spin_lock(&eph_lists_spinlock);
+        eph_pcpu_drain(cpu);
+        tmem_spin_unlock(&eph_lists_spinlock);
+    }
+}
+
+static int eph_pcpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct eph_pcpu_list *epl = &per_cpu(eph_pcpu_lists, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&epl->lock);
+        INIT_LIST_HEAD(&epl->pages);
+        epl->count = 0;
+        break;
+    case CPU_DEAD:
+        /*
+         * Not reached through a tmem hypercall, so tmem_spinlock is not
+         * held even with tmh_lock_all: take the locks for real.
+         */
+        if ( tmh_lock_all > 1 )
+            spin_lock_irq(&tmem_spinlock);
+        else if ( tmh_lock_all )
+            spin_lock(&tmem_spinlock);
+        spin_lock(&eph_lists_spinlock);
+        eph_pcpu_drain(cpu);
+        spin_unlock(&eph_lists_spinlock);
+        if ( tmh_lock_all > 1 )
+            spin_unlock_irq(&tmem_spinlock);
+        else if ( tmh_lock_all )
+            spin_unlock(&tmem_spinlock);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block eph_pcpu_nfb = {
+    .notifier_call = eph_pcpu_callback
+};
+
+/* returns 1 if the page was still queued on a per-cpu list and is now off */
+static bool_t eph_pcpu_del(pgp_t *pgp)
+{
+    uint16_t cpu = read_atomic(&pgp->eph_cpu);
+    struct eph_pcpu_list *epl;
+    bool_t found = 0;
+
+    if ( cpu == NO_EPH_CPU )
+        return 0;
+    epl = &per_cpu(eph_pcpu_lists, cpu);
+    tmem_spin_lock(&epl->lock);
+    /* recheck, eph_pcpu_drain may have moved it onto the LRU lists */
+    if ( pgp->eph_cpu == cpu )
+    {
+        list_del_init(&pgp->global_eph_pages);
+        pgp->eph_cpu = NO_EPH_CPU;
+        if ( --epl->count == 0 )
+            cpumask_clear_cpu(cpu, &eph_pcpu_queued);
+        found = 1;
+    }
+    tmem_spin_unlock(&epl->lock);
+    return found;
+}
+
 /* remove the page from appropriate lists but not from parent object */
 static void pgp_delist(pgp_t *pgp, bool_t no_eph_lock)
 {
@@ -719,6 +885,8 @@ static void pgp_delist(pgp_t *pgp, bool_t no_eph_lock)
     ASSERT(client != NULL);
     if ( is_ephemeral(pgp->us.obj->pool) )
     {
+        if ( eph_pcpu_del(pgp) )
+            return;
         if ( !no_eph_lock )
             tmem_spin_lock(&eph_lists_spinlock);
         if ( !list_empty(&pgp->us.client_eph_pages) )
@@ -1081,6 +1249,8 @@ static pool_t * pool_alloc(void)
     pool->found_gets = pool->gets = 0;
     pool->flushs_found = pool->flushs = 0;
     pool->flush_objs_found = pool->flush_objs = 0;
+    atomic_set(&pool->compress_poor_run, 0);
+    pool->compress_backoff = 0;
     pool->is_dying = 0;
     SET_SENTINEL(pool,POOL);
     return pool;
@@ -1133,10 +1303,14 @@ static NOINLINE void shared_pool_reassign(pool_t *pool)
         if (new_client->pools[poolid] == pool)
             break;
     ASSERT(poolid != MAX_POOLS_PER_DOMAIN);
+    /* pages still on the per-cpu queues are not in old_client's counts yet */
+    tmem_spin_lock(&eph_lists_spinlock);
+    eph_pcpu_drain_all();
     new_client->eph_count += _atomic_read(pool->pgp_count);
     old_client->eph_count -= _atomic_read(pool->pgp_count);
     list_splice_init(&old_client->ephemeral_page_list,
                      &new_client->ephemeral_page_list);
+    tmem_spin_unlock(&eph_lists_spinlock);
     tmh_client_info("reassigned shared pool from %s=%d to %s=%d pool_id=%d\n",
         cli_id_str, old_client->cli_id, cli_id_str, new_client->cli_id, poolid);
     pool->pool_id = poolid;
@@ -1234,6 +1408,8 @@ static client_t *client_create(cli_id_t cli_id)
     }
     client->cli_id = cli_id;
     client->compress = tmh_compression_enabled();
+    client->codec = tmh_default_codec();
+    client->compress_ratio = tmh_compress_ratio();
     client->shared_auth_required = tmh_shared_auth();
     for ( i = 0; i < MAX_GLOBAL_SHARED_POOLS; i++)
         client->shared_auth_uuid[i][0] =
@@ -1356,6 +1532,7 @@ static int tmem_evict(void)
 
     evict_attempts++;
     tmem_spin_lock(&eph_lists_spinlock);
+    eph_pcpu_drain_all();
     if ( (client != NULL) && client_over_quota(client) &&
          !list_empty(&client->ephemeral_page_list) )
     {
@@ -1443,12 +1620,38 @@ static inline void tmem_ensure_avail_pages(void)
 
 /************ TMEM CORE OPERATIONS ************************************/
 
+/*
+ * After TMEM_COMPRESS_POOR_RUN consecutive pages of a pool fail to compress
+ * below its ratio, stop trying for the next TMEM_COMPRESS_BACKOFF puts.
+ * (A dup put of a page that was stored uncompressed is never retried.)
+ */
+#define TMEM_COMPRESS_POOR_RUN 16
+#define TMEM_COMPRESS_BACKOFF 256
+
+/* Take one put off the pool's backoff, if any is left; never wraps. */
+static bool_t tmem_compress_backoff(pool_t *pool)
+{
+    unsigned int old, cur = read_atomic(&pool->compress_backoff);
+
+    while ( cur != 0 )
+    {
+        old = cmpxchg(&pool->compress_backoff, cur, cur - 1);
+        if ( old == cur )
+            return 1;
+        cur = old;
+    }
+    return 0;
+}
+
 static NOINLINE int do_tmem_put_compress(pgp_t *pgp, tmem_cli_mfn_t cmfn,
                                          tmem_cli_va_param_t clibuf)
 {
     void *dst, *p;
     size_t size;
     int ret = 0;
+    pool_t *pool;
+    client_t *client;
+    uint64_t start;
     DECL_LOCAL_CYC_COUNTER(compress);
     
     ASSERT(pgp != NULL);
@@ -1456,20 +1659,40 @@ static NOINLINE int do_tmem_put_compress(pgp_t *pgp, tmem_cli_mfn_t cmfn,
     ASSERT_SPINLOCK(&pgp->us.obj->obj_spinlock);
     ASSERT(pgp->us.obj->pool != NULL);
     ASSERT(pgp->us.obj->pool->client != NULL);
+    pool = pgp->us.obj->pool;
+    client = pool->client;
 
     if ( pgp->pfp != NULL )
-        pgp_free_data(pgp, pgp->us.obj->pool);
+        pgp_free_data(pgp, pool);
+    if ( tmem_compress_backoff(pool) )
+    {
+        client->compress_skipped++;
+        return 0;
+    }
     START_CYC_COUNTER(compress);
-    ret = tmh_compress_from_client(cmfn, &dst, &size, clibuf);
+    start = get_cycles();
+    ret = tmh_compress_from_client(cmfn, &dst, &size, clibuf, pool->codec);
+    client->compress_cycles += get_cycles() - start;
     if ( ret <= 0 )
         goto out;
-    else if ( (size == 0) || (size >= tmem_subpage_maxsize()) ) {
+    client->compress_attempts++;
+    client->compress_out_bytes += size;
+    if ( (size == 0) || (size >= tmem_subpage_maxsize()) ||
+         (size * 100 > (size_t)pool->compress_ratio * PAGE_SIZE) ) {
+        atomic_inc(&pool->compress_poor_run);
+        if ( atomic_read(&pool->compress_poor_run) >= TMEM_COMPRESS_POOR_RUN )
+        {
+            atomic_set(&pool->compress_poor_run, 0);
+            write_atomic(&pool->compress_backoff, TMEM_COMPRESS_BACKOFF);
+        }
         ret = 0;
         goto out;
-    } else if ( tmh_dedup_enabled() && !is_persistent(pgp->us.obj->pool) ) {
+    }
+    atomic_set(&pool->compress_poor_run, 0);
+    if ( tmh_dedup_enabled() && !is_persistent(pool) ) {
         if ( (ret = pcd_associate(pgp,dst,size)) == -ENOMEM )
             goto out;
-    } else if ( (p = tmem_malloc_bytes(size,pgp->us.obj->pool)) == NULL ) {
+    } else if ( (p = tmem_malloc_bytes(size,pool)) == NULL ) {
         ret = -ENOMEM;
         goto out;
     } else {
@@ -1477,8 +1700,9 @@ static NOINLINE int do_tmem_put_compress(pgp_t *pgp, tmem_cli_mfn_t cmfn,
         pgp->cdata = p;
     }
     pgp->size = size;
-    pgp->us.obj->pool->client->compressed_pages++;
-    pgp->us.obj->pool->client->compressed_sum_size += size;
+    pgp->codec = pool->codec;
+    client->compressed_pages++;
+    client->compressed_sum_size += size;
     ret = 1;
 
 out:
@@ -1665,18 +1889,8 @@ copy_uncompressed:
 
 insert_page:
     if ( is_ephemeral(pool) )
-    {
-        tmem_spin_lock(&eph_lists_spinlock);
-        list_add_tail(&pgp->global_eph_pages,
-            &global_ephemeral_page_list);
-        if (++global_eph_count > global_eph_count_max)
-            global_eph_count_max = global_eph_count;
-        list_add_tail(&pgp->us.client_eph_pages,
-            &client->ephemeral_page_list);
-        if (++client->eph_count > client->eph_count_max)
-            client->eph_count_max = client->eph_count;
-        tmem_spin_unlock(&eph_lists_spinlock);
-    } else { /* is_persistent */
+        eph_pcpu_add(pgp);
+    else { /* is_persistent */
         tmem_spin_lock(&pers_lists_spinlock);
         list_add_tail(&pgp->us.pool_pers_pages,
             &pool->persistent_page_list);
@@ -1728,6 +1942,7 @@ static NOINLINE int do_tmem_get(pool_t *pool, OID *oidp, uint32_t index,
     pgp_t *pgp;
     client_t *client = pool->client;
     DECL_LOCAL_CYC_COUNTER(decompress);
+    uint64_t start;
     int rc;
 
     if ( !_atomic_read(pool->pgp_count) )
@@ -1756,8 +1971,10 @@ static NOINLINE int do_tmem_get(pool_t *pool, OID *oidp, uint32_t index,
     else if ( pgp->size != 0 )
     {
         START_CYC_COUNTER(decompress);
+        start = get_cycles();
         rc = tmh_decompress_to_client(cmfn, pgp->cdata,
-                                      pgp->size, clibuf);
+                                      pgp->size, clibuf, pgp->codec);
+        client->decompress_cycles += get_cycles() - start;
         END_CYC_COUNTER(decompress);
     }
     else
@@ -1779,12 +1996,18 @@ static NOINLINE int do_tmem_get(pool_t *pool, OID *oidp, uint32_t index,
                 tmem_write_unlock(&pool->pool_rwlock);
             }
         } else {
-            tmem_spin_lock(&eph_lists_spinlock);
-            list_del(&pgp->global_eph_pages);
-            list_add_tail(&pgp->global_eph_pages,&global_ephemeral_page_list);
-            list_del(&pgp->us.client_eph_pages);
-            list_add_tail(&pgp->us.client_eph_pages,&client->ephemeral_page_list);
-            tmem_spin_unlock(&eph_lists_spinlock);
+            /* pages still queued per-cpu are already most recently used */
+            if ( read_atomic(&pgp->eph_cpu) == NO_EPH_CPU )
+            {
+                tmem_spin_lock(&eph_lists_spinlock);
+                list_del(&pgp->global_eph_pages);
+                list_add_tail(&pgp->global_eph_pages,
+                              &global_ephemeral_page_list);
+                list_del(&pgp->us.client_eph_pages);
+                list_add_tail(&pgp->us.client_eph_pages,
+                              &client->ephemeral_page_list);
+                tmem_spin_unlock(&eph_lists_spinlock);
+            }
             obj->last_client = tmh_get_cli_id_from_current();
         }
     }
@@ -1964,6 +2187,8 @@ static NOINLINE int do_tmem_new_pool(cli_id_t this_cli_id,
     }
     pool->shared = shared;
     pool->client = client;
+    pool->codec = client->codec;
+    pool->compress_ratio = client->compress_ratio;
     if ( shared )
     {
         first_unused_s_poolid = MAX_GLOBAL_SHARED_POOLS;
@@ -2081,10 +2306,15 @@ static int tmemc_list_client(client_t *c, tmem_cli_va_param_t buf,
         use_long ? ',' : '\n');
     if (use_long)
         n += scnprintf(info+n,BSIZE-n,
-             "Ec:%ld,Em:%ld,cp:%ld,cb:%"PRId64",cn:%ld,cm:%ld\n",
+             "Ec:%ld,Em:%ld,cp:%ld,cb:%"PRId64",cn:%ld,cm:%ld,"
+             "cc:%d,cr:%u,cs:%lu,cz:%"PRIu64",ck:%lu,"
+             "ct:%"PRIu64",dt:%"PRIu64"\n",
              c->eph_count, c->eph_count_max,
              c->compressed_pages, c->compressed_sum_size,
-             c->compress_poor, c->compress_nomem);
+             c->compress_poor, c->compress_nomem,
+             c->codec, c->compress_ratio, c->compress_attempts,
+             c->compress_out_bytes, c->compress_skipped,
+             c->compress_cycles, c->decompress_cycles);
     tmh_copy_to_client_buf_offset(buf,off+sum,info,n+1);
     sum += n;
     for ( i = 0; i < MAX_POOLS_PER_DOMAIN; i++ )
@@ -2211,14 +2441,15 @@ static int tmemc_list_global(tmem_cli_va_param_t buf, int off, uint32_t len,
     if (use_long)
         n += scnprintf(info+n,BSIZE-n,
           "Ec:%ld,Em:%ld,Oc:%d,Om:%d,Nc:%d,Nm:%d,Pc:%d,Pm:%d,"
-          "Fc:%d,Fm:%d,Sc:%d,Sm:%d,Ep:%lu,Gd:%lu,Zt:%lu,Gz:%lu\n",
+          "Fc:%d,Fm:%d,Sc:%d,Sm:%d,Ep:%lu,Gd:%lu,Zt:%lu,Gz:%lu,Ed:%lu\n",
           global_eph_count, global_eph_count_max,
           _atomic_read(global_obj_count), global_obj_count_max,
           _atomic_read(global_rtree_node_count), global_rtree_node_count_max,
           _atomic_read(global_pgp_count), global_pgp_count_max,
           _atomic_read(global_page_count), global_page_count_max,
           _atomic_read(global_pcd_count), global_pcd_count_max,
-         tot_good_eph_puts,deduped_puts,pcd_tot_tze_size,pcd_tot_csize);
+         tot_good_eph_puts,deduped_puts,pcd_tot_tze_size,pcd_tot_csize,
+         eph_pcpu_drains);
     if ( sum + n >= len )
         return sum;
     tmh_copy_to_client_buf_offset(buf,off+sum,info,n+1);
@@ -2251,6 +2482,7 @@ static int tmemc_set_var_one(client_t *client, uint32_t subop, uint32_t arg1)
 {
     cli_id_t cli_id = client->cli_id;
     uint32_t old_weight;
+    int i;
 
     switch (subop)
     {
@@ -2279,6 +2511,43 @@ static int tmemc_set_var_one(client_t *client, uint32_t subop, uint32_t arg1)
         tmh_client_info("tmem: compression %s for %s=%d\n",
             arg1 ? "enabled" : "disabled",cli_id_str,cli_id);
         break;
+    case TMEMC_SET_COMPRESS_CODEC:
+        if ( tmh_dedup_enabled() )
+        {
+            tmh_client_warn("tmem: codec cannot be changed when tmem_dedup is enabled\n");
+            return -1;
+        }
+        if ( arg1 >= TMH_NR_CODECS )
+        {
+            tmh_client_warn("tmem: unknown codec %d\n", arg1);
+            return -1;
+        }
+        client->codec = arg1;
+        for ( i = 0; i < MAX_POOLS_PER_DOMAIN; i++ )
+            if ( client->pools[i] != NULL &&
+                 client->pools[i]->client == client )
+                client->pools[i]->codec = arg1;
+        tmh_client_info("tmem: codec set to %s for %s=%d\n",
+                        tmh_codec_name(arg1), cli_id_str, cli_id);
+        break;
+    case TMEMC_SET_COMPRESS_RATIO:
+        if ( arg1 == 0 || arg1 > 100 )
+        {
+            tmh_client_warn("tmem: compression ratio must be 1-100%%\n");
+            return -1;
+        }
+        client->compress_ratio = arg1;
+        for ( i = 0; i < MAX_POOLS_PER_DOMAIN; i++ )
+            if ( client->pools[i] != NULL &&
+                 client->pools[i]->client == client )
+            {
+                client->pools[i]->compress_ratio = arg1;
+                atomic_set(&client->pools[i]->compress_poor_run, 0);
+                write_atomic(&client->pools[i]->compress_backoff, 0);
+            }
+        tmh_client_info("tmem: compression ratio set to %d%% for %s=%d\n",
+                        arg1, cli_id_str, cli_id);
+        break;
     default:
         tmh_client_warn("tmem: unknown subop %d for tmemc_set_var\n", subop);
         return -1;
@@ -2575,6 +2844,8 @@ static NOINLINE int do_tmem_control(struct tmem_op *op)
     case TMEMC_SET_WEIGHT:
     case TMEMC_SET_CAP:
     case TMEMC_SET_COMPRESS:
+    case TMEMC_SET_COMPRESS_CODEC:
+    case TMEMC_SET_COMPRESS_RATIO:
         ret = tmemc_set_var(op->u.ctrl.cli_id,subop,op->u.ctrl.arg1);
         break;
     case TMEMC_QUERY_FREEABLE_MB:
@@ -2950,11 +3221,16 @@ static int __init init_tmem(void)
             rwlock_init(&pcd_tree_rwlocks[i]);
         }
 
+    for_each_online_cpu ( i )
+        eph_pcpu_callback(&eph_pcpu_nfb, CPU_UP_PREPARE, (void *)(long)i);
+    register_cpu_notifier(&eph_pcpu_nfb);
+
     if ( tmh_init() )
     {
-        printk("tmem: initialized comp=%d dedup=%d tze=%d global-lock=%d\n",
-            tmh_compression_enabled(), tmh_dedup_enabled(), tmh_tze_enabled(),
-            tmh_lock_all);
+        printk("tmem: initialized comp=%d codec=%s dedup=%d tze=%d "
+               "global-lock=%d\n",
+            tmh_compression_enabled(), tmh_codec_name(tmh_default_codec()),
+            tmh_dedup_enabled(), tmh_tze_enabled(), tmh_lock_all);
         if ( tmh_dedup_enabled()&&tmh_compression_enabled()&&tmh_tze_enabled() )
         {
             tmh_tze_disable();
@@ -9,6 +9,7 @@
 #include <xen/tmem.h>
 #include <xen/tmem_xen.h>
 #include <xen/lzo.h> /* compression code */
+#include <xen/lz4.h>
 #include <xen/paging.h>
 #include <xen/domain_page.h>
 #include <xen/cpu.h>
@@ -22,6 +23,23 @@ boolean_param("tmem", opt_tmem);
 EXPORT bool_t __read_mostly opt_tmem_compress = 0;
 boolean_param("tmem_compress", opt_tmem_compress);
 
+EXPORT unsigned int __read_mostly opt_tmem_codec = TMH_CODEC_LZO;
+
+EXPORT unsigned int __read_mostly opt_tmem_compress_ratio = 100;
+static void __init parse_tmem_compress_ratio(const char *s)
+{
+    unsigned long ratio = simple_strtoul(s, NULL, 0);
+
+    if ( ratio == 0 || ratio > 100 )
+    {
+        printk("tmem: compression ratio must be 1-100%%, using %u%%\n",
+               opt_tmem_compress_ratio);
+        return;
+    }
+    opt_tmem_compress_ratio = ratio;
+}
+custom_param("tmem_compress_ratio", parse_tmem_compress_ratio);
+
 EXPORT bool_t __read_mostly opt_tmem_dedup = 0;
 boolean_param("tmem_dedup", opt_tmem_dedup);
 
@@ -193,8 +211,43 @@ EXPORT int tmh_copy_from_client(pfp_t *pfp,
     return rc;
 }
 
+/* all codecs share the per-cpu workmem and dstmem buffers sized below */
+struct tmh_codec {
+    const char *name;
+    int (*compress)(const unsigned char *src, size_t src_len,
+                    unsigned char *dst, size_t *dst_len, void *wrkmem);
+    int (*decompress)(const unsigned char *src, size_t src_len,
+                      unsigned char *dst, size_t *dst_len);
+};
+
+static const struct tmh_codec tmh_codecs[TMH_NR_CODECS] = {
+    [TMH_CODEC_LZO] = { "lzo", lzo1x_1_compress, lzo1x_decompress_safe },
+    [TMH_CODEC_LZ4] = { "lz4", lz4_compress, lz4_decompress_safe },
+};
+
+EXPORT const char *tmh_codec_name(unsigned int codec)
+{
+    return codec < TMH_NR_CODECS ? tmh_codecs[codec].name : "unknown";
+}
+
+static void __init parse_tmem_codec(const char *s)
+{
+    unsigned int codec;
+
+    for ( codec = 0; codec < TMH_NR_CODECS; codec++ )
+        if ( !strcmp(s, tmh_codecs[codec].name) )
+        {
+            opt_tmem_codec = codec;
+            return;
+        }
+    printk("tmem: unknown codec '%s', using %s\n",
+           s, tmh_codecs[opt_tmem_codec].name);
+}
+custom_param("tmem_codec", parse_tmem_codec);
+
 EXPORT int tmh_compress_from_client(tmem_cli_mfn_t cmfn,
-    void **out_va, size_t *out_len, tmem_cli_va_param_t clibuf)
+    void **out_va, size_t *out_len, tmem_cli_va_param_t clibuf,
+    unsigned int codec)
 {
     int ret = 0;
     unsigned char *dmem = this_cpu(dstmem);
@@ -217,8 +270,10 @@ EXPORT int tmh_compress_from_client(tmem_cli_mfn_t cmfn,
     else if ( copy_from_guest(scratch, clibuf, PAGE_SIZE) )
         return -EFAULT;
     mb();
-    ret = lzo1x_1_compress(cli_va ?: scratch, PAGE_SIZE, dmem, out_len, wmem);
-    ASSERT(ret == LZO_E_OK);
+    ASSERT(codec < TMH_NR_CODECS);
+    ret = tmh_codecs[codec].compress(cli_va ?: scratch, PAGE_SIZE, dmem,
+                                     out_len, wmem);
+    ASSERT(ret == 0);
     *out_va = dmem;
     if ( cli_va )
         cli_put_page(cli_va, cli_pfp, cli_mfn, 0);
@@ -265,7 +320,8 @@ EXPORT int tmh_copy_to_client(tmem_cli_mfn_t cmfn, pfp_t *pfp,
 }
 
 EXPORT int tmh_decompress_to_client(tmem_cli_mfn_t cmfn, void *tmem_va,
-                                    size_t size, tmem_cli_va_param_t clibuf)
+                                    size_t size, tmem_cli_va_param_t clibuf,
+                                    unsigned int codec)
 {
     unsigned long cli_mfn = 0;
     pfp_t *cli_pfp = NULL;
@@ -282,8 +338,10 @@ EXPORT int tmh_decompress_to_client(tmem_cli_mfn_t cmfn, void *tmem_va,
     }
     else if ( !scratch )
         return 0;
-    ret = lzo1x_decompress_safe(tmem_va, size, cli_va ?: scratch, &out_len);
-    ASSERT(ret == LZO_E_OK);
+    ASSERT(codec < TMH_NR_CODECS);
+    ret = tmh_codecs[codec].decompress(tmem_va, size, cli_va ?: scratch,
+                                       &out_len);
+    ASSERT(ret == 0);
     ASSERT(out_len == PAGE_SIZE);
     if ( cli_va )
         cli_put_page(cli_va, cli_pfp, cli_mfn, 1);
@@ -496,8 +554,10 @@ EXPORT int __init tmh_init(void)
     if ( !tmh_mempool_init() )
         return 0;
 
+    BUILD_BUG_ON(lz4_worst_compress(PAGE_SIZE) > LZO_DSTMEM_PAGES * PAGE_SIZE);
+    BUILD_BUG_ON(LZ4_MEM_COMPRESS > LZO_WORKMEM_BYTES);
     dstmem_order = get_order_from_pages(LZO_DSTMEM_PAGES);
-    workmem_order = get_order_from_bytes(LZO1X_1_MEM_COMPRESS);
+    workmem_order = get_order_from_bytes(LZO_WORKMEM_BYTES);
 
     for_each_online_cpu ( cpu )
     {
@@ -111,6 +111,8 @@ struct hvm_domain {
     /* hypervisor intercepted msix table */
     struct list_head       msixtbl_list;
     spinlock_t             msixtbl_list_lock;
+    /* Span of all tables on msixtbl_list; other addresses skip the walk. */
+    unsigned long          msixtbl_start, msixtbl_end;
 
     struct viridian_domain viridian;
 
@@ -20,12 +20,14 @@
 #ifndef __ASM_X86_HVM_IO_H__
 #define __ASM_X86_HVM_IO_H__
 
+#include <xen/rcupdate.h>
 #include <asm/hvm/vpic.h>
 #include <asm/hvm/vioapic.h>
 #include <public/hvm/ioreq.h>
 #include <public/event_channel.h>
 
 #define MAX_IO_HANDLER             16
+#define HVM_MMIO_HANDLER_NR         5
 
 #define HVM_PORTIO                  0
 #define HVM_BUFFERED_IO             2
@@ -47,6 +49,7 @@ struct io_handler {
     int                 type;
     unsigned long       addr;
     unsigned long       size;
+    unsigned int        idx;    /* Registration order, for hit counts. */
     union {
         portio_action_t portio;
         mmio_action_t   mmio;
@@ -54,11 +57,19 @@ struct io_handler {
     } action;
 };
 
-struct hvm_io_handler {
+struct io_handler_list {
+    struct rcu_head rcu;
     int     num_slot;
+    /* Sorted by type, then address. */
     struct  io_handler hdl_list[MAX_IO_HANDLER];
 };
 
+struct hvm_io_handler {
+    spinlock_t lock;    /* Serialises register/relocate. */
+    /* Lookups are lock-free: a relocation publishes a new list via RCU. */
+    struct io_handler_list *list;
+};
+
 struct hvm_mmio_handler {
     hvm_mmio_check_t check_handler;
     hvm_mmio_read_t read_handler;
@@ -71,15 +82,16 @@ extern const struct hvm_mmio_handler vioapic_mmio_handler;
 extern const struct hvm_mmio_handler msixtbl_mmio_handler;
 extern const struct hvm_mmio_handler iommu_mmio_handler;
 
-#define HVM_MMIO_HANDLER_NR 5
-
 int hvm_io_intercept(ioreq_t *p, int type);
+int hvm_init_io_handler(struct domain *d);
+void hvm_destroy_io_handler(struct domain *d);
 void register_io_handler(
     struct domain *d, unsigned long addr, unsigned long size,
     void *action, int type);
-void relocate_io_handler(
+int relocate_io_handler(
     struct domain *d, unsigned long old_addr, unsigned long new_addr,
     unsigned long size, int type);
+void hvm_dump_io_handlers(struct domain *d);
 
 static inline int hvm_portio_intercept(ioreq_t *p)
 {
@@ -101,11 +113,11 @@ static inline void register_portio_handler(
     register_io_handler(d, addr, size, action, HVM_PORTIO);
 }
 
-static inline void relocate_portio_handler(
+static inline int relocate_portio_handler(
     struct domain *d, unsigned long old_addr, unsigned long new_addr,
     unsigned long size)
 {
-    relocate_io_handler(d, old_addr, new_addr, size, HVM_PORTIO);
+    return relocate_io_handler(d, old_addr, new_addr, size, HVM_PORTIO);
 }
 
 static inline void register_buffered_io_handler(
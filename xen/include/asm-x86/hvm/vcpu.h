@@ -66,6 +66,10 @@ struct hvm_vcpu_io {
     /* We may write up to m256 as a number of device-model transactions. */
     unsigned int mmio_large_write_bytes;
     paddr_t mmio_large_write_pa;
+
+    /* Intercept hits, per vcpu so that counting costs no shared lines. */
+    unsigned long       io_hits[MAX_IO_HANDLER];
+    unsigned long       mmio_hits[HVM_MMIO_HANDLER_NR];
 };
 
 #define VMCX_EADDR    (~0ULL)
@@ -29,6 +29,7 @@
 
 #include <xen/config.h>
 #include <xen/paging.h>
+#include <xen/timer.h>
 #include <asm/mem_sharing.h>
 #include <asm/page.h>    /* for pagetable_t */
 
@@ -274,6 +275,10 @@ struct p2m_domain {
         /* gpfn of last guest superpage demand-populated */
         unsigned long    last_populated[POD_HISTORY_MAX]; 
         unsigned int     last_populated_index;
+        /* Background sweep, refilling the cache before it runs dry */
+        struct timer     sweep_timer;
+        s_time_t         sweep_delay;  /* Current re-arm interval       */
+        bool_t           sweep_pending;
         mm_lock_t        lock;         /* Locking of private pod structs,   *
                                         * not relying on the p2m lock.      */
     } pod;
@@ -514,6 +519,10 @@ int clear_mmio_p2m_entry(struct domain *d, unsigned long gfn);
 /* Dump PoD information about the domain */
 void p2m_pod_dump_data(struct domain *d);
 
+/* Set up and tear down the background PoD sweeper */
+void p2m_pod_init(struct p2m_domain *p2m);
+void p2m_pod_teardown(struct p2m_domain *p2m);
+
 /* Move all pages from the populate-on-demand cache to the domain page_list
  * (usually in preparation for domain destruction) */
 void p2m_pod_empty_cache(struct domain *d);
@@ -36,7 +36,7 @@
 #include "grant_table.h"
 #include "hvm/save.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x00000008
+#define XEN_DOMCTL_INTERFACE_VERSION 0x00000009
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -279,6 +279,44 @@ typedef struct xen_domctl_getvcpuinfo xen_domctl_getvcpuinfo_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_getvcpuinfo_t);
 
 
+/*
+ * Histograms of how long a vcpu waited for a pcpu each time it became
+ * runnable, and of how long it then ran for.  Bucket 0 counts intervals
+ * shorter than 1024ns, bucket i intervals in [2^(i+9), 2^(i+10)) ns and
+ * the last bucket everything longer.  Either handle may be NULL; otherwise
+ * it must have room for XEN_DOMCTL_SCHED_HIST_BUCKETS counts.
+ */
+/* XEN_DOMCTL_getvcpuschedhist */
+#define XEN_DOMCTL_SCHED_HIST_BUCKETS   24
+struct xen_domctl_vcpuschedhist {
+    /* IN variables. */
+    uint32_t vcpu;
+#define XEN_DOMCTL_SCHED_HIST_RESET     (1U<<0) /* clear once read */
+    uint32_t flags;
+    /* OUT variables. */
+    XEN_GUEST_HANDLE_64(uint32) wait;  /* runnable -> running */
+    XEN_GUEST_HANDLE_64(uint32) run;   /* running -> anything else */
+};
+typedef struct xen_domctl_vcpuschedhist xen_domctl_vcpuschedhist_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_vcpuschedhist_t);
+
+
+/*
+ * Get/set the NUMA nodes a domain is affine to.  Memory is allocated from
+ * these nodes and the scheduler prefers running the domain's vcpus on
+ * their pcpus.  Setting all nodes reverts to the default, computed from
+ * the vcpus' cpu affinity.  nodemap.nr_cpus is the number of nodes (bits)
+ * in nodemap.bitmap.
+ */
+/* XEN_DOMCTL_setnodeaffinity */
+/* XEN_DOMCTL_getnodeaffinity */
+struct xen_domctl_nodeaffinity {
+    struct xenctl_cpumap nodemap; /* IN/OUT */
+};
+typedef struct xen_domctl_nodeaffinity xen_domctl_nodeaffinity_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_nodeaffinity_t);
+
+
 /* Get/set which physical cpus a vcpu can execute on. */
 /* XEN_DOMCTL_setvcpuaffinity */
 /* XEN_DOMCTL_getvcpuaffinity */
@@ -304,6 +342,7 @@ DEFINE_XEN_GUEST_HANDLE(xen_domctl_max_vcpus_t);
 #define XEN_SCHEDULER_CREDIT   5
 #define XEN_SCHEDULER_CREDIT2  6
 #define XEN_SCHEDULER_ARINC653 7
+#define XEN_SCHEDULER_RTDS     8
 /* Set or get info? */
 #define XEN_DOMCTL_SCHEDOP_putinfo 0
 #define XEN_DOMCTL_SCHEDOP_getinfo 1
@@ -321,10 +360,17 @@ struct xen_domctl_scheduler_op {
         struct xen_domctl_sched_credit {
             uint16_t weight;
             uint16_t cap;
+            uint16_t gang;   /* co-schedule all vcpus; ~0 on put: no change */
         } credit;
         struct xen_domctl_sched_credit2 {
             uint16_t weight;
         } credit2;
+        struct xen_domctl_sched_rtds {
+            uint32_t period;    /* us */
+            uint32_t budget;    /* us, per period and per vcpu */
+            /* OUT: periods any vcpu ended queued, denied its budget. */
+            uint64_aligned_t deadline_misses;
+        } rtds;
     } u;
 };
 typedef struct xen_domctl_scheduler_op xen_domctl_scheduler_op_t;
@@ -907,6 +953,9 @@ struct xen_domctl {
 #define XEN_DOMCTL_audit_p2m                     65
 #define XEN_DOMCTL_set_virq_handler              66
 #define XEN_DOMCTL_set_broken_page_p2m           67
+#define XEN_DOMCTL_setnodeaffinity               68
+#define XEN_DOMCTL_getnodeaffinity               69
+#define XEN_DOMCTL_getvcpuschedhist              70
 #define XEN_DOMCTL_gdbsx_guestmemio            1000
 #define XEN_DOMCTL_gdbsx_pausevcpu             1001
 #define XEN_DOMCTL_gdbsx_unpausevcpu           1002
@@ -920,11 +969,13 @@ struct xen_domctl {
         struct xen_domctl_getpageframeinfo  getpageframeinfo;
         struct xen_domctl_getpageframeinfo2 getpageframeinfo2;
         struct xen_domctl_getpageframeinfo3 getpageframeinfo3;
+        struct xen_domctl_nodeaffinity      nodeaffinity;
         struct xen_domctl_vcpuaffinity      vcpuaffinity;
         struct xen_domctl_shadow_op         shadow_op;
         struct xen_domctl_max_mem           max_mem;
         struct xen_domctl_vcpucontext       vcpucontext;
         struct xen_domctl_getvcpuinfo       getvcpuinfo;
+        struct xen_domctl_vcpuschedhist     vcpuschedhist;
         struct xen_domctl_max_vcpus         max_vcpus;
         struct xen_domctl_scheduler_op      scheduler_op;
         struct xen_domctl_setdomainhandle   setdomainhandle;
@@ -373,6 +373,8 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_event_op_t);
 #define XENMEM_sharing_op_debug_gref        6
 #define XENMEM_sharing_op_add_physmap       7
 #define XENMEM_sharing_op_audit             8
+#define XENMEM_sharing_op_bulk_share        9
+#define XENMEM_sharing_op_bulk_add_physmap  10
 
 #define XENMEM_SHARING_OP_S_HANDLE_INVALID  (-10)
 #define XENMEM_SHARING_OP_C_HANDLE_INVALID  (-9)
@@ -390,6 +392,21 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_event_op_t);
 #define XENMEM_SHARING_OP_FIELD_GET_GREF(field)        \
     ((field) & (~XENMEM_SHARING_OP_FIELD_IS_GREF_FLAG))
 
+/* One element of an OP_BULK_SHARE or OP_BULK_ADD_PHYSMAP array.  For
+ * BULK_SHARE the source page is shared with the client page, nominating
+ * either of them first if needed.  For BULK_ADD_PHYSMAP the source page is
+ * nominated if needed and added to the client physmap, as for
+ * OP_ADD_PHYSMAP; the client gfn must not be populated. */
+struct xen_mem_sharing_bulk_entry {
+    uint64_aligned_t source_gfn;    /* IN: the gfn of the source page */
+    uint64_aligned_t client_gfn;    /* IN: the client gfn */
+    domid_t  client_domain;         /* IN: the client domain id */
+    uint16_t pad;
+    int32_t  status;                /* OUT: 0, -errno or XENMEM_SHARING_OP_* */
+};
+typedef struct xen_mem_sharing_bulk_entry xen_mem_sharing_bulk_entry_t;
+DEFINE_XEN_GUEST_HANDLE(xen_mem_sharing_bulk_entry_t);
+
 struct xen_mem_sharing_op {
     uint8_t     op;     /* XENMEM_sharing_op_* */
     domid_t     domain;
@@ -416,6 +433,15 @@ struct xen_mem_sharing_op {
                 uint32_t gref;     /* IN: gref to debug         */
             } u;
         } debug;
+        struct mem_sharing_op_bulk {      /* OP_BULK_xxx */
+            /* IN/OUT: the pages to share, and the result for each */
+            XEN_GUEST_HANDLE_64(xen_mem_sharing_bulk_entry_t) entries;
+            uint32_t nr_entries;          /* IN: number of entries */
+            /* IN/OUT: entries processed so far, used internally for
+             * preemption.  Callers must set this and nr_shared to zero. */
+            uint32_t nr_done;
+            uint32_t nr_shared;           /* OUT: entries with status 0 */
+        } bulk;
     } u;
 };
 typedef struct xen_mem_sharing_op xen_mem_sharing_op_t;
@@ -578,6 +578,20 @@ struct xen_sysctl_credit_schedule {
 typedef struct xen_sysctl_credit_schedule xen_sysctl_credit_schedule_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_credit_schedule_t);
 
+struct xen_sysctl_credit2_schedule {
+    /*
+     * Which pcpus share a runqueue. Can only be changed while the
+     * cpupool has no pcpus.
+     */
+#define XEN_SYSCTL_CSCHED2_RUNQ_CORE   0
+#define XEN_SYSCTL_CSCHED2_RUNQ_SOCKET 1
+#define XEN_SYSCTL_CSCHED2_RUNQ_NODE   2
+#define XEN_SYSCTL_CSCHED2_RUNQ_ALL    3
+    unsigned runqueue;
+};
+typedef struct xen_sysctl_credit2_schedule xen_sysctl_credit2_schedule_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_credit2_schedule_t);
+
 /* XEN_SYSCTL_scheduler_op */
 /* Set or get info? */
 #define XEN_SYSCTL_SCHEDOP_putinfo 0
@@ -591,6 +605,7 @@ struct xen_sysctl_scheduler_op {
             XEN_GUEST_HANDLE_64(xen_sysctl_arinc653_schedule_t) schedule;
         } sched_arinc653;
         struct xen_sysctl_credit_schedule sched_credit;
+        struct xen_sysctl_credit2_schedule sched_credit2;
     } u;
 };
 typedef struct xen_sysctl_scheduler_op xen_sysctl_scheduler_op_t;
@@ -74,6 +74,12 @@
 #define TMEMC_RESTORE_BEGIN          30
 #define TMEMC_RESTORE_PUT_PAGE       32
 #define TMEMC_RESTORE_FLUSH_PAGE     33
+#define TMEMC_SET_COMPRESS_CODEC     40
+#define TMEMC_SET_COMPRESS_RATIO     41
+
+/* Codecs for TMEMC_SET_COMPRESS_CODEC */
+#define TMEM_CODEC_LZO             0
+#define TMEM_CODEC_LZ4             1
 
 /* Bits for HYPERVISOR_tmem_op(TMEM_NEW_POOL) */
 #define TMEM_POOL_PERSIST          1
@@ -0,0 +1,34 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 block format compressor and safe decompressor
+ *
+ *  A small implementation of the LZ4 block format, limited to inputs
+ *  below 64KiB so that the match table can hold 16-bit offsets.  It
+ *  trades some compression ratio for much lower cpu cost than LZO1X.
+ */
+
+#define LZ4_HASH_LOG 12
+#define LZ4_MEM_COMPRESS ((1 << LZ4_HASH_LOG) * sizeof(uint16_t))
+#define LZ4_MAX_INPUT_SIZE 0xffff
+
+#define lz4_worst_compress(x) ((x) + ((x) / 255) + 16)
+
+/* This requires 'wrkmem' of size LZ4_MEM_COMPRESS */
+int lz4_compress(const unsigned char *src, size_t src_len,
+                 unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/* safe decompression with overrun testing */
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+                        unsigned char *dst, size_t *dst_len);
+
+/*
+ * Return values (< 0 = Error)
+ */
+#define LZ4_E_OK                  0
+#define LZ4_E_ERROR               (-1)
+#define LZ4_E_INPUT_OVERRUN       (-4)
+#define LZ4_E_OUTPUT_OVERRUN      (-5)
+#define LZ4_E_LOOKBEHIND_OVERRUN  (-6)
+
+#endif
@@ -21,6 +21,8 @@ PERFCOUNTER(dom_init,               "sched: dom_init")
 PERFCOUNTER(dom_destroy,            "sched: dom_destroy")
 PERFCOUNTER(vcpu_init,              "sched: vcpu_init")
 PERFCOUNTER(vcpu_destroy,           "sched: vcpu_destroy")
+PERFCOUNTER(vcpu_migrate,           "sched: vcpu_migrate")
+PERFCOUNTER(vcpu_migrate_slow,      "sched: vcpu_migrate lock retry")
 
 /* credit specific counters */
 PERFCOUNTER(delay_ms,               "csched: delay")
@@ -37,6 +39,9 @@ PERFCOUNTER(vcpu_wake_running,      "csched: vcpu_wake_running")
 PERFCOUNTER(vcpu_wake_onrunq,       "csched: vcpu_wake_onrunq")
 PERFCOUNTER(vcpu_wake_runnable,     "csched: vcpu_wake_runnable")
 PERFCOUNTER(vcpu_wake_not_runnable, "csched: vcpu_wake_not_runnable")
+PERFCOUNTER(vcpu_yield_to_boost,    "csched: vcpu_yield_to_boost")
+PERFCOUNTER(gang_start,             "csched: gang_start")
+PERFCOUNTER(gang_join,              "csched: gang_join")
 PERFCOUNTER(vcpu_park,              "csched: vcpu_park")
 PERFCOUNTER(vcpu_unpark,            "csched: vcpu_unpark")
 PERFCOUNTER(tickle_idlers_none,     "csched: tickle_idlers_none")
@@ -51,6 +56,11 @@ PERFCOUNTER(migrate_running,        "csched: migrate_running")
 PERFCOUNTER(migrate_kicked_away,    "csched: migrate_kicked_away")
 PERFCOUNTER(vcpu_hot,               "csched: vcpu_hot")
 
+/* rtds specific counters */
+PERFCOUNTER(rtds_replenish,         "rtds: replenish")
+PERFCOUNTER(rtds_deadline_miss,     "rtds: deadline_miss")
+PERFCOUNTER(rtds_tickle,            "rtds: tickle")
+
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -39,6 +39,10 @@ struct schedule_data {
     void               *sched_priv;
     struct timer        s_timer;        /* scheduling timer                */
     atomic_t            urgent_count;   /* how many urgent vcpus           */
+    /* vcpu_migrate() calls run on this cpu which moved a vcpu. */
+    unsigned long       nr_migrations;
+    unsigned long       nr_migrate_slow; /* needed the lock retry loop     */
+    s_time_t            migrate_time;   /* ns spent locking and moving     */
 };
 
 #define curr_on_cpu(c)    (per_cpu(schedule_data, c).curr)
@@ -165,6 +169,9 @@ struct scheduler {
     int          (*init_domain)    (const struct scheduler *, struct domain *);
     void         (*destroy_domain) (const struct scheduler *, struct domain *);
 
+    void         (*set_node_affinity) (const struct scheduler *,
+                                       struct domain *, nodemask_t *);
+
     /* Activate / deactivate vcpus in a cpu pool */
     void         (*insert_vcpu)    (const struct scheduler *, struct vcpu *);
     void         (*remove_vcpu)    (const struct scheduler *, struct vcpu *);
@@ -172,6 +179,9 @@ struct scheduler {
     void         (*sleep)          (const struct scheduler *, struct vcpu *);
     void         (*wake)           (const struct scheduler *, struct vcpu *);
     void         (*yield)          (const struct scheduler *, struct vcpu *);
+    /* Called with the schedule lock of the target (last) vcpu held. */
+    void         (*yield_to)       (const struct scheduler *, struct vcpu *,
+                                    struct vcpu *);
     void         (*context_saved)  (const struct scheduler *, struct vcpu *);
 
     struct task_slice (*do_schedule) (const struct scheduler *, s_time_t,
@@ -195,6 +205,7 @@ extern const struct scheduler sched_sedf_def;
 extern const struct scheduler sched_credit_def;
 extern const struct scheduler sched_credit2_def;
 extern const struct scheduler sched_arinc653_def;
+extern const struct scheduler sched_rtds_def;
 
 
 struct cpupool
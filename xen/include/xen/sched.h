@@ -128,6 +128,10 @@ struct vcpu
     /* last time when vCPU is scheduled out */
     uint64_t last_run_time;
 
+    /* Histograms of runnable->running waits and of running periods. */
+    uint32_t         sched_wait_hist[XEN_DOMCTL_SCHED_HIST_BUCKETS];
+    uint32_t         sched_run_hist[XEN_DOMCTL_SCHED_HIST_BUCKETS];
+
     /* Has the FPU been initialised? */
     bool_t           fpu_initialised;
     /* Has the FPU been used since it was last saved? */
@@ -359,7 +363,12 @@ struct domain
     /* Various mem_events */
     struct mem_event_per_domain *mem_event;
 
-    /* Currently computed from union of all vcpu cpu-affinity masks. */
+    /*
+     * Computed from union of all vcpu cpu-affinity masks, unless set
+     * explicitly by the toolstack (auto_node_affinity == 0).  Used both
+     * for memory allocation and as a soft scheduling preference.
+     */
+    bool_t auto_node_affinity;
     nodemask_t node_affinity;
     unsigned int last_alloc_node;
     spinlock_t node_affinity_lock;
@@ -430,6 +439,7 @@ static inline void get_knownalive_domain(struct domain *d)
 }
 
 void domain_update_node_affinity(struct domain *d);
+int domain_set_node_affinity(struct domain *d, const nodemask_t *affinity);
 
 struct domain *domain_create(
     domid_t domid, unsigned int domcr_flags, uint32_t ssidref);
@@ -541,6 +551,7 @@ void sched_destroy_vcpu(struct vcpu *v);
 int  sched_init_domain(struct domain *d);
 void sched_destroy_domain(struct domain *d);
 int sched_move_domain(struct domain *d, struct cpupool *c);
+void sched_set_node_affinity(struct domain *, nodemask_t *);
 long sched_adjust(struct domain *, struct xen_domctl_scheduler_op *);
 long sched_adjust_global(struct xen_sysctl_scheduler_op *);
 int  sched_id(void);
@@ -688,10 +699,13 @@ struct scheduler *scheduler_alloc(unsigned int sched_id, int *perr);
 void scheduler_free(struct scheduler *sched);
 int schedule_cpu_switch(unsigned int cpu, struct cpupool *c);
 void vcpu_force_reschedule(struct vcpu *v);
+void vcpu_directed_yield(void);
 int cpu_disable_scheduler(unsigned int cpu);
 int vcpu_set_affinity(struct vcpu *v, const cpumask_t *affinity);
 
 void vcpu_runstate_get(struct vcpu *v, struct vcpu_runstate_info *runstate);
+void vcpu_sched_hist_get(struct vcpu *v, uint32_t *wait, uint32_t *run,
+                         bool_t reset);
 uint64_t get_cpu_idle_time(unsigned int cpu);
 
 /*
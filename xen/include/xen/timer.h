@@ -73,6 +73,13 @@ void stop_timer(struct timer *timer);
 /* Migrate a timer to a different CPU. The timer may be currently active. */
 void migrate_timer(struct timer *timer, unsigned int new_cpu);
 
+/*
+ * Migrate @nr timers to a different CPU, taking each pair of per-CPU timer
+ * locks once rather than once per timer.
+ */
+void migrate_timers(struct timer **timers, unsigned int nr,
+                    unsigned int new_cpu);
+
 /*
  * Deactivate a timer and prevent it from being re-set (future calls to
  * set_timer will silently fail). When this function returns it is guaranteed
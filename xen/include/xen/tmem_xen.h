@@ -57,6 +57,26 @@ static inline bool_t tmh_compression_enabled(void)
     return opt_tmem_compress;
 }
 
+/* compression codecs, recorded with each compressed page */
+#define TMH_CODEC_LZO  TMEM_CODEC_LZO
+#define TMH_CODEC_LZ4  TMEM_CODEC_LZ4
+#define TMH_NR_CODECS  2
+
+extern unsigned int opt_tmem_codec;
+static inline unsigned int tmh_default_codec(void)
+{
+    return opt_tmem_codec;
+}
+
+extern const char *tmh_codec_name(unsigned int codec);
+
+/* largest compressed size worth keeping, in percent of a page */
+extern unsigned int opt_tmem_compress_ratio;
+static inline unsigned int tmh_compress_ratio(void)
+{
+    return opt_tmem_compress_ratio;
+}
+
 extern bool_t opt_tmem_dedup;
 static inline bool_t tmh_dedup_enabled(void)
 {
@@ -485,10 +505,10 @@ static inline void tmh_copy_to_client_buf_offset(tmem_cli_va_param_t clibuf,
 #define tmh_client_str "domain"
 
 int tmh_decompress_to_client(tmem_cli_mfn_t, void *, size_t,
-			     tmem_cli_va_param_t);
+			     tmem_cli_va_param_t, unsigned int codec);
 
 int tmh_compress_from_client(tmem_cli_mfn_t, void **, size_t *,
-			     tmem_cli_va_param_t);
+			     tmem_cli_va_param_t, unsigned int codec);
 
 int tmh_copy_from_client(pfp_t *, tmem_cli_mfn_t, pagesize_t tmem_offset,
     pagesize_t pfn_offset, pagesize_t len, tmem_cli_va_param_t);
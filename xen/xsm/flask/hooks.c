@@ -528,9 +528,11 @@ static int flask_vcpuaffinity(int cmd, struct domain *d)
     switch ( cmd )
     {
     case XEN_DOMCTL_setvcpuaffinity:
+    case XEN_DOMCTL_setnodeaffinity:
         perm = DOMAIN__SETVCPUAFFINITY;
         break;
     case XEN_DOMCTL_getvcpuaffinity:
+    case XEN_DOMCTL_getnodeaffinity:
         perm = DOMAIN__GETVCPUAFFINITY;
         break;
     default: